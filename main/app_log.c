@@ -0,0 +1,96 @@
+/**
+ * @file app_log.c
+ * @brief Logging facade: rate limiting and the binary event ring
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "app_log.h"
+
+#define LOG_RATE_PER_SEC CONFIG_AWS_IOT_LOG_RATE_PER_SEC
+#define LOG_RATE_BURST CONFIG_AWS_IOT_LOG_RATE_BURST
+#define LOG_RING_ENTRIES CONFIG_AWS_IOT_LOG_RING_ENTRIES
+
+static portMUX_TYPE log_lock = portMUX_INITIALIZER_UNLOCKED;
+
+bool app_log_limiter_allow(app_log_limiter_t *limiter, uint32_t *suppressed)
+{
+    int64_t now = esp_timer_get_time();
+    bool allowed = false;
+
+    portENTER_CRITICAL(&log_lock);
+    if (limiter->last_refill_us == 0) {
+        // First use: start with a full bucket
+        limiter->tokens_milli = LOG_RATE_BURST * 1000;
+        limiter->last_refill_us = now;
+    } else {
+        int64_t refill = (now - limiter->last_refill_us) * LOG_RATE_PER_SEC / 1000;
+        int64_t tokens = limiter->tokens_milli + refill;
+        if (tokens >= LOG_RATE_BURST * 1000) {
+            limiter->tokens_milli = LOG_RATE_BURST * 1000;
+            limiter->last_refill_us = now;
+        } else {
+            // Advance only by the time turned into tokens, rounded up so it
+            // never gains, and keep the remainder for the next call
+            limiter->tokens_milli = (uint32_t)tokens;
+            limiter->last_refill_us += (refill * 1000 + LOG_RATE_PER_SEC - 1) / LOG_RATE_PER_SEC;
+        }
+    }
+
+    if (limiter->tokens_milli >= 1000) {
+        limiter->tokens_milli -= 1000;
+        *suppressed = limiter->suppressed;
+        limiter->suppressed = 0;
+        allowed = true;
+    } else {
+        limiter->suppressed++;
+    }
+    portEXIT_CRITICAL(&log_lock);
+    return allowed;
+}
+
+#if LOG_RING_ENTRIES > 0
+
+static app_log_record_t ring[LOG_RING_ENTRIES];
+static uint32_t ring_written = 0;   // Records ever written
+
+void app_log_event(app_log_event_t event, int32_t value)
+{
+    app_log_record_t record = {
+        .timestamp_ms = (uint32_t)(esp_timer_get_time() / 1000),
+        .event = event,
+        .value = value,
+    };
+
+    portENTER_CRITICAL(&log_lock);
+    ring[ring_written % LOG_RING_ENTRIES] = record;
+    ring_written++;
+    portEXIT_CRITICAL(&log_lock);
+}
+
+size_t app_log_ring_read(uint32_t *cursor, app_log_record_t *out, size_t max)
+{
+    size_t count = 0;
+
+    portENTER_CRITICAL(&log_lock);
+    uint32_t oldest = ring_written > LOG_RING_ENTRIES ? ring_written - LOG_RING_ENTRIES : 0;
+    if (*cursor < oldest || *cursor > ring_written) {
+        *cursor = oldest;
+    }
+    while (count < max && *cursor < ring_written) {
+        out[count++] = ring[*cursor % LOG_RING_ENTRIES];
+        (*cursor)++;
+    }
+    portEXIT_CRITICAL(&log_lock);
+    return count;
+}
+
+#else
+
+size_t app_log_ring_read(uint32_t *cursor, app_log_record_t *out, size_t max)
+{
+    return 0;
+}
+
+#endif
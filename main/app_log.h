@@ -0,0 +1,128 @@
+/**
+ * @file app_log.h
+ * @brief Logging facade: compile-time module levels, rate limiting and a
+ *        binary event ring
+ *
+ * A module selects its compile-time level by defining APP_LOG_LEVEL before
+ * including this header:
+ *
+ *     #include "aws_iot_config.h"
+ *     #define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_CLIENT
+ *     #include "app_log.h"
+ *
+ * ESP_LOGx calls above that level are compiled out, format strings
+ * included. The APP_LOGx_LIMITED macros add a per-call-site token bucket for
+ * messages that can repeat at message rate. app_log_event() appends a
+ * compact binary record to a RAM ring that can be dumped over MQTT.
+ */
+
+#ifndef APP_LOG_H
+#define APP_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_log.h"
+#include "aws_iot_config.h"
+
+#ifdef APP_LOG_LEVEL
+#undef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL APP_LOG_LEVEL
+#endif
+
+/**
+ * @brief Token bucket state, one per rate-limited call site
+ */
+typedef struct {
+    uint32_t tokens_milli;      ///< Available tokens x1000
+    int64_t last_refill_us;
+    uint32_t suppressed;        ///< Messages dropped since the last one allowed
+} app_log_limiter_t;
+
+/**
+ * @brief Take a token from a limiter
+ * @param limiter Call-site limiter
+ * @param suppressed Set to the number of messages dropped since the last
+ *                   allowed one when a token is granted
+ * @return true if the message should be logged
+ */
+bool app_log_limiter_allow(app_log_limiter_t *limiter, uint32_t *suppressed);
+
+#define APP_LOG_LIMITED(level, tag, format, ...)                                        \
+    do {                                                                                \
+        if (LOG_LOCAL_LEVEL >= (level)) {                                               \
+            static app_log_limiter_t _limiter;                                          \
+            uint32_t _suppressed = 0;                                                   \
+            if (app_log_limiter_allow(&_limiter, &_suppressed)) {                       \
+                if (_suppressed > 0) {                                                  \
+                    ESP_LOG_LEVEL(level, tag, "%u similar messages suppressed",         \
+                                  (unsigned)_suppressed);                               \
+                }                                                                       \
+                ESP_LOG_LEVEL(level, tag, format, ##__VA_ARGS__);                       \
+            }                                                                           \
+        }                                                                               \
+    } while (0)
+
+#define APP_LOGE_LIMITED(tag, format, ...) APP_LOG_LIMITED(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define APP_LOGW_LIMITED(tag, format, ...) APP_LOG_LIMITED(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define APP_LOGI_LIMITED(tag, format, ...) APP_LOG_LIMITED(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+
+/**
+ * @brief Event ids stored in the binary log ring
+ */
+typedef enum {
+    APP_LOG_EVT_BOOT = 1,
+    APP_LOG_EVT_MQTT_CONNECTED,
+    APP_LOG_EVT_MQTT_DISCONNECTED,
+    APP_LOG_EVT_MQTT_SUBSCRIBED,        ///< value: msg_id
+    APP_LOG_EVT_MQTT_PUBLISHED,         ///< value: msg_id
+    APP_LOG_EVT_MQTT_DATA,              ///< value: payload length
+    APP_LOG_EVT_MQTT_ERROR,             ///< value: error type << 16 | esp-tls error (low 16 bits)
+    APP_LOG_EVT_COMMAND,                ///< value: esp_err_t of submit
+    APP_LOG_EVT_PUBLISH_FAILED,         ///< value: payload length
+    APP_LOG_EVT_SPOOL_STORE,            ///< value: samples spooled
+    APP_LOG_EVT_SPOOL_REPLAY,           ///< value: samples replayed
+    APP_LOG_EVT_WIFI_DISCONNECTED,      ///< value: wifi_err_reason_t
+    APP_LOG_EVT_WIFI_CONNECTED,         ///< value: connect attempts
+    APP_LOG_EVT_LINK_CHANGED,           ///< value: network_link_type_t
+} app_log_event_t;
+
+/**
+ * @brief Binary log record (little endian, 12 bytes, as dumped over MQTT)
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp_ms;  ///< ms since boot
+    uint16_t event;         ///< app_log_event_t
+    uint16_t reserved;
+    int32_t value;
+} app_log_record_t;
+
+/**
+ * @brief Append a record to the binary log ring
+ *
+ * Cheap enough for the MQTT event handler; compiled to nothing when
+ * CONFIG_AWS_IOT_LOG_RING_ENTRIES is 0.
+ *
+ * @param event Event id
+ * @param value Event-specific value
+ */
+#if CONFIG_AWS_IOT_LOG_RING_ENTRIES > 0
+void app_log_event(app_log_event_t event, int32_t value);
+#else
+static inline void app_log_event(app_log_event_t event, int32_t value) {}
+#endif
+
+/**
+ * @brief Copy records out of the ring, oldest first
+ *
+ * The cursor counts records ever written; start with 0. If the ring has
+ * wrapped past the cursor, copying resumes at the oldest record still held.
+ *
+ * @param cursor Read position, advanced past the copied records
+ * @param out Output array
+ * @param max Capacity of the output array
+ * @return Number of records copied, 0 when caught up
+ */
+size_t app_log_ring_read(uint32_t *cursor, app_log_record_t *out, size_t max);
+
+#endif // APP_LOG_H
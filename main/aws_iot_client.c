@@ -4,7 +4,7 @@
  *
  * This application connects an ESP32-S3 to AWS IoT Core using MQTT over TLS.
  * Features:
- * - WiFi connection management
+ * - WiFi connection management with cellular fallback
  * - AWS IoT device authentication with certificates
  * - Device shadow synchronization
  * - Telemetry data publishing
@@ -18,20 +18,37 @@
 #include "aws_iot_config.h"
 #include "sdkconfig.h"
 
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_CLIENT
+#include "app_log.h"
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
 
 #include "esp_event.h"
-#include "esp_log.h"
 #include "esp_system.h"
 #include "esp_timer.h"
 #include "nvs_flash.h"
 
+#include "bench.h"
+#include "boot_timing.h"
 #include "certificate_manager.h"
+#include "command_processor.h"
 #include "device_shadow.h"
-#include "wifi_manager.h"
+#include "duty_cycle.h"
+#include "flash_spool.h"
+#include "payload_compress.h"
+#include "metrics.h"
+#include "mqtt_reassembly.h"
+#include "mqtt_session.h"
+#include "publish_manager.h"
+#include "task_config.h"
+#include "task_monitor.h"
+#include "telemetry.h"
+#include "tls_transport.h"
+#include "network_link.h"
+#include "topic_router.h"
 
 #include "mqtt_client.h"
 
@@ -51,14 +68,295 @@ const int AWS_IOT_CONNECTED_BIT = BIT0;
 
 // MQTT Topics
 #define TELEMETRY_TOPIC_FMT "device/%s/telemetry"
+#define TELEMETRY_COMPRESSED_TOPIC_FMT "device/%s/telemetry/hs"
 #define COMMAND_TOPIC_FMT "device/%s/commands"
+#define COMMAND_RESPONSE_TOPIC_FMT "device/%s/commands/response"
 #define SHADOW_UPDATE_TOPIC_FMT "$aws/things/%s/shadow/update"
 #define SHADOW_GET_TOPIC_FMT "$aws/things/%s/shadow/get"
+#define SHADOW_GET_ACCEPTED_TOPIC_FMT "$aws/things/%s/shadow/get/accepted"
+#define SHADOW_GET_REJECTED_TOPIC_FMT "$aws/things/%s/shadow/get/rejected"
+#define SHADOW_UPDATE_ACCEPTED_TOPIC_FMT "$aws/things/%s/shadow/update/accepted"
+#define SHADOW_UPDATE_REJECTED_TOPIC_FMT "$aws/things/%s/shadow/update/rejected"
+#define SHADOW_UPDATE_DELTA_TOPIC_FMT "$aws/things/%s/shadow/update/delta"
+#define METRICS_TOPIC_FMT "device/%s/telemetry/metrics"
+#define LOG_DUMP_TOPIC_FMT "device/%s/log"
+#define CREDENTIALS_TOPIC_FMT "device/%s/credentials"
+#define SHADOW_FILTER_FMT "$aws/things/%s/shadow/#"
+
+// Topic strings, formatted once at startup
+static char telemetry_topic[128];
+static char telemetry_compressed_topic[128];
+static char command_topic[128];
+static char shadow_get_accepted_topic[256];
+static char shadow_get_rejected_topic[256];
+static char shadow_update_accepted_topic[256];
+static char shadow_update_rejected_topic[256];
+static char shadow_update_delta_topic[256];
+static char metrics_topic[128];
+static char log_dump_topic[128];
+static char credentials_topic[128];
+
+// Binary log records per dump message (buffered on the worker stack)
+#define LOG_DUMP_RECORDS_PER_MESSAGE 40
+
+// Largest inbound message reassembled from esp-mqtt fragments
+#define MQTT_REASSEMBLY_MAX_SIZE CONFIG_AWS_IOT_MQTT_REASSEMBLY_MAX_SIZE
+
+// Telemetry parameters (task layout lives in task_config.h)
+#define TELEMETRY_SAMPLE_INTERVAL CONFIG_AWS_IOT_TELEMETRY_SAMPLE_INTERVAL_MS
+#define TELEMETRY_BATCH_BUFFER_SIZE CONFIG_AWS_IOT_TELEMETRY_BATCH_BUFFER_SIZE
+#define TELEMETRY_BATCH_MAX_AGE_MS CONFIG_AWS_IOT_TELEMETRY_BATCH_MAX_AGE_MS
+#define TASK_MONITOR_INTERVAL_MS CONFIG_AWS_IOT_TASK_MONITOR_INTERVAL_MS
+#define METRICS_INTERVAL_MS CONFIG_AWS_IOT_METRICS_INTERVAL_MS
+#define TELEMETRY_COMPRESS CONFIG_AWS_IOT_TELEMETRY_COMPRESS
+#define TELEMETRY_COMPRESS_THRESHOLD CONFIG_AWS_IOT_TELEMETRY_COMPRESS_THRESHOLD
+
+// Publish flow control (see publish_manager.h)
+#define PUBLISH_DOWNSAMPLE_FACTOR CONFIG_AWS_IOT_PUBLISH_DOWNSAMPLE_FACTOR
+#define PUBLISH_OUTBOX_LIMIT CONFIG_AWS_IOT_PUBLISH_OUTBOX_LIMIT
+
+// MQTT 5 session options
+#define MQTT_PROTOCOL_5 CONFIG_AWS_IOT_MQTT_PROTOCOL_5
+#define MQTT5_TOPIC_ALIAS_MAX CONFIG_AWS_IOT_MQTT5_TOPIC_ALIAS_MAX
+
+// Persistent session (see mqtt_session.h)
+#define MQTT_PERSISTENT_SESSION CONFIG_AWS_IOT_MQTT_PERSISTENT_SESSION
+#define MQTT_SESSION_EXPIRY_S CONFIG_AWS_IOT_MQTT_SESSION_EXPIRY_S
+
+#if MQTT_PROTOCOL_5 && !defined(CONFIG_MQTT_PROTOCOL_5)
+#error "CONFIG_AWS_IOT_MQTT_PROTOCOL_5 needs CONFIG_MQTT_PROTOCOL_5 in sdkconfig"
+#endif
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+// Batching on a metered link
+#define CELLULAR_TELEMETRY_FLUSH_THRESHOLD                                     \
+    CONFIG_AWS_IOT_CELLULAR_TELEMETRY_FLUSH_THRESHOLD
+#define CELLULAR_TELEMETRY_BATCH_MAX_AGE_MS                                    \
+    CONFIG_AWS_IOT_CELLULAR_TELEMETRY_BATCH_MAX_AGE_MS
+#define CELLULAR_METRICS_INTERVAL_MS CONFIG_AWS_IOT_CELLULAR_METRICS_INTERVAL_MS
+
+// Duty-cycled uploads: bounds on each phase of an upload wake
+#define DUTY_CYCLE_CONNECT_TIMEOUT_MS CONFIG_AWS_IOT_DUTY_CYCLE_CONNECT_TIMEOUT_MS
+#define DUTY_CYCLE_FLUSH_TIMEOUT_MS CONFIG_AWS_IOT_DUTY_CYCLE_FLUSH_TIMEOUT_MS
+
+// Store-and-forward spool
+#define SPOOL_PARTITION_LABEL CONFIG_AWS_IOT_SPOOL_PARTITION_LABEL
+#define SPOOL_DRAIN_BATCHES_PER_TICK CONFIG_AWS_IOT_SPOOL_DRAIN_BATCHES_PER_TICK
+
+static bool spool_available = false;
+
+// Credential rotation: failed connects tolerated before rolling back
+#define CERT_TRIAL_MAX_FAILURES CONFIG_AWS_IOT_CERT_TRIAL_MAX_FAILURES
+
+static int credential_trial_failures = 0;
+static volatile bool mqtt_restart_pending = false;
+
+// The client starts once it exists and some link is up, whichever is last
+static bool mqtt_link_ready = false;
+static bool mqtt_client_ready = false;
+static bool mqtt_started = false;
+static portMUX_TYPE mqtt_start_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void mqtt_restart_request(bool rollback);
+
+#if MQTT_PROTOCOL_5
+// Properties of the MQTT_EVENT_DATA being dispatched, NULL for fragmented
+// messages (esp-mqtt only decodes them with the first fragment)
+static const esp_mqtt5_event_property_t *inbound_property = NULL;
+#endif
+
+/**
+ * @brief Handle credential rotation messages
+ */
+static void credentials_message_handler(const char *topic, size_t topic_len,
+                                        const char *data, size_t data_len,
+                                        void *arg) {
+    ESP_LOGI(TAG, "Received credential rotation, %u bytes",
+             (unsigned)data_len);
+    if (certificate_manager_handle_rotation(data, data_len) == ESP_OK) {
+        mqtt_restart_request(false);
+    }
+}
+
+/**
+ * @brief Handle messages on the command topic
+ */
+static void command_message_handler(const char *topic, size_t topic_len,
+                                    const char *data, size_t data_len,
+                                    void *arg) {
+    const command_reply_t *reply = NULL;
+
+    ESP_LOGD(TAG, "Received command: %.*s", (int)data_len, data);
+#if MQTT_PROTOCOL_5
+    command_reply_t mqtt5_reply;
+    if (inbound_property != NULL) {
+        mqtt5_reply = (command_reply_t){
+            .topic = inbound_property->response_topic,
+            .topic_len = inbound_property->response_topic_len,
+            .correlation_data = inbound_property->correlation_data,
+            .correlation_len = inbound_property->correlation_data_len,
+        };
+        reply = &mqtt5_reply;
+    }
+#endif
+    app_log_event(APP_LOG_EVT_COMMAND,
+                  command_processor_submit(data, data_len, reply));
+}
+
+/**
+ * @brief "ping" command: report uptime and free heap
+ */
+static esp_err_t ping_command(const command_t *cmd, json_writer_t *result) {
+    json_writer_add_int(result, "uptime_ms", esp_timer_get_time() / 1000);
+    json_writer_add_uint(result, "free_heap", esp_get_free_heap_size());
+    return ESP_OK;
+}
+
+/**
+ * @brief "log_dump" command: publish the binary log ring, oldest first
+ *
+ * Each message on the log topic is a packed array of app_log_record_t. The
+ * dump is bulk traffic: it goes through the telemetry window and waits out
+ * a full window or outbox, so it never holds the control slots that shadow
+ * and command responses need.
+ */
+static esp_err_t log_dump_command(const command_t *cmd,
+                                  json_writer_t *result) {
+    app_log_record_t records[LOG_DUMP_RECORDS_PER_MESSAGE];
+    uint32_t cursor = 0;
+    size_t total = 0;
+    size_t messages = 0;
+    size_t count;
+
+    while (command_time_remaining_ms(cmd) > 0 &&
+           (count = app_log_ring_read(&cursor, records,
+                                      LOG_DUMP_RECORDS_PER_MESSAGE)) > 0) {
+        const publish_message_t msg = {
+            .topic = log_dump_topic,
+            .data = records,
+            .len = count * sizeof(records[0]),
+            .qos = 1,
+            .content_type = "application/octet-stream",
+        };
+        esp_err_t err = ESP_ERR_NO_MEM;
+        // Wait for room rather than skip records
+        while (command_time_remaining_ms(cmd) > 0 &&
+               (publish_manager_high_water() ||
+                (err = publish_manager_publish(&msg)) == ESP_ERR_NO_MEM)) {
+            vTaskDelay(pdMS_TO_TICKS(20));
+        }
+        if (err != ESP_OK) {
+            return err == ESP_ERR_NO_MEM ? ESP_ERR_TIMEOUT : ESP_FAIL;
+        }
+        total += count;
+        messages++;
+    }
+
+    json_writer_add_uint(result, "records", total);
+    json_writer_add_uint(result, "messages", messages);
+    return ESP_OK;
+}
+
+static void reboot_timer_callback(void *arg) { esp_restart(); }
+
+/**
+ * @brief "reboot" command: restart shortly after the response is published
+ */
+static esp_err_t reboot_command(const command_t *cmd, json_writer_t *result) {
+    static esp_timer_handle_t reboot_timer = NULL;
+    const esp_timer_create_args_t args = {
+        .callback = reboot_timer_callback,
+        .name = "reboot",
+    };
+
+    if (reboot_timer == NULL &&
+        esp_timer_create(&args, &reboot_timer) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    json_writer_add_uint(result, "delay_ms", 1000);
+    return esp_timer_start_once(reboot_timer, 1000 * 1000);
+}
+
+/**
+ * @brief Start the command worker pool and register built-in commands
+ */
+static void commands_init(void) {
+    char response_topic[128];
+
+    snprintf(response_topic, sizeof(response_topic),
+             COMMAND_RESPONSE_TOPIC_FMT, AWS_IOT_DEVICE_THING_NAME);
+    if (command_processor_init(response_topic) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start command processor");
+        return;
+    }
+
+    command_processor_register("ping", ping_command, 0);
+    command_processor_register("reboot", reboot_command, 0);
+    command_processor_register("log_dump", log_dump_command, 0);
+#if CONFIG_AWS_IOT_BENCH_ENABLE
+    bench_init(AWS_IOT_DEVICE_THING_NAME);
+#endif
+}
+
+/**
+ * @brief Handle messages on the device shadow topics
+ */
+static void shadow_message_handler(const char *topic, size_t topic_len,
+                                   const char *data, size_t data_len,
+                                   void *arg) {
+    device_shadow_handle_response(topic, topic_len, data, data_len);
+}
 
-// Task parameters
-#define TELEMETRY_TASK_STACK_SIZE 4096
-#define TELEMETRY_TASK_PRIORITY 5
-#define TELEMETRY_PUBLISH_INTERVAL 30000 // 30 seconds
+/**
+ * @brief Format topic strings and register inbound topic handlers
+ */
+static void topics_init(void) {
+    char shadow_filter[256];
+
+    snprintf(telemetry_topic, sizeof(telemetry_topic), TELEMETRY_TOPIC_FMT,
+             AWS_IOT_DEVICE_THING_NAME);
+    snprintf(telemetry_compressed_topic, sizeof(telemetry_compressed_topic),
+             TELEMETRY_COMPRESSED_TOPIC_FMT, AWS_IOT_DEVICE_THING_NAME);
+    snprintf(command_topic, sizeof(command_topic), COMMAND_TOPIC_FMT,
+             AWS_IOT_DEVICE_THING_NAME);
+    snprintf(shadow_get_accepted_topic, sizeof(shadow_get_accepted_topic),
+             SHADOW_GET_ACCEPTED_TOPIC_FMT, AWS_IOT_DEVICE_THING_NAME);
+    snprintf(shadow_get_rejected_topic, sizeof(shadow_get_rejected_topic),
+             SHADOW_GET_REJECTED_TOPIC_FMT, AWS_IOT_DEVICE_THING_NAME);
+    snprintf(shadow_update_accepted_topic, sizeof(shadow_update_accepted_topic),
+             SHADOW_UPDATE_ACCEPTED_TOPIC_FMT, AWS_IOT_DEVICE_THING_NAME);
+    snprintf(shadow_update_rejected_topic, sizeof(shadow_update_rejected_topic),
+             SHADOW_UPDATE_REJECTED_TOPIC_FMT, AWS_IOT_DEVICE_THING_NAME);
+    snprintf(shadow_update_delta_topic, sizeof(shadow_update_delta_topic),
+             SHADOW_UPDATE_DELTA_TOPIC_FMT, AWS_IOT_DEVICE_THING_NAME);
+    snprintf(metrics_topic, sizeof(metrics_topic), METRICS_TOPIC_FMT,
+             AWS_IOT_DEVICE_THING_NAME);
+    snprintf(log_dump_topic, sizeof(log_dump_topic), LOG_DUMP_TOPIC_FMT,
+             AWS_IOT_DEVICE_THING_NAME);
+    snprintf(credentials_topic, sizeof(credentials_topic),
+             CREDENTIALS_TOPIC_FMT, AWS_IOT_DEVICE_THING_NAME);
+    snprintf(shadow_filter, sizeof(shadow_filter), SHADOW_FILTER_FMT,
+             AWS_IOT_DEVICE_THING_NAME);
+
+    ESP_ERROR_CHECK(
+        topic_router_register(command_topic, command_message_handler, NULL));
+    ESP_ERROR_CHECK(
+        topic_router_register(shadow_filter, shadow_message_handler, NULL));
+    ESP_ERROR_CHECK(topic_router_register(
+        credentials_topic, credentials_message_handler, NULL));
+
+    // Subscribed in one SUBSCRIBE on connect, or not at all when the
+    // broker's session still holds them
+    ESP_ERROR_CHECK(mqtt_session_add(command_topic, 1));
+    ESP_ERROR_CHECK(mqtt_session_add(credentials_topic, 1));
+    ESP_ERROR_CHECK(mqtt_session_add(shadow_get_accepted_topic, 1));
+    ESP_ERROR_CHECK(mqtt_session_add(shadow_get_rejected_topic, 1));
+    ESP_ERROR_CHECK(mqtt_session_add(shadow_update_accepted_topic, 1));
+    ESP_ERROR_CHECK(mqtt_session_add(shadow_update_rejected_topic, 1));
+    ESP_ERROR_CHECK(mqtt_session_add(shadow_update_delta_topic, 1));
+}
 
 /**
  * @brief MQTT event handler
@@ -67,143 +365,331 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base,
                                int32_t event_id, void *event_data) {
     esp_mqtt_event_handle_t event = event_data;
     esp_mqtt_client_handle_t client = event->client;
-    int msg_id;
 
     switch ((esp_mqtt_event_id_t)event_id) {
+    case MQTT_EVENT_BEFORE_CONNECT:
+        ESP_LOGD(TAG, "MQTT_EVENT_BEFORE_CONNECT");
+        metrics_span_begin(METRICS_CONNECT_TIME);
+        break;
+
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+        metrics_span_end(METRICS_CONNECT_TIME);
+        boot_timing_mark(BOOT_PHASE_MQTT_CONNECTED);
+
+        // A connection with staged credentials proves them
+        credential_trial_failures = 0;
+        certificate_manager_confirm();
+        app_log_event(APP_LOG_EVT_MQTT_CONNECTED, 0);
         xEventGroupSetBits(aws_iot_event_group, AWS_IOT_CONNECTED_BIT);
 
-        // Subscribe to command topic
-        char command_topic[128];
-        snprintf(command_topic, sizeof(command_topic), COMMAND_TOPIC_FMT,
-                 AWS_IOT_DEVICE_THING_NAME);
-        msg_id = esp_mqtt_client_subscribe(client, command_topic, 1);
-        ESP_LOGI(TAG, "Subscribed to commands, msg_id=%d", msg_id);
-
-        // Subscribe to shadow responses
-        char shadow_get_accepted[256];
-        snprintf(shadow_get_accepted, sizeof(shadow_get_accepted),
-                 "$aws/things/%s/shadow/get/accepted",
-                 AWS_IOT_DEVICE_THING_NAME);
-        msg_id = esp_mqtt_client_subscribe(client, shadow_get_accepted, 1);
-        ESP_LOGI(TAG, "Subscribed to shadow get accepted, msg_id=%d", msg_id);
+        // Queued QoS 1 commands are delivered right after the CONNACK when
+        // the session was resumed
+        mqtt_session_connected(client, event->session_present);
+
+        // Resume desired state from the cached version
+        device_shadow_sync(client);
 
         break;
 
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        app_log_event(APP_LOG_EVT_MQTT_DISCONNECTED, 0);
         xEventGroupClearBits(aws_iot_event_group, AWS_IOT_CONNECTED_BIT);
+        mqtt_reassembly_reset();
         break;
 
     case MQTT_EVENT_SUBSCRIBED:
-        ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+        ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+        app_log_event(APP_LOG_EVT_MQTT_SUBSCRIBED, event->msg_id);
+        mqtt_session_subscribed(event->msg_id, (const uint8_t *)event->data,
+                                event->data_len > 0 ? event->data_len : 0);
         break;
 
     case MQTT_EVENT_UNSUBSCRIBED:
-        ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+        ESP_LOGD(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
 
     case MQTT_EVENT_PUBLISHED:
-        ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        app_log_event(APP_LOG_EVT_MQTT_PUBLISHED, event->msg_id);
+        metrics_publish_acked(event->msg_id);
+        publish_manager_acked(event->msg_id);
+        if (boot_timing_mark(BOOT_PHASE_FIRST_PUBLISH)) {
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+            duty_cycle_mark(DUTY_CYCLE_PHASE_FIRST_PUBLISH);
+#endif
+        }
         break;
 
-    case MQTT_EVENT_DATA:
-        ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        printf("Topic: %.*s\n", event->topic_len, event->topic);
-        printf("Data: %.*s\n", event->data_len, event->data);
-
-        // Handle command messages
-        char cmd_topic[128];
-        snprintf(cmd_topic, sizeof(cmd_topic), COMMAND_TOPIC_FMT,
-                 AWS_IOT_DEVICE_THING_NAME);
-        if (strncmp(event->topic, cmd_topic, event->topic_len) == 0) {
-            ESP_LOGI(TAG, "Received command: %.*s", event->data_len,
-                     event->data);
-            // TODO: Process commands
-        }
+    case MQTT_EVENT_DELETED:
+        // Expired from the outbox without a PUBACK
+        APP_LOGW_LIMITED(TAG, "Message %d expired unacknowledged",
+                         event->msg_id);
+        publish_manager_deleted(event->msg_id);
+        break;
 
-        // Handle shadow responses
-        if (strstr(event->topic, "/shadow/") != NULL) {
-            device_shadow_handle_response(event->topic, event->topic_len,
-                                          event->data, event->data_len);
+    case MQTT_EVENT_DATA: {
+        // Large payloads arrive in several events; wait for the last one
+        mqtt_message_t msg;
+        if (!mqtt_reassembly_feed(event, &msg)) {
+            break;
         }
+
+        ESP_LOGD(TAG, "MQTT_EVENT_DATA on %.*s, %u bytes", (int)msg.topic_len,
+                 msg.topic, (unsigned)msg.data_len);
+        ESP_LOGV(TAG, "Data: %.*s", (int)msg.data_len, msg.data);
+        app_log_event(APP_LOG_EVT_MQTT_DATA, msg.data_len);
+
+#if MQTT_PROTOCOL_5
+        inbound_property = event->data_len == event->total_data_len
+                               ? event->property
+                               : NULL;
+#endif
+        topic_router_dispatch(msg.topic, msg.topic_len, msg.data,
+                              msg.data_len);
+#if MQTT_PROTOCOL_5
+        inbound_property = NULL;
+#endif
+        metrics_record(METRICS_DISPATCH_LATENCY,
+                       esp_timer_get_time() - msg.rx_us);
         break;
+    }
 
-    case MQTT_EVENT_ERROR:
-        ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
+    case MQTT_EVENT_ERROR: {
+        // The error handle's transport fields are only filled by esp-mqtt's
+        // own transports, tls_transport keeps its own
+        tls_transport_error_t tls_error;
+        tls_transport_get_last_error(&tls_error);
+        app_log_event(APP_LOG_EVT_MQTT_ERROR,
+                      (event->error_handle->error_type << 16) |
+                          (tls_error.esp_tls_err & 0xFFFF));
+        if (certificate_manager_in_trial() &&
+            !(xEventGroupGetBits(aws_iot_event_group) &
+              AWS_IOT_CONNECTED_BIT) &&
+            ++credential_trial_failures >= CERT_TRIAL_MAX_FAILURES) {
+            ESP_LOGW(TAG, "Staged credentials failed %d connects",
+                     credential_trial_failures);
+            mqtt_restart_request(true);
+        }
         if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
-            ESP_LOGI(TAG, "Last error code reported from esp-tls: 0x%x",
-                     event->error_handle->esp_tls_last_esp_err);
-            ESP_LOGI(TAG, "Last tls stack error number: 0x%x",
-                     event->error_handle->esp_tls_stack_err);
-            ESP_LOGI(TAG, "Last captured errno : %d (%s)",
-                     event->error_handle->esp_transport_sock_errno,
-                     strerror(event->error_handle->esp_transport_sock_errno));
+            APP_LOGW_LIMITED(
+                TAG,
+                "MQTT transport error: esp-tls 0x%x, tls stack 0x%x, verify "
+                "flags 0x%x, errno %d (%s)",
+                tls_error.esp_tls_err, tls_error.tls_stack_err,
+                tls_error.tls_verify_flags, tls_error.sock_errno,
+                strerror(tls_error.sock_errno));
         } else if (event->error_handle->error_type ==
                    MQTT_ERROR_TYPE_CONNECTION_REFUSED) {
-            ESP_LOGI(TAG, "Connection refused error: 0x%x",
-                     event->error_handle->connect_return_code);
+            APP_LOGW_LIMITED(TAG, "Connection refused error: 0x%x",
+                             event->error_handle->connect_return_code);
         } else {
-            ESP_LOGW(TAG, "Unknown error type: 0x%x",
-                     event->error_handle->error_type);
+            APP_LOGW_LIMITED(TAG, "Unknown error type: 0x%x",
+                             event->error_handle->error_type);
         }
         break;
+    }
 
     default:
-        ESP_LOGI(TAG, "Other event id:%d", event->event_id);
+        ESP_LOGD(TAG, "Other event id:%d", event->event_id);
         break;
     }
 }
 
 /**
- * @brief Initialize and start MQTT client
+ * @brief Build the MQTT client configuration from the current credentials
+ * @return false if any credential is missing
  */
-static void mqtt_client_init(void) {
+static bool mqtt_config_init(esp_mqtt_client_config_t *mqtt_cfg) {
+    static char mqtt_uri[256];
+
     // Get certificates
     const char *root_ca = certificate_manager_get_root_ca();
     const char *client_cert = certificate_manager_get_client_cert();
     const char *client_key = certificate_manager_get_client_key();
 
-    if (!root_ca || !client_cert || !client_key) {
+    // With the global CA store the root CA is already parsed once
+    bool global_ca_store = certificate_manager_uses_global_ca_store();
+
+    // With the DS peripheral the key stays in hardware and client_key is NULL
+    void *ds_data = certificate_manager_get_ds_data();
+
+    if (!root_ca || !client_cert || (!client_key && !ds_data)) {
         ESP_LOGE(TAG, "Failed to load certificates");
-        return;
+        return false;
+    }
+
+    esp_transport_handle_t transport = tls_transport_get();
+    if (transport == NULL) {
+        ESP_LOGE(TAG, "Failed to create TLS transport");
+        return false;
     }
 
-    char mqtt_uri[256];
+    // The TLS handshake is done by tls_transport so that it can resume the
+    // previous session; esp-mqtt only sees the transport
+    tls_transport_set_credentials(&(tls_transport_credentials_t){
+        .root_ca = root_ca,
+        .use_global_ca_store = global_ca_store,
+        .client_cert = client_cert,
+        .client_key = client_key,
+        .ds_data = ds_data,
+    });
+
     snprintf(mqtt_uri, sizeof(mqtt_uri), "mqtts://%s:%d", AWS_IOT_MQTT_HOST,
              AWS_IOT_MQTT_PORT);
 
-    esp_mqtt_client_config_t mqtt_cfg = {
+    *mqtt_cfg = (esp_mqtt_client_config_t){
         .broker =
             {
                 .address.uri = mqtt_uri,
-                .verification.certificate = root_ca,
             },
+#if MQTT_PERSISTENT_SESSION
         .credentials =
             {
-                .authentication =
-                    {
-                        .certificate = client_cert,
-                        .key = client_key,
-                    },
+                // The broker keys the session on the client ID
+                .client_id = AWS_IOT_DEVICE_THING_NAME,
             },
+#endif
         .session =
             {
                 .keepalive = 60,
-                .disable_clean_session = false,
+                .disable_clean_session = MQTT_PERSISTENT_SESSION,
+#if MQTT_PROTOCOL_5
+                .protocol_ver = MQTT_PROTOCOL_V_5,
+#endif
             },
         .network =
             {
+                // No refresh_connection_after_ms: every forced reconnect
+                // costs a TLS handshake
                 .timeout_ms = 5000,
-                .refresh_connection_after_ms = 20000,
+                .transport = transport,
             },
         .buffer =
             {
                 .size = 1024,
-                .out_size = 1024,
+                .out_size = TELEMETRY_BATCH_BUFFER_SIZE,
+            },
+        .outbox =
+            {
+                .limit = PUBLISH_OUTBOX_LIMIT,
+            },
+        .task =
+            {
+                .priority = MQTT_TASK_PRIORITY,
+                .stack_size = MQTT_TASK_STACK_SIZE,
             },
     };
+    return true;
+}
+
+/**
+ * @brief Restart the MQTT client with reloaded credentials
+ *
+ * esp_mqtt_client_stop() can't be called from the MQTT task, so the restart
+ * runs in a short-lived task of its own.
+ */
+static void mqtt_restart_task(void *pvParameters) {
+    bool rollback = (bool)(uintptr_t)pvParameters;
+    esp_mqtt_client_config_t mqtt_cfg;
+
+    esp_mqtt_client_stop(mqtt_client);
+    xEventGroupClearBits(aws_iot_event_group, AWS_IOT_CONNECTED_BIT);
+    mqtt_reassembly_reset();
+
+    // Credentials may only change while the client is stopped
+    if (rollback) {
+        certificate_manager_rollback();
+    } else {
+        certificate_manager_load();
+    }
+    credential_trial_failures = 0;
+
+    if (mqtt_config_init(&mqtt_cfg) &&
+        esp_mqtt_set_config(mqtt_client, &mqtt_cfg) == ESP_OK) {
+        ESP_LOGI(TAG, "Restarting MQTT client with %s credentials",
+                 certificate_manager_in_trial() ? "staged" : "active");
+    }
+    esp_mqtt_client_start(mqtt_client);
+
+    mqtt_restart_pending = false;
+    vTaskDelete(NULL);
+}
+
+static void mqtt_restart_request(bool rollback) {
+    if (mqtt_restart_pending) {
+        return;
+    }
+    mqtt_restart_pending = true;
+    if (xTaskCreatePinnedToCore(mqtt_restart_task, "mqtt_restart",
+                                MQTT_RESTART_TASK_STACK_SIZE,
+                                (void *)(uintptr_t)rollback,
+                                MQTT_RESTART_TASK_PRIORITY, NULL,
+                                MQTT_RESTART_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create MQTT restart task");
+        mqtt_restart_pending = false;
+    }
+}
+
+/**
+ * @brief Start the MQTT client once it is built and a link is up
+ * @param link_up Called for a link coming up
+ * @param client_up Called for the client having been built
+ */
+static void mqtt_start_when_ready(bool link_up, bool client_up) {
+    bool start;
+
+    portENTER_CRITICAL(&mqtt_start_lock);
+    mqtt_link_ready |= link_up;
+    mqtt_client_ready |= client_up;
+    start = mqtt_link_ready && mqtt_client_ready && !mqtt_started;
+    mqtt_started |= start;
+    portEXIT_CRITICAL(&mqtt_start_lock);
+
+    if (start) {
+        ESP_LOGI(TAG, "Starting AWS IoT client over %s",
+                 network_link_name(network_link_active()));
+        esp_mqtt_client_start(mqtt_client);
+    }
+}
+
+/**
+ * @brief Move the MQTT session onto a new uplink
+ *
+ * Runs from the link supervisor as soon as an IP event lands. The first
+ * link-up starts the MQTT client, so nothing on the boot path blocks waiting
+ * for an address. The client's socket stays bound to the interface it was
+ * opened on, so a switch between WiFi and cellular forces a reconnect over
+ * the new default route instead of waiting for the keepalive to notice.
+ */
+static void network_link_changed(network_link_type_t link, void *arg) {
+    static network_link_type_t mqtt_link = NETWORK_LINK_NONE;
+
+    if (link == NETWORK_LINK_NONE) {
+        return;
+    }
+    boot_timing_mark(BOOT_PHASE_LINK_UP);
+    mqtt_start_when_ready(true, false);
+    if (mqtt_client != NULL && mqtt_link != NETWORK_LINK_NONE &&
+        link != mqtt_link) {
+        ESP_LOGI(TAG, "Reconnecting MQTT over %s", network_link_name(link));
+        esp_mqtt_client_disconnect(mqtt_client);
+        esp_mqtt_client_reconnect(mqtt_client);
+    }
+    mqtt_link = link;
+    device_shadow_report_string("link", network_link_name(link));
+}
+
+/**
+ * @brief Build the MQTT client; it is started on the first link-up
+ */
+static void mqtt_client_init(void) {
+    esp_mqtt_client_config_t mqtt_cfg;
+
+    if (!mqtt_config_init(&mqtt_cfg)) {
+        return;
+    }
 
     mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
     if (mqtt_client == NULL) {
@@ -211,54 +697,389 @@ static void mqtt_client_init(void) {
         return;
     }
 
+#if MQTT_PROTOCOL_5
+    // Kept by the client across reconnects and esp_mqtt_set_config(). Topic
+    // aliases are only accepted inbound: esp-mqtt resends unacknowledged
+    // QoS 1 packets verbatim after a reconnect, when an alias set up on the
+    // old connection no longer exists
+    esp_mqtt5_connection_property_config_t connect_property = {
+        .session_expiry_interval =
+            MQTT_PERSISTENT_SESSION ? MQTT_SESSION_EXPIRY_S : 0,
+        .topic_alias_maximum = MQTT5_TOPIC_ALIAS_MAX,
+        .request_problem_info = true,
+    };
+    if (esp_mqtt5_client_set_connect_property(
+            mqtt_client, &connect_property) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to set MQTT 5 connect properties");
+    }
+#endif
+
+    publish_manager_init(mqtt_client);
     esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID,
                                    mqtt_event_handler, NULL);
-    esp_mqtt_client_start(mqtt_client);
+    mqtt_start_when_ready(false, true);
+}
+
+/**
+ * @brief Completion of a queued telemetry batch
+ *
+ * The samples were consumed when the batch was queued, so a batch the client
+ * rejects or that expires from the outbox is lost.
+ */
+static void telemetry_publish_done(esp_err_t result, int msg_id, void *arg) {
+    size_t len = (size_t)(uintptr_t)arg;
+
+    if (result != ESP_OK) {
+        app_log_event(APP_LOG_EVT_PUBLISH_FAILED, len);
+        APP_LOGW_LIMITED(TAG, "Telemetry batch of %u bytes lost: %s",
+                         (unsigned)len, esp_err_to_name(result));
+    } else {
+        ESP_LOGD(TAG, "Telemetry batch msg_id=%d acknowledged", msg_id);
+    }
+}
+
+/**
+ * @brief Queue one encoded telemetry batch
+ *
+ * Batches of at least TELEMETRY_COMPRESS_THRESHOLD bytes go out compressed
+ * on the /hs topic if that makes them smaller. Never blocks.
+ *
+ * @return ESP_OK if queued, ESP_ERR_NO_MEM if the in-flight window is full
+ */
+static esp_err_t telemetry_publish_batch(const char *buf, size_t len) {
+    // MQTT 5 only; the /hs topic says the same for MQTT 3.1.1 consumers
+    static const publish_user_property_t properties[] = {
+        {"schema", TO_STRING(TELEMETRY_SCHEMA_VERSION)},
+        {"content-encoding", "heatshrink"},
+    };
+    const char *topic = telemetry_topic;
+    const char *payload = buf;
+    size_t property_count = 1;
+
+#if TELEMETRY_COMPRESS
+    const uint8_t *compressed = NULL;
+    size_t compressed_len = 0;
+    if (len >= TELEMETRY_COMPRESS_THRESHOLD &&
+        payload_compress(buf, len, &compressed, &compressed_len) == ESP_OK) {
+        ESP_LOGD(TAG, "Compressed batch %u -> %u bytes", (unsigned)len,
+                 (unsigned)compressed_len);
+        topic = telemetry_compressed_topic;
+        payload = (const char *)compressed;
+        len = compressed_len;
+        property_count = 2;
+    }
+#endif
+
+    const publish_message_t msg = {
+        .topic = topic,
+        .data = payload,
+        .len = len,
+        .qos = 1,
+        .content_type = telemetry_get_encoding() == TELEMETRY_ENCODING_CBOR
+                            ? "application/cbor"
+                            : "application/json",
+        .user_properties = properties,
+        .user_property_count = property_count,
+        .callback = telemetry_publish_done,
+        .arg = (void *)(uintptr_t)len,
+    };
+    return publish_manager_publish(&msg);
+}
+
+/**
+ * @brief Publish all buffered live samples once a batch is due
+ */
+static void telemetry_flush_live(char *buf, size_t buf_len) {
+    if (!telemetry_flush_due(telemetry_now_ms())) {
+        return;
+    }
+    while (telemetry_pending_count() > 0) {
+        size_t batch_len = 0;
+        size_t batch_count = telemetry_encode_batch(buf, buf_len, &batch_len);
+        if (batch_count == 0) {
+            break;
+        }
+
+        esp_err_t err = telemetry_publish_batch(buf, batch_len);
+        if (err == ESP_ERR_NO_MEM) {
+            // Window full; the samples wait for the next tick
+            break;
+        }
+        if (err != ESP_OK) {
+            app_log_event(APP_LOG_EVT_PUBLISH_FAILED, batch_len);
+            APP_LOGW_LIMITED(TAG,
+                             "Failed to queue telemetry batch (%s), keeping "
+                             "%u samples buffered",
+                             esp_err_to_name(err),
+                             (unsigned)telemetry_pending_count());
+            break;
+        }
+
+        telemetry_consume(batch_count);
+        ESP_LOGI(TAG, "Queued telemetry batch of %u samples",
+                 (unsigned)batch_count);
+    }
+}
+
+/**
+ * @brief Move full batches from the ring buffer to the flash spool
+ */
+static void telemetry_spool_store(void) {
+    telemetry_sample_t batch[TELEMETRY_BATCH_SIZE];
+
+    while (telemetry_pending_count() >= TELEMETRY_BATCH_SIZE) {
+        size_t count = telemetry_peek(batch, TELEMETRY_BATCH_SIZE);
+        if (flash_spool_append(batch, count * sizeof(batch[0])) != ESP_OK) {
+            break;
+        }
+        telemetry_consume(count);
+        app_log_event(APP_LOG_EVT_SPOOL_STORE, count);
+        ESP_LOGD(TAG, "Spooled %u samples to flash", (unsigned)count);
+    }
+}
+
+/**
+ * @brief Replay a bounded number of spooled batches
+ *
+ * Live samples are flushed first on every tick, so the drain only uses what
+ * is left of the per-tick budget.
+ */
+static void telemetry_spool_drain(char *buf, size_t buf_len) {
+    telemetry_sample_t batch[TELEMETRY_BATCH_SIZE];
+
+    for (int i = 0; i < SPOOL_DRAIN_BATCHES_PER_TICK; i++) {
+        size_t record_len = 0;
+        if (flash_spool_read(batch, sizeof(batch), &record_len) != ESP_OK) {
+            break;
+        }
+
+        size_t count = record_len / sizeof(batch[0]);
+        size_t batch_len = 0;
+        if (record_len % sizeof(batch[0]) != 0) {
+            // Written by firmware with a different sample layout
+            ESP_LOGW(TAG, "Spooled record of %u bytes has another schema, "
+                          "discarding",
+                     (unsigned)record_len);
+            flash_spool_consume();
+            continue;
+        }
+        if (telemetry_encode_samples(batch, count, buf, buf_len, &batch_len) !=
+            count) {
+            ESP_LOGE(TAG, "Spooled batch does not fit, discarding");
+            flash_spool_consume();
+            continue;
+        }
+
+        if (telemetry_publish_batch(buf, batch_len) != ESP_OK) {
+            break;
+        }
+
+        flash_spool_consume();
+        app_log_event(APP_LOG_EVT_SPOOL_REPLAY, count);
+        ESP_LOGI(TAG, "Replayed spooled batch of %u samples",
+                 (unsigned)count);
+    }
+}
+
+/**
+ * @brief Publish buffered and spooled telemetry under flow control
+ *
+ * Below the outbox high-water mark live samples go first and the spool is
+ * drained with what is left of the in-flight window. Above it, the
+ * configured policy decides: drop-oldest stops publishing and leaves the
+ * ring to overwrite its oldest samples, downsample keeps publishing at a
+ * reduced sample rate, and spill moves full batches to the flash spool
+ * (falling back to drop-oldest without one).
+ */
+static void telemetry_publish_stage(char *buf, size_t buf_len) {
+    publish_policy_t policy = publish_manager_policy();
+    bool congested = publish_manager_high_water();
+
+    telemetry_set_decimation(congested && policy == PUBLISH_POLICY_DOWNSAMPLE
+                                 ? PUBLISH_DOWNSAMPLE_FACTOR
+                                 : 1);
+    if (!congested) {
+        telemetry_flush_live(buf, buf_len);
+        if (spool_available && !flash_spool_is_empty()) {
+            telemetry_spool_drain(buf, buf_len);
+        }
+    } else if (policy == PUBLISH_POLICY_DOWNSAMPLE) {
+        telemetry_flush_live(buf, buf_len);
+    } else if (policy == PUBLISH_POLICY_SPILL && spool_available) {
+        telemetry_spool_store();
+    }
+}
+
+/**
+ * @brief Publish the latency histograms collected since the last report
+ */
+static void telemetry_publish_metrics(char *buf, size_t buf_len) {
+    size_t len = 0;
+    if (telemetry_encode_metrics(buf, buf_len, &len) != ESP_OK) {
+        ESP_LOGE(TAG, "Metrics report does not fit in %u bytes",
+                 (unsigned)buf_len);
+        return;
+    }
+
+    // QoS 0: a lost report only costs one interval of histogram data
+    const publish_message_t msg = {
+        .topic = metrics_topic,
+        .data = buf,
+        .len = len,
+        .qos = 0,
+        .control = true,
+        .content_type = "application/json",
+    };
+    if (publish_manager_publish(&msg) != ESP_OK) {
+        APP_LOGW_LIMITED(TAG, "Metrics report dropped");
+    }
 }
 
 /**
  * @brief Telemetry publishing task
+ *
+ * Samples into the telemetry ring buffer every TELEMETRY_SAMPLE_INTERVAL and
+ * publishes the buffered samples as one batch once the batch is full or the
+ * oldest sample reaches the maximum batch age. While MQTT is disconnected,
+ * full batches are written to the flash spool and replayed after reconnect.
+ * Publishing is paced by the publish manager's in-flight window.
  */
 static void telemetry_task(void *pvParameters) {
-    char telemetry_topic[128];
-    char telemetry_data[256];
-    static int message_count = 0;
-
-    snprintf(telemetry_topic, sizeof(telemetry_topic), TELEMETRY_TOPIC_FMT,
-             AWS_IOT_DEVICE_THING_NAME);
+    static char batch_data[TELEMETRY_BATCH_BUFFER_SIZE];
 
+    TickType_t last_wake = xTaskGetTickCount();
+    int64_t last_metrics_ms = esp_timer_get_time() / 1000;
+    bool metered = false;
     while (1) {
-        // Wait for MQTT connection
-        xEventGroupWaitBits(aws_iot_event_group, AWS_IOT_CONNECTED_BIT, false,
-                            true, portMAX_DELAY);
-
-        // Create telemetry message
-        snprintf(telemetry_data, sizeof(telemetry_data),
-                 "{"
-                 "\"timestamp\": %lld,"
-                 "\"device_id\": \"%s\","
-                 "\"message_count\": %d,"
-                 "\"free_heap\": %lu,"
-                 "\"uptime_ms\": %llu"
-                 "}",
-                 esp_timer_get_time() / 1000, AWS_IOT_DEVICE_THING_NAME,
-                 ++message_count, esp_get_free_heap_size(),
-                 esp_timer_get_time() / 1000);
-
-        // Publish telemetry
-        int msg_id = esp_mqtt_client_publish(mqtt_client, telemetry_topic,
-                                             telemetry_data, 0, 1, 0);
-        ESP_LOGI(TAG, "Published telemetry, msg_id=%d", msg_id);
-
-        vTaskDelay(pdMS_TO_TICKS(TELEMETRY_PUBLISH_INTERVAL));
+        // Sampling stage
+        telemetry_sample();
+
+        // Batch harder while on cellular
+        if (network_link_is_metered() != metered) {
+            metered = !metered;
+            if (metered) {
+                telemetry_set_batch_policy(CELLULAR_TELEMETRY_FLUSH_THRESHOLD,
+                                           CELLULAR_TELEMETRY_BATCH_MAX_AGE_MS);
+            } else {
+                telemetry_set_batch_policy(TELEMETRY_BATCH_SIZE,
+                                           TELEMETRY_BATCH_MAX_AGE_MS);
+            }
+        }
+
+        // Publish stage
+        EventBits_t bits = xEventGroupGetBits(aws_iot_event_group);
+        if (bits & AWS_IOT_CONNECTED_BIT) {
+            telemetry_publish_stage(batch_data, sizeof(batch_data));
+
+            int64_t now_ms = esp_timer_get_time() / 1000;
+            int64_t metrics_interval_ms =
+                metered ? CELLULAR_METRICS_INTERVAL_MS : METRICS_INTERVAL_MS;
+            if (now_ms - last_metrics_ms >= metrics_interval_ms) {
+                telemetry_publish_metrics(batch_data, sizeof(batch_data));
+                last_metrics_ms = now_ms;
+            }
+        } else if (spool_available) {
+            telemetry_spool_store();
+        }
+
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(TELEMETRY_SAMPLE_INTERVAL));
     }
 }
 
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+/**
+ * @brief Wait until every queued QoS 1 message has been acknowledged
+ */
+static bool mqtt_wait_outbox_empty(int64_t deadline_ms) {
+    while (publish_manager_pending() > 0 ||
+           esp_mqtt_client_get_outbox_size(mqtt_client) > 0) {
+        if (esp_timer_get_time() / 1000 >= deadline_ms) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+    return true;
+}
+
+/**
+ * @brief Upload wake: connect, publish everything buffered and sleep
+ *
+ * Every phase is bounded so a missing AP or broker costs at most
+ * DUTY_CYCLE_CONNECT_TIMEOUT_MS twice plus DUTY_CYCLE_FLUSH_TIMEOUT_MS of
+ * radio time. Samples that couldn't be sent stay in RTC memory, or go to
+ * the flash spool once full batches build up.
+ */
+static void duty_cycle_upload(void) {
+    static char batch_data[TELEMETRY_BATCH_BUFFER_SIZE];
+    bool ok = false;
+
+    // Everything buffered goes out in this cycle
+    telemetry_set_batch_policy(1, 0);
+
+    // The client was built in app_main() and starts on the link-up event
+    if (mqtt_client != NULL && network_link_wait_for_connection(pdMS_TO_TICKS(
+                                   DUTY_CYCLE_CONNECT_TIMEOUT_MS))) {
+        duty_cycle_mark(DUTY_CYCLE_PHASE_LINK_UP);
+
+        EventBits_t bits = xEventGroupWaitBits(
+            aws_iot_event_group, AWS_IOT_CONNECTED_BIT, pdFALSE, pdTRUE,
+            pdMS_TO_TICKS(DUTY_CYCLE_CONNECT_TIMEOUT_MS));
+        if (bits & AWS_IOT_CONNECTED_BIT) {
+            duty_cycle_mark(DUTY_CYCLE_PHASE_MQTT_CONNECTED);
+            int64_t deadline_ms =
+                esp_timer_get_time() / 1000 + DUTY_CYCLE_FLUSH_TIMEOUT_MS;
+
+            // Reports the timings of the previous upload cycle
+            telemetry_publish_metrics(batch_data, sizeof(batch_data));
+            // The in-flight window paces this loop; wait for PUBACKs to
+            // open it again
+            while ((telemetry_pending_count() > 0 ||
+                    (spool_available && !flash_spool_is_empty())) &&
+                   esp_timer_get_time() / 1000 < deadline_ms) {
+                telemetry_flush_live(batch_data, sizeof(batch_data));
+                if (spool_available && !flash_spool_is_empty()) {
+                    telemetry_spool_drain(batch_data, sizeof(batch_data));
+                }
+                vTaskDelay(pdMS_TO_TICKS(20));
+            }
+
+            ok = telemetry_pending_count() == 0 &&
+                 mqtt_wait_outbox_empty(deadline_ms);
+            if (ok) {
+                duty_cycle_mark(DUTY_CYCLE_PHASE_FLUSHED);
+            }
+        }
+        esp_mqtt_client_disconnect(mqtt_client);
+        esp_mqtt_client_stop(mqtt_client);
+    }
+
+    if (!ok && spool_available) {
+        telemetry_spool_store();
+    }
+    duty_cycle_upload_done(ok);
+    network_link_shutdown();
+    duty_cycle_sleep();
+}
+#endif
+
 /**
  * @brief Application main entry point
  */
 void app_main(void) {
+    // Telemetry state survives deep sleep, so this comes before anything else
+    telemetry_init(AWS_IOT_DEVICE_THING_NAME);
+
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+    // Sample-only wakes end here, before NVS, the radio or TLS are touched
+    duty_cycle_wake();
+    telemetry_sample();
+    if (!duty_cycle_upload_due(telemetry_pending_count())) {
+        duty_cycle_sleep();
+    }
+#endif
+
     ESP_LOGI(TAG, "ESP32-S3 AWS IoT Client Starting...");
+    app_log_event(APP_LOG_EVT_BOOT, esp_reset_reason());
 
     // Initialize NVS
     esp_err_t ret = nvs_flash_init();
@@ -275,26 +1096,46 @@ void app_main(void) {
     // Create event group
     aws_iot_event_group = xEventGroupCreate();
 
-    // Initialize certificates
-    certificate_manager_init();
+    // Everything the link-up callback touches exists before WiFi starts
+    device_shadow_init(AWS_IOT_DEVICE_THING_NAME);
+    topics_init();
 
-    // Initialize WiFi
-    wifi_manager_init();
-    wifi_manager_connect();
+    // Bring up WiFi, with cellular as fallback. Association and DHCP run in
+    // the background while the rest of startup proceeds
+    ESP_ERROR_CHECK(network_link_init(network_link_changed, NULL));
 
-    // Wait for WiFi connection
-    wifi_manager_wait_for_connection();
-    ESP_LOGI(TAG, "WiFi connected, starting AWS IoT client");
+    // Load credentials and parse the CA store while WiFi associates
+    certificate_manager_init();
+    boot_timing_mark(BOOT_PHASE_CERTS_READY);
 
-    // Initialize device shadow
-    device_shadow_init(AWS_IOT_DEVICE_THING_NAME);
+    // Offline telemetry store
+    spool_available = flash_spool_init(SPOOL_PARTITION_LABEL) == ESP_OK;
+    if (!spool_available) {
+        ESP_LOGW(TAG, "Flash spool unavailable, offline telemetry will be "
+                      "dropped");
+    }
+
+    // Allocate the inbound reassembly arena before any data can arrive
+    mqtt_reassembly_init(MQTT_REASSEMBLY_MAX_SIZE);
 
-    // Initialize MQTT client
+    // Build the MQTT client; the first link-up starts it, which may already
+    // have happened
     mqtt_client_init();
 
-    // Create telemetry task
-    xTaskCreate(telemetry_task, "telemetry_task", TELEMETRY_TASK_STACK_SIZE,
-                NULL, TELEMETRY_TASK_PRIORITY, NULL);
+    // Start command processing
+    commands_init();
+
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+    duty_cycle_upload();
+#endif
+
+    // Create telemetry task on the application core
+    xTaskCreatePinnedToCore(telemetry_task, "telemetry_task",
+                            TELEMETRY_TASK_STACK_SIZE, NULL,
+                            TELEMETRY_TASK_PRIORITY, NULL, TELEMETRY_TASK_CORE);
+
+    // Periodic per-task CPU usage report
+    task_monitor_start(TASK_MONITOR_INTERVAL_MS);
 
     ESP_LOGI(TAG, "AWS IoT client initialized");
 }
\ No newline at end of file
@@ -11,11 +11,182 @@
 // WiFi Configuration
 #define CONFIG_EXAMPLE_WIFI_SSID "Noovoleum_Office"
 #define CONFIG_EXAMPLE_WIFI_PASSWORD "greenenergychampion"
-#define CONFIG_EXAMPLE_WIFI_MAXIMUM_RETRY 5
+
+// WiFi reconnect: jittered exponential backoff between these bounds, never
+// giving up. The first attempts after a drop go straight to the AP and
+// channel cached in NVS before falling back to a full scan.
+#define CONFIG_AWS_IOT_WIFI_BACKOFF_MIN_MS 500
+#define CONFIG_AWS_IOT_WIFI_BACKOFF_MAX_MS 60000
+#define CONFIG_AWS_IOT_WIFI_FAST_CONNECT_ATTEMPTS 2
+
+// Cellular fallback: SIM7600 over PPP through esp_modem. Dialed after WiFi
+// has been down for FAILOVER_MS, hung up once WiFi has been back for
+// FAILBACK_MS; a PPP session that doesn't come up is redialed after REDIAL_MS
+#define CONFIG_AWS_IOT_CELLULAR_ENABLE 0
+#define CONFIG_AWS_IOT_CELLULAR_APN "internet"
+#define CONFIG_AWS_IOT_CELLULAR_UART_PORT 1
+#define CONFIG_AWS_IOT_CELLULAR_UART_TX_PIN 17
+#define CONFIG_AWS_IOT_CELLULAR_UART_RX_PIN 18
+#define CONFIG_AWS_IOT_CELLULAR_UART_BAUD 115200
+#define CONFIG_AWS_IOT_LINK_FAILOVER_MS 30000
+#define CONFIG_AWS_IOT_LINK_FAILBACK_MS 60000
+#define CONFIG_AWS_IOT_CELLULAR_REDIAL_MS 60000
 
 // Certificate filenames
 #define CONFIG_AWS_IOT_ROOT_CA_FILENAME "aws_root_ca.pem"
 #define CONFIG_AWS_IOT_CERTIFICATE_FILENAME "device_cert.pem"
 #define CONFIG_AWS_IOT_PRIVATE_KEY_FILENAME "device_private_key.pem"
 
+// Parse the root CA once into the esp-tls global CA store instead of on
+// every TLS handshake
+#define CONFIG_AWS_IOT_CERT_GLOBAL_CA_STORE 1
+
+// TLS session resumption: offer the last session (ID and ticket) on
+// reconnect instead of a full handshake. Needs
+// CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS=y. The serialized session, including
+// the server certificate, is kept in this many bytes of RTC memory so it
+// survives deep sleep
+#define CONFIG_AWS_IOT_TLS_SESSION_RESUMPTION 1
+#define CONFIG_AWS_IOT_TLS_SESSION_RTC_SIZE 2048
+
+// Sign TLS handshakes with the Digital Signature peripheral; the encrypted
+// key parameters are read from this NVS partition (see partitions.csv)
+#define CONFIG_AWS_IOT_CERT_USE_DS_PERIPHERAL 0
+#define CONFIG_AWS_IOT_CERT_DS_PARTITION "pre_prov"
+
+// Credential rotation: a staged certificate/key pair is rolled back after
+// this many failed connects, or after this many boots without connecting
+#define CONFIG_AWS_IOT_CERT_TRIAL_MAX_FAILURES 3
+#define CONFIG_AWS_IOT_CERT_TRIAL_MAX_ATTEMPTS 3
+// A rotated private key is written to NVS. Without CONFIG_NVS_ENCRYPTION it
+// would be stored in the clear, so it is refused unless this is set
+#define CONFIG_AWS_IOT_CERT_ALLOW_PLAINTEXT_KEY 0
+
+// Telemetry batching
+#define CONFIG_AWS_IOT_TELEMETRY_SAMPLE_INTERVAL_MS 1000
+#define CONFIG_AWS_IOT_TELEMETRY_RING_CAPACITY 64
+#define CONFIG_AWS_IOT_TELEMETRY_BATCH_SIZE 20
+#define CONFIG_AWS_IOT_TELEMETRY_BATCH_MAX_AGE_MS 30000
+#define CONFIG_AWS_IOT_TELEMETRY_BATCH_BUFFER_SIZE 2048
+// Samples within every field's deadband are dropped, but one is stored at
+// least this often so the cloud can tell a quiet device from a dead one
+#define CONFIG_AWS_IOT_TELEMETRY_HEARTBEAT_MS 60000
+// Encode batches as CBOR instead of JSON (see telemetry.h for the layout);
+// about a fifth of the bytes per sample
+#define CONFIG_AWS_IOT_TELEMETRY_ENCODING_CBOR 0
+// Batches of at least THRESHOLD bytes are LZSS-compressed (heatshrink format)
+// and published on device/<thing>/telemetry/hs when that makes them smaller
+#define CONFIG_AWS_IOT_TELEMETRY_COMPRESS 1
+#define CONFIG_AWS_IOT_TELEMETRY_COMPRESS_THRESHOLD 512
+#define CONFIG_AWS_IOT_COMPRESS_BUFFER_SIZE CONFIG_AWS_IOT_TELEMETRY_BATCH_BUFFER_SIZE
+
+// Bulk QoS 1 publishes: at most MAX_INFLIGHT unacknowledged at once. Once
+// the outbox holds HIGH_WATER bytes (until it is back under LOW_WATER)
+// telemetry applies HIGH_WATER_POLICY: 0 stops publishing and lets the ring
+// drop its oldest samples, 1 keeps one sample in DOWNSAMPLE_FACTOR, 2 moves
+// full batches to the flash spool. OUTBOX_LIMIT is the client's hard cap,
+// beyond which every QoS 1 publish fails. Each window slot holds a copy of
+// up to MAX_PAYLOAD bytes until the publisher task has sent it
+#define CONFIG_AWS_IOT_PUBLISH_MAX_INFLIGHT 4
+#define CONFIG_AWS_IOT_PUBLISH_MAX_PAYLOAD CONFIG_AWS_IOT_TELEMETRY_BATCH_BUFFER_SIZE
+#define CONFIG_AWS_IOT_PUBLISH_OUTBOX_HIGH_WATER 8192
+#define CONFIG_AWS_IOT_PUBLISH_OUTBOX_LOW_WATER 4096
+#define CONFIG_AWS_IOT_PUBLISH_HIGH_WATER_POLICY 2
+#define CONFIG_AWS_IOT_PUBLISH_DOWNSAMPLE_FACTOR 4
+#define CONFIG_AWS_IOT_PUBLISH_OUTBOX_LIMIT 32768
+
+// MQTT 5 (needs CONFIG_MQTT_PROTOCOL_5 in sdkconfig): telemetry carries its
+// content type and schema as properties, and commands may name a response
+// topic and correlation data. The broker may alias up to TOPIC_ALIAS_MAX
+// inbound topics; outgoing messages never use aliases
+#define CONFIG_AWS_IOT_MQTT_PROTOCOL_5 0
+#define CONFIG_AWS_IOT_MQTT5_TOPIC_ALIAS_MAX 8
+
+// Persistent session: connect with clean session off and the thing name as
+// client ID, so the broker keeps our subscriptions and queues QoS 1 commands
+// while we are offline. SESSION_EXPIRY_S is the MQTT 5 session expiry; for
+// MQTT 3.1.1 AWS IoT applies the account's persistent session expiry
+#define CONFIG_AWS_IOT_MQTT_PERSISTENT_SESSION 1
+#define CONFIG_AWS_IOT_MQTT_SESSION_EXPIRY_S 3600
+
+// Telemetry while on a metered (cellular) link: flush only once this many
+// samples are buffered or the oldest is this old, and report metrics less
+// often
+#define CONFIG_AWS_IOT_CELLULAR_TELEMETRY_FLUSH_THRESHOLD 60
+#define CONFIG_AWS_IOT_CELLULAR_TELEMETRY_BATCH_MAX_AGE_MS 120000
+#define CONFIG_AWS_IOT_CELLULAR_METRICS_INTERVAL_MS 600000
+
+// Battery mode: deep sleep between wakes, one sample per wake and an upload
+// every SAMPLES_PER_UPLOAD wakes. Connect and flush timeouts bound the radio
+// time of an upload wake
+#define CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE 0
+#define CONFIG_AWS_IOT_DUTY_CYCLE_SLEEP_MS 30000
+#define CONFIG_AWS_IOT_DUTY_CYCLE_SAMPLES_PER_UPLOAD 10
+#define CONFIG_AWS_IOT_DUTY_CYCLE_CONNECT_TIMEOUT_MS 15000
+#define CONFIG_AWS_IOT_DUTY_CYCLE_FLUSH_TIMEOUT_MS 10000
+
+// Reported shadow keys changed within this window go out as one update
+#define CONFIG_AWS_IOT_SHADOW_REPORT_DEBOUNCE_MS 1000
+// Shadow requests in flight at once; unanswered ones time out and throttled
+// or conflicting ones are retried, RETRY_BASE_MS doubling per attempt
+#define CONFIG_AWS_IOT_SHADOW_MAX_PENDING 6
+#define CONFIG_AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS 10000
+#define CONFIG_AWS_IOT_SHADOW_MAX_RETRIES 3
+#define CONFIG_AWS_IOT_SHADOW_RETRY_BASE_MS 1000
+
+// Inbound MQTT messages larger than the RX buffer are reassembled in a
+// PSRAM-backed arena of this size
+#define CONFIG_AWS_IOT_MQTT_REASSEMBLY_MAX_SIZE 16384
+
+// PSRAM-placed buffers only fall back to internal RAM while this much of
+// it stays free for WiFi, lwIP and TLS handshakes (see mem_budget.h)
+#define CONFIG_AWS_IOT_MEM_INTERNAL_RESERVE 40960
+
+// Command processing
+#define CONFIG_AWS_IOT_COMMAND_QUEUE_LENGTH 8
+#define CONFIG_AWS_IOT_COMMAND_WORKER_COUNT 2
+#define CONFIG_AWS_IOT_COMMAND_DEFAULT_TIMEOUT_MS 10000
+
+// Store-and-forward spool (see partitions.csv)
+#define CONFIG_AWS_IOT_SPOOL_PARTITION_LABEL "spool"
+#define CONFIG_AWS_IOT_SPOOL_DRAIN_BATCHES_PER_TICK 5
+
+// Latency histograms are published on device/<thing>/telemetry/metrics
+#define CONFIG_AWS_IOT_METRICS_INTERVAL_MS 60000
+
+// Compile-time log levels per module; ESP_LOGx calls above the level are
+// compiled out (use ESP_LOG_WARN for production builds)
+#define CONFIG_AWS_IOT_LOG_LEVEL_CLIENT ESP_LOG_INFO
+#define CONFIG_AWS_IOT_LOG_LEVEL_COMMAND ESP_LOG_INFO
+#define CONFIG_AWS_IOT_LOG_LEVEL_METRICS ESP_LOG_INFO
+#define CONFIG_AWS_IOT_LOG_LEVEL_PUBLISH ESP_LOG_INFO
+#define CONFIG_AWS_IOT_LOG_LEVEL_REASSEMBLY ESP_LOG_INFO
+#define CONFIG_AWS_IOT_LOG_LEVEL_ROUTER ESP_LOG_INFO
+#define CONFIG_AWS_IOT_LOG_LEVEL_SHADOW ESP_LOG_INFO
+#define CONFIG_AWS_IOT_LOG_LEVEL_TELEMETRY ESP_LOG_INFO
+#define CONFIG_AWS_IOT_LOG_LEVEL_WIFI ESP_LOG_INFO
+
+// Rate limit for repeated log messages, per call site
+#define CONFIG_AWS_IOT_LOG_RATE_PER_SEC 1
+#define CONFIG_AWS_IOT_LOG_RATE_BURST 5
+
+// Binary event log kept in RAM and dumped by the "log_dump" command
+// (12 bytes per entry, 0 disables)
+#define CONFIG_AWS_IOT_LOG_RING_ENTRIES 256
+
+// Per-task CPU usage report (needs FreeRTOS run-time stats, see task_config.h)
+#define CONFIG_AWS_IOT_TASK_MONITOR_INTERVAL_MS 60000
+
+// On-device benchmark and soak harness (see bench.h), for test builds only.
+// SOAK_* are the defaults of the "soak" command; SOAK_AUTOSTART runs a soak
+// from boot for unattended runs, e.g. against a local broker set as
+// CONFIG_AWS_IOT_MQTT_HOST (SOAK_DURATION_S 0 runs until stopped)
+#define CONFIG_AWS_IOT_BENCH_ENABLE 0
+#define CONFIG_AWS_IOT_BENCH_ITERATIONS 200
+#define CONFIG_AWS_IOT_SOAK_RATE_HZ 10
+#define CONFIG_AWS_IOT_SOAK_PAYLOAD_SIZE 512
+#define CONFIG_AWS_IOT_SOAK_DURATION_S 0
+#define CONFIG_AWS_IOT_SOAK_REPORT_INTERVAL_S 60
+#define CONFIG_AWS_IOT_SOAK_AUTOSTART 0
+
 #endif // AWS_IOT_CONFIG_H
\ No newline at end of file
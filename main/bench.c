@@ -0,0 +1,608 @@
+/**
+ * @file bench.c
+ * @brief On-device benchmarks and soak test for the MQTT/shadow pipeline
+ */
+
+#include "aws_iot_config.h"
+#include "bench.h"
+
+#if CONFIG_AWS_IOT_BENCH_ENABLE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "command_processor.h"
+#include "device_shadow.h"
+#include "json_reader.h"
+#include "json_writer.h"
+#include "publish_manager.h"
+#include "task_config.h"
+#include "telemetry.h"
+
+static const char *TAG = "BENCH";
+
+#define BENCH_ITERATIONS CONFIG_AWS_IOT_BENCH_ITERATIONS
+#define BENCH_MAX_ITERATIONS 5000
+#define BENCH_CASE_TIMEOUT_MS 5000
+#define BENCH_COMMAND_TIMEOUT_MS 30000
+#define BENCH_REPORT_SIZE 768
+
+#define SOAK_RATE_HZ CONFIG_AWS_IOT_SOAK_RATE_HZ
+#define SOAK_PAYLOAD_SIZE CONFIG_AWS_IOT_SOAK_PAYLOAD_SIZE
+#define SOAK_DURATION_S CONFIG_AWS_IOT_SOAK_DURATION_S
+#define SOAK_REPORT_INTERVAL_S CONFIG_AWS_IOT_SOAK_REPORT_INTERVAL_S
+#define SOAK_MAX_RATE_HZ 1000
+#define SOAK_MIN_PAYLOAD 32
+#define SOAK_MAX_PAYLOAD CONFIG_AWS_IOT_PUBLISH_MAX_PAYLOAD
+#define SOAK_REPORT_SIZE 512
+#define SOAK_REPORT_RETRY_MS 20
+#define SOAK_REPORT_RETRIES 25
+
+// Publish times by sequence number; only queued messages take a number, so
+// at most MAX_INFLIGHT are live at once
+#define SOAK_TRACK_SLOTS 32
+_Static_assert(SOAK_PAYLOAD_SIZE >= SOAK_MIN_PAYLOAD && SOAK_PAYLOAD_SIZE <= SOAK_MAX_PAYLOAD,
+               "Soak payload must fit a publish slot");
+_Static_assert(SOAK_TRACK_SLOTS >= CONFIG_AWS_IOT_PUBLISH_MAX_INFLIGHT,
+               "Every in-flight soak message needs a publish time slot");
+
+#define CAPS_INTERNAL (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+
+#define BENCH_TOPIC_FMT "device/%s/bench"
+#define SOAK_LOAD_TOPIC_FMT "device/%s/bench/load"
+#define SOAK_REPORT_TOPIC_FMT "device/%s/bench/soak"
+#define SHADOW_DELTA_TOPIC_FMT "$aws/things/%s/shadow/update/delta"
+
+typedef struct {
+    const char *name;
+    esp_err_t (*run)(void);
+} bench_case_t;
+
+typedef struct {
+    const bench_case_t *bench;
+    uint32_t iterations;
+    TaskHandle_t caller;
+    esp_err_t err;
+    uint32_t cycles_min;
+    uint32_t cycles_max;
+    uint64_t cycles_total;
+    int64_t elapsed_us;
+    int32_t heap_delta;
+    uint32_t stack_used;
+} bench_job_t;
+
+typedef struct {
+    uint32_t rate_hz;
+    uint32_t payload;
+    uint32_t duration_s;    ///< 0 until stopped
+} soak_params_t;
+
+typedef struct {
+    uint32_t sent;
+    uint32_t acked;
+    uint32_t failed;
+    uint32_t window_full;
+    // Since the last report
+    uint32_t interval_acked;
+    int64_t latency_min;
+    int64_t latency_max;
+    int64_t latency_total;
+} soak_stats_t;
+
+static char bench_topic[PUBLISH_MAX_TOPIC_LEN];
+static char soak_load_topic[PUBLISH_MAX_TOPIC_LEN];
+static char soak_report_topic[PUBLISH_MAX_TOPIC_LEN];
+static char shadow_delta_topic[PUBLISH_MAX_TOPIC_LEN];
+
+// Scratch for the cases; a case runs in one task at a time
+static char bench_buf[CONFIG_AWS_IOT_TELEMETRY_BATCH_BUFFER_SIZE];
+static telemetry_sample_t bench_samples[TELEMETRY_BATCH_SIZE];
+static bench_job_t bench_job;
+static bool bench_busy;     // Stays set if a case never finishes
+static portMUX_TYPE bench_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static soak_params_t soak_params;
+static soak_stats_t soak_stats;
+static bool soak_running;
+static volatile bool soak_stop;
+static int64_t soak_sent_us[SOAK_TRACK_SLOTS];
+static char soak_payload[SOAK_MAX_PAYLOAD];
+static portMUX_TYPE soak_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// A get/accepted-sized delta. Without a version it is applied whatever the
+// cached one, and leaves it as it is; without a client token it finishes no
+// request. Its keys are not registered, so the cache and NVS stay untouched
+// while every member is still tokenized through apply_document().
+static const char shadow_fixture[] =
+    "{\"state\":{\"bench_interval_ms\":5000,\"bench_led\":true,\"bench_mode\":\"normal\","
+    "\"bench_thresholds\":{\"heap_low\":32768,\"heap_critical\":16384,\"rssi_low\":-80},"
+    "\"bench_schedule\":[{\"start\":\"06:00\",\"end\":\"22:00\"},{\"start\":\"22:00\",\"end\":\"06:00\"}]},"
+    "\"metadata\":{\"bench_interval_ms\":{\"timestamp\":1760000000},"
+    "\"bench_led\":{\"timestamp\":1760000000},\"bench_mode\":{\"timestamp\":1760000000},"
+    "\"bench_thresholds\":{\"heap_low\":{\"timestamp\":1760000000},"
+    "\"heap_critical\":{\"timestamp\":1760000000},\"rssi_low\":{\"timestamp\":1760000000}}},"
+    "\"timestamp\":1760000000}";
+
+static esp_err_t case_shadow_document(void)
+{
+    size_t len;
+    return device_shadow_create_state_document(bench_buf, sizeof(bench_buf), &len);
+}
+
+static esp_err_t case_shadow_response(void)
+{
+    return device_shadow_handle_response(shadow_delta_topic, strlen(shadow_delta_topic),
+                                         shadow_fixture, sizeof(shadow_fixture) - 1);
+}
+
+static esp_err_t case_telemetry_encode(void)
+{
+    size_t len;
+    return telemetry_encode_samples(bench_samples, TELEMETRY_BATCH_SIZE, bench_buf,
+                                    sizeof(bench_buf), &len) > 0 ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+static const bench_case_t bench_cases[] = {
+    {"shadow_document", case_shadow_document},
+    {"shadow_response", case_shadow_response},
+    {"telemetry_encode", case_telemetry_encode},
+};
+
+/**
+ * Samples that drift like real heap readings, so delta encoding sees
+ * small, varying differences
+ */
+static void fill_samples(void)
+{
+    for (size_t i = 0; i < TELEMETRY_BATCH_SIZE; i++) {
+        telemetry_sample_t *sample = &bench_samples[i];
+        sample->timestamp_ms = 1760000000000LL + (int64_t)i * 1000;
+        sample->sequence = (uint32_t)i;
+        for (size_t f = 0; f < TELEMETRY_MAX_FIELDS; f++) {
+            sample->values[f].u = 180000 - (uint32_t)(f * 20000) + (uint32_t)((i * 37 + f * 11) % 512);
+        }
+    }
+}
+
+static void bench_task(void *arg)
+{
+    bench_job_t *job = arg;
+
+    // Warm-up call: first-use initialization and cold caches are not timed
+    job->err = job->bench->run();
+    job->cycles_min = UINT32_MAX;
+
+    size_t heap_before = heap_caps_get_free_size(CAPS_INTERNAL);
+    int64_t start_us = esp_timer_get_time();
+    for (uint32_t i = 0; i < job->iterations && job->err == ESP_OK; i++) {
+        esp_cpu_cycle_count_t start = esp_cpu_get_cycle_count();
+        job->err = job->bench->run();
+        uint32_t cycles = esp_cpu_get_cycle_count() - start;
+
+        job->cycles_total += cycles;
+        if (cycles < job->cycles_min) {
+            job->cycles_min = cycles;
+        }
+        if (cycles > job->cycles_max) {
+            job->cycles_max = cycles;
+        }
+    }
+    job->elapsed_us = esp_timer_get_time() - start_us;
+    job->heap_delta = (int32_t)((int64_t)heap_before - (int64_t)heap_caps_get_free_size(CAPS_INTERNAL));
+    job->stack_used = BENCH_TASK_STACK_SIZE - uxTaskGetStackHighWaterMark(NULL);
+
+    xTaskNotifyGive(job->caller);
+    vTaskDelete(NULL);
+}
+
+/**
+ * Find a member of the command's params object
+ */
+static bool param_token(const command_t *cmd, const char *name, json_token_t *value)
+{
+    json_reader_t r;
+    json_token_t key;
+
+    if (cmd->params_len == 0) {
+        return false;
+    }
+    json_reader_init(&r, cmd->params, cmd->params_len);
+    if (json_reader_next(&r, &key) != ESP_OK || key.type != JSON_TOKEN_OBJECT_BEGIN) {
+        return false;
+    }
+    while (json_reader_next(&r, &key) == ESP_OK && key.type == JSON_TOKEN_KEY) {
+        if (json_reader_next(&r, value) != ESP_OK) {
+            return false;
+        }
+        if (json_token_equals(&key, name)) {
+            return true;
+        }
+        if (json_reader_skip(&r, value) != ESP_OK) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static uint32_t param_uint(const command_t *cmd, const char *name, uint32_t fallback,
+                           uint32_t min, uint32_t max)
+{
+    json_token_t value;
+    int64_t n;
+
+    if (!param_token(cmd, name, &value) || value.type != JSON_TOKEN_NUMBER ||
+        json_token_get_int(&value, &n) != ESP_OK) {
+        return fallback;
+    }
+    return n < min ? min : n > max ? max : (uint32_t)n;
+}
+
+/**
+ * Publish a report as a control message, waiting briefly for a slot
+ */
+static esp_err_t publish_report(const char *topic, const char *data, size_t len, uint32_t retries)
+{
+    const publish_message_t msg = {
+        .topic = topic,
+        .data = data,
+        .len = len,
+        .qos = 1,
+        .control = true,
+        .content_type = "application/json",
+    };
+    esp_err_t err;
+
+    while ((err = publish_manager_publish(&msg)) == ESP_ERR_NO_MEM && retries-- > 0) {
+        vTaskDelay(pdMS_TO_TICKS(SOAK_REPORT_RETRY_MS));
+    }
+    return err;
+}
+
+/**
+ * @brief Let the next "bench" command run
+ */
+static void bench_release(void)
+{
+    portENTER_CRITICAL(&bench_lock);
+    bench_busy = false;
+    portEXIT_CRITICAL(&bench_lock);
+}
+
+/**
+ * @brief "bench" command: time the hot paths and publish the report
+ */
+static esp_err_t bench_command(const command_t *cmd, json_writer_t *result)
+{
+    static char report[BENCH_REPORT_SIZE];
+    uint32_t iterations = param_uint(cmd, "iterations", BENCH_ITERATIONS, 1, BENCH_MAX_ITERATIONS);
+    json_writer_t w;
+    size_t len;
+    bool busy;
+
+    // Test and set in one section so two callers cannot both start a run
+    portENTER_CRITICAL(&bench_lock);
+    busy = bench_busy;
+    bench_busy = true;
+    portEXIT_CRITICAL(&bench_lock);
+    if (busy) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    fill_samples();
+
+    json_writer_init(&w, report, sizeof(report));
+    json_writer_begin_object(&w, NULL);
+    json_writer_add_uint(&w, "iterations", iterations);
+    json_writer_add_string(&w, "encoding",
+                           telemetry_get_encoding() == TELEMETRY_ENCODING_CBOR ? "cbor" : "json");
+    json_writer_begin_object(&w, "cases");
+    for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+        bench_job = (bench_job_t){
+            .bench = &bench_cases[i],
+            .iterations = iterations,
+            .caller = xTaskGetCurrentTaskHandle(),
+        };
+        ulTaskNotifyTake(pdTRUE, 0);
+        if (xTaskCreatePinnedToCore(bench_task, "bench", BENCH_TASK_STACK_SIZE, &bench_job,
+                                    BENCH_TASK_PRIORITY, NULL, BENCH_TASK_CORE) != pdPASS) {
+            bench_release();
+            return ESP_ERR_NO_MEM;
+        }
+        if (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BENCH_CASE_TIMEOUT_MS)) == 0) {
+            ESP_LOGE(TAG, "Case %s did not finish, benchmarks disabled", bench_cases[i].name);
+            return ESP_ERR_TIMEOUT;
+        }
+        if (bench_job.err != ESP_OK) {
+            ESP_LOGE(TAG, "Case %s failed: %s", bench_cases[i].name, esp_err_to_name(bench_job.err));
+            bench_release();
+            return bench_job.err;
+        }
+
+        uint32_t cycles_avg = (uint32_t)(bench_job.cycles_total / iterations);
+        ESP_LOGI(TAG, "%s: %" PRIu32 " cycles min, %" PRIu32 " avg, %" PRIu32 " max, "
+                 "heap %" PRId32 ", stack %" PRIu32, bench_cases[i].name, bench_job.cycles_min,
+                 cycles_avg, bench_job.cycles_max, bench_job.heap_delta, bench_job.stack_used);
+
+        json_writer_begin_object(&w, bench_cases[i].name);
+        json_writer_add_uint(&w, "cycles_min", bench_job.cycles_min);
+        json_writer_add_uint(&w, "cycles_avg", cycles_avg);
+        json_writer_add_uint(&w, "cycles_max", bench_job.cycles_max);
+        json_writer_add_uint(&w, "us_avg", bench_job.elapsed_us / iterations);
+        json_writer_add_int(&w, "heap_delta", bench_job.heap_delta);
+        json_writer_add_uint(&w, "stack_used", bench_job.stack_used);
+        json_writer_end_object(&w);
+    }
+    json_writer_end_object(&w);
+    json_writer_end_object(&w);
+    bench_release();
+
+    esp_err_t err = json_writer_finish(&w, &len);
+    if (err == ESP_OK) {
+        uint32_t retries = command_time_remaining_ms(cmd) / SOAK_REPORT_RETRY_MS;
+        err = publish_report(bench_topic, report, len, retries);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    json_writer_add_uint(result, "cases", sizeof(bench_cases) / sizeof(bench_cases[0]));
+    json_writer_add_uint(result, "bytes", len);
+    return ESP_OK;
+}
+
+static void soak_publish_done(esp_err_t result, int msg_id, void *arg)
+{
+    uint32_t seq = (uint32_t)(uintptr_t)arg;
+    int64_t latency = esp_timer_get_time() - soak_sent_us[seq % SOAK_TRACK_SLOTS];
+
+    portENTER_CRITICAL(&soak_lock);
+    if (result == ESP_OK) {
+        soak_stats.acked++;
+        soak_stats.interval_acked++;
+        soak_stats.latency_total += latency;
+        if (soak_stats.latency_min == 0 || latency < soak_stats.latency_min) {
+            soak_stats.latency_min = latency;
+        }
+        if (latency > soak_stats.latency_max) {
+            soak_stats.latency_max = latency;
+        }
+    } else {
+        soak_stats.failed++;
+    }
+    portEXIT_CRITICAL(&soak_lock);
+}
+
+/**
+ * Queue one load message; returns true if it took the sequence number
+ */
+static bool soak_send(uint32_t seq, size_t len)
+{
+    char header[32];
+    int header_len = snprintf(header, sizeof(header), "{\"seq\":%010" PRIu32 ",\"pad\":\"", seq);
+    memcpy(soak_payload, header, header_len);
+
+    soak_sent_us[seq % SOAK_TRACK_SLOTS] = esp_timer_get_time();
+    const publish_message_t msg = {
+        .topic = soak_load_topic,
+        .data = soak_payload,
+        .len = len,
+        .qos = 1,
+        .content_type = "application/json",
+        .callback = soak_publish_done,
+        .arg = (void *)(uintptr_t)seq,
+    };
+    esp_err_t err = publish_manager_publish(&msg);
+
+    portENTER_CRITICAL(&soak_lock);
+    if (err == ESP_OK) {
+        soak_stats.sent++;
+    } else if (err == ESP_ERR_NO_MEM) {
+        soak_stats.window_full++;
+    } else {
+        soak_stats.failed++;
+    }
+    portEXIT_CRITICAL(&soak_lock);
+    return err == ESP_OK;
+}
+
+static void soak_report(const soak_params_t *p, int64_t elapsed_us, int64_t interval_us,
+                        size_t heap_start, bool done)
+{
+    static char report[SOAK_REPORT_SIZE];
+    soak_stats_t s;
+    json_writer_t w;
+    size_t len;
+
+    portENTER_CRITICAL(&soak_lock);
+    s = soak_stats;
+    soak_stats.interval_acked = 0;
+    soak_stats.latency_min = 0;
+    soak_stats.latency_max = 0;
+    soak_stats.latency_total = 0;
+    portEXIT_CRITICAL(&soak_lock);
+
+    size_t heap_free = heap_caps_get_free_size(CAPS_INTERNAL);
+    int64_t drift = (int64_t)heap_free - (int64_t)heap_start;
+    uint64_t acked_per_s = interval_us > 0 ? (uint64_t)s.interval_acked * 1000000 / interval_us : 0;
+    int64_t latency_avg = s.interval_acked > 0 ? s.latency_total / s.interval_acked : 0;
+
+    json_writer_init(&w, report, sizeof(report));
+    json_writer_begin_object(&w, NULL);
+    json_writer_add_int(&w, "elapsed_s", elapsed_us / 1000000);
+    json_writer_add_uint(&w, "rate_hz", p->rate_hz);
+    json_writer_add_uint(&w, "payload", p->payload);
+    json_writer_add_uint(&w, "sent", s.sent);
+    json_writer_add_uint(&w, "acked", s.acked);
+    json_writer_add_uint(&w, "failed", s.failed);
+    json_writer_add_uint(&w, "window_full", s.window_full);
+    json_writer_add_uint(&w, "acked_per_s", acked_per_s);
+    json_writer_add_uint(&w, "bytes_per_s", acked_per_s * p->payload);
+    json_writer_begin_object(&w, "puback_us");
+    json_writer_add_int(&w, "min", s.latency_min);
+    json_writer_add_int(&w, "avg", latency_avg);
+    json_writer_add_int(&w, "max", s.latency_max);
+    json_writer_end_object(&w);
+    json_writer_begin_object(&w, "heap");
+    json_writer_add_uint(&w, "free", heap_free);
+    json_writer_add_int(&w, "drift", drift);
+    json_writer_add_uint(&w, "min_free", heap_caps_get_minimum_free_size(CAPS_INTERNAL));
+    json_writer_end_object(&w);
+    json_writer_add_uint(&w, "stack_free", uxTaskGetStackHighWaterMark(NULL));
+    if (done) {
+        json_writer_add_bool(&w, "done", true);
+    }
+    json_writer_end_object(&w);
+
+    ESP_LOGI(TAG, "Soak %llds: %" PRIu32 " sent, %" PRIu32 " acked, %" PRIu32 " failed, "
+             "%llu/s, PUBACK avg %lld us, heap drift %lld",
+             (long long)(elapsed_us / 1000000), s.sent, s.acked, s.failed,
+             (unsigned long long)acked_per_s, (long long)latency_avg, (long long)drift);
+
+    if (json_writer_finish(&w, &len) != ESP_OK ||
+        publish_report(soak_report_topic, report, len, SOAK_REPORT_RETRIES) != ESP_OK) {
+        ESP_LOGW(TAG, "Soak report not published");
+    }
+}
+
+static void soak_task(void *arg)
+{
+    const soak_params_t p = soak_params;
+    // Sends are spread over ticks; rates above the tick rate send bursts
+    TickType_t period = p.rate_hz < configTICK_RATE_HZ ? configTICK_RATE_HZ / p.rate_hz : 1;
+    const int64_t report_interval_us = (int64_t)SOAK_REPORT_INTERVAL_S * 1000000;
+    uint32_t credit = 0;
+    uint32_t seq = 0;
+
+    memset(soak_payload, 'x', p.payload - 2);
+    memcpy(soak_payload + p.payload - 2, "\"}", 2);
+
+    portENTER_CRITICAL(&soak_lock);
+    memset(&soak_stats, 0, sizeof(soak_stats));
+    portEXIT_CRITICAL(&soak_lock);
+
+    size_t heap_start = heap_caps_get_free_size(CAPS_INTERNAL);
+    int64_t start_us = esp_timer_get_time();
+    int64_t end_us = p.duration_s > 0 ? start_us + (int64_t)p.duration_s * 1000000 : INT64_MAX;
+    int64_t last_report_us = start_us;
+    TickType_t wake = xTaskGetTickCount();
+
+    ESP_LOGI(TAG, "Soak started: %" PRIu32 " Hz, %" PRIu32 " bytes, %" PRIu32 " s",
+             p.rate_hz, p.payload, p.duration_s);
+
+    while (!soak_stop && esp_timer_get_time() < end_us) {
+        xTaskDelayUntil(&wake, period);
+        for (credit += p.rate_hz * period; credit >= configTICK_RATE_HZ; credit -= configTICK_RATE_HZ) {
+            if (soak_send(seq, p.payload)) {
+                seq++;
+            }
+        }
+
+        int64_t now = esp_timer_get_time();
+        if (now - last_report_us >= report_interval_us) {
+            soak_report(&p, now - start_us, now - last_report_us, heap_start, false);
+            last_report_us = now;
+        }
+    }
+
+    int64_t now = esp_timer_get_time();
+    soak_report(&p, now - start_us, now - last_report_us, heap_start, true);
+
+    portENTER_CRITICAL(&soak_lock);
+    soak_running = false;
+    portEXIT_CRITICAL(&soak_lock);
+    vTaskDelete(NULL);
+}
+
+static esp_err_t soak_start(const soak_params_t *p)
+{
+    bool running;
+
+    portENTER_CRITICAL(&soak_lock);
+    running = soak_running;
+    soak_running = true;
+    portEXIT_CRITICAL(&soak_lock);
+    if (running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    soak_params = *p;
+    soak_stop = false;
+    if (xTaskCreatePinnedToCore(soak_task, "soak", SOAK_TASK_STACK_SIZE, NULL,
+                                SOAK_TASK_PRIORITY, NULL, SOAK_TASK_CORE) != pdPASS) {
+        portENTER_CRITICAL(&soak_lock);
+        soak_running = false;
+        portEXIT_CRITICAL(&soak_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief "soak" command: start a soak run, or stop the running one
+ */
+static esp_err_t soak_command(const command_t *cmd, json_writer_t *result)
+{
+    json_token_t stop;
+
+    if (param_token(cmd, "stop", &stop) && stop.type == JSON_TOKEN_TRUE) {
+        json_writer_add_bool(result, "running", soak_running);
+        soak_stop = true;
+        return ESP_OK;
+    }
+
+    soak_params_t p = {
+        .rate_hz = param_uint(cmd, "rate_hz", SOAK_RATE_HZ, 1, SOAK_MAX_RATE_HZ),
+        .payload = param_uint(cmd, "payload", SOAK_PAYLOAD_SIZE, SOAK_MIN_PAYLOAD, SOAK_MAX_PAYLOAD),
+        .duration_s = param_uint(cmd, "duration_s", SOAK_DURATION_S, 0, UINT32_MAX),
+    };
+    esp_err_t err = soak_start(&p);
+    if (err != ESP_OK) {
+        return err;
+    }
+    json_writer_add_uint(result, "rate_hz", p.rate_hz);
+    json_writer_add_uint(result, "payload", p.payload);
+    json_writer_add_uint(result, "duration_s", p.duration_s);
+    return ESP_OK;
+}
+
+esp_err_t bench_init(const char *thing_name)
+{
+    snprintf(bench_topic, sizeof(bench_topic), BENCH_TOPIC_FMT, thing_name);
+    snprintf(soak_load_topic, sizeof(soak_load_topic), SOAK_LOAD_TOPIC_FMT, thing_name);
+    snprintf(soak_report_topic, sizeof(soak_report_topic), SOAK_REPORT_TOPIC_FMT, thing_name);
+    snprintf(shadow_delta_topic, sizeof(shadow_delta_topic), SHADOW_DELTA_TOPIC_FMT,
+             thing_name);
+
+    esp_err_t err = command_processor_register("bench", bench_command, BENCH_COMMAND_TIMEOUT_MS);
+    if (err == ESP_OK) {
+        err = command_processor_register("soak", soak_command, 0);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to register benchmark commands");
+        return err;
+    }
+
+#if CONFIG_AWS_IOT_SOAK_AUTOSTART
+    const soak_params_t p = {
+        .rate_hz = SOAK_RATE_HZ,
+        .payload = SOAK_PAYLOAD_SIZE,
+        .duration_s = SOAK_DURATION_S,
+    };
+    err = soak_start(&p);
+#endif
+    ESP_LOGW(TAG, "Benchmark build: \"bench\" and \"soak\" commands enabled");
+    return err;
+}
+
+#else
+
+esp_err_t bench_init(const char *thing_name)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif // CONFIG_AWS_IOT_BENCH_ENABLE
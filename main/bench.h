@@ -0,0 +1,54 @@
+/**
+ * @file bench.h
+ * @brief On-device benchmarks and soak test for the MQTT/shadow pipeline
+ *
+ * Built with CONFIG_AWS_IOT_BENCH_ENABLE, for test builds only. Registers
+ * two commands:
+ *
+ * "bench" times the hot paths: building the shadow state document,
+ * handling a shadow response and encoding a telemetry batch in the current
+ * encoding. Each case runs CONFIG_AWS_IOT_BENCH_ITERATIONS times (or
+ * params.iterations) in a task of its own, so the stack high-water mark is
+ * that case's alone. The report is published on device/<thing>/bench:
+ * {"iterations":n,"cases":{"<case>":{"cycles_min":n,"cycles_avg":n,
+ * "cycles_max":n,"us_avg":n,"heap_delta":n,"stack_used":n},...}}.
+ * cycles_min is the figure to gate on; the others include preemption.
+ * heap_delta is internal heap not given back over the run, so anything but
+ * 0 is a leak or concurrent activity.
+ *
+ * "soak" publishes QoS 1 messages on device/<thing>/bench/load through the
+ * bulk window, params {"rate_hz":n,"payload":n,"duration_s":n} defaulting
+ * to CONFIG_AWS_IOT_SOAK_*, or {"stop":true}. Every
+ * CONFIG_AWS_IOT_SOAK_REPORT_INTERVAL_S a report goes out on
+ * device/<thing>/bench/soak: {"elapsed_s":n,"rate_hz":n,"payload":n,
+ * "sent":n,"acked":n,"failed":n,"window_full":n,"acked_per_s":n,
+ * "bytes_per_s":n,"puback_us":{"min":n,"avg":n,"max":n},"heap":{"free":n,
+ * "drift":n,"min_free":n},"stack_free":n}. Counts are totals, rates and
+ * PUBACK latency cover the interval and drift is internal free heap now
+ * minus at the start. The last report has "done":true.
+ *
+ * The shadow case feeds a delta with no version, no client token and only
+ * unregistered keys on the /update/delta topic, so the whole document goes
+ * through the header scan and apply pass without changing cached state or
+ * writing NVS. Decoding into registered keys is covered by the unit tests
+ * in test/; these commands only time and load the pipeline.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "esp_err.h"
+
+/**
+ * @brief Register the benchmark commands
+ *
+ * Call after command_processor_init(). Starts a soak straight away with
+ * CONFIG_AWS_IOT_SOAK_AUTOSTART.
+ *
+ * @param thing_name Thing name for the report topics
+ * @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED without
+ *         CONFIG_AWS_IOT_BENCH_ENABLE
+ */
+esp_err_t bench_init(const char *thing_name);
+
+#endif // BENCH_H
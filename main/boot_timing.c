@@ -0,0 +1,68 @@
+/**
+ * @file boot_timing.c
+ * @brief Time from application start to the first acknowledged publish
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "boot_timing.h"
+
+static const char *TAG = "BOOT_TIMING";
+
+static const char *const phase_keys[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_CERTS_READY] = "certs_ms",
+    [BOOT_PHASE_LINK_UP] = "link_ms",
+    [BOOT_PHASE_MQTT_CONNECTED] = "mqtt_ms",
+    [BOOT_PHASE_FIRST_PUBLISH] = "publish_ms",
+};
+
+static uint32_t phase_ms[BOOT_PHASE_COUNT];
+static uint32_t marked;     // Bit per phase
+static portMUX_TYPE boot_lock = portMUX_INITIALIZER_UNLOCKED;
+
+bool boot_timing_mark(boot_phase_t phase)
+{
+    if (phase >= BOOT_PHASE_COUNT) {
+        return false;
+    }
+
+    // esp_timer starts with the application, so ROM and bootloader time is
+    // not included
+    uint32_t now_ms = (uint32_t)(esp_timer_get_time() / 1000);
+    bool first;
+
+    portENTER_CRITICAL(&boot_lock);
+    first = (marked & (1u << phase)) == 0;
+    if (first) {
+        marked |= 1u << phase;
+        phase_ms[phase] = now_ms;
+    }
+    portEXIT_CRITICAL(&boot_lock);
+
+    if (first && phase == BOOT_PHASE_FIRST_PUBLISH) {
+        ESP_LOGI(TAG, "First publish acknowledged %u ms after start (certs %u, link %u, mqtt %u)",
+                 (unsigned)phase_ms[BOOT_PHASE_FIRST_PUBLISH],
+                 (unsigned)phase_ms[BOOT_PHASE_CERTS_READY],
+                 (unsigned)phase_ms[BOOT_PHASE_LINK_UP],
+                 (unsigned)phase_ms[BOOT_PHASE_MQTT_CONNECTED]);
+    }
+    return first;
+}
+
+void boot_timing_write_json(json_writer_t *w, const char *key)
+{
+    uint32_t snapshot[BOOT_PHASE_COUNT];
+
+    portENTER_CRITICAL(&boot_lock);
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        snapshot[i] = phase_ms[i];
+    }
+    portEXIT_CRITICAL(&boot_lock);
+
+    json_writer_begin_object(w, key);
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        json_writer_add_uint(w, phase_keys[i], snapshot[i]);
+    }
+    json_writer_end_object(w);
+}
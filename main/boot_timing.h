@@ -0,0 +1,52 @@
+/**
+ * @file boot_timing.h
+ * @brief Time from application start to the first acknowledged publish
+ *
+ * Startup is event-driven: WiFi associates while credentials are loaded and
+ * the CA store is parsed, and the MQTT client is started from the first
+ * link-up event. Each milestone is recorded once per boot, in milliseconds
+ * since the application started, and the whole path is logged when the
+ * first PUBACK arrives. With duty cycling every upload wake is a boot, so
+ * this is also the per-wake radio cost.
+ */
+
+#ifndef BOOT_TIMING_H
+#define BOOT_TIMING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "json_writer.h"
+
+/**
+ * @brief Startup milestones, in the order they are normally reached
+ */
+typedef enum {
+    BOOT_PHASE_CERTS_READY,     ///< Credentials loaded and the CA store parsed
+    BOOT_PHASE_LINK_UP,         ///< Some link has an IP address
+    BOOT_PHASE_MQTT_CONNECTED,  ///< First CONNACK
+    BOOT_PHASE_FIRST_PUBLISH,   ///< First PUBACK
+    BOOT_PHASE_COUNT,
+} boot_phase_t;
+
+/**
+ * @brief Record a milestone; only the first call per phase counts
+ *
+ * Safe to call from any task, including event handlers.
+ *
+ * @param phase Milestone reached
+ * @return true if this call recorded it
+ */
+bool boot_timing_mark(boot_phase_t phase);
+
+/**
+ * @brief Write the milestones as a JSON object member
+ *
+ * Format: {"certs_ms":n,"link_ms":n,"mqtt_ms":n,"publish_ms":n}; phases not
+ * reached yet are 0.
+ *
+ * @param w Writer positioned inside an object
+ * @param key Member name
+ */
+void boot_timing_write_json(json_writer_t *w, const char *key);
+
+#endif // BOOT_TIMING_H
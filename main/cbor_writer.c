@@ -0,0 +1,162 @@
+/**
+ * @file cbor_writer.c
+ * @brief Zero-allocation streaming CBOR (RFC 8949) writer
+ */
+
+#include <string.h>
+#include "cbor_writer.h"
+
+// Major types, already shifted into the initial byte
+#define CBOR_MAJOR_UINT     0x00
+#define CBOR_MAJOR_NEGINT   0x20
+#define CBOR_MAJOR_TEXT     0x60
+#define CBOR_MAJOR_ARRAY    0x80
+#define CBOR_MAJOR_MAP      0xa0
+#define CBOR_MAJOR_TAG      0xc0
+
+#define CBOR_FALSE          0xf4
+#define CBOR_TRUE           0xf5
+#define CBOR_FLOAT32        0xfa
+#define CBOR_INDEFINITE     0x1f
+#define CBOR_BREAK          0xff
+
+static void put_bytes(cbor_writer_t *w, const void *data, size_t len)
+{
+    if (w->overflow) {
+        return;
+    }
+    if (len > w->size - w->len) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+/**
+ * Emit an initial byte with its argument in the shortest encoding.
+ */
+static void put_head(cbor_writer_t *w, uint8_t major, uint64_t value)
+{
+    uint8_t head[9];
+    size_t n;
+
+    if (value < 24) {
+        head[0] = major | (uint8_t)value;
+        n = 1;
+    } else if (value <= UINT8_MAX) {
+        head[0] = major | 24;
+        n = 2;
+    } else if (value <= UINT16_MAX) {
+        head[0] = major | 25;
+        n = 3;
+    } else if (value <= UINT32_MAX) {
+        head[0] = major | 26;
+        n = 5;
+    } else {
+        head[0] = major | 27;
+        n = 9;
+    }
+    // Big-endian argument
+    for (size_t i = n - 1; i > 0; i--) {
+        head[i] = (uint8_t)value;
+        value >>= 8;
+    }
+    put_bytes(w, head, n);
+}
+
+void cbor_writer_init(cbor_writer_t *w, void *buf, size_t size)
+{
+    w->buf = buf;
+    w->size = buf != NULL ? size : 0;
+    w->len = 0;
+    w->overflow = false;
+    w->open = 0;
+}
+
+void cbor_writer_add_uint(cbor_writer_t *w, uint64_t value)
+{
+    put_head(w, CBOR_MAJOR_UINT, value);
+}
+
+void cbor_writer_add_int(cbor_writer_t *w, int64_t value)
+{
+    if (value >= 0) {
+        put_head(w, CBOR_MAJOR_UINT, (uint64_t)value);
+    } else {
+        // -1 - n, computed without overflowing INT64_MIN
+        put_head(w, CBOR_MAJOR_NEGINT, ~(uint64_t)value);
+    }
+}
+
+void cbor_writer_add_float(cbor_writer_t *w, float value)
+{
+    uint32_t bits;
+    uint8_t item[5];
+
+    memcpy(&bits, &value, sizeof(bits));
+    item[0] = CBOR_FLOAT32;
+    item[1] = (uint8_t)(bits >> 24);
+    item[2] = (uint8_t)(bits >> 16);
+    item[3] = (uint8_t)(bits >> 8);
+    item[4] = (uint8_t)bits;
+    put_bytes(w, item, sizeof(item));
+}
+
+void cbor_writer_add_bool(cbor_writer_t *w, bool value)
+{
+    uint8_t item = value ? CBOR_TRUE : CBOR_FALSE;
+    put_bytes(w, &item, 1);
+}
+
+void cbor_writer_add_text(cbor_writer_t *w, const char *value)
+{
+    size_t len = strlen(value);
+    put_head(w, CBOR_MAJOR_TEXT, len);
+    put_bytes(w, value, len);
+}
+
+void cbor_writer_add_tag(cbor_writer_t *w, uint64_t tag)
+{
+    put_head(w, CBOR_MAJOR_TAG, tag);
+}
+
+void cbor_writer_begin_array(cbor_writer_t *w, size_t count)
+{
+    put_head(w, CBOR_MAJOR_ARRAY, count);
+}
+
+void cbor_writer_begin_indefinite_array(cbor_writer_t *w)
+{
+    uint8_t item = CBOR_MAJOR_ARRAY | CBOR_INDEFINITE;
+    put_bytes(w, &item, 1);
+    w->open++;
+}
+
+void cbor_writer_begin_map(cbor_writer_t *w, size_t count)
+{
+    put_head(w, CBOR_MAJOR_MAP, count);
+}
+
+void cbor_writer_end_indefinite(cbor_writer_t *w)
+{
+    uint8_t item = CBOR_BREAK;
+    put_bytes(w, &item, 1);
+    if (w->open > 0) {
+        w->open--;
+    }
+}
+
+esp_err_t cbor_writer_finish(cbor_writer_t *w, size_t *out_len)
+{
+    if (w->overflow) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (w->open != 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (out_len != NULL) {
+        *out_len = w->len;
+    }
+    return ESP_OK;
+}
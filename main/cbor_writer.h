@@ -0,0 +1,122 @@
+/**
+ * @file cbor_writer.h
+ * @brief Zero-allocation streaming CBOR (RFC 8949) writer
+ *
+ * Counterpart of json_writer for binary payloads. Items are encoded in their
+ * shortest form straight into a caller-supplied buffer; once the buffer is
+ * exhausted the writer latches an overflow flag and cbor_writer_finish()
+ * reports the failure. Like json_writer_t the state is a plain struct that
+ * can be snapshot by value to roll back a partially written item.
+ */
+
+#ifndef CBOR_WRITER_H
+#define CBOR_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/**
+ * @brief Self-described CBOR tag; as the first item it makes a payload
+ *        recognizable by its leading bytes d9 d9 f7
+ */
+#define CBOR_TAG_SELF_DESCRIBE 55799
+
+/**
+ * @brief CBOR writer state
+ */
+typedef struct {
+    uint8_t *buf;       ///< Output buffer
+    size_t size;        ///< Output buffer size
+    size_t len;         ///< Bytes written
+    bool overflow;      ///< Buffer exhausted
+    uint8_t open;       ///< Indefinite-length containers left open
+} cbor_writer_t;
+
+/**
+ * @brief Initialize a writer over a buffer
+ * @param w Writer
+ * @param buf Output buffer
+ * @param size Output buffer size
+ */
+void cbor_writer_init(cbor_writer_t *w, void *buf, size_t size);
+
+/**
+ * @brief Add an unsigned integer
+ * @param w Writer
+ * @param value Value
+ */
+void cbor_writer_add_uint(cbor_writer_t *w, uint64_t value);
+
+/**
+ * @brief Add a signed integer
+ * @param w Writer
+ * @param value Value
+ */
+void cbor_writer_add_int(cbor_writer_t *w, int64_t value);
+
+/**
+ * @brief Add a single-precision float
+ * @param w Writer
+ * @param value Value
+ */
+void cbor_writer_add_float(cbor_writer_t *w, float value);
+
+/**
+ * @brief Add a boolean
+ * @param w Writer
+ * @param value Value
+ */
+void cbor_writer_add_bool(cbor_writer_t *w, bool value);
+
+/**
+ * @brief Add a UTF-8 text string
+ * @param w Writer
+ * @param value NUL-terminated string
+ */
+void cbor_writer_add_text(cbor_writer_t *w, const char *value);
+
+/**
+ * @brief Add a tag; the next item is its content
+ * @param w Writer
+ * @param tag Tag number
+ */
+void cbor_writer_add_tag(cbor_writer_t *w, uint64_t tag);
+
+/**
+ * @brief Open an array of known length; the next count items are its elements
+ * @param w Writer
+ * @param count Number of elements
+ */
+void cbor_writer_begin_array(cbor_writer_t *w, size_t count);
+
+/**
+ * @brief Open an array whose length is not known up front
+ * @param w Writer
+ */
+void cbor_writer_begin_indefinite_array(cbor_writer_t *w);
+
+/**
+ * @brief Open a map of known size; the next 2 * count items are its keys and values
+ * @param w Writer
+ * @param count Number of key/value pairs
+ */
+void cbor_writer_begin_map(cbor_writer_t *w, size_t count);
+
+/**
+ * @brief Close the innermost indefinite-length container
+ * @param w Writer
+ */
+void cbor_writer_end_indefinite(cbor_writer_t *w);
+
+/**
+ * @brief Finish the document
+ * @param w Writer
+ * @param out_len Document length, may be NULL
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the buffer overflowed,
+ *         ESP_ERR_INVALID_STATE if indefinite-length containers are left open
+ */
+esp_err_t cbor_writer_finish(cbor_writer_t *w, size_t *out_len);
+
+#endif // CBOR_WRITER_H
@@ -0,0 +1,138 @@
+/**
+ * @file cellular_link.c
+ * @brief SIM7600 cellular uplink over PPP
+ */
+
+#include "aws_iot_config.h"
+#include "cellular_link.h"
+#include "sdkconfig.h"
+
+#if CONFIG_AWS_IOT_CELLULAR_ENABLE
+
+#ifndef CONFIG_LWIP_PPP_SUPPORT
+#error "CONFIG_AWS_IOT_CELLULAR_ENABLE needs CONFIG_LWIP_PPP_SUPPORT=y in sdkconfig (it also pulls in esp_modem)"
+#endif
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_modem_api.h"
+#include "esp_netif.h"
+
+static const char *TAG = "CELLULAR_LINK";
+
+#define CELLULAR_UP_BIT BIT0
+
+static esp_netif_t *ppp_netif = NULL;
+static esp_modem_dce_t *dce = NULL;
+static EventGroupHandle_t cellular_event_group;
+static bool data_mode = false;
+
+static void ip_event_handler(void *arg, esp_event_base_t event_base,
+                             int32_t event_id, void *event_data)
+{
+    if (event_id == IP_EVENT_PPP_GOT_IP) {
+        ip_event_got_ip_t *event = (ip_event_got_ip_t *)event_data;
+        ESP_LOGI(TAG, "PPP got ip:" IPSTR, IP2STR(&event->ip_info.ip));
+        xEventGroupSetBits(cellular_event_group, CELLULAR_UP_BIT);
+    } else if (event_id == IP_EVENT_PPP_LOST_IP) {
+        ESP_LOGW(TAG, "PPP lost ip");
+        xEventGroupClearBits(cellular_event_group, CELLULAR_UP_BIT);
+    }
+}
+
+esp_err_t cellular_link_init(void)
+{
+    cellular_event_group = xEventGroupCreate();
+    if (cellular_event_group == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_netif_config_t netif_config = ESP_NETIF_DEFAULT_PPP();
+    ppp_netif = esp_netif_new(&netif_config);
+    if (ppp_netif == NULL) {
+        ESP_LOGE(TAG, "Failed to create PPP interface");
+        return ESP_FAIL;
+    }
+
+    esp_modem_dte_config_t dte_config = ESP_MODEM_DTE_DEFAULT_CONFIG();
+    dte_config.uart_config.port_num = CONFIG_AWS_IOT_CELLULAR_UART_PORT;
+    dte_config.uart_config.tx_io_num = CONFIG_AWS_IOT_CELLULAR_UART_TX_PIN;
+    dte_config.uart_config.rx_io_num = CONFIG_AWS_IOT_CELLULAR_UART_RX_PIN;
+    dte_config.uart_config.baud_rate = CONFIG_AWS_IOT_CELLULAR_UART_BAUD;
+    dte_config.uart_config.flow_control = ESP_MODEM_FLOW_CONTROL_NONE;
+
+    esp_modem_dce_config_t dce_config = ESP_MODEM_DCE_DEFAULT_CONFIG(CONFIG_AWS_IOT_CELLULAR_APN);
+    dce = esp_modem_new_dev(ESP_MODEM_DCE_SIM7600, &dte_config, &dce_config, ppp_netif);
+    if (dce == NULL) {
+        ESP_LOGE(TAG, "Failed to create SIM7600 modem device");
+        esp_netif_destroy(ppp_netif);
+        ppp_netif = NULL;
+        return ESP_FAIL;
+    }
+
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_PPP_GOT_IP, &ip_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_PPP_LOST_IP, &ip_event_handler, NULL));
+
+    ESP_LOGI(TAG, "SIM7600 on UART%d, APN %s", CONFIG_AWS_IOT_CELLULAR_UART_PORT,
+             CONFIG_AWS_IOT_CELLULAR_APN);
+    return ESP_OK;
+}
+
+esp_err_t cellular_link_start(void)
+{
+    if (dce == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (data_mode) {
+        return ESP_OK;
+    }
+
+    esp_err_t err = esp_modem_sync(dce);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Modem not responding: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    int rssi = 0, ber = 0;
+    if (esp_modem_get_signal_quality(dce, &rssi, &ber) == ESP_OK) {
+        ESP_LOGI(TAG, "Signal quality: rssi=%d ber=%d", rssi, ber);
+    }
+
+    err = esp_modem_set_mode(dce, ESP_MODEM_MODE_DATA);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to enter data mode: %s", esp_err_to_name(err));
+        return err;
+    }
+    data_mode = true;
+    return ESP_OK;
+}
+
+esp_err_t cellular_link_stop(void)
+{
+    if (dce == NULL || !data_mode) {
+        return ESP_OK;
+    }
+
+    xEventGroupClearBits(cellular_event_group, CELLULAR_UP_BIT);
+    data_mode = false;
+    esp_err_t err = esp_modem_set_mode(dce, ESP_MODEM_MODE_COMMAND);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to leave data mode: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+bool cellular_link_is_up(void)
+{
+    return cellular_event_group != NULL &&
+           (xEventGroupGetBits(cellular_event_group) & CELLULAR_UP_BIT) != 0;
+}
+
+esp_netif_t *cellular_link_get_netif(void)
+{
+    return ppp_netif;
+}
+
+#endif // CONFIG_AWS_IOT_CELLULAR_ENABLE
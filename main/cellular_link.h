@@ -0,0 +1,51 @@
+/**
+ * @file cellular_link.h
+ * @brief SIM7600 cellular uplink over PPP
+ *
+ * The modem is driven through esp_modem: AT commands set up the PDP context
+ * and the UART is then switched to PPP, so the MQTT client's TLS socket runs
+ * over the modem exactly as it does over WiFi. Built only when
+ * CONFIG_AWS_IOT_CELLULAR_ENABLE is set.
+ */
+
+#ifndef CELLULAR_LINK_H
+#define CELLULAR_LINK_H
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_netif.h"
+
+/**
+ * @brief Create the PPP interface and the modem DTE/DCE
+ * @return ESP_OK on success
+ */
+esp_err_t cellular_link_init(void);
+
+/**
+ * @brief Dial: sync with the modem and enter PPP data mode
+ *
+ * Blocks for the AT exchange; the link is up once PPP has an address.
+ *
+ * @return ESP_OK if the modem entered data mode
+ */
+esp_err_t cellular_link_start(void);
+
+/**
+ * @brief Hang up and return the modem to command mode
+ * @return ESP_OK on success
+ */
+esp_err_t cellular_link_stop(void);
+
+/**
+ * @brief Check whether PPP has an IP address
+ * @return true if the link can carry traffic
+ */
+bool cellular_link_is_up(void);
+
+/**
+ * @brief Get the PPP network interface
+ * @return Interface handle, NULL before cellular_link_init()
+ */
+esp_netif_t *cellular_link_get_netif(void);
+
+#endif // CELLULAR_LINK_H
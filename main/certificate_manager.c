@@ -6,95 +6,678 @@
 #include <stdlib.h>
 #include <string.h>
 #include "esp_log.h"
+#include "esp_random.h"
+#include "esp_tls.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/platform_util.h"
+#include "mbedtls/x509_crt.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+#include "aws_iot_config.h"
 #include "certificate_manager.h"
+#include "json_reader.h"
+#include "mem_budget.h"
+
+#if CONFIG_AWS_IOT_CERT_USE_DS_PERIPHERAL
+#include "esp_ds.h"
+#include "nvs_flash.h"
+#include "rsa_sign_alt.h"
+#endif
 
 static const char *TAG = "CERT_MANAGER";
 
-// Certificate storage - these will be populated from files
-static char *root_ca_cert = NULL;
-static char *client_cert = NULL;
-static char *client_private_key = NULL;
+// Rotated credentials: slot 1 (A) and 2 (B); 0 means the embedded ones
+#define CERT_NVS_NAMESPACE "certs"
+#define CERT_SLOT_NONE 0
+#define CERT_TRIAL_MAX_ATTEMPTS CONFIG_AWS_IOT_CERT_TRIAL_MAX_ATTEMPTS
+
+static const char *const nvs_cert_keys[] = {NULL, "a.cert", "b.cert"};
+static const char *const nvs_key_keys[] = {NULL, "a.key", "b.key"};
 
 // AWS IoT Root CA certificate (Amazon Root CA 1)
 // This is the standard AWS IoT Root CA that doesn't change
-extern const uint8_t aws_root_ca_pem_start[] asm("_binary_aws_root_ca_pem_start");
-extern const uint8_t aws_root_ca_pem_end[] asm("_binary_aws_root_ca_pem_end");
+extern const char aws_root_ca_pem_start[] asm("_binary_aws_root_ca_pem_start");
+extern const char aws_root_ca_pem_end[] asm("_binary_aws_root_ca_pem_end");
 
 // Device certificate - will be embedded from certificates/device_cert.pem
-extern const uint8_t device_cert_pem_start[] asm("_binary_device_cert_pem_start");
-extern const uint8_t device_cert_pem_end[] asm("_binary_device_cert_pem_end");
+extern const char device_cert_pem_start[] asm("_binary_device_cert_pem_start");
+extern const char device_cert_pem_end[] asm("_binary_device_cert_pem_end");
 
+#if !CONFIG_AWS_IOT_CERT_USE_DS_PERIPHERAL
 // Device private key - will be embedded from certificates/device_private_key.pem
-extern const uint8_t device_private_key_pem_start[] asm("_binary_device_private_key_pem_start");
-extern const uint8_t device_private_key_pem_end[] asm("_binary_device_private_key_pem_end");
+// (left out of DS builds by main/CMakeLists.txt)
+extern const char device_private_key_pem_start[] asm("_binary_device_private_key_pem_start");
+extern const char device_private_key_pem_end[] asm("_binary_device_private_key_pem_end");
+#endif
+
+typedef struct {
+    const char *start;
+    const char *end;
+} embedded_pem_t;
+
+static const embedded_pem_t embedded[CERTIFICATE_COUNT] = {
+    [CERTIFICATE_ROOT_CA] = {aws_root_ca_pem_start, aws_root_ca_pem_end},
+    [CERTIFICATE_CLIENT_CERT] = {device_cert_pem_start, device_cert_pem_end},
+#if !CONFIG_AWS_IOT_CERT_USE_DS_PERIPHERAL
+    [CERTIFICATE_CLIENT_KEY] = {device_private_key_pem_start, device_private_key_pem_end},
+#endif
+};
+
+typedef struct {
+    const char *pem;    ///< Flash-mapped or heap, always NUL-terminated
+    bool owned;         ///< pem is a heap copy
+} certificate_slot_t;
+
+static certificate_slot_t slots[CERTIFICATE_COUNT];
+static bool global_ca_store = false;
+// Root CA provisioned since the global CA store was last built
+static bool ca_store_stale = false;
+static uint8_t active_slot = CERT_SLOT_NONE;
+static uint8_t staged_slot = CERT_SLOT_NONE;
+static bool trial = false;
+
+// Private key held by the Digital Signature peripheral (NULL when unused)
+static void *ds_data = NULL;
+
+static const char *const slot_names[CERTIFICATE_COUNT] = {
+    [CERTIFICATE_ROOT_CA] = "Root CA",
+    [CERTIFICATE_CLIENT_CERT] = "Client certificate",
+    [CERTIFICATE_CLIENT_KEY] = "Client private key",
+};
+
+static void load_embedded(certificate_type_t type)
+{
+    // Not embedded: the DS peripheral holds the client key
+    if (embedded[type].start == NULL) {
+        slots[type] = (certificate_slot_t) {0};
+        return;
+    }
+    // EMBED_TXTFILES appends a NUL, which end includes
+    slots[type] = (certificate_slot_t) {
+        .pem = embedded[type].start,
+        .owned = false,
+    };
+    ESP_LOGI(TAG, "%s mapped from flash, size: %u bytes", slot_names[type],
+             (unsigned)(embedded[type].end - embedded[type].start - 1));
+}
+
+// Key material is wiped before the buffer goes back to the heap
+static void free_pem(certificate_type_t type, const char *pem)
+{
+    if (pem == NULL) {
+        return;
+    }
+    if (type == CERTIFICATE_CLIENT_KEY) {
+        mbedtls_platform_zeroize((void *)pem, strlen(pem));
+    }
+    mem_budget_free(MEM_TAG_CERTS, (void *)pem);
+}
+
+// Takes ownership of pem
+static void set_owned(certificate_type_t type, char *pem)
+{
+    if (slots[type].owned) {
+        free_pem(type, slots[type].pem);
+    }
+    slots[type] = (certificate_slot_t) {
+        .pem = pem,
+        .owned = true,
+    };
+}
+
+#if CONFIG_AWS_IOT_CERT_USE_DS_PERIPHERAL
+/**
+ * Read the DS context provisioned into the pre_prov NVS partition (the
+ * layout written by ESP-IDF's configure_ds.py): the eFuse HMAC key block,
+ * the RSA key length and the encrypted private key parameters.
+ */
+static esp_err_t load_ds_context(void)
+{
+    static esp_ds_data_ctx_t ds_ctx;
+    static esp_ds_data_t ds_params;
+    nvs_handle_t h;
+    uint16_t rsa_length_bits = 0;
+    size_t len;
+
+    esp_err_t err = nvs_flash_init_partition(CONFIG_AWS_IOT_CERT_DS_PARTITION);
+    if (err == ESP_OK) {
+        err = nvs_open_from_partition(CONFIG_AWS_IOT_CERT_DS_PARTITION, "esp_ds_ns", NVS_READONLY, &h);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "DS parameters not provisioned: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    err = nvs_get_u8(h, "esp_ds_key_id", &ds_ctx.efuse_key_id);
+    if (err == ESP_OK) {
+        err = nvs_get_u16(h, "esp_ds_rsa_len", &rsa_length_bits);
+    }
+    if (err == ESP_OK) {
+        len = sizeof(ds_params.c);
+        err = nvs_get_blob(h, "esp_ds_c", ds_params.c, &len);
+    }
+    if (err == ESP_OK) {
+        len = sizeof(ds_params.iv);
+        err = nvs_get_blob(h, "esp_ds_iv", ds_params.iv, &len);
+    }
+    nvs_close(h);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read DS parameters: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ds_params.rsa_length = (rsa_length_bits / 32) - 1;
+    ds_ctx.esp_ds_data = &ds_params;
+    ds_ctx.rsa_length_bits = rsa_length_bits;
+    ds_data = &ds_ctx;
+    ESP_LOGI(TAG, "Client key held by DS peripheral (RSA-%u, eFuse key %u)",
+             rsa_length_bits, ds_ctx.efuse_key_id);
+    return ESP_OK;
+}
+#endif
+
+// mbedTLS wants PEM lengths to include the NUL
+static bool certificate_parses(const char *pem, size_t len)
+{
+    mbedtls_x509_crt crt;
+    mbedtls_x509_crt_init(&crt);
+    int ret = mbedtls_x509_crt_parse(&crt, (const unsigned char *)pem, len);
+    mbedtls_x509_crt_free(&crt);
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Certificate does not parse: -0x%04x", (unsigned)-ret);
+    }
+    return ret == 0;
+}
+
+/**
+ * (Re)build the global CA store from the root CA slot. Handshakes read the
+ * store without locking, so this only runs while the MQTT client is stopped.
+ * On failure the store is left empty and per-connection parsing is used.
+ */
+static esp_err_t load_global_ca_store(void)
+{
+#if CONFIG_AWS_IOT_CERT_GLOBAL_CA_STORE
+    const char *ca = slots[CERTIFICATE_ROOT_CA].pem;
+
+    ca_store_stale = false;
+    // Check the CA on a scratch chain first, so a bad one never costs the
+    // working store
+    if (!certificate_parses(ca, strlen(ca) + 1)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Parsing appends to the store, so start from an empty one
+    if (global_ca_store) {
+        esp_tls_free_global_ca_store();
+        global_ca_store = false;
+    }
+    esp_err_t err = esp_tls_init_global_ca_store();
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = esp_tls_set_global_ca_store((const unsigned char *)ca, strlen(ca) + 1);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to parse root CA into global CA store: %s", esp_err_to_name(err));
+        esp_tls_free_global_ca_store();
+        return err;
+    }
+    global_ca_store = true;
+    ESP_LOGI(TAG, "Root CA parsed into global CA store");
+#endif
+    return ESP_OK;
+}
 
 esp_err_t certificate_manager_init(void)
 {
     ESP_LOGI(TAG, "Initializing certificate manager");
-    
-    // Load AWS Root CA
-    size_t root_ca_len = aws_root_ca_pem_end - aws_root_ca_pem_start;
-    root_ca_cert = malloc(root_ca_len + 1);
-    if (root_ca_cert == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for root CA");
-        return ESP_ERR_NO_MEM;
+
+    for (int i = 0; i < CERTIFICATE_COUNT; i++) {
+        load_embedded(i);
+    }
+
+    if (load_global_ca_store() != ESP_OK) {
+        ESP_LOGW(TAG, "Falling back to per-connection root CA parsing");
     }
-    memcpy(root_ca_cert, aws_root_ca_pem_start, root_ca_len);
-    root_ca_cert[root_ca_len] = '\0';
-    ESP_LOGI(TAG, "Root CA loaded, size: %zu bytes", root_ca_len);
-    
-    // Load device certificate
-    size_t client_cert_len = device_cert_pem_end - device_cert_pem_start;
-    client_cert = malloc(client_cert_len + 1);
-    if (client_cert == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for client certificate");
+
+#if CONFIG_AWS_IOT_CERT_USE_DS_PERIPHERAL
+    // No software fallback: a DS build must not ship a usable plaintext key
+    esp_err_t err = load_ds_context();
+    if (err != ESP_OK) {
+        return err;
+    }
+#endif
+    return certificate_manager_load();
+}
+
+// Private keys stay in internal RAM; certificates are only read during a
+// handshake and can live in PSRAM
+static mem_placement_t placement_for(certificate_type_t type)
+{
+    return type == CERTIFICATE_CLIENT_KEY ? MEM_PLACE_INTERNAL : MEM_PLACE_SPIRAM;
+}
+
+static esp_err_t read_blob(nvs_handle_t h, const char *key, certificate_type_t type, char **out)
+{
+    size_t len = 0;
+    esp_err_t err = nvs_get_blob(h, key, NULL, &len);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    char *buf = mem_budget_alloc(MEM_TAG_CERTS, len + 1, placement_for(type));
+    if (buf == NULL) {
         return ESP_ERR_NO_MEM;
     }
-    memcpy(client_cert, device_cert_pem_start, client_cert_len);
-    client_cert[client_cert_len] = '\0';
-    ESP_LOGI(TAG, "Client certificate loaded, size: %zu bytes", client_cert_len);
-    
-    // Load device private key
-    size_t client_key_len = device_private_key_pem_end - device_private_key_pem_start;
-    client_private_key = malloc(client_key_len + 1);
-    if (client_private_key == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for client private key");
+    err = nvs_get_blob(h, key, buf, &len);
+    if (err != ESP_OK) {
+        mbedtls_platform_zeroize(buf, len + 1);
+        mem_budget_free(MEM_TAG_CERTS, buf);
+        return err;
+    }
+    buf[len] = '\0';
+    *out = buf;
+    return ESP_OK;
+}
+
+// Load both halves of a slot or neither
+static esp_err_t load_credential_slot(nvs_handle_t h, uint8_t slot)
+{
+    char *cert = NULL;
+    char *key = NULL;
+
+    esp_err_t err = read_blob(h, nvs_cert_keys[slot], CERTIFICATE_CLIENT_CERT, &cert);
+    if (err == ESP_OK && ds_data == NULL) {
+        err = read_blob(h, nvs_key_keys[slot], CERTIFICATE_CLIENT_KEY, &key);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read credential slot %c: %s", 'A' + slot - 1, esp_err_to_name(err));
+        mem_budget_free(MEM_TAG_CERTS, cert);
+        return err;
+    }
+
+    set_owned(CERTIFICATE_CLIENT_CERT, cert);
+    if (key != NULL) {
+        set_owned(CERTIFICATE_CLIENT_KEY, key);
+    }
+    ESP_LOGI(TAG, "Client credentials loaded from slot %c", 'A' + slot - 1);
+    return ESP_OK;
+}
+
+static void erase_credential_slot(nvs_handle_t h, uint8_t slot)
+{
+    if (slot != CERT_SLOT_NONE) {
+        nvs_erase_key(h, nvs_cert_keys[slot]);
+        nvs_erase_key(h, nvs_key_keys[slot]);
+    }
+}
+
+static void discard_staged(nvs_handle_t h)
+{
+    erase_credential_slot(h, staged_slot);
+    nvs_erase_key(h, "staged");
+    nvs_erase_key(h, "attempts");
+    staged_slot = CERT_SLOT_NONE;
+    trial = false;
+}
+
+static void load_embedded_client(void)
+{
+    for (int i = CERTIFICATE_CLIENT_CERT; i <= CERTIFICATE_CLIENT_KEY; i++) {
+        if (slots[i].owned) {
+            free_pem(i, slots[i].pem);
+        }
+        load_embedded(i);
+    }
+}
+
+esp_err_t certificate_manager_load(void)
+{
+    if (ca_store_stale && load_global_ca_store() != ESP_OK) {
+        ESP_LOGW(TAG, "Falling back to per-connection root CA parsing");
+    }
+
+    nvs_handle_t h;
+    esp_err_t err = nvs_open(CERT_NVS_NAMESPACE, NVS_READWRITE, &h);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Credential store unavailable (%s), using embedded credentials", esp_err_to_name(err));
+        load_embedded_client();
+        return ESP_OK;
+    }
+
+    active_slot = CERT_SLOT_NONE;
+    staged_slot = CERT_SLOT_NONE;
+    trial = false;
+    nvs_get_u8(h, "active", &active_slot);
+    nvs_get_u8(h, "staged", &staged_slot);
+
+    if (staged_slot != CERT_SLOT_NONE) {
+        // Persisted so a staged pair that crashes the device is dropped too
+        uint8_t attempts = 0;
+        nvs_get_u8(h, "attempts", &attempts);
+        if (++attempts > CERT_TRIAL_MAX_ATTEMPTS) {
+            ESP_LOGW(TAG, "Staged credentials failed %d times, discarding", CERT_TRIAL_MAX_ATTEMPTS);
+            discard_staged(h);
+        } else if (load_credential_slot(h, staged_slot) == ESP_OK) {
+            nvs_set_u8(h, "attempts", attempts);
+            trial = true;
+            ESP_LOGI(TAG, "Trying staged credentials (attempt %u/%d)", attempts, CERT_TRIAL_MAX_ATTEMPTS);
+        } else {
+            discard_staged(h);
+        }
+    }
+
+    if (!trial && (active_slot == CERT_SLOT_NONE || load_credential_slot(h, active_slot) != ESP_OK)) {
+        load_embedded_client();
+    }
+
+    nvs_commit(h);
+    nvs_close(h);
+    return ESP_OK;
+}
+
+static int fill_random(void *ctx, unsigned char *buf, size_t len)
+{
+    esp_fill_random(buf, len);
+    return 0;
+}
+
+// mbedTLS wants PEM NUL-terminated, with the NUL counted in the length
+static char *pem_copy(certificate_type_t type, const char *pem, size_t len)
+{
+    char *copy = mem_budget_alloc(MEM_TAG_CERTS, len + 1, placement_for(type));
+    if (copy != NULL) {
+        memcpy(copy, pem, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/**
+ * Parse the certificate and key and check that they are a pair, so a bad
+ * rotation message is rejected here instead of costing a trial reconnect.
+ * key is NULL when the DS peripheral holds the key.
+ */
+static esp_err_t check_credentials(const char *cert, size_t cert_len, const char *key, size_t key_len)
+{
+    mbedtls_x509_crt crt;
+    mbedtls_pk_context pk;
+    esp_err_t err = ESP_OK;
+    int ret = 0;
+
+    char *cert_pem = pem_copy(CERTIFICATE_CLIENT_CERT, cert, cert_len);
+    char *key_pem = key != NULL ? pem_copy(CERTIFICATE_CLIENT_KEY, key, key_len) : NULL;
+    if (cert_pem == NULL || (key != NULL && key_pem == NULL)) {
+        err = ESP_ERR_NO_MEM;
+    }
+
+    mbedtls_x509_crt_init(&crt);
+    mbedtls_pk_init(&pk);
+    if (err == ESP_OK &&
+        (ret = mbedtls_x509_crt_parse(&crt, (const unsigned char *)cert_pem, cert_len + 1)) != 0) {
+        ESP_LOGE(TAG, "Staged certificate does not parse: -0x%04x", (unsigned)-ret);
+        err = ESP_ERR_INVALID_ARG;
+    }
+    if (err == ESP_OK && key_pem != NULL &&
+        (ret = mbedtls_pk_parse_key(&pk, (const unsigned char *)key_pem, key_len + 1,
+                                    NULL, 0, fill_random, NULL)) != 0) {
+        ESP_LOGE(TAG, "Staged private key does not parse: -0x%04x", (unsigned)-ret);
+        err = ESP_ERR_INVALID_ARG;
+    }
+    if (err == ESP_OK && key_pem != NULL &&
+        (ret = mbedtls_pk_check_pair(&crt.pk, &pk, fill_random, NULL)) != 0) {
+        ESP_LOGE(TAG, "Rejecting staged credentials: key does not match certificate");
+        err = ESP_ERR_INVALID_ARG;
+    }
+
+    // pk_free zeroizes the parsed key
+    mbedtls_pk_free(&pk);
+    mbedtls_x509_crt_free(&crt);
+    free_pem(CERTIFICATE_CLIENT_CERT, cert_pem);
+    free_pem(CERTIFICATE_CLIENT_KEY, key_pem);
+    return err;
+}
+
+esp_err_t certificate_manager_stage(const char *cert, size_t cert_len, const char *key, size_t key_len)
+{
+    // With the DS peripheral only the certificate rotates
+    if (ds_data != NULL) {
+        key = NULL;
+    }
+    if (cert == NULL || cert_len == 0 || (ds_data == NULL && (key == NULL || key_len == 0))) {
+        ESP_LOGE(TAG, "Rejecting staged credentials: certificate or key missing");
+        return ESP_ERR_INVALID_ARG;
+    }
+#if !defined(CONFIG_NVS_ENCRYPTION) && !CONFIG_AWS_IOT_CERT_ALLOW_PLAINTEXT_KEY
+    // The key would sit in flash in the clear
+    if (key != NULL) {
+        ESP_LOGE(TAG, "Rejecting staged private key: NVS encryption is off");
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
+    esp_err_t err = check_credentials(cert, cert_len, key, key_len);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    nvs_handle_t h;
+    err = nvs_open(CERT_NVS_NAMESPACE, NVS_READWRITE, &h);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // Replaces any pair already on trial
+    uint8_t target = active_slot == 1 ? 2 : 1;
+    err = nvs_set_blob(h, nvs_cert_keys[target], cert, cert_len);
+    if (err == ESP_OK && key != NULL) {
+        err = nvs_set_blob(h, nvs_key_keys[target], key, key_len);
+    } else if (err == ESP_OK) {
+        nvs_erase_key(h, nvs_key_keys[target]);
+    }
+    if (err == ESP_OK) {
+        err = nvs_set_u8(h, "staged", target);
+    }
+    if (err == ESP_OK) {
+        nvs_erase_key(h, "attempts");
+        err = nvs_commit(h);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to stage credentials: %s", esp_err_to_name(err));
+        erase_credential_slot(h, target);
+        nvs_commit(h);
+    } else {
+        ESP_LOGI(TAG, "Credentials staged in slot %c", 'A' + target - 1);
+    }
+    nvs_close(h);
+    return err;
+}
+
+esp_err_t certificate_manager_handle_rotation(const char *data, size_t data_len)
+{
+    json_reader_t r;
+    json_token_t key, value;
+    char *cert = NULL;
+    char *private_key = NULL;
+    esp_err_t err;
+
+    json_reader_init(&r, data, data_len);
+    if (json_reader_next(&r, &key) != ESP_OK || key.type != JSON_TOKEN_OBJECT_BEGIN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while ((err = json_reader_next(&r, &key)) == ESP_OK && key.type != JSON_TOKEN_OBJECT_END) {
+        if (key.type != JSON_TOKEN_KEY || json_reader_next(&r, &value) != ESP_OK) {
+            err = ESP_ERR_INVALID_ARG;
+            break;
+        }
+
+        char **target = NULL;
+        certificate_type_t type = CERTIFICATE_CLIENT_CERT;
+        if (json_token_equals(&key, "certificate")) {
+            target = &cert;
+        } else if (json_token_equals(&key, "private_key")) {
+            target = &private_key;
+            type = CERTIFICATE_CLIENT_KEY;
+        }
+
+        if (target != NULL && value.type == JSON_TOKEN_STRING && *target == NULL) {
+            // Unescaping never makes a string longer
+            *target = mem_budget_alloc(MEM_TAG_CERTS, value.len + 1, placement_for(type));
+            if (*target == NULL) {
+                err = ESP_ERR_NO_MEM;
+                break;
+            }
+            json_token_get_string(&value, *target, value.len + 1);
+        } else if ((err = json_reader_skip(&r, &value)) != ESP_OK) {
+            break;
+        }
+    }
+
+    if (err == ESP_OK && (cert == NULL || (private_key == NULL && ds_data == NULL))) {
+        err = ESP_ERR_INVALID_ARG;
+    }
+    if (err == ESP_OK) {
+        err = certificate_manager_stage(cert, strlen(cert), private_key,
+                                        private_key != NULL ? strlen(private_key) : 0);
+    } else {
+        ESP_LOGE(TAG, "Malformed credential rotation message");
+    }
+
+    free_pem(CERTIFICATE_CLIENT_CERT, cert);
+    free_pem(CERTIFICATE_CLIENT_KEY, private_key);
+    return err;
+}
+
+bool certificate_manager_in_trial(void)
+{
+    return trial;
+}
+
+esp_err_t certificate_manager_confirm(void)
+{
+    if (!trial) {
+        return ESP_OK;
+    }
+
+    nvs_handle_t h;
+    esp_err_t err = nvs_open(CERT_NVS_NAMESPACE, NVS_READWRITE, &h);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    uint8_t previous = active_slot;
+    err = nvs_set_u8(h, "active", staged_slot);
+    if (err == ESP_OK) {
+        nvs_erase_key(h, "staged");
+        nvs_erase_key(h, "attempts");
+        err = nvs_commit(h);
+    }
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Credentials in slot %c confirmed", 'A' + staged_slot - 1);
+        active_slot = staged_slot;
+        staged_slot = CERT_SLOT_NONE;
+        trial = false;
+        if (previous != CERT_SLOT_NONE && previous != active_slot) {
+            erase_credential_slot(h, previous);
+            nvs_commit(h);
+        }
+    } else {
+        ESP_LOGE(TAG, "Failed to confirm credentials: %s", esp_err_to_name(err));
+    }
+    nvs_close(h);
+    return err;
+}
+
+esp_err_t certificate_manager_rollback(void)
+{
+    if (!trial) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    nvs_handle_t h;
+    esp_err_t err = nvs_open(CERT_NVS_NAMESPACE, NVS_READWRITE, &h);
+    if (err != ESP_OK) {
+        return err;
+    }
+    ESP_LOGW(TAG, "Rolling back staged credentials in slot %c", 'A' + staged_slot - 1);
+    discard_staged(h);
+    nvs_commit(h);
+    nvs_close(h);
+    return certificate_manager_load();
+}
+
+esp_err_t certificate_manager_provision(certificate_type_t type, const char *pem, size_t len)
+{
+    if (type >= CERTIFICATE_COUNT || pem == NULL || len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+#if CONFIG_AWS_IOT_CERT_USE_DS_PERIPHERAL
+    if (type == CERTIFICATE_CLIENT_KEY) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+#endif
+
+    char *copy = mem_budget_alloc(MEM_TAG_CERTS, len + 1, placement_for(type));
+    if (copy == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for %s", slot_names[type]);
         return ESP_ERR_NO_MEM;
     }
-    memcpy(client_private_key, device_private_key_pem_start, client_key_len);
-    client_private_key[client_key_len] = '\0';
-    ESP_LOGI(TAG, "Client private key loaded, size: %zu bytes", client_key_len);
-    
+    memcpy(copy, pem, len);
+    copy[len] = '\0';
+
+    // A root CA that doesn't parse would leave no CA store at all
+    if (type == CERTIFICATE_ROOT_CA && !certificate_parses(copy, len + 1)) {
+        mem_budget_free(MEM_TAG_CERTS, copy);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    set_owned(type, copy);
+    ESP_LOGI(TAG, "%s provisioned at runtime, size: %u bytes", slot_names[type], (unsigned)len);
+
+    // The store is swapped by the next certificate_manager_load(), which
+    // runs with the client stopped
+    if (type == CERTIFICATE_ROOT_CA && CONFIG_AWS_IOT_CERT_GLOBAL_CA_STORE) {
+        ca_store_stale = true;
+    }
     return ESP_OK;
 }
 
+bool certificate_manager_uses_global_ca_store(void)
+{
+    return global_ca_store;
+}
+
 const char* certificate_manager_get_root_ca(void)
 {
-    return root_ca_cert;
+    return slots[CERTIFICATE_ROOT_CA].pem;
 }
 
 const char* certificate_manager_get_client_cert(void)
 {
-    return client_cert;
+    return slots[CERTIFICATE_CLIENT_CERT].pem;
 }
 
 const char* certificate_manager_get_client_key(void)
 {
-    return client_private_key;
+    return ds_data != NULL ? NULL : slots[CERTIFICATE_CLIENT_KEY].pem;
+}
+
+void *certificate_manager_get_ds_data(void)
+{
+    return ds_data;
 }
 
 void certificate_manager_cleanup(void)
 {
-    if (root_ca_cert) {
-        free(root_ca_cert);
-        root_ca_cert = NULL;
-    }
-    if (client_cert) {
-        free(client_cert);
-        client_cert = NULL;
+    if (global_ca_store) {
+        esp_tls_free_global_ca_store();
+        global_ca_store = false;
     }
-    if (client_private_key) {
-        free(client_private_key);
-        client_private_key = NULL;
+
+    for (int i = 0; i < CERTIFICATE_COUNT; i++) {
+        if (slots[i].owned) {
+            free_pem(i, slots[i].pem);
+        }
+        load_embedded(i);
     }
-}
\ No newline at end of file
+    trial = false;
+}
@@ -0,0 +1,321 @@
+/**
+ * @file command_processor.c
+ * @brief Remote command processing off the MQTT task
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "aws_iot_config.h"
+
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_COMMAND
+#include "app_log.h"
+#include "command_processor.h"
+#include "json_reader.h"
+#include "metrics.h"
+#include "task_config.h"
+
+static const char *TAG = "COMMAND_PROCESSOR";
+
+#define COMMAND_QUEUE_LENGTH CONFIG_AWS_IOT_COMMAND_QUEUE_LENGTH
+#define COMMAND_WORKER_COUNT CONFIG_AWS_IOT_COMMAND_WORKER_COUNT
+#define COMMAND_DEFAULT_TIMEOUT_MS CONFIG_AWS_IOT_COMMAND_DEFAULT_TIMEOUT_MS
+#define COMMAND_MAX_HANDLERS 16
+#define COMMAND_RESPONSE_BUFFER_SIZE 512
+// Workers retry a response this often while every publish slot is taken
+#define COMMAND_RESPONSE_RETRY_MS 20
+#define COMMAND_RESPONSE_RETRIES 25
+
+typedef struct {
+    const char *name;
+    command_handler_t handler;
+    uint32_t timeout_ms;
+} command_entry_t;
+
+static command_entry_t handlers[COMMAND_MAX_HANDLERS];
+static size_t handler_count = 0;
+
+static char response_topic[PUBLISH_MAX_TOPIC_LEN];
+
+static QueueHandle_t command_queue = NULL;
+static StaticQueue_t command_queue_struct;
+static uint8_t command_queue_storage[COMMAND_QUEUE_LENGTH * sizeof(command_t)];
+
+static const command_entry_t *find_handler(const char *name)
+{
+    for (size_t i = 0; i < handler_count; i++) {
+        if (strcmp(handlers[i].name, name) == 0) {
+            return &handlers[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Publish a command response. The publisher task does the socket write; from
+ * the MQTT task (in_mqtt_task) a full window is not waited out.
+ */
+static void publish_response(const command_t *cmd, const char *status,
+                             const char *result, size_t result_len, bool in_mqtt_task)
+{
+    char buf[COMMAND_RESPONSE_BUFFER_SIZE];
+    size_t len = 0;
+    json_writer_t w;
+
+    json_writer_init(&w, buf, sizeof(buf));
+    json_writer_begin_object(&w, NULL);
+    json_writer_add_string(&w, "id", cmd->id);
+    json_writer_add_string(&w, "command", cmd->name);
+    json_writer_add_string(&w, "status", status);
+    json_writer_add_int(&w, "duration_ms", (esp_timer_get_time() - cmd->received_us) / 1000);
+    if (result_len > 0) {
+        json_writer_add_raw(&w, "result", result, result_len);
+    }
+    json_writer_end_object(&w);
+
+    if (json_writer_finish(&w, &len) != ESP_OK) {
+        ESP_LOGE(TAG, "Response for %s does not fit, sending status only", cmd->name);
+        json_writer_init(&w, buf, sizeof(buf));
+        json_writer_begin_object(&w, NULL);
+        json_writer_add_string(&w, "id", cmd->id);
+        json_writer_add_string(&w, "command", cmd->name);
+        json_writer_add_string(&w, "status", status);
+        json_writer_end_object(&w);
+        if (json_writer_finish(&w, &len) != ESP_OK) {
+            return;
+        }
+    }
+
+    const publish_message_t msg = {
+        .topic = cmd->reply_topic[0] != '\0' ? cmd->reply_topic : response_topic,
+        .data = buf,
+        .len = len,
+        .qos = 1,
+        .control = true,
+        .content_type = "application/json",
+        .correlation_data = cmd->correlation,
+        .correlation_len = cmd->correlation_len,
+    };
+    esp_err_t err = publish_manager_publish(&msg);
+    for (int i = 0; err == ESP_ERR_NO_MEM && !in_mqtt_task && i < COMMAND_RESPONSE_RETRIES; i++) {
+        vTaskDelay(pdMS_TO_TICKS(COMMAND_RESPONSE_RETRY_MS));
+        err = publish_manager_publish(&msg);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Response to %s (%s) not sent: %s", cmd->name, cmd->id, esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Command %s (%s): %s", cmd->name, cmd->id, status);
+}
+
+static void command_worker_task(void *pvParameters)
+{
+    command_t cmd;
+    char result[COMMAND_RESPONSE_BUFFER_SIZE / 2];
+
+    while (1) {
+        if (xQueueReceive(command_queue, &cmd, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+
+        metrics_record(METRICS_COMMAND_QUEUE, esp_timer_get_time() - cmd.received_us);
+        if (esp_timer_get_time() >= cmd.deadline_us) {
+            publish_response(&cmd, "expired", NULL, 0, false);
+            continue;
+        }
+
+        const command_entry_t *entry = find_handler(cmd.name);
+        if (entry == NULL) {
+            publish_response(&cmd, "unknown", NULL, 0, false);
+            continue;
+        }
+
+        json_writer_t w;
+        size_t result_len = 0;
+        json_writer_init(&w, result, sizeof(result));
+        json_writer_begin_object(&w, NULL);
+        esp_err_t err = entry->handler(&cmd, &w);
+        json_writer_end_object(&w);
+        if (json_writer_finish(&w, &result_len) != ESP_OK) {
+            ESP_LOGW(TAG, "Result of %s truncated", cmd.name);
+            result_len = 0;
+        }
+
+        if (esp_timer_get_time() > cmd.deadline_us) {
+            publish_response(&cmd, "timeout", NULL, 0, false);
+        } else if (err != ESP_OK) {
+            publish_response(&cmd, "error", result, result_len, false);
+        } else {
+            publish_response(&cmd, "ok", result, result_len, false);
+        }
+    }
+}
+
+esp_err_t command_processor_init(const char *topic)
+{
+    if (topic == NULL) {
+        ESP_LOGE(TAG, "Invalid parameters for command processor");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (command_queue != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    strncpy(response_topic, topic, sizeof(response_topic) - 1);
+    response_topic[sizeof(response_topic) - 1] = '\0';
+
+    command_queue = xQueueCreateStatic(COMMAND_QUEUE_LENGTH, sizeof(command_t),
+                                       command_queue_storage, &command_queue_struct);
+    if (command_queue == NULL) {
+        ESP_LOGE(TAG, "Failed to create command queue");
+        return ESP_FAIL;
+    }
+
+    for (int i = 0; i < COMMAND_WORKER_COUNT; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "cmd_worker_%d", i);
+        if (xTaskCreatePinnedToCore(command_worker_task, name, COMMAND_WORKER_STACK_SIZE,
+                                    NULL, COMMAND_WORKER_PRIORITY, NULL,
+                                    COMMAND_WORKER_CORE) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create command worker %d", i);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    ESP_LOGI(TAG, "Command processor started: %d workers, queue=%d",
+             COMMAND_WORKER_COUNT, COMMAND_QUEUE_LENGTH);
+    return ESP_OK;
+}
+
+esp_err_t command_processor_register(const char *name, command_handler_t handler, uint32_t timeout_ms)
+{
+    if (name == NULL || handler == NULL || strlen(name) >= COMMAND_NAME_MAX_LEN) {
+        ESP_LOGE(TAG, "Invalid parameters for command registration");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (handler_count >= COMMAND_MAX_HANDLERS) {
+        ESP_LOGE(TAG, "Command table full, cannot register %s", name);
+        return ESP_ERR_NO_MEM;
+    }
+
+    handlers[handler_count++] = (command_entry_t) {
+        .name = name,
+        .handler = handler,
+        .timeout_ms = timeout_ms > 0 ? timeout_ms : COMMAND_DEFAULT_TIMEOUT_MS,
+    };
+    return ESP_OK;
+}
+
+static esp_err_t parse_command(const char *data, size_t data_len, command_t *cmd, int64_t *timeout_ms)
+{
+    json_reader_t r;
+    json_token_t key, value;
+    esp_err_t err;
+
+    json_reader_init(&r, data, data_len);
+    if (json_reader_next(&r, &key) != ESP_OK || key.type != JSON_TOKEN_OBJECT_BEGIN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    while ((err = json_reader_next(&r, &key)) == ESP_OK && key.type != JSON_TOKEN_OBJECT_END) {
+        if (key.type != JSON_TOKEN_KEY || json_reader_next(&r, &value) != ESP_OK) {
+            return ESP_ERR_INVALID_ARG;
+        }
+
+        if (json_token_equals(&key, "command") && value.type == JSON_TOKEN_STRING) {
+            json_token_get_string(&value, cmd->name, sizeof(cmd->name));
+        } else if (json_token_equals(&key, "id") && value.type == JSON_TOKEN_STRING) {
+            json_token_get_string(&value, cmd->id, sizeof(cmd->id));
+        } else if (json_token_equals(&key, "timeout_ms") && value.type == JSON_TOKEN_NUMBER) {
+            json_token_get_int(&value, timeout_ms);
+        } else if (json_token_equals(&key, "params")) {
+            // Keep the raw JSON of the params value for the handler
+            const char *start = value.start;
+            const char *end = value.start + value.len;
+            if (value.type == JSON_TOKEN_STRING) {
+                // Include the quotes
+                start--;
+                end++;
+            }
+            if (json_reader_skip(&r, &value) != ESP_OK) {
+                return ESP_ERR_INVALID_ARG;
+            }
+            if (value.type == JSON_TOKEN_OBJECT_BEGIN || value.type == JSON_TOKEN_ARRAY_BEGIN) {
+                end = r.data + r.pos;
+            }
+            cmd->params_len = end - start;
+            if (cmd->params_len >= sizeof(cmd->params)) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            memcpy(cmd->params, start, cmd->params_len);
+            cmd->params[cmd->params_len] = '\0';
+        } else if (json_reader_skip(&r, &value) != ESP_OK) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    if (err != ESP_OK || cmd->name[0] == '\0') {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+esp_err_t command_processor_submit(const char *data, size_t data_len, const command_reply_t *reply)
+{
+    if (command_queue == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    command_t cmd = {0};
+    int64_t timeout_ms = 0;
+    cmd.received_us = esp_timer_get_time();
+
+    if (reply != NULL) {
+        if (reply->topic != NULL && reply->topic_len > 0) {
+            if (reply->topic_len < sizeof(cmd.reply_topic)) {
+                memcpy(cmd.reply_topic, reply->topic, reply->topic_len);
+            } else {
+                ESP_LOGW(TAG, "Response topic of %u bytes ignored", (unsigned)reply->topic_len);
+            }
+        }
+        if (reply->correlation_data != NULL && reply->correlation_len <= sizeof(cmd.correlation)) {
+            memcpy(cmd.correlation, reply->correlation_data, reply->correlation_len);
+            cmd.correlation_len = reply->correlation_len;
+        } else if (reply->correlation_data != NULL) {
+            ESP_LOGW(TAG, "Correlation data of %u bytes ignored", (unsigned)reply->correlation_len);
+        }
+    }
+
+    esp_err_t err = parse_command(data, data_len, &cmd, &timeout_ms);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Malformed command: %.*s", (int)data_len, data);
+        publish_response(&cmd, err == ESP_ERR_INVALID_SIZE ? "too_large" : "malformed", NULL, 0, true);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    const command_entry_t *entry = find_handler(cmd.name);
+    if (entry == NULL) {
+        publish_response(&cmd, "unknown", NULL, 0, true);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (timeout_ms <= 0) {
+        timeout_ms = entry->timeout_ms;
+    }
+    cmd.deadline_us = cmd.received_us + timeout_ms * 1000;
+
+    if (xQueueSend(command_queue, &cmd, 0) != pdTRUE) {
+        publish_response(&cmd, "busy", NULL, 0, true);
+        return ESP_ERR_TIMEOUT;
+    }
+    return ESP_OK;
+}
+
+uint32_t command_time_remaining_ms(const command_t *cmd)
+{
+    int64_t remaining = cmd->deadline_us - esp_timer_get_time();
+    return remaining > 0 ? (uint32_t)(remaining / 1000) : 0;
+}
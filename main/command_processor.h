@@ -0,0 +1,116 @@
+/**
+ * @file command_processor.h
+ * @brief Remote command processing off the MQTT task
+ *
+ * Inbound command messages are parsed into fixed-size descriptors in the MQTT
+ * task and pushed onto a FreeRTOS queue. A pool of worker tasks pinned to the
+ * APP core runs the registered handlers and publishes a response, so a slow
+ * handler never delays keepalives or PUBACK processing.
+ *
+ * Command format:
+ * {"command": "<name>", "id": "<request id>", "timeout_ms": 5000, "params": {...}}
+ *
+ * Response format (published on the response topic):
+ * {"id": "...", "command": "...", "status": "ok", "duration_ms": 12, "result": {...}}
+ *
+ * Over MQTT 5 a command may carry a response topic and correlation data; the
+ * response then goes to that topic and echoes the correlation data, so a
+ * caller can match it without parsing the payload.
+ */
+
+#ifndef COMMAND_PROCESSOR_H
+#define COMMAND_PROCESSOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "json_writer.h"
+#include "publish_manager.h"
+
+#define COMMAND_NAME_MAX_LEN 32
+#define COMMAND_ID_MAX_LEN 40
+#define COMMAND_PARAMS_MAX_LEN 256
+
+/**
+ * @brief Parsed command descriptor
+ */
+typedef struct {
+    char name[COMMAND_NAME_MAX_LEN];
+    char id[COMMAND_ID_MAX_LEN];
+    char params[COMMAND_PARAMS_MAX_LEN];    ///< Raw JSON of "params", empty if absent
+    size_t params_len;
+    int64_t received_us;                    ///< esp_timer time the command arrived
+    int64_t deadline_us;                    ///< Result is discarded after this time
+    char reply_topic[PUBLISH_MAX_TOPIC_LEN];    ///< Empty for the default response topic
+    uint8_t correlation[PUBLISH_MAX_CORRELATION_LEN];
+    size_t correlation_len;
+} command_t;
+
+/**
+ * @brief Where to answer a command (MQTT 5 request/response)
+ *
+ * Neither string is NUL-terminated; both are copied.
+ */
+typedef struct {
+    const char *topic;                      ///< Response topic, NULL for the default
+    size_t topic_len;
+    const void *correlation_data;           ///< May be NULL
+    size_t correlation_len;
+} command_reply_t;
+
+/**
+ * @brief Command handler
+ *
+ * Runs in a worker task. Long-running handlers should check
+ * command_time_remaining_ms() and give up once it reaches zero; a result
+ * produced after the deadline is reported as "timeout".
+ *
+ * @param cmd Command descriptor
+ * @param result Writer positioned inside the response "result" object
+ * @return ESP_OK on success, any other value is reported as "error"
+ */
+typedef esp_err_t (*command_handler_t)(const command_t *cmd, json_writer_t *result);
+
+/**
+ * @brief Start the command queue and worker pool
+ *
+ * Responses are published through the publish manager.
+ *
+ * @param response_topic Default topic for command responses (copied)
+ * @return ESP_OK on success
+ */
+esp_err_t command_processor_init(const char *response_topic);
+
+/**
+ * @brief Register a command handler
+ * @param name Command name (must remain valid for the lifetime of the program)
+ * @param handler Handler function
+ * @param timeout_ms Default timeout, used when the command has no "timeout_ms"
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the handler table is full
+ */
+esp_err_t command_processor_register(const char *name, command_handler_t handler, uint32_t timeout_ms);
+
+/**
+ * @brief Parse a command message and queue it for a worker
+ *
+ * Safe to call from the MQTT event handler; never blocks. Malformed, unknown
+ * or rejected commands are answered immediately.
+ *
+ * @param data Message payload (not NUL-terminated)
+ * @param data_len Payload length
+ * @param reply Response topic and correlation data from the message, NULL
+ *              to answer on the default topic. A response topic or
+ *              correlation data too long to store is ignored
+ * @return ESP_OK if queued, ESP_ERR_INVALID_ARG for malformed commands,
+ *         ESP_ERR_NOT_FOUND for unknown commands, ESP_ERR_TIMEOUT if the queue is full
+ */
+esp_err_t command_processor_submit(const char *data, size_t data_len, const command_reply_t *reply);
+
+/**
+ * @brief Time left before a command's deadline
+ * @param cmd Command descriptor
+ * @return Remaining time in milliseconds, 0 once the deadline has passed
+ */
+uint32_t command_time_remaining_ms(const command_t *cmd);
+
+#endif // COMMAND_PROCESSOR_H
@@ -3,17 +3,833 @@
  * @brief AWS IoT Device Shadow management for ESP32-S3
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
-#include "cJSON.h"
-#include "esp_log.h"
+#include "esp_system.h"
 #include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_random.h"
+#include "nvs.h"
 #include "device_shadow.h"
+#include "json_reader.h"
+#include "json_writer.h"
+#include "aws_iot_config.h"
+
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_SHADOW
+#include "app_log.h"
+#include "mem_budget.h"
+#include "metrics.h"
+#include "publish_manager.h"
 
 static const char *TAG = "DEVICE_SHADOW";
+
+// Get and sync request documents are built on the caller's stack
+#define SHADOW_UPDATE_BUFFER_SIZE 256
+
+// Desired values are cached in NVS under "d.<fnv1a(key)>", the shadow
+// version under "version" and a hash of the registered keys it covers under
+// "keyset"
+#define SHADOW_NVS_NAMESPACE "shadow"
+#define SHADOW_NVS_VERSION_KEY "version"
+#define SHADOW_NVS_KEYSET_KEY "keyset"
+// Stored type of a key the last full document did not have
+#define PERSISTED_ABSENT 0xff
+
+// Reported documents are built in a static buffer sized for every key
+// holding a maximum-length string
+#define SHADOW_REPORT_DEBOUNCE_MS CONFIG_AWS_IOT_SHADOW_REPORT_DEBOUNCE_MS
+#define SHADOW_REPORT_BUFFER_SIZE                                            \
+    (64 + DEVICE_SHADOW_MAX_REPORTED_KEYS *                                   \
+              (DEVICE_SHADOW_MAX_KEY_LEN + DEVICE_SHADOW_MAX_STRING_LEN + 8))
+_Static_assert(SHADOW_REPORT_BUFFER_SIZE <= CONFIG_AWS_IOT_PUBLISH_MAX_PAYLOAD,
+               "Reported documents must fit a publish slot");
+
+// Requests awaiting /accepted or /rejected, matched by clientToken. Throttled
+// (429), conflicting (409) and server-failed (5xx) requests and timeouts are
+// retried with jittered exponential backoff
+#define SHADOW_MAX_PENDING CONFIG_AWS_IOT_SHADOW_MAX_PENDING
+#define SHADOW_REQUEST_TIMEOUT_MS CONFIG_AWS_IOT_SHADOW_REQUEST_TIMEOUT_MS
+#define SHADOW_MAX_RETRIES CONFIG_AWS_IOT_SHADOW_MAX_RETRIES
+#define SHADOW_RETRY_BASE_MS CONFIG_AWS_IOT_SHADOW_RETRY_BASE_MS
+#define SHADOW_REQUEST_POLL_MS 250
+// Slots reported documents leave free, so a get and a sync always fit
+#define SHADOW_MAX_PENDING_REPORTS (SHADOW_MAX_PENDING - 2)
+
+typedef union {
+    bool boolean;
+    double number;
+    char string[DEVICE_SHADOW_MAX_STRING_LEN];
+} shadow_storage_t;
+
+typedef struct {
+    const char *key;
+    device_shadow_value_type_t type;
+    device_shadow_desired_cb_t callback;
+    void *arg;
+    bool valid;                 ///< Value received from the cloud or restored from NVS
+    bool dirty;                 ///< Changed since last persisted
+    int64_t version;            ///< Shadow version that last changed the value
+    shadow_storage_t value;
+} desired_entry_t;
+
+/**
+ * A reported key is sent when its value differs from the last one AWS
+ * acknowledged. Several reported documents can be in flight, but a key is in
+ * at most one of them; changes made meanwhile wait for its response.
+ */
+typedef struct {
+    const char *key;
+    device_shadow_value_type_t type;
+    bool acked_valid;           ///< acked holds a value AWS accepted
+    bool held;                  ///< Last document failed; not resent until the value changes
+    int8_t request;             ///< Slot of the document carrying the key, -1 if none
+    shadow_storage_t value;     ///< Latest local value
+    shadow_storage_t sent;      ///< Value in the outstanding document
+    shadow_storage_t acked;
+} reported_entry_t;
+
+typedef enum {
+    SHADOW_REQUEST_FREE,
+    SHADOW_REQUEST_GET,
+    SHADOW_REQUEST_SYNC,
+    SHADOW_REQUEST_REPORT,
+} shadow_request_kind_t;
+
+typedef struct {
+    shadow_request_kind_t kind;
+    uint32_t token;             ///< clientToken is "d<token>"
+    uint8_t attempts;           ///< Sends so far
+    bool retry_pending;         ///< Waiting for deadline_us to resend
+    int64_t deadline_us;        ///< Response timeout, or resend time if retry_pending
+    int64_t sent_us;            ///< Last send, 0 before the first
+    device_shadow_done_cb_t callback;
+    void *arg;
+} shadow_request_t;
+
+// As stored in NVS
+typedef struct {
+    int64_t version;
+    uint8_t type;
+    shadow_storage_t value;
+} persisted_entry_t;
+
+static desired_entry_t desired_entries[DEVICE_SHADOW_MAX_DESIRED_KEYS];
+static size_t desired_entry_count = 0;
+static int64_t shadow_version = -1;     // Last version applied, -1 if unknown
+static int64_t persisted_version = -1;  // Version NVS holds
+static uint32_t persisted_keyset = 0;   // Key set hash stored with the version
+static bool cache_incomplete = false;   // A registered key had no NVS record
 static char device_thing_name[64] = {0};
+static esp_mqtt_client_handle_t shadow_client = NULL;
+static portMUX_TYPE shadow_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static reported_entry_t reported_entries[DEVICE_SHADOW_MAX_REPORTED_KEYS];
+static size_t reported_entry_count = 0;
+static esp_timer_handle_t report_timer = NULL;
+static SemaphoreHandle_t report_mutex = NULL;   // Guards report_document
+static char *report_document = NULL;                // SHADOW_REPORT_BUFFER_SIZE bytes, in PSRAM
+
+static shadow_request_t requests[SHADOW_MAX_PENDING];
+static uint32_t request_seq = 0;
+static esp_timer_handle_t request_timer = NULL;
+
+static const char *const request_names[] = {
+    [SHADOW_REQUEST_FREE] = "free",
+    [SHADOW_REQUEST_GET] = "get",
+    [SHADOW_REQUEST_SYNC] = "sync",
+    [SHADOW_REQUEST_REPORT] = "report",
+};
+
+static uint32_t key_hash(const char *key)
+{
+    uint32_t hash = 2166136261u;
+    for (const char *c = key; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return hash;
+}
+
+static void nvs_entry_key(const char *key, char *out, size_t out_len)
+{
+    snprintf(out, out_len, "d.%08" PRIx32, key_hash(key));
+}
+
+// Registered desired keys and their types, independent of registration order
+static uint32_t keyset_hash(void)
+{
+    uint32_t hash = 0;
+    for (size_t i = 0; i < desired_entry_count; i++) {
+        hash += (key_hash(desired_entries[i].key) ^ desired_entries[i].type) * 16777619u;
+    }
+    return hash;
+}
+
+static void load_version(void)
+{
+    nvs_handle_t h;
+    if (nvs_open(SHADOW_NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_i64(h, SHADOW_NVS_VERSION_KEY, &shadow_version) != ESP_OK) {
+        shadow_version = -1;
+    }
+    persisted_version = shadow_version;
+    if (nvs_get_u32(h, SHADOW_NVS_KEYSET_KEY, &persisted_keyset) != ESP_OK) {
+        persisted_keyset = 0;
+    }
+    nvs_close(h);
+}
+
+static esp_err_t restore_entry(desired_entry_t *entry)
+{
+    nvs_handle_t h;
+    persisted_entry_t stored;
+    size_t len = sizeof(stored);
+    char nvs_key[NVS_KEY_NAME_MAX_SIZE];
+
+    esp_err_t err = nvs_open(SHADOW_NVS_NAMESPACE, NVS_READONLY, &h);
+    if (err != ESP_OK) {
+        return err;
+    }
+    nvs_entry_key(entry->key, nvs_key, sizeof(nvs_key));
+    err = nvs_get_blob(h, nvs_key, &stored, &len);
+    nvs_close(h);
+
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (len == sizeof(stored) && stored.type == PERSISTED_ABSENT) {
+        // Known, but not in the shadow when it was last fetched
+        return ESP_OK;
+    }
+    if (len != sizeof(stored) || stored.type != entry->type) {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    entry->value = stored.value;
+    entry->version = stored.version;
+    entry->valid = true;
+    return ESP_OK;
+}
+
+/**
+ * Write changed entries and the document version. Runs on the MQTT task
+ * after a response has been applied; shadow updates are rare enough that
+ * every change is written through. After a full document, keys it did not
+ * have are recorded as absent and the key set is stored with the version,
+ * so the version vouches for every registered key.
+ */
+static void persist_changes(bool full_document)
+{
+    nvs_handle_t h;
+    char nvs_key[NVS_KEY_NAME_MAX_SIZE];
+
+    // A redelivered or unchanged response leaves nothing to write
+    bool pending = full_document || shadow_version != persisted_version;
+    for (size_t i = 0; i < desired_entry_count && !pending; i++) {
+        pending = desired_entries[i].dirty;
+    }
+    if (!pending) {
+        return;
+    }
+    if (nvs_open(SHADOW_NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        ESP_LOGW(TAG, "Cannot open NVS, shadow cache not persisted");
+        return;
+    }
+    bool complete = true;
+    for (size_t i = 0; i < desired_entry_count; i++) {
+        desired_entry_t *entry = &desired_entries[i];
+        persisted_entry_t stored = {
+            .version = entry->version,
+            .type = entry->type,
+            .value = entry->value,
+        };
+        if (!entry->dirty && (entry->valid || !full_document)) {
+            continue;
+        }
+        if (!entry->valid) {
+            stored = (persisted_entry_t) {.version = shadow_version, .type = PERSISTED_ABSENT};
+        }
+        nvs_entry_key(entry->key, nvs_key, sizeof(nvs_key));
+        if (nvs_set_blob(h, nvs_key, &stored, sizeof(stored)) == ESP_OK) {
+            entry->dirty = false;
+        } else {
+            complete = false;
+        }
+    }
+    bool version_set = nvs_set_i64(h, SHADOW_NVS_VERSION_KEY, shadow_version) == ESP_OK;
+    uint32_t keyset = keyset_hash();
+    if (full_document && complete && nvs_set_u32(h, SHADOW_NVS_KEYSET_KEY, keyset) == ESP_OK &&
+        nvs_commit(h) == ESP_OK) {
+        persisted_keyset = keyset;
+        cache_incomplete = false;
+    } else if (nvs_commit(h) != ESP_OK) {
+        version_set = false;
+    }
+    if (version_set) {
+        persisted_version = shadow_version;
+    }
+    nvs_close(h);
+}
+
+/**
+ * The cached version only covers the keys that were registered when it was
+ * stored. A key with no record, or a changed key set, may have a desired
+ * value set before this firmware that no delta will repeat.
+ */
+static bool cached_version_usable(void)
+{
+    return shadow_version >= 0 && !cache_incomplete && persisted_keyset == keyset_hash();
+}
+
+static void to_value(const desired_entry_t *entry, device_shadow_value_t *out)
+{
+    out->type = entry->type;
+    switch (entry->type) {
+    case DEVICE_SHADOW_VALUE_BOOL:
+        out->boolean = entry->value.boolean;
+        break;
+    case DEVICE_SHADOW_VALUE_NUMBER:
+        out->number = entry->value.number;
+        break;
+    case DEVICE_SHADOW_VALUE_STRING:
+        out->string = entry->value.string;
+        break;
+    }
+}
+
+static bool storage_equal(device_shadow_value_type_t type, const shadow_storage_t *a,
+                          const shadow_storage_t *b)
+{
+    switch (type) {
+    case DEVICE_SHADOW_VALUE_BOOL:
+        return a->boolean == b->boolean;
+    case DEVICE_SHADOW_VALUE_NUMBER:
+        return a->number == b->number;
+    case DEVICE_SHADOW_VALUE_STRING:
+        return strcmp(a->string, b->string) == 0;
+    }
+    return false;
+}
+
+static bool reported_dirty(const reported_entry_t *entry)
+{
+    return !entry->acked_valid || !storage_equal(entry->type, &entry->value, &entry->acked);
+}
+
+// Dirty and free to go into a new document
+static bool reported_flushable(const reported_entry_t *entry)
+{
+    return entry->request < 0 && !entry->held && reported_dirty(entry);
+}
+
+static void schedule_report(uint32_t delay_ms)
+{
+    if (report_timer == NULL) {
+        return;
+    }
+    if (delay_ms == 0) {
+        esp_timer_stop(report_timer);
+        esp_timer_start_once(report_timer, 0);
+    } else if (!esp_timer_is_active(report_timer)) {
+        // Window opens with the first change, so a stream of changes is
+        // still reported every SHADOW_REPORT_DEBOUNCE_MS
+        esp_timer_start_once(report_timer, (uint64_t)delay_ms * 1000);
+    }
+}
+
+static void write_storage(json_writer_t *w, const char *key, device_shadow_value_type_t type,
+                          const shadow_storage_t *value)
+{
+    switch (type) {
+    case DEVICE_SHADOW_VALUE_BOOL:
+        json_writer_add_bool(w, key, value->boolean);
+        break;
+    case DEVICE_SHADOW_VALUE_NUMBER:
+        json_writer_add_double(w, key, value->number);
+        break;
+    case DEVICE_SHADOW_VALUE_STRING:
+        json_writer_add_string(w, key, value->string);
+        break;
+    }
+}
+
+/**
+ * Take a free request slot. Caller holds shadow_lock.
+ * @return Slot index, -1 if the table (or the reported share of it) is full
+ */
+static int request_alloc(shadow_request_kind_t kind, device_shadow_done_cb_t callback, void *arg)
+{
+    int slot = -1;
+    size_t reports = 0;
+
+    for (int i = 0; i < SHADOW_MAX_PENDING; i++) {
+        if (requests[i].kind == SHADOW_REQUEST_FREE) {
+            if (slot < 0) {
+                slot = i;
+            }
+        } else if (requests[i].kind == SHADOW_REQUEST_REPORT) {
+            reports++;
+        }
+    }
+    if (slot < 0 || (kind == SHADOW_REQUEST_REPORT && reports >= SHADOW_MAX_PENDING_REPORTS)) {
+        return -1;
+    }
+
+    if (++request_seq == 0) {
+        request_seq = 1;
+    }
+    requests[slot] = (shadow_request_t) {
+        .kind = kind,
+        .token = request_seq,
+        .deadline_us = esp_timer_get_time() + (int64_t)SHADOW_REQUEST_TIMEOUT_MS * 1000,
+        .callback = callback,
+        .arg = arg,
+    };
+    return slot;
+}
+
+// Caller holds shadow_lock
+static int request_find_kind(shadow_request_kind_t kind)
+{
+    for (int i = 0; i < SHADOW_MAX_PENDING; i++) {
+        if (requests[i].kind == kind) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Caller holds shadow_lock
+static bool request_current(int slot, uint32_t token)
+{
+    return requests[slot].kind != SHADOW_REQUEST_FREE && requests[slot].token == token;
+}
+
+/**
+ * Look up the request a response answers. The kind and token are read
+ * under the lock with the slot, as the slot may be reused right after.
+ * @return Slot index, -1 if the token is not one of ours or not pending
+ */
+static int request_find_token(const char *client_token, shadow_request_kind_t *kind, uint32_t *token)
+{
+    uint32_t seq = 0;
+    char tail;
+    int slot = -1;
+
+    if (sscanf(client_token, "d%" SCNu32 "%c", &seq, &tail) != 1) {
+        return -1;
+    }
+    portENTER_CRITICAL(&shadow_lock);
+    for (int i = 0; i < SHADOW_MAX_PENDING; i++) {
+        if (request_current(i, seq)) {
+            slot = i;
+            *kind = requests[i].kind;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&shadow_lock);
+    *token = seq;
+    return slot;
+}
+
+/**
+ * Free a slot. Reported keys it carried take the sent value as acknowledged
+ * on success and are held back on failure. Caller holds shadow_lock.
+ * @return true if reported keys are left to flush
+ */
+static bool request_release(int slot, esp_err_t result)
+{
+    bool dirty = false;
+
+    requests[slot].kind = SHADOW_REQUEST_FREE;
+    for (size_t i = 0; i < reported_entry_count; i++) {
+        reported_entry_t *entry = &reported_entries[i];
+        if (entry->request == slot) {
+            if (result == ESP_OK) {
+                entry->acked = entry->sent;
+                entry->acked_valid = true;
+            } else {
+                entry->held = storage_equal(entry->type, &entry->value, &entry->sent);
+            }
+            entry->request = -1;
+        }
+        dirty |= reported_flushable(entry);
+    }
+    return dirty;
+}
+
+// An answer from AWS, accepted or with a rejection code, ends a round trip
+static void record_round_trip(const shadow_request_t *request, esp_err_t result, int code)
+{
+    if ((result == ESP_OK || code != 0) && request->sent_us != 0) {
+        metrics_record(METRICS_SHADOW_ROUND_TRIP, esp_timer_get_time() - request->sent_us);
+    }
+}
+
+// Report the outcome of a request released with request_release()
+static void request_complete(const shadow_request_t *request, esp_err_t result, int code, bool dirty)
+{
+    record_round_trip(request, result, code);
+    if (result != ESP_OK) {
+        ESP_LOGW(TAG, "Shadow %s d%" PRIu32 " failed after %u attempts: %s (code %d)",
+                 request_names[request->kind], request->token, (unsigned)request->attempts,
+                 esp_err_to_name(result), code);
+    }
+    if (request->callback != NULL) {
+        request->callback(result, code, request->arg);
+    }
+    if (dirty) {
+        schedule_report(SHADOW_REPORT_DEBOUNCE_MS);
+    }
+}
+
+/**
+ * Release a slot and report the outcome. Does nothing if the request is no
+ * longer in the slot, so each request completes exactly once.
+ */
+static void request_finish(int slot, uint32_t token, esp_err_t result, int code)
+{
+    portENTER_CRITICAL(&shadow_lock);
+    if (!request_current(slot, token)) {
+        portEXIT_CRITICAL(&shadow_lock);
+        return;
+    }
+    shadow_request_t request = requests[slot];
+    bool dirty = request_release(slot, result);
+    portEXIT_CRITICAL(&shadow_lock);
+
+    request_complete(&request, result, code, dirty);
+}
+
+/**
+ * Schedule a resend with backoff, or give up after SHADOW_MAX_RETRIES.
+ * Like request_finish(), ignores a slot that no longer holds the request.
+ */
+static void request_failed(int slot, uint32_t token, esp_err_t result, int code, bool retryable)
+{
+    portENTER_CRITICAL(&shadow_lock);
+    if (!request_current(slot, token)) {
+        portEXIT_CRITICAL(&shadow_lock);
+        return;
+    }
+    shadow_request_t request = requests[slot];
+    if (retryable && request.attempts <= SHADOW_MAX_RETRIES) {
+        uint32_t delay_ms = SHADOW_RETRY_BASE_MS << (request.attempts > 0 ? request.attempts - 1 : 0);
+        delay_ms = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+        requests[slot].retry_pending = true;
+        requests[slot].deadline_us = esp_timer_get_time() + (int64_t)delay_ms * 1000;
+        portEXIT_CRITICAL(&shadow_lock);
+        record_round_trip(&request, result, code);
+        ESP_LOGW(TAG, "Shadow %s d%" PRIu32 " %s (code %d), retrying in %u ms",
+                 request_names[request.kind], request.token, esp_err_to_name(result), code,
+                 (unsigned)delay_ms);
+        esp_timer_start_once(request_timer, (uint64_t)SHADOW_REQUEST_POLL_MS * 1000);
+        return;
+    }
+    bool dirty = request_release(slot, result);
+    portEXIT_CRITICAL(&shadow_lock);
+
+    request_complete(&request, result, code, dirty);
+}
+
+static esp_err_t build_request(int slot, shadow_request_kind_t kind, const char *token,
+                               char *buf, size_t size, size_t *len)
+{
+    json_writer_t w;
+
+    json_writer_init(&w, buf, size);
+    json_writer_begin_object(&w, NULL);
+    if (kind != SHADOW_REQUEST_GET) {
+        json_writer_begin_object(&w, "state");
+        json_writer_begin_object(&w, "reported");
+        if (kind == SHADOW_REQUEST_SYNC) {
+            json_writer_add_bool(&w, "connected", true);
+        } else {
+            for (size_t i = 0; i < reported_entry_count; i++) {
+                const reported_entry_t *entry = &reported_entries[i];
+                if (entry->request == slot) {
+                    write_storage(&w, entry->key, entry->type, &entry->sent);
+                }
+            }
+        }
+        json_writer_end_object(&w);
+        json_writer_end_object(&w);
+        if (kind == SHADOW_REQUEST_SYNC) {
+            // Optimistic locking: rejected with 409 unless still current
+            json_writer_add_int(&w, "version", shadow_version);
+        }
+    }
+    json_writer_add_string(&w, "clientToken", token);
+    json_writer_end_object(&w);
+    return json_writer_finish(&w, len);
+}
+
+/**
+ * (Re)send the request in a slot. Reported documents are rebuilt from the
+ * latest values of their keys, so a retry also carries changes made since.
+ * Only queues the document for the publisher task, so it is safe from the
+ * MQTT event handler. Fails with ESP_ERR_INVALID_STATE if the request with
+ * this sequence number has left the slot.
+ */
+static esp_err_t request_send(int slot, uint32_t seq)
+{
+    char topic[256];
+    char token[16];
+    char small_document[SHADOW_UPDATE_BUFFER_SIZE];
+
+    portENTER_CRITICAL(&shadow_lock);
+    if (!request_current(slot, seq)) {
+        portEXIT_CRITICAL(&shadow_lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    shadow_request_t *request = &requests[slot];
+    shadow_request_kind_t kind = request->kind;
+    request->attempts++;
+    request->retry_pending = false;
+    request->sent_us = esp_timer_get_time();
+    request->deadline_us = request->sent_us + (int64_t)SHADOW_REQUEST_TIMEOUT_MS * 1000;
+    for (size_t i = 0; i < reported_entry_count; i++) {
+        if (reported_entries[i].request == slot) {
+            reported_entries[i].sent = reported_entries[i].value;
+        }
+    }
+    portEXIT_CRITICAL(&shadow_lock);
+
+    snprintf(topic, sizeof(topic), "$aws/things/%s/shadow/%s", device_thing_name,
+             kind == SHADOW_REQUEST_GET ? "get" : "update");
+    snprintf(token, sizeof(token), "d%" PRIu32, seq);
+
+    bool report = kind == SHADOW_REQUEST_REPORT;
+    char *document = report ? report_document : small_document;
+    size_t document_size = report ? SHADOW_REPORT_BUFFER_SIZE : sizeof(small_document);
+    size_t document_len = 0;
+    esp_err_t publish_err = ESP_ERR_INVALID_STATE;
+
+    if (report) {
+        xSemaphoreTake(report_mutex, portMAX_DELAY);
+    }
+    esp_err_t err = build_request(slot, kind, token, document, document_size, &document_len);
+    if (err == ESP_OK && shadow_client != NULL) {
+        const publish_message_t msg = {
+            .topic = topic,
+            .data = document,
+            .len = document_len,
+            .qos = 1,
+            .control = true,
+            .content_type = "application/json",
+        };
+        publish_err = publish_manager_publish(&msg);
+    }
+    if (report) {
+        xSemaphoreGive(report_mutex);
+    }
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Shadow %s does not fit in %u bytes", request_names[kind], (unsigned)document_size);
+        request_finish(slot, seq, ESP_ERR_INVALID_SIZE, 0);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (publish_err != ESP_OK) {
+        // Includes a full publish window; retried like a failed publish
+        request_failed(slot, seq, ESP_FAIL, 0, true);
+        return ESP_FAIL;
+    }
+
+    esp_timer_start_once(request_timer, (uint64_t)SHADOW_REQUEST_POLL_MS * 1000);
+    ESP_LOGI(TAG, "Queued shadow %s %s", request_names[kind], token);
+    return ESP_OK;
+}
+
+/**
+ * Resend requests whose backoff expired and time out unanswered ones. A
+ * one-shot timer, re-armed while requests are pending; request_send() arms
+ * it as well, so a request added while this runs is never missed.
+ */
+static void request_timer_cb(void *arg)
+{
+    bool pending = false;
+    int64_t now_us = esp_timer_get_time();
+
+    for (int i = 0; i < SHADOW_MAX_PENDING; i++) {
+        portENTER_CRITICAL(&shadow_lock);
+        shadow_request_t request = requests[i];
+        portEXIT_CRITICAL(&shadow_lock);
+
+        if (request.kind == SHADOW_REQUEST_FREE) {
+            continue;
+        }
+        pending = true;
+        if (now_us < request.deadline_us) {
+            continue;
+        }
+        // Both recheck the token under the lock, so a request answered, or
+        // replaced by a new one in the same slot, since the copy is left alone
+        if (request.retry_pending) {
+            request_send(i, request.token);
+        } else {
+            request_failed(i, request.token, ESP_ERR_TIMEOUT, 0, true);
+        }
+    }
+
+    if (pending) {
+        esp_timer_start_once(request_timer, (uint64_t)SHADOW_REQUEST_POLL_MS * 1000);
+    }
+}
+
+/**
+ * Put every flushable reported key into one new document and send it
+ */
+static esp_err_t flush_reported(device_shadow_done_cb_t callback, void *arg)
+{
+    if (shadow_client == NULL) {
+        // Not connected yet; device_shadow_sync() flushes
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t count = 0;
+    portENTER_CRITICAL(&shadow_lock);
+    for (size_t i = 0; i < reported_entry_count; i++) {
+        count += reported_flushable(&reported_entries[i]);
+    }
+    int slot = count > 0 ? request_alloc(SHADOW_REQUEST_REPORT, callback, arg) : -1;
+    uint32_t token = slot >= 0 ? requests[slot].token : 0;
+    if (slot >= 0) {
+        for (size_t i = 0; i < reported_entry_count; i++) {
+            if (reported_flushable(&reported_entries[i])) {
+                reported_entries[i].request = slot;
+            }
+        }
+    }
+    portEXIT_CRITICAL(&shadow_lock);
+
+    if (count == 0) {
+        if (callback != NULL) {
+            callback(ESP_OK, 0, arg);
+        }
+        return ESP_OK;
+    }
+    if (slot < 0) {
+        // Retried when one of the outstanding documents completes
+        ESP_LOGD(TAG, "Too many shadow requests in flight, deferring %u reported keys", (unsigned)count);
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGD(TAG, "Reporting %u keys", (unsigned)count);
+    return request_send(slot, token);
+}
+
+static void report_timer_cb(void *arg)
+{
+    flush_reported(NULL, NULL);
+}
+
+esp_err_t device_shadow_report(const char *key, const device_shadow_value_t *value)
+{
+    if (key == NULL || value == NULL || strlen(key) > DEVICE_SHADOW_MAX_KEY_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    shadow_storage_t stored;
+    switch (value->type) {
+    case DEVICE_SHADOW_VALUE_BOOL:
+        stored.boolean = value->boolean;
+        break;
+    case DEVICE_SHADOW_VALUE_NUMBER:
+        stored.number = value->number;
+        break;
+    case DEVICE_SHADOW_VALUE_STRING:
+        if (value->string == NULL || strlen(value->string) >= sizeof(stored.string)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        strcpy(stored.string, value->string);
+        break;
+    default:
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_OK;
+    bool dirty = false;
+    portENTER_CRITICAL(&shadow_lock);
+    reported_entry_t *entry = NULL;
+    for (size_t i = 0; i < reported_entry_count; i++) {
+        if (strcmp(reported_entries[i].key, key) == 0) {
+            entry = &reported_entries[i];
+            break;
+        }
+    }
+    if (entry == NULL && reported_entry_count < DEVICE_SHADOW_MAX_REPORTED_KEYS) {
+        entry = &reported_entries[reported_entry_count++];
+        *entry = (reported_entry_t) {
+            .key = key,
+            .request = -1,
+        };
+    }
+    if (entry == NULL) {
+        err = ESP_ERR_NO_MEM;
+    } else {
+        if (entry->type != value->type) {
+            entry->type = value->type;
+            entry->acked_valid = false;
+            entry->held = false;
+        } else if (!storage_equal(entry->type, &entry->value, &stored)) {
+            entry->held = false;
+        }
+        entry->value = stored;
+        dirty = reported_flushable(entry);
+    }
+    portEXIT_CRITICAL(&shadow_lock);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Reported key table full, cannot report %s", key);
+        return err;
+    }
+    if (dirty) {
+        schedule_report(SHADOW_REPORT_DEBOUNCE_MS);
+    }
+    return ESP_OK;
+}
+
+esp_err_t device_shadow_report_bool(const char *key, bool value)
+{
+    device_shadow_value_t v = {
+        .type = DEVICE_SHADOW_VALUE_BOOL,
+        .boolean = value,
+    };
+    return device_shadow_report(key, &v);
+}
+
+esp_err_t device_shadow_report_number(const char *key, double value)
+{
+    device_shadow_value_t v = {
+        .type = DEVICE_SHADOW_VALUE_NUMBER,
+        .number = value,
+    };
+    return device_shadow_report(key, &v);
+}
+
+esp_err_t device_shadow_report_string(const char *key, const char *value)
+{
+    device_shadow_value_t v = {
+        .type = DEVICE_SHADOW_VALUE_STRING,
+        .string = value,
+    };
+    return device_shadow_report(key, &v);
+}
+
+esp_err_t device_shadow_commit_reported(device_shadow_done_cb_t callback, void *arg)
+{
+    if (report_timer != NULL) {
+        esp_timer_stop(report_timer);
+    }
+    portENTER_CRITICAL(&shadow_lock);
+    for (size_t i = 0; i < reported_entry_count; i++) {
+        reported_entries[i].held = false;
+    }
+    portEXIT_CRITICAL(&shadow_lock);
+    return flush_reported(callback, arg);
+}
 
 esp_err_t device_shadow_init(const char *thing_name)
 {
@@ -24,53 +840,357 @@ esp_err_t device_shadow_init(const char *thing_name)
     
     strncpy(device_thing_name, thing_name, sizeof(device_thing_name) - 1);
     device_thing_name[sizeof(device_thing_name) - 1] = '\0';
-    
-    ESP_LOGI(TAG, "Device shadow initialized for thing: %s", device_thing_name);
+
+    load_version();
+
+    // Only touched once per debounce interval, so PSRAM latency is no concern
+    if (report_document == NULL) {
+        report_document = mem_budget_alloc(MEM_TAG_SHADOW, SHADOW_REPORT_BUFFER_SIZE, MEM_PLACE_SPIRAM);
+    }
+    report_mutex = xSemaphoreCreateMutex();
+    if (report_document == NULL || report_mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    const esp_timer_create_args_t report_timer_args = {
+        .callback = report_timer_cb,
+        .name = "shadow_report",
+    };
+    const esp_timer_create_args_t request_timer_args = {
+        .callback = request_timer_cb,
+        .name = "shadow_request",
+    };
+    esp_err_t err = esp_timer_create(&report_timer_args, &report_timer);
+    if (err == ESP_OK) {
+        err = esp_timer_create(&request_timer_args, &request_timer);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create shadow timers: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Device shadow initialized for thing: %s, cached version %lld",
+             device_thing_name, (long long)shadow_version);
     return ESP_OK;
 }
 
-char* device_shadow_create_state_document(void)
+esp_err_t device_shadow_create_state_document(char *buf, size_t buf_len, size_t *out_len)
 {
-    cJSON *shadow = cJSON_CreateObject();
-    cJSON *state = cJSON_CreateObject();
-    cJSON *reported = cJSON_CreateObject();
-    
-    if (shadow == NULL || state == NULL || reported == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON objects");
-        goto error;
+    if (buf == NULL) {
+        ESP_LOGE(TAG, "Output buffer cannot be NULL");
+        return ESP_ERR_INVALID_ARG;
     }
-    
-    // Add device state information
-    cJSON *connected = cJSON_CreateBool(true);
-    cJSON *timestamp = cJSON_CreateNumber(esp_timer_get_time() / 1000);
-    cJSON *free_heap = cJSON_CreateNumber(esp_get_free_heap_size());
-    cJSON *uptime = cJSON_CreateNumber(esp_timer_get_time() / 1000);
-    
-    if (connected == NULL || timestamp == NULL || free_heap == NULL || uptime == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON values");
-        goto error;
+
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    json_writer_t w;
+
+    json_writer_init(&w, buf, buf_len);
+    json_writer_begin_object(&w, NULL);
+    json_writer_begin_object(&w, "state");
+    json_writer_begin_object(&w, "reported");
+    json_writer_add_bool(&w, "connected", true);
+    json_writer_add_int(&w, "timestamp", now_ms);
+    json_writer_add_uint(&w, "free_heap", esp_get_free_heap_size());
+    json_writer_add_uint(&w, "largest_free_block", mem_budget_largest_free_internal());
+    json_writer_add_uint(&w, "heap_fragmentation", mem_budget_fragmentation_internal());
+    json_writer_add_int(&w, "uptime_ms", now_ms);
+    json_writer_end_object(&w);
+    json_writer_end_object(&w);
+    json_writer_end_object(&w);
+
+    esp_err_t err = json_writer_finish(&w, out_len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "State document does not fit in %u bytes", (unsigned)buf_len);
+    }
+    return err;
+}
+
+esp_err_t device_shadow_register_desired(const char *key, device_shadow_value_type_t type,
+                                         device_shadow_desired_cb_t callback, void *arg)
+{
+    if (key == NULL || callback == NULL) {
+        ESP_LOGE(TAG, "Invalid parameters for desired key registration");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (desired_entry_count >= DEVICE_SHADOW_MAX_DESIRED_KEYS) {
+        ESP_LOGE(TAG, "Desired key table full, cannot register %s", key);
+        return ESP_ERR_NO_MEM;
     }
-    
-    cJSON_AddItemToObject(reported, "connected", connected);
-    cJSON_AddItemToObject(reported, "timestamp", timestamp);
-    cJSON_AddItemToObject(reported, "free_heap", free_heap);
-    cJSON_AddItemToObject(reported, "uptime_ms", uptime);
-    
-    cJSON_AddItemToObject(state, "reported", reported);
-    cJSON_AddItemToObject(shadow, "state", state);
-    
-    char *json_string = cJSON_Print(shadow);
-    cJSON_Delete(shadow);
-    
-    return json_string;
 
-error:
-    if (shadow) cJSON_Delete(shadow);
-    if (state) cJSON_Delete(state);
-    if (reported) cJSON_Delete(reported);
+    desired_entry_t *entry = &desired_entries[desired_entry_count];
+    *entry = (desired_entry_t) {
+        .key = key,
+        .type = type,
+        .callback = callback,
+        .arg = arg,
+    };
+
+    // Hand the last known value over straight away, before any network
+    esp_err_t err = restore_entry(entry);
+    if (err == ESP_OK && entry->valid) {
+        device_shadow_value_t v;
+        to_value(entry, &v);
+        ESP_LOGI(TAG, "Desired %s restored from version %lld", key, (long long)entry->version);
+        callback(key, &v, arg);
+    } else if (err != ESP_OK) {
+        ESP_LOGD(TAG, "Desired %s not cached (%s)", key, esp_err_to_name(err));
+        cache_incomplete = true;
+    }
+
+    portENTER_CRITICAL(&shadow_lock);
+    desired_entry_count++;
+    portEXIT_CRITICAL(&shadow_lock);
+    return ESP_OK;
+}
+
+esp_err_t device_shadow_get_desired(const char *key, device_shadow_value_t *value,
+                                    char *string_buf, size_t string_buf_len)
+{
+    if (key == NULL || value == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    portENTER_CRITICAL(&shadow_lock);
+    for (size_t i = 0; i < desired_entry_count; i++) {
+        const desired_entry_t *entry = &desired_entries[i];
+        if (strcmp(entry->key, key) != 0) {
+            continue;
+        }
+        if (!entry->valid) {
+            break;
+        }
+        to_value(entry, value);
+        err = ESP_OK;
+        if (entry->type == DEVICE_SHADOW_VALUE_STRING) {
+            if (string_buf == NULL || string_buf_len <= strlen(entry->value.string)) {
+                err = ESP_ERR_INVALID_SIZE;
+            } else {
+                strcpy(string_buf, entry->value.string);
+                value->string = string_buf;
+            }
+        }
+        break;
+    }
+    portEXIT_CRITICAL(&shadow_lock);
+    return err;
+}
+
+int64_t device_shadow_get_version(void)
+{
+    return shadow_version;
+}
+
+static desired_entry_t *find_desired_entry(const json_token_t *key)
+{
+    for (size_t i = 0; i < desired_entry_count; i++) {
+        if (json_token_equals(key, desired_entries[i].key)) {
+            return &desired_entries[i];
+        }
+    }
     return NULL;
 }
 
+/**
+ * Store a decoded value in the cache entry.
+ * @return true if the value differs from the cached one
+ */
+static bool update_entry(desired_entry_t *entry, const shadow_storage_t *value, int64_t version)
+{
+    bool changed = !entry->valid;
+    if (!changed) {
+        switch (entry->type) {
+        case DEVICE_SHADOW_VALUE_BOOL:
+            changed = entry->value.boolean != value->boolean;
+            break;
+        case DEVICE_SHADOW_VALUE_NUMBER:
+            changed = entry->value.number != value->number;
+            break;
+        case DEVICE_SHADOW_VALUE_STRING:
+            changed = strcmp(entry->value.string, value->string) != 0;
+            break;
+        }
+    }
+    if (!changed) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&shadow_lock);
+    entry->value = *value;
+    entry->version = version;
+    entry->valid = true;
+    entry->dirty = true;
+    portEXIT_CRITICAL(&shadow_lock);
+    return true;
+}
+
+/**
+ * Apply the members of a desired/delta object to the cache and call the
+ * callbacks of keys whose value changed. The reader is positioned just after
+ * the object's opening brace.
+ */
+static esp_err_t process_desired_section(json_reader_t *r, int64_t version)
+{
+    json_token_t key, value;
+    esp_err_t err;
+
+    while ((err = json_reader_next(r, &key)) == ESP_OK) {
+        if (key.type == JSON_TOKEN_OBJECT_END) {
+            return ESP_OK;
+        }
+        if (key.type != JSON_TOKEN_KEY || json_reader_next(r, &value) != ESP_OK) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+
+        desired_entry_t *entry = find_desired_entry(&key);
+        if (entry == NULL) {
+            ESP_LOGD(TAG, "Ignoring unregistered desired key %.*s", (int)key.len, key.start);
+            err = json_reader_skip(r, &value);
+            if (err != ESP_OK) {
+                return err;
+            }
+            continue;
+        }
+
+        shadow_storage_t decoded;
+        bool ok = false;
+        switch (entry->type) {
+        case DEVICE_SHADOW_VALUE_BOOL:
+            ok = value.type == JSON_TOKEN_TRUE || value.type == JSON_TOKEN_FALSE;
+            decoded.boolean = value.type == JSON_TOKEN_TRUE;
+            break;
+        case DEVICE_SHADOW_VALUE_NUMBER:
+            ok = value.type == JSON_TOKEN_NUMBER && json_token_get_double(&value, &decoded.number) == ESP_OK;
+            break;
+        case DEVICE_SHADOW_VALUE_STRING:
+            ok = value.type == JSON_TOKEN_STRING &&
+                 json_token_get_string(&value, decoded.string, sizeof(decoded.string)) == ESP_OK;
+            break;
+        }
+        if (!ok) {
+            ESP_LOGW(TAG, "Desired %s has the wrong type or is too long, ignoring", entry->key);
+            err = json_reader_skip(r, &value);
+            if (err != ESP_OK) {
+                return err;
+            }
+            continue;
+        }
+
+        if (update_entry(entry, &decoded, version)) {
+            device_shadow_value_t v;
+            to_value(entry, &v);
+            ESP_LOGI(TAG, "Desired %s updated at version %lld", entry->key, (long long)version);
+            entry->callback(entry->key, &v, entry->arg);
+        }
+    }
+    return err == ESP_ERR_NOT_FOUND ? ESP_ERR_INVALID_RESPONSE : err;
+}
+
+/**
+ * Walk a full shadow document's "state" object, applying "desired" and
+ * skipping "reported" and "delta" (delta is a subset of desired).
+ */
+static esp_err_t process_state_document(json_reader_t *r, int64_t version)
+{
+    json_token_t key, value;
+    esp_err_t err;
+
+    while ((err = json_reader_next(r, &key)) == ESP_OK) {
+        if (key.type == JSON_TOKEN_OBJECT_END) {
+            return ESP_OK;
+        }
+        if (key.type != JSON_TOKEN_KEY || json_reader_next(r, &value) != ESP_OK) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+
+        if (json_token_equals(&key, "desired") && value.type == JSON_TOKEN_OBJECT_BEGIN) {
+            ESP_LOGD(TAG, "Processing desired state");
+            err = process_desired_section(r, version);
+        } else {
+            if (json_token_equals(&key, "reported")) {
+                ESP_LOGD(TAG, "Current reported state received");
+            }
+            err = json_reader_skip(r, &value);
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return err == ESP_ERR_NOT_FOUND ? ESP_ERR_INVALID_RESPONSE : err;
+}
+
+static bool topic_ends_with(const char *topic, size_t topic_len, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    return topic_len >= n && memcmp(topic + topic_len - n, suffix, n) == 0;
+}
+
+/**
+ * The top-level "version" follows "state" in AWS documents, but has to be
+ * known before the state is applied, so it is read in a first pass. The
+ * pass reads the whole document, so it also validates it: nothing is
+ * applied, and no callback runs, for a document that turns out malformed.
+ */
+static esp_err_t scan_document_header(const char *data, size_t data_len, int64_t *version,
+                                      int64_t *code, char *client_token, size_t client_token_len)
+{
+    json_reader_t r;
+    json_token_t key, value;
+    esp_err_t err;
+
+    json_reader_init(&r, data, data_len);
+    if (json_reader_next(&r, &key) != ESP_OK || key.type != JSON_TOKEN_OBJECT_BEGIN) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    while ((err = json_reader_next(&r, &key)) == ESP_OK && key.type != JSON_TOKEN_OBJECT_END) {
+        if (key.type != JSON_TOKEN_KEY || json_reader_next(&r, &value) != ESP_OK) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (value.type == JSON_TOKEN_NUMBER && json_token_equals(&key, "version")) {
+            json_token_get_int(&value, version);
+        } else if (value.type == JSON_TOKEN_NUMBER && json_token_equals(&key, "code")) {
+            json_token_get_int(&value, code);
+        } else if (value.type == JSON_TOKEN_STRING && json_token_equals(&key, "clientToken")) {
+            if (json_token_get_string(&value, client_token, client_token_len) != ESP_OK) {
+                client_token[0] = '\0';
+            }
+        } else if ((err = json_reader_skip(&r, &value)) != ESP_OK) {
+            return err;
+        }
+    }
+    if (err == ESP_OK && json_reader_next(&r, &key) != ESP_ERR_NOT_FOUND) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return err;
+}
+
+static esp_err_t apply_document(const char *data, size_t data_len, bool is_delta, int64_t version)
+{
+    json_reader_t r;
+    json_token_t key, value;
+    esp_err_t err;
+
+    json_reader_init(&r, data, data_len);
+    json_reader_next(&r, &key);     // Opening brace, checked by scan_document_header()
+
+    while ((err = json_reader_next(&r, &key)) == ESP_OK && key.type != JSON_TOKEN_OBJECT_END) {
+        if (key.type != JSON_TOKEN_KEY || json_reader_next(&r, &value) != ESP_OK) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (json_token_equals(&key, "state") && value.type == JSON_TOKEN_OBJECT_BEGIN) {
+            // On /update/delta the "state" object holds the delta itself
+            err = is_delta ? process_desired_section(&r, version) : process_state_document(&r, version);
+        } else {
+            // version, metadata, timestamp, clientToken, ...
+            err = json_reader_skip(&r, &value);
+        }
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return err;
+}
+
 esp_err_t device_shadow_handle_response(const char *topic, size_t topic_len, 
                                       const char *data, size_t data_len)
 {
@@ -79,114 +1199,146 @@ esp_err_t device_shadow_handle_response(const char *topic, size_t topic_len,
         return ESP_ERR_INVALID_ARG;
     }
     
-    ESP_LOGI(TAG, "Handling shadow response from topic: %.*s", topic_len, topic);
-    
-    // Parse JSON response
-    char *data_copy = malloc(data_len + 1);
-    if (data_copy == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate memory for data copy");
-        return ESP_ERR_NO_MEM;
-    }
-    
-    memcpy(data_copy, data, data_len);
-    data_copy[data_len] = '\0';
+    ESP_LOGD(TAG, "Handling shadow response from topic: %.*s", (int)topic_len, topic);
     
-    cJSON *json = cJSON_Parse(data_copy);
-    free(data_copy);
+    bool is_get = topic_ends_with(topic, topic_len, "/get/accepted");
+    bool is_delta = topic_ends_with(topic, topic_len, "/update/delta");
+    bool is_rejected = topic_ends_with(topic, topic_len, "/rejected");
     
-    if (json == NULL) {
+    int64_t version = -1;
+    int64_t code = 0;
+    char client_token[16] = {0};
+    if (scan_document_header(data, data_len, &version, &code, client_token, sizeof(client_token)) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to parse JSON response");
         return ESP_ERR_INVALID_RESPONSE;
     }
     
-    // Check for shadow document
-    cJSON *state = cJSON_GetObjectItem(json, "state");
-    if (state != NULL) {
-        cJSON *desired = cJSON_GetObjectItem(state, "desired");
-        if (desired != NULL) {
-            ESP_LOGI(TAG, "Processing desired state");
-            
-            // Handle desired state changes
-            cJSON *item = NULL;
-            cJSON_ArrayForEach(item, desired) {
-                if (cJSON_IsString(item)) {
-                    ESP_LOGI(TAG, "Desired %s: %s", item->string, item->valuestring);
-                } else if (cJSON_IsNumber(item)) {
-                    ESP_LOGI(TAG, "Desired %s: %f", item->string, item->valuedouble);
-                } else if (cJSON_IsBool(item)) {
-                    ESP_LOGI(TAG, "Desired %s: %s", item->string, 
-                             cJSON_IsTrue(item) ? "true" : "false");
-                }
-            }
+    shadow_request_kind_t kind = SHADOW_REQUEST_FREE;
+    uint32_t token = 0;
+    int slot = request_find_token(client_token, &kind, &token);
+    if (is_rejected) {
+        if (slot < 0) {
+            // Another client's request, or one we already gave up on
+            ESP_LOGD(TAG, "Shadow request %s rejected with code %lld", client_token, (long long)code);
+            return ESP_OK;
         }
-        
-        cJSON *reported = cJSON_GetObjectItem(state, "reported");
-        if (reported != NULL) {
-            ESP_LOGI(TAG, "Current reported state received");
+        if (kind == SHADOW_REQUEST_SYNC && code == 409) {
+            // The cached version is stale: something changed while we were away
+            request_finish(slot, token, ESP_ERR_INVALID_VERSION, code);
+            return device_shadow_request_document(shadow_client);
         }
+        request_failed(slot, token, ESP_FAIL, code, code == 409 || code == 429 || code >= 500);
+        return ESP_OK;
+    }
+    if (slot >= 0) {
+        request_finish(slot, token, ESP_OK, 0);
     }
     
-    // Check for metadata
-    cJSON *metadata = cJSON_GetObjectItem(json, "metadata");
-    if (metadata != NULL) {
-        cJSON *desired_meta = cJSON_GetObjectItem(metadata, "desired");
-        if (desired_meta != NULL) {
-            ESP_LOGI(TAG, "Shadow metadata received");
+    // Anything but a full document is only applied on top of what it follows;
+    // MQTT redelivery and reordering can hand us versions we already have
+    bool gap = false;
+    if (!is_get && version >= 0 && shadow_version >= 0) {
+        // /update/accepted and /update/delta share a version, so a delta
+        // is still applied at the current one
+        if (version < shadow_version || (version == shadow_version && !is_delta)) {
+            ESP_LOGD(TAG, "Ignoring shadow version %lld, have %lld",
+                     (long long)version, (long long)shadow_version);
+            return ESP_OK;
         }
+        gap = version > shadow_version + 1;
     }
     
-    cJSON_Delete(json);
+    if (apply_document(data, data_len, is_delta, version) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to parse JSON response");
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    
+    if (version >= 0) {
+        shadow_version = version;
+    }
+    persist_changes(is_get);
+    ESP_LOGD(TAG, "Shadow version %lld", (long long)shadow_version);
+    
+    if (gap && shadow_client != NULL) {
+        // Missed at least one update; a delta only carries what still differs
+        // from reported, so fetch the whole document to be sure
+        ESP_LOGW(TAG, "Shadow version gap, requesting full document");
+        return device_shadow_request_document(shadow_client);
+    }
     return ESP_OK;
 }
 
-esp_err_t device_shadow_update_reported_state(esp_mqtt_client_handle_t client, 
-                                             const char *key, const char *value)
+esp_err_t device_shadow_request_document(esp_mqtt_client_handle_t client)
 {
-    if (client == NULL || key == NULL || value == NULL) {
-        ESP_LOGE(TAG, "Invalid parameters for shadow update");
+    if (client == NULL) {
         return ESP_ERR_INVALID_ARG;
     }
+    shadow_client = client;
     
-    char topic[256];
-    snprintf(topic, sizeof(topic), "$aws/things/%s/shadow/update", device_thing_name);
-    
-    cJSON *shadow = cJSON_CreateObject();
-    cJSON *state = cJSON_CreateObject();
-    cJSON *reported = cJSON_CreateObject();
+    portENTER_CRITICAL(&shadow_lock);
+    bool pending = request_find_kind(SHADOW_REQUEST_GET) >= 0;
+    int slot = pending ? -1 : request_alloc(SHADOW_REQUEST_GET, NULL, NULL);
+    uint32_t token = slot >= 0 ? requests[slot].token : 0;
+    portEXIT_CRITICAL(&shadow_lock);
     
-    if (shadow == NULL || state == NULL || reported == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON objects for shadow update");
-        goto error;
+    if (pending) {
+        return ESP_OK;
     }
-    
-    cJSON *json_value = cJSON_CreateString(value);
-    if (json_value == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON value");
-        goto error;
+    if (slot < 0) {
+        ESP_LOGE(TAG, "No free shadow request slot for get");
+        return ESP_ERR_NO_MEM;
     }
+    return request_send(slot, token);
+}
+
+esp_err_t device_shadow_sync(esp_mqtt_client_handle_t client)
+{
+    if (client == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    shadow_client = client;
     
-    cJSON_AddItemToObject(reported, key, json_value);
-    cJSON_AddItemToObject(state, "reported", reported);
-    cJSON_AddItemToObject(shadow, "state", state);
-    
-    char *json_string = cJSON_Print(shadow);
-    if (json_string == NULL) {
-        ESP_LOGE(TAG, "Failed to generate JSON string");
-        goto error;
+    // New session: gets and syncs are reissued below, and reported documents
+    // get a fresh timeout since esp-mqtt resends them from its outbox
+    bool dirty = false;
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)SHADOW_REQUEST_TIMEOUT_MS * 1000;
+    portENTER_CRITICAL(&shadow_lock);
+    for (int i = 0; i < SHADOW_MAX_PENDING; i++) {
+        if (requests[i].kind == SHADOW_REQUEST_GET || requests[i].kind == SHADOW_REQUEST_SYNC) {
+            requests[i].kind = SHADOW_REQUEST_FREE;
+        } else if (requests[i].kind == SHADOW_REQUEST_REPORT && !requests[i].retry_pending) {
+            requests[i].deadline_us = deadline_us;
+        }
+    }
+    for (size_t i = 0; i < reported_entry_count; i++) {
+        reported_entries[i].held = false;
+        dirty |= reported_flushable(&reported_entries[i]);
+    }
+    portEXIT_CRITICAL(&shadow_lock);
+    if (dirty) {
+        schedule_report(SHADOW_REPORT_DEBOUNCE_MS);
     }
     
-    int msg_id = esp_mqtt_client_publish(client, topic, json_string, 0, 1, 0);
-    ESP_LOGI(TAG, "Published shadow update for %s, msg_id=%d", key, msg_id);
+    if (!cached_version_usable()) {
+        if (shadow_version >= 0) {
+            ESP_LOGI(TAG, "Desired keys changed since version %lld, fetching full document",
+                     (long long)shadow_version);
+        }
+        return device_shadow_request_document(client);
+    }
     
-    cJSON_free(json_string);
-    cJSON_Delete(shadow);
-    return ESP_OK;
-
-error:
-    if (shadow) cJSON_Delete(shadow);
-    if (state) cJSON_Delete(state);
-    if (reported) cJSON_Delete(reported);
-    return ESP_FAIL;
+    // A version-checked update is accepted only if nothing changed while we
+    // were away; otherwise /update/rejected answers 409 and the full document
+    // is fetched from there
+    portENTER_CRITICAL(&shadow_lock);
+    int slot = request_alloc(SHADOW_REQUEST_SYNC, NULL, NULL);
+    uint32_t token = slot >= 0 ? requests[slot].token : 0;
+    portEXIT_CRITICAL(&shadow_lock);
+    if (slot < 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    ESP_LOGI(TAG, "Resuming shadow from version %lld", (long long)shadow_version);
+    return request_send(slot, token);
 }
 
 const char* device_shadow_get_thing_name(void)
@@ -6,9 +6,69 @@
 #ifndef DEVICE_SHADOW_H
 #define DEVICE_SHADOW_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "esp_err.h"
 #include "mqtt_client.h"
 
+/**
+ * @brief Maximum number of desired-state keys that can be registered
+ */
+#define DEVICE_SHADOW_MAX_DESIRED_KEYS 16
+
+/**
+ * @brief Maximum number of reported-state keys
+ */
+#define DEVICE_SHADOW_MAX_REPORTED_KEYS 16
+
+/**
+ * @brief Longest reported key name
+ */
+#define DEVICE_SHADOW_MAX_KEY_LEN 32
+
+/**
+ * @brief Longest cached desired or reported string value, including the terminator
+ */
+#define DEVICE_SHADOW_MAX_STRING_LEN 64
+
+/**
+ * @brief Type of a desired-state value
+ */
+typedef enum {
+    DEVICE_SHADOW_VALUE_BOOL,
+    DEVICE_SHADOW_VALUE_NUMBER,
+    DEVICE_SHADOW_VALUE_STRING,
+} device_shadow_value_type_t;
+
+/**
+ * @brief Desired-state value delivered to a registered callback
+ */
+typedef struct {
+    device_shadow_value_type_t type;
+    union {
+        bool boolean;
+        double number;
+        const char *string;     ///< Only valid for the duration of the callback
+    };
+} device_shadow_value_t;
+
+/**
+ * @brief Callback invoked for a registered desired-state key
+ * @param key Registered key
+ * @param value New desired value
+ * @param arg User argument passed at registration
+ */
+typedef void (*device_shadow_desired_cb_t)(const char *key, const device_shadow_value_t *value, void *arg);
+
+/**
+ * @brief Called when a shadow request completes
+ * @param result ESP_OK if accepted; ESP_FAIL if rejected, ESP_ERR_TIMEOUT if
+ *               unanswered after every retry
+ * @param code AWS error code of the last rejection, 0 otherwise
+ * @param arg User argument
+ */
+typedef void (*device_shadow_done_cb_t)(esp_err_t result, int code, void *arg);
+
 /**
  * @brief Initialize device shadow manager
  * @param thing_name AWS IoT Thing name
@@ -18,12 +78,57 @@ esp_err_t device_shadow_init(const char *thing_name);
 
 /**
  * @brief Create a device state document
- * @return Allocated JSON string (must be freed by caller)
+ *
+ * The document is serialized as compact JSON directly into the supplied
+ * buffer; no heap memory is used.
+ *
+ * @param buf Output buffer
+ * @param buf_len Output buffer size
+ * @param out_len Document length (excluding NUL), may be NULL
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the buffer is too small
+ */
+esp_err_t device_shadow_create_state_document(char *buf, size_t buf_len, size_t *out_len);
+
+/**
+ * @brief Register interest in a desired-state key
+ *
+ * Only registered keys are decoded from shadow responses; everything else
+ * (including metadata) is skipped without being materialized. Values are
+ * kept in a local cache backed by NVS; if one was stored by a previous boot
+ * the callback is invoked with it before this function returns.
+ *
+ * @param key Key name (must remain valid for the lifetime of the program)
+ * @param type Expected value type; values of other types are ignored
+ * @param callback Called from the MQTT task whenever the value changes
+ * @param arg User argument passed to callback
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the key table is full
+ */
+esp_err_t device_shadow_register_desired(const char *key, device_shadow_value_type_t type,
+                                         device_shadow_desired_cb_t callback, void *arg);
+
+/**
+ * @brief Read a cached desired value
+ * @param key Registered key
+ * @param value Receives the value; for strings, value->string points into string_buf
+ * @param string_buf Buffer for string values, may be NULL for other types
+ * @param string_buf_len Size of string_buf
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the key is unknown or has no
+ *         value yet, ESP_ERR_INVALID_SIZE if string_buf is too small
+ */
+esp_err_t device_shadow_get_desired(const char *key, device_shadow_value_t *value,
+                                    char *string_buf, size_t string_buf_len);
+
+/**
+ * @brief Get the shadow version the cache reflects
+ * @return Version, -1 if no document has been seen yet
  */
-char* device_shadow_create_state_document(void);
+int64_t device_shadow_get_version(void);
 
 /**
  * @brief Handle shadow response from AWS IoT
+ *
+ * The payload is tokenized in place; it is neither copied nor required to be
+ * NUL-terminated.
  * @param topic MQTT topic
  * @param topic_len Topic length
  * @param data Message data
@@ -34,14 +139,82 @@ esp_err_t device_shadow_handle_response(const char *topic, size_t topic_len,
                                        const char *data, size_t data_len);
 
 /**
- * @brief Update reported state in device shadow
+ * @brief Set a reported-state value
+ *
+ * The key is marked dirty if the value differs from the last one AWS
+ * acknowledged. Dirty keys are merged into a single reported document sent
+ * CONFIG_AWS_IOT_SHADOW_REPORT_DEBOUNCE_MS after the first change, or on
+ * device_shadow_commit_reported(). Unchanged keys are never sent. Safe to
+ * call from any task.
+ *
+ * @param key Key name, at most DEVICE_SHADOW_MAX_KEY_LEN characters (must
+ *            remain valid for the lifetime of the program)
+ * @param value New value; strings are copied
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the key table is full,
+ *         ESP_ERR_INVALID_SIZE if a string is too long
+ */
+esp_err_t device_shadow_report(const char *key, const device_shadow_value_t *value);
+
+/**
+ * @brief Set a boolean reported-state value, see device_shadow_report()
+ */
+esp_err_t device_shadow_report_bool(const char *key, bool value);
+
+/**
+ * @brief Set a numeric reported-state value, see device_shadow_report()
+ */
+esp_err_t device_shadow_report_number(const char *key, double value);
+
+/**
+ * @brief Set a string reported-state value, see device_shadow_report()
+ */
+esp_err_t device_shadow_report_string(const char *key, const char *value);
+
+/**
+ * @brief Send dirty reported keys now instead of waiting for the debounce
+ *
+ * The keys go out in one document with its own clientToken, pipelined with
+ * any documents still awaiting a response. Keys already in one of those are
+ * sent once it has been answered. Keys whose last document failed are retried.
+ *
+ * @param callback Optional; called when the document is accepted or has
+ *                 finally failed, or straight away if nothing is dirty
+ * @param arg User argument for the callback
+ * @return ESP_OK if the document was queued or nothing was dirty,
+ *         ESP_ERR_INVALID_STATE before the first connect, ESP_ERR_NO_MEM if
+ *         too many requests are in flight (the keys stay dirty)
+ */
+esp_err_t device_shadow_commit_reported(device_shadow_done_cb_t callback, void *arg);
+
+/**
+ * @brief Request the full shadow document
+ *
+ * The response arrives on /get/accepted and is applied like any other shadow
+ * response. Does nothing if a get is already pending. Safe to call from the
+ * MQTT event handler.
+ *
  * @param client MQTT client handle
- * @param key State key
- * @param value State value
- * @return ESP_OK on success
+ * @return ESP_OK if the request was queued
+ */
+esp_err_t device_shadow_request_document(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Bring the cache up to date after (re)connecting
+ *
+ * The full document is requested when there is no cached version, when a
+ * registered desired key has nothing in NVS, or when the set of registered
+ * keys differs from the one the version was stored with. Otherwise a
+ * reported update carrying the cached version is sent: AWS accepts it only
+ * if the shadow has not changed since, and answers 409 on /update/rejected
+ * if it has, which makes the full document be requested. Later updates
+ * arrive as deltas and are applied in place; a version gap also triggers a
+ * full request. Safe to call from the MQTT event handler.
+ *
+ * @param client MQTT client handle, also used for requests made later from
+ *               device_shadow_handle_response()
+ * @return ESP_OK if the request was queued
  */
-esp_err_t device_shadow_update_reported_state(esp_mqtt_client_handle_t client, 
-                                              const char *key, const char *value);
+esp_err_t device_shadow_sync(esp_mqtt_client_handle_t client);
 
 /**
  * @brief Get the configured thing name
@@ -0,0 +1,148 @@
+/**
+ * @file duty_cycle.c
+ * @brief Deep-sleep duty cycling for battery deployments
+ */
+
+#include "aws_iot_config.h"
+#include "duty_cycle.h"
+
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_rtc_time.h"
+#include "esp_sleep.h"
+#include "esp_system.h"
+
+static const char *TAG = "DUTY_CYCLE";
+
+#define DUTY_CYCLE_SLEEP_MS CONFIG_AWS_IOT_DUTY_CYCLE_SLEEP_MS
+#define DUTY_CYCLE_SAMPLES_PER_UPLOAD CONFIG_AWS_IOT_DUTY_CYCLE_SAMPLES_PER_UPLOAD
+// A failed upload is retried after 2, 4, ... up to this many wakes
+#define DUTY_CYCLE_MAX_RETRY_WAKES 16
+
+/**
+ * Kept in RTC slow memory: zeroed on power-on, preserved across deep sleep.
+ * Times are RTC timer microseconds, which keep counting while asleep.
+ */
+typedef struct {
+    uint32_t wakes;
+    uint32_t uploads;
+    uint32_t upload_failures;
+    uint32_t consecutive_failures;
+    uint32_t retry_at_wake;         ///< First wake allowed to retry a failed upload
+    uint64_t wake_us;               ///< When the current cycle's wake timer fired
+    uint64_t total_awake_us;
+    uint64_t total_sleep_us;
+    uint32_t last_awake_ms;         ///< Previous cycle, wake to sleep
+    uint32_t last_upload_awake_ms;  ///< Previous upload cycle, wake to sleep
+    uint32_t last_phase_ms[DUTY_CYCLE_PHASE_COUNT];
+    uint32_t phase_ms[DUTY_CYCLE_PHASE_COUNT];  ///< Current cycle
+    bool uploading;                 ///< Current cycle is an upload cycle
+} duty_cycle_state_t;
+
+static RTC_DATA_ATTR duty_cycle_state_t state;
+
+static uint32_t ms_since_wake(void)
+{
+    return (uint32_t)((esp_rtc_get_time_us() - state.wake_us) / 1000);
+}
+
+void duty_cycle_wake(void)
+{
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP) {
+        // Power-on or crash: whatever RTC memory holds is not ours
+        state = (duty_cycle_state_t) {0};
+        state.wake_us = esp_rtc_get_time_us();
+    } else if (state.wake_us > esp_rtc_get_time_us()) {
+        // Woke early against the RTC clock
+        state.wake_us = esp_rtc_get_time_us();
+    }
+    // After deep sleep wake_us was set to the scheduled wake time, so boot
+    // time counts as awake time
+    state.wakes++;
+    state.uploading = false;
+    for (int i = 0; i < DUTY_CYCLE_PHASE_COUNT; i++) {
+        state.phase_ms[i] = 0;
+    }
+    ESP_LOGI(TAG, "Wake %u, %u ms since timer", (unsigned)state.wakes, (unsigned)ms_since_wake());
+}
+
+bool duty_cycle_upload_due(size_t pending)
+{
+    // Upload on power-on so commissioning sees the device straight away
+    bool due = state.wakes == 1 ||
+               (pending >= DUTY_CYCLE_SAMPLES_PER_UPLOAD && state.wakes >= state.retry_at_wake);
+    state.uploading = due;
+    return due;
+}
+
+void duty_cycle_mark(duty_cycle_phase_t phase)
+{
+    if (phase < DUTY_CYCLE_PHASE_COUNT) {
+        state.phase_ms[phase] = ms_since_wake();
+    }
+}
+
+void duty_cycle_upload_done(bool ok)
+{
+    if (ok) {
+        state.uploads++;
+        state.consecutive_failures = 0;
+        state.retry_at_wake = 0;
+        return;
+    }
+
+    state.upload_failures++;
+    state.consecutive_failures++;
+    uint32_t backoff = state.consecutive_failures < 4 ? 1u << state.consecutive_failures
+                                                      : DUTY_CYCLE_MAX_RETRY_WAKES;
+    state.retry_at_wake = state.wakes + backoff;
+    ESP_LOGW(TAG, "Upload failed (%u in a row), next attempt in %u wakes",
+             (unsigned)state.consecutive_failures, (unsigned)backoff);
+}
+
+void duty_cycle_write_json(json_writer_t *w, const char *key)
+{
+    json_writer_begin_object(w, key);
+    json_writer_add_uint(w, "wakes", state.wakes);
+    json_writer_add_uint(w, "uploads", state.uploads);
+    json_writer_add_uint(w, "upload_failures", state.upload_failures);
+    json_writer_add_uint(w, "awake_ms", state.last_awake_ms);
+    json_writer_add_uint(w, "upload_awake_ms", state.last_upload_awake_ms);
+    json_writer_add_uint(w, "link_ms", state.last_phase_ms[DUTY_CYCLE_PHASE_LINK_UP]);
+    json_writer_add_uint(w, "mqtt_ms", state.last_phase_ms[DUTY_CYCLE_PHASE_MQTT_CONNECTED]);
+    json_writer_add_uint(w, "publish_ms", state.last_phase_ms[DUTY_CYCLE_PHASE_FIRST_PUBLISH]);
+    json_writer_add_uint(w, "flush_ms", state.last_phase_ms[DUTY_CYCLE_PHASE_FLUSHED]);
+    json_writer_add_int(w, "total_awake_ms", state.total_awake_us / 1000);
+    json_writer_add_int(w, "total_sleep_ms", state.total_sleep_us / 1000);
+    json_writer_end_object(w);
+}
+
+void duty_cycle_sleep(void)
+{
+    uint64_t now = esp_rtc_get_time_us();
+    uint64_t awake_us = now - state.wake_us;
+    uint64_t sleep_us = (uint64_t)DUTY_CYCLE_SLEEP_MS * 1000;
+
+    // Keep the period fixed: the time spent awake comes out of the sleep
+    sleep_us = awake_us < sleep_us ? sleep_us - awake_us : 1000;
+
+    state.last_awake_ms = (uint32_t)(awake_us / 1000);
+    if (state.uploading) {
+        state.last_upload_awake_ms = state.last_awake_ms;
+        for (int i = 0; i < DUTY_CYCLE_PHASE_COUNT; i++) {
+            state.last_phase_ms[i] = state.phase_ms[i];
+        }
+    }
+    state.total_awake_us += awake_us;
+    state.total_sleep_us += sleep_us;
+    state.wake_us = now + sleep_us;
+
+    ESP_LOGI(TAG, "Awake %u ms (%s), sleeping %u ms", (unsigned)state.last_awake_ms,
+             state.uploading ? "upload" : "sample", (unsigned)(sleep_us / 1000));
+    esp_sleep_enable_timer_wakeup(sleep_us);
+    esp_deep_sleep_start();
+}
+
+#endif // CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
@@ -0,0 +1,77 @@
+/**
+ * @file duty_cycle.h
+ * @brief Deep-sleep duty cycling for battery deployments
+ *
+ * With CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE the device wakes every
+ * CONFIG_AWS_IOT_DUTY_CYCLE_SLEEP_MS, takes one telemetry sample into the
+ * RTC-retained ring buffer and goes back to sleep without touching the
+ * radio. Every CONFIG_AWS_IOT_DUTY_CYCLE_SAMPLES_PER_UPLOAD samples it brings
+ * the network up, flushes the batch and sleeps again. Counters and the
+ * timings of each phase live in RTC memory and are reported with the
+ * metrics message of the next upload.
+ */
+
+#ifndef DUTY_CYCLE_H
+#define DUTY_CYCLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "json_writer.h"
+
+/**
+ * @brief Points in an upload cycle whose time since wake is recorded
+ */
+typedef enum {
+    DUTY_CYCLE_PHASE_LINK_UP,       ///< Network link has an IP address
+    DUTY_CYCLE_PHASE_MQTT_CONNECTED,///< CONNACK received
+    DUTY_CYCLE_PHASE_FIRST_PUBLISH, ///< First PUBACK received
+    DUTY_CYCLE_PHASE_FLUSHED,       ///< Every publish acknowledged
+    DUTY_CYCLE_PHASE_COUNT,
+} duty_cycle_phase_t;
+
+/**
+ * @brief Count a wake-up; call first thing in app_main()
+ */
+void duty_cycle_wake(void);
+
+/**
+ * @brief Check whether this wake should upload
+ * @param pending Samples buffered in the telemetry ring
+ * @return true if enough samples are buffered or the last upload failed
+ */
+bool duty_cycle_upload_due(size_t pending);
+
+/**
+ * @brief Record the time since wake at which a phase was reached
+ * @param phase Phase reached in the current cycle
+ */
+void duty_cycle_mark(duty_cycle_phase_t phase);
+
+/**
+ * @brief Record the outcome of this cycle's upload
+ * @param ok Every batch was acknowledged
+ */
+void duty_cycle_upload_done(bool ok);
+
+/**
+ * @brief Write the retained counters and last-cycle timings as a JSON member
+ *
+ * Format: {"wakes":n,"uploads":n,"upload_failures":n,"awake_ms":n,
+ * "upload_awake_ms":n,"link_ms":n,"mqtt_ms":n,"publish_ms":n,"flush_ms":n,
+ * "total_awake_ms":n,"total_sleep_ms":n}; timings are from the previous
+ * cycle, measured from wake.
+ *
+ * @param w Writer positioned inside an object
+ * @param key Member name
+ */
+void duty_cycle_write_json(json_writer_t *w, const char *key);
+
+/**
+ * @brief Record the wake-to-sleep time and enter deep sleep
+ *
+ * The caller must have stopped the MQTT client and the radio.
+ */
+void duty_cycle_sleep(void) __attribute__((noreturn));
+
+#endif // DUTY_CYCLE_H
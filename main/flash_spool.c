@@ -0,0 +1,350 @@
+/**
+ * @file flash_spool.c
+ * @brief Append-only store-and-forward spool on a flash partition
+ *
+ * Layout: the partition is split into 4 KB sectors used as a circular log.
+ * Every sector in use starts with a header carrying a monotonic sequence
+ * number, followed by records of the form [state|len|crc32|payload]. Record
+ * state bits are only ever cleared (erased -> valid -> consumed), so marking a
+ * record consumed is a single byte write and needs no erase. The newest
+ * sector is the one with the highest sequence number; the oldest is found by
+ * walking back through the contiguous sequence chain.
+ */
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "flash_spool.h"
+
+static const char *TAG = "FLASH_SPOOL";
+
+#define SPOOL_SECTOR_SIZE 4096
+#define SPOOL_SECTOR_MAGIC 0x314C5053 // "SPL1"
+
+#define SPOOL_RECORD_ERASED 0xFF
+#define SPOOL_RECORD_VALID 0xFE
+#define SPOOL_RECORD_CONSUMED 0xFC
+
+#define SPOOL_ALIGN(x) (((x) + 3) & ~(size_t)3)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;
+} spool_sector_header_t;
+
+typedef struct {
+    uint8_t state;
+    uint8_t reserved;
+    uint16_t length;
+    uint32_t crc;
+} spool_record_header_t;
+
+#define SECTOR_HEADER_SIZE sizeof(spool_sector_header_t)
+#define RECORD_HEADER_SIZE sizeof(spool_record_header_t)
+#define SPOOL_MAX_RECORD_SIZE (SPOOL_SECTOR_SIZE - SECTOR_HEADER_SIZE - RECORD_HEADER_SIZE)
+
+static const esp_partition_t *spool_partition = NULL;
+static size_t sector_count = 0;
+
+// Append position
+static size_t write_sector = 0;
+static size_t write_offset = 0;
+static uint32_t write_sequence = 0;
+
+// Replay position
+static size_t read_sector = 0;
+static size_t read_offset = 0;
+static size_t last_read_size = 0;
+
+static size_t sector_address(size_t sector)
+{
+    return sector * SPOOL_SECTOR_SIZE;
+}
+
+static bool read_sector_header(size_t sector, spool_sector_header_t *hdr)
+{
+    if (esp_partition_read(spool_partition, sector_address(sector), hdr, sizeof(*hdr)) != ESP_OK) {
+        return false;
+    }
+    return hdr->magic == SPOOL_SECTOR_MAGIC;
+}
+
+/**
+ * Read the record header at offset. Returns true only for a well-formed
+ * valid or consumed record; hdr is filled in either way.
+ */
+static bool read_record_header(size_t sector, size_t offset, spool_record_header_t *hdr)
+{
+    memset(hdr, 0xFF, sizeof(*hdr));
+    if (offset + RECORD_HEADER_SIZE > SPOOL_SECTOR_SIZE) {
+        return false;
+    }
+    if (esp_partition_read(spool_partition, sector_address(sector) + offset, hdr, sizeof(*hdr)) != ESP_OK) {
+        return false;
+    }
+    if (hdr->state != SPOOL_RECORD_VALID && hdr->state != SPOOL_RECORD_CONSUMED) {
+        return false;
+    }
+    return hdr->length != 0 && offset + RECORD_HEADER_SIZE + hdr->length <= SPOOL_SECTOR_SIZE;
+}
+
+static bool record_header_is_erased(const spool_record_header_t *hdr)
+{
+    const uint8_t *bytes = (const uint8_t *)hdr;
+    for (size_t i = 0; i < sizeof(*hdr); i++) {
+        if (bytes[i] != 0xFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static esp_err_t open_sector(size_t sector)
+{
+    esp_err_t err = esp_partition_erase_range(spool_partition, sector_address(sector), SPOOL_SECTOR_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to erase sector %u: %s", (unsigned)sector, esp_err_to_name(err));
+        return err;
+    }
+
+    spool_sector_header_t hdr = {
+        .magic = SPOOL_SECTOR_MAGIC,
+        .sequence = write_sequence + 1,
+    };
+    err = esp_partition_write(spool_partition, sector_address(sector), &hdr, sizeof(hdr));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write sector header %u: %s", (unsigned)sector, esp_err_to_name(err));
+        return err;
+    }
+
+    write_sequence = hdr.sequence;
+    write_sector = sector;
+    write_offset = SECTOR_HEADER_SIZE;
+    return ESP_OK;
+}
+
+static void advance_read_sector(void)
+{
+    read_sector = (read_sector + 1) % sector_count;
+    read_offset = SECTOR_HEADER_SIZE;
+}
+
+/**
+ * Move the replay position forward to the next valid record, skipping
+ * consumed records and unreadable sector tails. Returns false when empty.
+ */
+static bool seek_valid_record(spool_record_header_t *hdr)
+{
+    while (!flash_spool_is_empty()) {
+        if (!read_record_header(read_sector, read_offset, hdr)) {
+            if (read_sector == write_sector) {
+                read_offset = write_offset;
+                return false;
+            }
+            advance_read_sector();
+            continue;
+        }
+        if (hdr->state == SPOOL_RECORD_CONSUMED) {
+            read_offset += SPOOL_ALIGN(RECORD_HEADER_SIZE + hdr->length);
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+static esp_err_t recover_positions(void)
+{
+    spool_sector_header_t hdr;
+    bool found = false;
+    size_t head = 0;
+
+    for (size_t i = 0; i < sector_count; i++) {
+        if (!read_sector_header(i, &hdr)) {
+            continue;
+        }
+        if (!found || (int32_t)(hdr.sequence - write_sequence) > 0) {
+            found = true;
+            head = i;
+            write_sequence = hdr.sequence;
+        }
+    }
+
+    if (!found) {
+        ESP_LOGI(TAG, "No spool data found, starting fresh");
+        write_sequence = 0;
+        esp_err_t err = open_sector(0);
+        read_sector = write_sector;
+        read_offset = write_offset;
+        return err;
+    }
+
+    // Find the end of the written data in the newest sector
+    spool_record_header_t rec;
+    size_t offset = SECTOR_HEADER_SIZE;
+    while (read_record_header(head, offset, &rec)) {
+        offset += SPOOL_ALIGN(RECORD_HEADER_SIZE + rec.length);
+    }
+    if (offset + RECORD_HEADER_SIZE <= SPOOL_SECTOR_SIZE && !record_header_is_erased(&rec)) {
+        // Torn write - the rest of this sector can't be trusted
+        ESP_LOGW(TAG, "Torn record in sector %u at offset %u", (unsigned)head, (unsigned)offset);
+        offset = SPOOL_SECTOR_SIZE;
+    }
+    write_sector = head;
+    write_offset = offset;
+
+    // Walk back through the contiguous sequence chain to the oldest sector
+    size_t oldest = head;
+    uint32_t sequence = write_sequence;
+    for (size_t n = 1; n < sector_count; n++) {
+        size_t prev = (oldest + sector_count - 1) % sector_count;
+        if (!read_sector_header(prev, &hdr) || hdr.sequence != sequence - 1) {
+            break;
+        }
+        oldest = prev;
+        sequence--;
+    }
+    read_sector = oldest;
+    read_offset = SECTOR_HEADER_SIZE;
+    seek_valid_record(&rec);
+
+    ESP_LOGI(TAG, "Spool recovered: newest sector %u, replay from sector %u%s",
+             (unsigned)write_sector, (unsigned)read_sector,
+             flash_spool_is_empty() ? " (empty)" : "");
+    return ESP_OK;
+}
+
+esp_err_t flash_spool_init(const char *partition_label)
+{
+    if (partition_label == NULL) {
+        ESP_LOGE(TAG, "Partition label cannot be NULL");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    spool_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                               ESP_PARTITION_SUBTYPE_ANY,
+                                               partition_label);
+    if (spool_partition == NULL) {
+        ESP_LOGE(TAG, "Spool partition '%s' not found", partition_label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    sector_count = spool_partition->size / SPOOL_SECTOR_SIZE;
+    if (sector_count < 2) {
+        ESP_LOGE(TAG, "Spool partition too small: %u bytes", (unsigned)spool_partition->size);
+        spool_partition = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    ESP_LOGI(TAG, "Spool partition '%s': %u sectors", partition_label, (unsigned)sector_count);
+    return recover_positions();
+}
+
+esp_err_t flash_spool_append(const void *data, size_t len)
+{
+    if (spool_partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (data == NULL || len == 0 || len > SPOOL_MAX_RECORD_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t err;
+    size_t record_size = SPOOL_ALIGN(RECORD_HEADER_SIZE + len);
+    if (write_offset + record_size > SPOOL_SECTOR_SIZE) {
+        size_t next = (write_sector + 1) % sector_count;
+        if (read_sector == next) {
+            // Log is full - drop the oldest sector
+            ESP_LOGW(TAG, "Spool full, dropping oldest sector %u", (unsigned)next);
+            advance_read_sector();
+            last_read_size = 0;
+        }
+        err = open_sector(next);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    spool_record_header_t hdr = {
+        .state = SPOOL_RECORD_VALID,
+        .reserved = 0xFF,
+        .length = (uint16_t)len,
+        .crc = esp_rom_crc32_le(0, data, len),
+    };
+    size_t address = sector_address(write_sector) + write_offset;
+    err = esp_partition_write(spool_partition, address, &hdr, sizeof(hdr));
+    if (err == ESP_OK) {
+        err = esp_partition_write(spool_partition, address + sizeof(hdr), data, len);
+    }
+    // Advance even on failure so a partial record is never overwritten in place
+    write_offset += record_size;
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to append record: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t flash_spool_read(void *buf, size_t buf_len, size_t *out_len)
+{
+    if (spool_partition == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (buf == NULL || out_len == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    spool_record_header_t hdr;
+    while (seek_valid_record(&hdr)) {
+        size_t record_size = SPOOL_ALIGN(RECORD_HEADER_SIZE + hdr.length);
+        if (hdr.length > buf_len) {
+            ESP_LOGE(TAG, "Record of %u bytes exceeds buffer, skipping", hdr.length);
+            read_offset += record_size;
+            continue;
+        }
+
+        size_t address = sector_address(read_sector) + read_offset + RECORD_HEADER_SIZE;
+        esp_err_t err = esp_partition_read(spool_partition, address, buf, hdr.length);
+        if (err != ESP_OK) {
+            return err;
+        }
+        if (esp_rom_crc32_le(0, buf, hdr.length) != hdr.crc) {
+            // Length can't be trusted either - skip the rest of the sector
+            ESP_LOGW(TAG, "CRC mismatch in sector %u at offset %u", (unsigned)read_sector, (unsigned)read_offset);
+            if (read_sector == write_sector) {
+                read_offset = write_offset;
+            } else {
+                advance_read_sector();
+            }
+            continue;
+        }
+
+        last_read_size = record_size;
+        *out_len = hdr.length;
+        return ESP_OK;
+    }
+
+    last_read_size = 0;
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t flash_spool_consume(void)
+{
+    if (spool_partition == NULL || last_read_size == 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    const uint8_t state = SPOOL_RECORD_CONSUMED;
+    esp_err_t err = esp_partition_write(spool_partition,
+                                        sector_address(read_sector) + read_offset,
+                                        &state, sizeof(state));
+    read_offset += last_read_size;
+    last_read_size = 0;
+    return err;
+}
+
+bool flash_spool_is_empty(void)
+{
+    return read_sector == write_sector && read_offset >= write_offset;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file flash_spool.h
+ * @brief Append-only store-and-forward spool on a flash partition
+ *
+ * Records are appended to a circular log of flash sectors. Each record is
+ * framed with a length and CRC32 so torn writes are detected on replay, and
+ * sectors are reused in ring order so erase cycles are spread evenly across
+ * the partition. When the log is full the oldest sector is dropped.
+ */
+
+#ifndef FLASH_SPOOL_H
+#define FLASH_SPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/**
+ * @brief Initialize the spool and recover read/write positions from flash
+ * @param partition_label Label of the data partition backing the spool
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the partition is missing
+ */
+esp_err_t flash_spool_init(const char *partition_label);
+
+/**
+ * @brief Append a record to the spool
+ * @param data Record payload
+ * @param len Payload length
+ * @return ESP_OK on success
+ */
+esp_err_t flash_spool_append(const void *data, size_t len);
+
+/**
+ * @brief Read the oldest unconsumed record without removing it
+ * @param buf Output buffer
+ * @param buf_len Output buffer size
+ * @param out_len Length of the record
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the spool is empty
+ */
+esp_err_t flash_spool_read(void *buf, size_t buf_len, size_t *out_len);
+
+/**
+ * @brief Mark the record returned by the last flash_spool_read() as consumed
+ * @return ESP_OK on success
+ */
+esp_err_t flash_spool_consume(void);
+
+/**
+ * @brief Check whether the spool holds unconsumed records
+ * @return true if there is nothing to replay
+ */
+bool flash_spool_is_empty(void);
+
+#endif // FLASH_SPOOL_H
@@ -0,0 +1,417 @@
+/**
+ * @file json_reader.c
+ * @brief In-place streaming JSON tokenizer
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "json_reader.h"
+
+// What may come next; json_reader_t.expect
+enum {
+    EXPECT_VALUE,           // Document start, after ':' or after ',' in an array
+    EXPECT_FIRST_VALUE,     // After '[': a value or ']'
+    EXPECT_KEY,             // After ',' in an object
+    EXPECT_FIRST_KEY,       // After '{': a key or '}'
+    EXPECT_NEXT,            // After a value: ',' or the closing bracket
+    EXPECT_END,             // After the top-level value: nothing
+};
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static void skip_space(json_reader_t *r)
+{
+    while (r->pos < r->len && is_space(r->data[r->pos])) {
+        r->pos++;
+    }
+}
+
+static bool in_object(const json_reader_t *r)
+{
+    return r->depth > 0 && (r->object_mask & (1u << (r->depth - 1))) != 0;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool parse_hex4(const char *p, uint32_t *out)
+{
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        int h = hex_value(p[i]);
+        if (h < 0) {
+            return false;
+        }
+        v = (v << 4) | (uint32_t)h;
+    }
+    *out = v;
+    return true;
+}
+
+/**
+ * Scan a string starting at the opening quote. On success pos is left just
+ * past the closing quote. Control characters and unknown escapes are
+ * rejected.
+ */
+static esp_err_t scan_string(json_reader_t *r, json_token_t *tok)
+{
+    size_t start = ++r->pos;
+
+    while (r->pos < r->len) {
+        char c = r->data[r->pos];
+        if (c == '"') {
+            tok->start = r->data + start;
+            tok->len = r->pos - start;
+            r->pos++;
+            return ESP_OK;
+        }
+        if ((unsigned char)c < 0x20) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        if (c == '\\') {
+            uint32_t cp;
+            char e = r->pos + 1 < r->len ? r->data[r->pos + 1] : '\0';
+            if (e == 'u') {
+                if (r->len - r->pos < 6 || !parse_hex4(r->data + r->pos + 2, &cp)) {
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                r->pos += 6;
+                continue;
+            }
+            if (e == '\0' || strchr("\"\\/bfnrt", e) == NULL) {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            r->pos++;
+        }
+        r->pos++;
+    }
+    return ESP_ERR_INVALID_RESPONSE;
+}
+
+static esp_err_t scan_literal(json_reader_t *r, const char *literal, json_token_type_t type, json_token_t *tok)
+{
+    size_t n = strlen(literal);
+    if (r->len - r->pos < n || memcmp(r->data + r->pos, literal, n) != 0) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    tok->type = type;
+    tok->start = r->data + r->pos;
+    tok->len = n;
+    r->pos += n;
+    return ESP_OK;
+}
+
+static bool next_is(const json_reader_t *r, const char *chars)
+{
+    return r->pos < r->len && r->data[r->pos] != '\0' && strchr(chars, r->data[r->pos]) != NULL;
+}
+
+static size_t scan_digits(json_reader_t *r)
+{
+    size_t start = r->pos;
+    while (next_is(r, "0123456789")) {
+        r->pos++;
+    }
+    return r->pos - start;
+}
+
+// -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+static esp_err_t scan_number(json_reader_t *r, json_token_t *tok)
+{
+    size_t start = r->pos;
+
+    if (next_is(r, "-")) {
+        r->pos++;
+    }
+    if (next_is(r, "0")) {
+        r->pos++;
+    } else if (scan_digits(r) == 0) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    if (next_is(r, ".")) {
+        r->pos++;
+        if (scan_digits(r) == 0) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    if (next_is(r, "eE")) {
+        r->pos++;
+        if (next_is(r, "+-")) {
+            r->pos++;
+        }
+        if (scan_digits(r) == 0) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    tok->type = JSON_TOKEN_NUMBER;
+    tok->start = r->data + start;
+    tok->len = r->pos - start;
+    return ESP_OK;
+}
+
+static esp_err_t push(json_reader_t *r, bool object)
+{
+    if (r->depth >= JSON_READER_MAX_DEPTH) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    if (object) {
+        r->object_mask |= 1u << r->depth;
+    } else {
+        r->object_mask &= ~(1u << r->depth);
+    }
+    r->depth++;
+    r->expect = object ? EXPECT_FIRST_KEY : EXPECT_FIRST_VALUE;
+    return ESP_OK;
+}
+
+static void value_done(json_reader_t *r)
+{
+    r->expect = r->depth == 0 ? EXPECT_END : EXPECT_NEXT;
+}
+
+static esp_err_t pop(json_reader_t *r, bool object)
+{
+    if (r->depth == 0 || in_object(r) != object) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    r->depth--;
+    value_done(r);
+    return ESP_OK;
+}
+
+void json_reader_init(json_reader_t *r, const char *data, size_t len)
+{
+    memset(r, 0, sizeof(*r));
+    r->data = data;
+    r->len = data != NULL ? len : 0;
+}
+
+esp_err_t json_reader_next(json_reader_t *r, json_token_t *tok)
+{
+    skip_space(r);
+    if (r->pos >= r->len) {
+        return r->expect == EXPECT_END ? ESP_ERR_NOT_FOUND : ESP_ERR_INVALID_RESPONSE;
+    }
+    if (r->expect == EXPECT_END) {
+        return ESP_ERR_INVALID_RESPONSE;    // Data after the document
+    }
+
+    char c = r->data[r->pos];
+    if (r->expect == EXPECT_NEXT) {
+        if (c == ',') {
+            r->pos++;
+            r->expect = in_object(r) ? EXPECT_KEY : EXPECT_VALUE;
+            skip_space(r);
+            if (r->pos >= r->len) {
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            c = r->data[r->pos];
+        } else if (c != '}' && c != ']') {
+            return ESP_ERR_INVALID_RESPONSE;    // Missing comma
+        }
+    }
+
+    tok->start = r->data + r->pos;
+    tok->len = 1;
+
+    if (c == '}' || c == ']') {
+        // Only after a value or straight after the opening bracket, so a
+        // trailing comma or a key without a value is an error
+        bool object = c == '}';
+        if (r->expect != EXPECT_NEXT && r->expect != (object ? EXPECT_FIRST_KEY : EXPECT_FIRST_VALUE)) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        r->pos++;
+        tok->type = object ? JSON_TOKEN_OBJECT_END : JSON_TOKEN_ARRAY_END;
+        return pop(r, object);
+    }
+
+    if (r->expect == EXPECT_KEY || r->expect == EXPECT_FIRST_KEY) {
+        // Member name - consume the following ':'
+        if (c != '"' || scan_string(r, tok) != ESP_OK) {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        tok->type = JSON_TOKEN_KEY;
+        skip_space(r);
+        if (r->pos >= r->len || r->data[r->pos] != ':') {
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+        r->pos++;
+        r->expect = EXPECT_VALUE;
+        return ESP_OK;
+    }
+
+    esp_err_t err;
+    switch (c) {
+    case '{':
+        r->pos++;
+        tok->type = JSON_TOKEN_OBJECT_BEGIN;
+        return push(r, true);
+    case '[':
+        r->pos++;
+        tok->type = JSON_TOKEN_ARRAY_BEGIN;
+        return push(r, false);
+    case '"':
+        tok->type = JSON_TOKEN_STRING;
+        err = scan_string(r, tok);
+        break;
+    case 't':
+        err = scan_literal(r, "true", JSON_TOKEN_TRUE, tok);
+        break;
+    case 'f':
+        err = scan_literal(r, "false", JSON_TOKEN_FALSE, tok);
+        break;
+    case 'n':
+        err = scan_literal(r, "null", JSON_TOKEN_NULL, tok);
+        break;
+    default:
+        err = scan_number(r, tok);
+        break;
+    }
+    if (err == ESP_OK) {
+        value_done(r);
+    }
+    return err;
+}
+
+esp_err_t json_reader_skip(json_reader_t *r, const json_token_t *tok)
+{
+    if (tok->type != JSON_TOKEN_OBJECT_BEGIN && tok->type != JSON_TOKEN_ARRAY_BEGIN) {
+        return ESP_OK;
+    }
+
+    // Tokenized rather than bracket-matched, so a skipped subtree is checked
+    // as strictly as the rest of the document
+    uint8_t target = r->depth - 1;
+    json_token_t inner;
+    esp_err_t err;
+    while ((err = json_reader_next(r, &inner)) == ESP_OK) {
+        if (r->depth == target) {
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_INVALID_RESPONSE;
+}
+
+bool json_token_equals(const json_token_t *tok, const char *str)
+{
+    size_t n = strlen(str);
+    return tok->len == n && memcmp(tok->start, str, n) == 0;
+}
+
+esp_err_t json_token_get_string(const json_token_t *tok, char *out, size_t out_len)
+{
+    if (out == NULL || out_len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t o = 0;
+    for (size_t i = 0; i < tok->len; i++) {
+        char utf8[4];
+        size_t n = 1;
+        utf8[0] = tok->start[i];
+
+        if (utf8[0] == '\\' && i + 1 < tok->len) {
+            char e = tok->start[++i];
+            switch (e) {
+            case 'b': utf8[0] = '\b'; break;
+            case 'f': utf8[0] = '\f'; break;
+            case 'n': utf8[0] = '\n'; break;
+            case 'r': utf8[0] = '\r'; break;
+            case 't': utf8[0] = '\t'; break;
+            case 'u': {
+                uint32_t cp;
+                if (i + 4 >= tok->len || !parse_hex4(&tok->start[i + 1], &cp)) {
+                    return ESP_ERR_INVALID_RESPONSE;
+                }
+                i += 4;
+                // Combine a surrogate pair when the low half follows
+                uint32_t low;
+                if (cp >= 0xD800 && cp < 0xDC00 && i + 6 < tok->len &&
+                    tok->start[i + 1] == '\\' && tok->start[i + 2] == 'u' &&
+                    parse_hex4(&tok->start[i + 3], &low) && low >= 0xDC00 && low < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    i += 6;
+                }
+                if (cp < 0x80) {
+                    utf8[0] = (char)cp;
+                } else if (cp < 0x800) {
+                    utf8[0] = (char)(0xC0 | (cp >> 6));
+                    utf8[1] = (char)(0x80 | (cp & 0x3F));
+                    n = 2;
+                } else if (cp < 0x10000) {
+                    utf8[0] = (char)(0xE0 | (cp >> 12));
+                    utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                    utf8[2] = (char)(0x80 | (cp & 0x3F));
+                    n = 3;
+                } else {
+                    utf8[0] = (char)(0xF0 | (cp >> 18));
+                    utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+                    utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                    utf8[3] = (char)(0x80 | (cp & 0x3F));
+                    n = 4;
+                }
+                break;
+            }
+            default:
+                // \" \\ \/ map to themselves
+                utf8[0] = e;
+                break;
+            }
+        }
+
+        if (o + n >= out_len) {
+            out[o] = '\0';
+            return ESP_ERR_INVALID_SIZE;
+        }
+        memcpy(out + o, utf8, n);
+        o += n;
+    }
+    out[o] = '\0';
+    return ESP_OK;
+}
+
+static esp_err_t copy_number(const json_token_t *tok, char *buf, size_t buf_len)
+{
+    if (tok->type != JSON_TOKEN_NUMBER || tok->len == 0 || tok->len >= buf_len) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(buf, tok->start, tok->len);
+    buf[tok->len] = '\0';
+    return ESP_OK;
+}
+
+esp_err_t json_token_get_double(const json_token_t *tok, double *out)
+{
+    char num[32];
+    esp_err_t err = copy_number(tok, num, sizeof(num));
+    if (err != ESP_OK) {
+        return err;
+    }
+    *out = strtod(num, NULL);
+    return ESP_OK;
+}
+
+esp_err_t json_token_get_int(const json_token_t *tok, int64_t *out)
+{
+    char num[32];
+    esp_err_t err = copy_number(tok, num, sizeof(num));
+    if (err != ESP_OK) {
+        return err;
+    }
+    // Exponent or fraction: go through strtod
+    if (strpbrk(num, ".eE") != NULL) {
+        *out = (int64_t)strtod(num, NULL);
+    } else {
+        *out = strtoll(num, NULL, 10);
+    }
+    return ESP_OK;
+}
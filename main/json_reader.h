@@ -0,0 +1,142 @@
+/**
+ * @file json_reader.h
+ * @brief In-place streaming JSON tokenizer
+ *
+ * Pull tokenizer that works directly on a length-bounded buffer (which does
+ * not need to be NUL-terminated). Tokens reference the input buffer, nothing
+ * is copied or allocated, and unwanted subtrees can be skipped in a single
+ * linear scan.
+ *
+ * The input is checked against the JSON grammar as it is read, skipped
+ * subtrees included: missing or extra commas, malformed numbers, strings
+ * and literals, and data after the document are all errors. A document
+ * read up to ESP_ERR_NOT_FOUND, skipping what is not needed, has been
+ * validated in full.
+ */
+
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/**
+ * @brief Maximum object/array nesting depth
+ */
+#define JSON_READER_MAX_DEPTH 32
+
+/**
+ * @brief Token types
+ */
+typedef enum {
+    JSON_TOKEN_OBJECT_BEGIN,
+    JSON_TOKEN_OBJECT_END,
+    JSON_TOKEN_ARRAY_BEGIN,
+    JSON_TOKEN_ARRAY_END,
+    JSON_TOKEN_KEY,     ///< Object member name
+    JSON_TOKEN_STRING,
+    JSON_TOKEN_NUMBER,
+    JSON_TOKEN_TRUE,
+    JSON_TOKEN_FALSE,
+    JSON_TOKEN_NULL,
+} json_token_type_t;
+
+/**
+ * @brief Token referencing the input buffer
+ *
+ * For keys and strings, start/len cover the raw contents between the quotes
+ * (escape sequences are left in place).
+ */
+typedef struct {
+    json_token_type_t type;
+    const char *start;
+    size_t len;
+} json_token_t;
+
+/**
+ * @brief Tokenizer state
+ */
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t pos;
+    uint8_t depth;
+    uint32_t object_mask;   ///< Bit n set when level n is an object
+    uint8_t expect;         ///< What the grammar allows next, internal
+} json_reader_t;
+
+/**
+ * @brief Initialize a tokenizer over a buffer
+ * @param r Reader
+ * @param data Input buffer
+ * @param len Input length
+ */
+void json_reader_init(json_reader_t *r, const char *data, size_t len);
+
+/**
+ * @brief Read the next token
+ * @param r Reader
+ * @param tok Output token
+ * @return ESP_OK on success, ESP_ERR_NOT_FOUND at the end of a complete
+ *         document, ESP_ERR_INVALID_RESPONSE on malformed or truncated input
+ */
+esp_err_t json_reader_next(json_reader_t *r, json_token_t *tok);
+
+/**
+ * @brief Skip the value that starts with tok
+ *
+ * For scalars this is a no-op; for objects and arrays the input is read and
+ * validated up to the matching closing bracket without returning tokens.
+ *
+ * @param r Reader
+ * @param tok Token returned by the last json_reader_next() call
+ * @return ESP_OK on success, ESP_ERR_INVALID_RESPONSE on malformed input
+ */
+esp_err_t json_reader_skip(json_reader_t *r, const json_token_t *tok);
+
+/**
+ * @brief Get the current nesting depth
+ * @param r Reader
+ * @return Number of open objects/arrays
+ */
+static inline uint8_t json_reader_depth(const json_reader_t *r)
+{
+    return r->depth;
+}
+
+/**
+ * @brief Compare a key or string token with a NUL-terminated string
+ * @param tok Token
+ * @param str String to compare against
+ * @return true if equal (escape sequences are not decoded)
+ */
+bool json_token_equals(const json_token_t *tok, const char *str);
+
+/**
+ * @brief Decode a string token into a buffer
+ * @param tok Key or string token
+ * @param out Output buffer (always NUL-terminated)
+ * @param out_len Output buffer size
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if truncated
+ */
+esp_err_t json_token_get_string(const json_token_t *tok, char *out, size_t out_len);
+
+/**
+ * @brief Convert a number token to a double
+ * @param tok Number token
+ * @param out Parsed value
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if not a number token
+ */
+esp_err_t json_token_get_double(const json_token_t *tok, double *out);
+
+/**
+ * @brief Convert a number token to a 64-bit integer
+ * @param tok Number token
+ * @param out Parsed value (fractional part truncated)
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG if not a number token
+ */
+esp_err_t json_token_get_int(const json_token_t *tok, int64_t *out);
+
+#endif // JSON_READER_H
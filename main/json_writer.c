@@ -0,0 +1,228 @@
+/**
+ * @file json_writer.c
+ * @brief Zero-allocation streaming JSON writer
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "json_writer.h"
+
+static void put_bytes(json_writer_t *w, const char *data, size_t len)
+{
+    if (w->overflow) {
+        return;
+    }
+    // Always keep room for the terminating NUL
+    if (w->size == 0 || len > w->size - 1 - w->len) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+static void put_char(json_writer_t *w, char c)
+{
+    put_bytes(w, &c, 1);
+}
+
+static void put_escaped(json_writer_t *w, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = str;
+
+    put_char(w, '"');
+    for (const char *p = str; *p != '\0'; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        // Flush the unescaped run before this character
+        put_bytes(w, run, p - run);
+        run = p + 1;
+
+        switch (c) {
+        case '"':  put_bytes(w, "\\\"", 2); break;
+        case '\\': put_bytes(w, "\\\\", 2); break;
+        case '\b': put_bytes(w, "\\b", 2); break;
+        case '\f': put_bytes(w, "\\f", 2); break;
+        case '\n': put_bytes(w, "\\n", 2); break;
+        case '\r': put_bytes(w, "\\r", 2); break;
+        case '\t': put_bytes(w, "\\t", 2); break;
+        default: {
+            char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0x0F]};
+            put_bytes(w, esc, sizeof(esc));
+            break;
+        }
+        }
+    }
+    put_bytes(w, run, strlen(run));
+    put_char(w, '"');
+}
+
+/**
+ * Emit the separator and member name that precede every value.
+ */
+static void begin_value(json_writer_t *w, const char *key)
+{
+    if (w->depth > 0) {
+        if (w->has_items[w->depth - 1]) {
+            put_char(w, ',');
+        }
+        w->has_items[w->depth - 1] = true;
+    }
+    if (key != NULL) {
+        put_escaped(w, key);
+        put_char(w, ':');
+    }
+}
+
+static void begin_container(json_writer_t *w, const char *key, char open)
+{
+    begin_value(w, key);
+    if (w->depth >= JSON_WRITER_MAX_DEPTH) {
+        // Treat excessive nesting like running out of space
+        w->overflow = true;
+        return;
+    }
+    put_char(w, open);
+    w->has_items[w->depth++] = false;
+}
+
+static void end_container(json_writer_t *w, char close)
+{
+    if (w->depth == 0) {
+        w->overflow = true;
+        return;
+    }
+    w->depth--;
+    put_char(w, close);
+}
+
+static void put_uint(json_writer_t *w, uint64_t value)
+{
+    char digits[20];
+    size_t n = 0;
+
+    do {
+        digits[sizeof(digits) - 1 - n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    put_bytes(w, &digits[sizeof(digits) - n], n);
+}
+
+void json_writer_init(json_writer_t *w, char *buf, size_t size)
+{
+    memset(w, 0, sizeof(*w));
+    w->buf = buf;
+    w->size = buf != NULL ? size : 0;
+    if (w->size > 0) {
+        w->buf[0] = '\0';
+    }
+}
+
+void json_writer_begin_object(json_writer_t *w, const char *key)
+{
+    begin_container(w, key, '{');
+}
+
+void json_writer_end_object(json_writer_t *w)
+{
+    end_container(w, '}');
+}
+
+void json_writer_begin_array(json_writer_t *w, const char *key)
+{
+    begin_container(w, key, '[');
+}
+
+void json_writer_end_array(json_writer_t *w)
+{
+    end_container(w, ']');
+}
+
+void json_writer_add_string(json_writer_t *w, const char *key, const char *value)
+{
+    if (value == NULL) {
+        json_writer_add_null(w, key);
+        return;
+    }
+    begin_value(w, key);
+    put_escaped(w, value);
+}
+
+void json_writer_add_int(json_writer_t *w, const char *key, int64_t value)
+{
+    begin_value(w, key);
+    if (value < 0) {
+        put_char(w, '-');
+        put_uint(w, (uint64_t)0 - (uint64_t)value);
+    } else {
+        put_uint(w, (uint64_t)value);
+    }
+}
+
+void json_writer_add_uint(json_writer_t *w, const char *key, uint64_t value)
+{
+    begin_value(w, key);
+    put_uint(w, value);
+}
+
+void json_writer_add_double(json_writer_t *w, const char *key, double value)
+{
+    if (!isfinite(value)) {
+        json_writer_add_null(w, key);
+        return;
+    }
+    // Shortest of the two that reads back as the same double; 15 digits
+    // keeps 0.1 as 0.1, 17 always round-trips
+    char num[32];
+    int len = snprintf(num, sizeof(num), "%.15g", value);
+    if (strtod(num, NULL) != value) {
+        len = snprintf(num, sizeof(num), "%.17g", value);
+    }
+    begin_value(w, key);
+    put_bytes(w, num, len > 0 ? (size_t)len : 0);
+}
+
+void json_writer_add_bool(json_writer_t *w, const char *key, bool value)
+{
+    begin_value(w, key);
+    if (value) {
+        put_bytes(w, "true", 4);
+    } else {
+        put_bytes(w, "false", 5);
+    }
+}
+
+void json_writer_add_null(json_writer_t *w, const char *key)
+{
+    begin_value(w, key);
+    put_bytes(w, "null", 4);
+}
+
+void json_writer_add_raw(json_writer_t *w, const char *key, const char *raw, size_t raw_len)
+{
+    begin_value(w, key);
+    put_bytes(w, raw, raw_len);
+}
+
+esp_err_t json_writer_finish(json_writer_t *w, size_t *out_len)
+{
+    if (w->size > 0) {
+        w->buf[w->len] = '\0';
+    }
+    if (w->overflow) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (w->depth != 0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (out_len != NULL) {
+        *out_len = w->len;
+    }
+    return ESP_OK;
+}
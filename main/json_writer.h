@@ -0,0 +1,140 @@
+/**
+ * @file json_writer.h
+ * @brief Zero-allocation streaming JSON writer
+ *
+ * Serializes compact JSON straight into a caller-supplied buffer. The writer
+ * never allocates; once the buffer is exhausted it latches an overflow flag
+ * and json_writer_finish() reports the failure. The writer state is a plain
+ * struct, so a caller can snapshot it by value and restore it to roll back a
+ * partially written element.
+ */
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/**
+ * @brief Maximum object/array nesting depth
+ */
+#define JSON_WRITER_MAX_DEPTH 8
+
+/**
+ * @brief JSON writer state
+ */
+typedef struct {
+    char *buf;                              ///< Output buffer
+    size_t size;                            ///< Output buffer size
+    size_t len;                             ///< Bytes written (excluding NUL)
+    bool overflow;                          ///< Buffer exhausted
+    uint8_t depth;                          ///< Current nesting depth
+    bool has_items[JSON_WRITER_MAX_DEPTH];  ///< Container already has members
+} json_writer_t;
+
+/**
+ * @brief Initialize a writer over a buffer
+ * @param w Writer
+ * @param buf Output buffer
+ * @param size Output buffer size
+ */
+void json_writer_init(json_writer_t *w, char *buf, size_t size);
+
+/**
+ * @brief Open an object
+ * @param w Writer
+ * @param key Member name, or NULL at the root or inside an array
+ */
+void json_writer_begin_object(json_writer_t *w, const char *key);
+
+/**
+ * @brief Close the innermost object
+ * @param w Writer
+ */
+void json_writer_end_object(json_writer_t *w);
+
+/**
+ * @brief Open an array
+ * @param w Writer
+ * @param key Member name, or NULL at the root or inside an array
+ */
+void json_writer_begin_array(json_writer_t *w, const char *key);
+
+/**
+ * @brief Close the innermost array
+ * @param w Writer
+ */
+void json_writer_end_array(json_writer_t *w);
+
+/**
+ * @brief Add an escaped string value
+ * @param w Writer
+ * @param key Member name, or NULL inside an array
+ * @param value NUL-terminated string
+ */
+void json_writer_add_string(json_writer_t *w, const char *key, const char *value);
+
+/**
+ * @brief Add a signed integer value
+ * @param w Writer
+ * @param key Member name, or NULL inside an array
+ * @param value Value
+ */
+void json_writer_add_int(json_writer_t *w, const char *key, int64_t value);
+
+/**
+ * @brief Add an unsigned integer value
+ * @param w Writer
+ * @param key Member name, or NULL inside an array
+ * @param value Value
+ */
+void json_writer_add_uint(json_writer_t *w, const char *key, uint64_t value);
+
+/**
+ * @brief Add a floating point value (non-finite values are written as null)
+ *
+ * Written with enough digits to read back as the same double, so epoch-ms
+ * timestamps and large counters are exact.
+ *
+ * @param w Writer
+ * @param key Member name, or NULL inside an array
+ * @param value Value
+ */
+void json_writer_add_double(json_writer_t *w, const char *key, double value);
+
+/**
+ * @brief Add a boolean value
+ * @param w Writer
+ * @param key Member name, or NULL inside an array
+ * @param value Value
+ */
+void json_writer_add_bool(json_writer_t *w, const char *key, bool value);
+
+/**
+ * @brief Add a null value
+ * @param w Writer
+ * @param key Member name, or NULL inside an array
+ */
+void json_writer_add_null(json_writer_t *w, const char *key);
+
+/**
+ * @brief Add a pre-encoded JSON value verbatim
+ * @param w Writer
+ * @param key Member name, or NULL inside an array
+ * @param raw Encoded JSON value
+ * @param raw_len Length of the encoded value
+ */
+void json_writer_add_raw(json_writer_t *w, const char *key, const char *raw, size_t raw_len);
+
+/**
+ * @brief Finish the document and NUL-terminate the buffer
+ * @param w Writer
+ * @param out_len Document length (excluding NUL), may be NULL
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the buffer overflowed,
+ *         ESP_ERR_INVALID_STATE if containers are left open
+ */
+esp_err_t json_writer_finish(json_writer_t *w, size_t *out_len);
+
+#endif // JSON_WRITER_H
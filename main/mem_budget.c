@@ -0,0 +1,173 @@
+/**
+ * @file mem_budget.c
+ * @brief Tagged heap allocations with placement and per-module accounting
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_memory_utils.h"
+#include "aws_iot_config.h"
+#include "mem_budget.h"
+
+static const char *TAG = "MEM_BUDGET";
+
+#define MEM_INTERNAL_RESERVE CONFIG_AWS_IOT_MEM_INTERNAL_RESERVE
+
+#define CAPS_INTERNAL (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define CAPS_DMA (MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA | MALLOC_CAP_8BIT)
+#define CAPS_SPIRAM (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+
+typedef struct {
+    size_t bytes;           ///< Live bytes, as allocated by the heap
+    size_t peak;
+    size_t psram;           ///< Live bytes in PSRAM
+    uint32_t failed;
+} tag_stats_t;
+
+static const char *const tag_names[MEM_TAG_COUNT] = {
+    [MEM_TAG_CERTS] = "certs",
+    [MEM_TAG_SHADOW] = "shadow",
+    [MEM_TAG_REASSEMBLY] = "reassembly",
+    [MEM_TAG_PUBLISH] = "publish",
+};
+
+static tag_stats_t tags[MEM_TAG_COUNT];
+static uint32_t stat_fallback;
+static portMUX_TYPE budget_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void *place(size_t size, mem_placement_t placement, bool *fallback)
+{
+    *fallback = false;
+    switch (placement) {
+    case MEM_PLACE_DMA:
+        return heap_caps_malloc(size, CAPS_DMA);
+    case MEM_PLACE_SPIRAM: {
+        void *ptr = heap_caps_malloc(size, CAPS_SPIRAM);
+        if (ptr != NULL) {
+            return ptr;
+        }
+        // The reserve is what WiFi and a TLS handshake need at their peak
+        size_t free_internal = heap_caps_get_free_size(CAPS_INTERNAL);
+        if (free_internal < size || free_internal - size < MEM_INTERNAL_RESERVE) {
+            return NULL;
+        }
+        *fallback = true;
+        return heap_caps_malloc(size, CAPS_INTERNAL);
+    }
+    case MEM_PLACE_INTERNAL:
+    default:
+        return heap_caps_malloc(size, CAPS_INTERNAL);
+    }
+}
+
+void *mem_budget_alloc(mem_tag_t tag, size_t size, mem_placement_t placement)
+{
+    if (tag >= MEM_TAG_COUNT || size == 0) {
+        return NULL;
+    }
+
+    bool fallback;
+    void *ptr = place(size, placement, &fallback);
+    if (ptr == NULL) {
+        portENTER_CRITICAL(&budget_lock);
+        tags[tag].failed++;
+        portEXIT_CRITICAL(&budget_lock);
+        ESP_LOGE(TAG, "%s: failed to allocate %u bytes (internal free %u, largest %u)",
+                 tag_names[tag], (unsigned)size,
+                 (unsigned)heap_caps_get_free_size(CAPS_INTERNAL),
+                 (unsigned)heap_caps_get_largest_free_block(CAPS_INTERNAL));
+        return NULL;
+    }
+
+    size_t allocated = heap_caps_get_allocated_size(ptr);
+    bool external = esp_ptr_external_ram(ptr);
+
+    portENTER_CRITICAL(&budget_lock);
+    tag_stats_t *stats = &tags[tag];
+    stats->bytes += allocated;
+    if (external) {
+        stats->psram += allocated;
+    }
+    if (stats->bytes > stats->peak) {
+        stats->peak = stats->bytes;
+    }
+    if (fallback) {
+        stat_fallback++;
+    }
+    portEXIT_CRITICAL(&budget_lock);
+
+    if (fallback) {
+        ESP_LOGW(TAG, "%s: %u bytes placed in internal RAM, PSRAM unavailable",
+                 tag_names[tag], (unsigned)size);
+    }
+    return ptr;
+}
+
+void mem_budget_free(mem_tag_t tag, void *ptr)
+{
+    if (ptr == NULL || tag >= MEM_TAG_COUNT) {
+        return;
+    }
+
+    size_t allocated = heap_caps_get_allocated_size(ptr);
+    bool external = esp_ptr_external_ram(ptr);
+
+    portENTER_CRITICAL(&budget_lock);
+    tag_stats_t *stats = &tags[tag];
+    stats->bytes = stats->bytes > allocated ? stats->bytes - allocated : 0;
+    if (external) {
+        stats->psram = stats->psram > allocated ? stats->psram - allocated : 0;
+    }
+    portEXIT_CRITICAL(&budget_lock);
+
+    heap_caps_free(ptr);
+}
+
+size_t mem_budget_largest_free_internal(void)
+{
+    return heap_caps_get_largest_free_block(CAPS_INTERNAL);
+}
+
+uint32_t mem_budget_fragmentation_internal(void)
+{
+    size_t free_bytes = heap_caps_get_free_size(CAPS_INTERNAL);
+    size_t largest = heap_caps_get_largest_free_block(CAPS_INTERNAL);
+
+    if (free_bytes == 0 || largest >= free_bytes) {
+        return 0;
+    }
+    return 100 - (uint32_t)((uint64_t)largest * 100 / free_bytes);
+}
+
+void mem_budget_write_json(json_writer_t *w, const char *key)
+{
+    tag_stats_t snapshot[MEM_TAG_COUNT];
+    uint32_t fallback;
+
+    portENTER_CRITICAL(&budget_lock);
+    memcpy(snapshot, tags, sizeof(snapshot));
+    fallback = stat_fallback;
+    portEXIT_CRITICAL(&budget_lock);
+
+    json_writer_begin_object(w, key);
+    json_writer_add_uint(w, "free", heap_caps_get_free_size(CAPS_INTERNAL));
+    json_writer_add_uint(w, "min_free", heap_caps_get_minimum_free_size(CAPS_INTERNAL));
+    json_writer_add_uint(w, "largest", mem_budget_largest_free_internal());
+    json_writer_add_uint(w, "frag", mem_budget_fragmentation_internal());
+    json_writer_add_uint(w, "psram_free", heap_caps_get_free_size(CAPS_SPIRAM));
+    json_writer_add_uint(w, "psram_min_free", heap_caps_get_minimum_free_size(CAPS_SPIRAM));
+    json_writer_add_uint(w, "fallback", fallback);
+    json_writer_begin_object(w, "tags");
+    for (size_t i = 0; i < MEM_TAG_COUNT; i++) {
+        json_writer_begin_object(w, tag_names[i]);
+        json_writer_add_uint(w, "bytes", snapshot[i].bytes);
+        json_writer_add_uint(w, "peak", snapshot[i].peak);
+        json_writer_add_uint(w, "psram", snapshot[i].psram);
+        json_writer_add_uint(w, "failed", snapshot[i].failed);
+        json_writer_end_object(w);
+    }
+    json_writer_end_object(w);
+    json_writer_end_object(w);
+}
@@ -0,0 +1,92 @@
+/**
+ * @file mem_budget.h
+ * @brief Tagged heap allocations with placement and per-module accounting
+ *
+ * Long-lived buffers are allocated through here with the tag of the module
+ * that owns them and a placement. Buffers that only tolerate being slow go
+ * to PSRAM, which keeps internal RAM for WiFi, lwIP and the TLS handshake;
+ * hot or DMA buffers stay internal. Usage and high-water marks are tracked
+ * per tag, so a leak shows up as one tag creeping up in the metrics report.
+ *
+ * Hot-path buffers with a fixed size (compressor tables, batch buffers)
+ * stay static and internal. esp-mqtt, esp-tls and the WiFi driver allocate
+ * on their own and are only visible in the heap totals.
+ */
+
+#ifndef MEM_BUDGET_H
+#define MEM_BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "json_writer.h"
+
+/**
+ * @brief Owner of an allocation
+ */
+typedef enum {
+    MEM_TAG_CERTS,          ///< PEM credentials loaded from NVS or provisioned
+    MEM_TAG_SHADOW,         ///< Reported-state document buffer
+    MEM_TAG_REASSEMBLY,     ///< Inbound MQTT reassembly arena
+    MEM_TAG_PUBLISH,        ///< Publish manager payload slots
+    MEM_TAG_COUNT,
+} mem_tag_t;
+
+/**
+ * @brief Where an allocation may live
+ */
+typedef enum {
+    MEM_PLACE_INTERNAL,     ///< Internal RAM only (hot paths, secrets)
+    MEM_PLACE_DMA,          ///< DMA-capable internal RAM
+    MEM_PLACE_SPIRAM,       ///< PSRAM, or internal RAM while it keeps its reserve
+} mem_placement_t;
+
+/**
+ * @brief Allocate a block on behalf of a module
+ *
+ * MEM_PLACE_SPIRAM falls back to internal RAM without PSRAM (or once it is
+ * full) only if at least CONFIG_AWS_IOT_MEM_INTERNAL_RESERVE bytes of
+ * internal RAM would remain free afterwards. Safe to call from any task.
+ *
+ * @param tag Owning module
+ * @param size Size in bytes
+ * @param placement Placement
+ * @return Block, NULL if it could not be placed
+ */
+void *mem_budget_alloc(mem_tag_t tag, size_t size, mem_placement_t placement);
+
+/**
+ * @brief Free a block returned by mem_budget_alloc()
+ * @param tag Tag the block was allocated with
+ * @param ptr Block, may be NULL
+ */
+void mem_budget_free(mem_tag_t tag, void *ptr);
+
+/**
+ * @brief Get the largest block that can be allocated from internal RAM
+ * @return Size in bytes
+ */
+size_t mem_budget_largest_free_internal(void);
+
+/**
+ * @brief Get internal RAM fragmentation
+ * @return 100 - largest free block * 100 / free bytes, in percent (0 when
+ *         all free memory is one block)
+ */
+uint32_t mem_budget_fragmentation_internal(void);
+
+/**
+ * @brief Write heap and per-tag usage as a JSON object member
+ *
+ * Format: {"free":n,"min_free":n,"largest":n,"frag":n,"psram_free":n,
+ * "psram_min_free":n,"fallback":n,"tags":{"<tag>":{"bytes":n,"peak":n,
+ * "psram":n,"failed":n},...}}. The first four cover internal RAM; fallback
+ * counts PSRAM-placed blocks that went to internal RAM. Per-tag peaks and
+ * failure counts are kept since boot, not reset per report.
+ *
+ * @param w Writer positioned inside an object
+ * @param key Member name
+ */
+void mem_budget_write_json(json_writer_t *w, const char *key);
+
+#endif // MEM_BUDGET_H
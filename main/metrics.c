@@ -0,0 +1,265 @@
+/**
+ * @file metrics.c
+ * @brief Hot-path latency histograms
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "metrics.h"
+
+#include "aws_iot_config.h"
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_METRICS
+#include "app_log.h"
+
+static const char *TAG = "METRICS";
+
+// Publishes awaiting PUBACK; must be a power of two
+#define METRICS_PENDING_SLOTS 32
+// Entries older than this (lost on disconnect, orphaned PUBACKs) are reused
+#define METRICS_PENDING_MAX_AGE_US (120LL * 1000 * 1000)
+
+typedef struct {
+    uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    int64_t max_us;
+} histogram_t;
+
+typedef struct {
+    uint16_t msg_id;    ///< 0 marks an empty slot
+    bool acked;         ///< PUBACK seen before the publish was noted
+    int64_t time_us;    ///< Publish start, or PUBACK time if acked
+} pending_publish_t;
+
+static const char *const histogram_names[METRICS_HISTOGRAM_COUNT] = {
+    [METRICS_PUBLISH_RTT] = "publish_rtt",
+    [METRICS_DISPATCH_LATENCY] = "dispatch",
+    [METRICS_COMMAND_QUEUE] = "command_queue",
+    [METRICS_SHADOW_ROUND_TRIP] = "shadow_rtt",
+    [METRICS_CONNECT_TIME] = "connect",
+    [METRICS_WIFI_RECONNECT] = "wifi_reconnect",
+    [METRICS_COMPRESS_TIME] = "compress",
+};
+
+static histogram_t histograms[METRICS_HISTOGRAM_COUNT];
+static int64_t span_start_us[METRICS_HISTOGRAM_COUNT];
+static pending_publish_t pending[METRICS_PENDING_SLOTS];
+static uint32_t pending_dropped = 0;
+static portMUX_TYPE metrics_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static size_t bucket_index(int64_t latency_us)
+{
+    if (latency_us <= 0) {
+        return 0;
+    }
+    if (latency_us >= (1LL << (METRICS_HISTOGRAM_BUCKETS - 1))) {
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    }
+    return 32 - __builtin_clz((uint32_t)latency_us);
+}
+
+// Caller holds metrics_lock
+static void record_locked(metrics_histogram_t id, int64_t latency_us)
+{
+    histogram_t *h = &histograms[id];
+    h->buckets[bucket_index(latency_us)]++;
+    h->count++;
+    if (latency_us > h->max_us) {
+        h->max_us = latency_us;
+    }
+}
+
+void metrics_record(metrics_histogram_t histogram, int64_t latency_us)
+{
+    if (histogram >= METRICS_HISTOGRAM_COUNT) {
+        return;
+    }
+    portENTER_CRITICAL(&metrics_lock);
+    record_locked(histogram, latency_us);
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+void metrics_span_begin(metrics_histogram_t histogram)
+{
+    if (histogram >= METRICS_HISTOGRAM_COUNT) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&metrics_lock);
+    span_start_us[histogram] = now;
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+void metrics_span_end(metrics_histogram_t histogram)
+{
+    if (histogram >= METRICS_HISTOGRAM_COUNT) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&metrics_lock);
+    if (span_start_us[histogram] != 0) {
+        record_locked(histogram, now - span_start_us[histogram]);
+        span_start_us[histogram] = 0;
+    }
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+static size_t pending_home(uint16_t msg_id)
+{
+    return (msg_id * 2654435761u) & (METRICS_PENDING_SLOTS - 1);
+}
+
+// Linear probing; returns the slot holding msg_id or -1
+static int pending_find(uint16_t msg_id)
+{
+    size_t i = pending_home(msg_id);
+    for (size_t n = 0; n < METRICS_PENDING_SLOTS; n++) {
+        if (pending[i].msg_id == 0) {
+            return -1;
+        }
+        if (pending[i].msg_id == msg_id) {
+            return i;
+        }
+        i = (i + 1) & (METRICS_PENDING_SLOTS - 1);
+    }
+    return -1;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+static void pending_remove(size_t i)
+{
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & (METRICS_PENDING_SLOTS - 1);
+        if (pending[j].msg_id == 0) {
+            break;
+        }
+        size_t k = pending_home(pending[j].msg_id);
+        bool movable = (i <= j) ? (k <= i || k > j) : (k <= i && k > j);
+        if (movable) {
+            pending[i] = pending[j];
+            i = j;
+        }
+    }
+    pending[i].msg_id = 0;
+}
+
+static void pending_insert(uint16_t msg_id, bool acked, int64_t time_us, int64_t now_us)
+{
+    size_t i = pending_home(msg_id);
+    for (size_t n = 0; n < METRICS_PENDING_SLOTS; n++) {
+        // A stale slot stays occupied, so reusing it in place keeps other chains valid
+        if (pending[i].msg_id == 0 || now_us - pending[i].time_us > METRICS_PENDING_MAX_AGE_US) {
+            pending[i] = (pending_publish_t) {
+                .msg_id = msg_id,
+                .acked = acked,
+                .time_us = time_us,
+            };
+            return;
+        }
+        i = (i + 1) & (METRICS_PENDING_SLOTS - 1);
+    }
+    pending_dropped++;
+}
+
+void metrics_publish_sent(int msg_id, int64_t start_us)
+{
+    if (msg_id <= 0) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&metrics_lock);
+    int i = pending_find(msg_id);
+    if (i < 0) {
+        pending_insert(msg_id, false, start_us, now);
+    } else if (pending[i].acked) {
+        record_locked(METRICS_PUBLISH_RTT, pending[i].time_us - start_us);
+        pending_remove(i);
+    } else {
+        // msg_id reused after wrapping; the old publish was never acked
+        pending[i].time_us = start_us;
+    }
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+void metrics_publish_acked(int msg_id)
+{
+    if (msg_id <= 0) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&metrics_lock);
+    int i = pending_find(msg_id);
+    if (i < 0) {
+        pending_insert(msg_id, true, now, now);
+    } else if (!pending[i].acked) {
+        record_locked(METRICS_PUBLISH_RTT, now - pending[i].time_us);
+        pending_remove(i);
+    }
+    portEXIT_CRITICAL(&metrics_lock);
+}
+
+static int64_t percentile_us(const histogram_t *h, uint32_t permille)
+{
+    uint32_t target = (uint32_t)(((uint64_t)h->count * permille + 999) / 1000);
+    uint32_t seen = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            int64_t upper = 1LL << i;
+            return upper < h->max_us ? upper : h->max_us;
+        }
+    }
+    return h->max_us;
+}
+
+static void write_histogram(json_writer_t *w, const char *key, const histogram_t *h)
+{
+    size_t used = 0;
+    for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+        if (h->buckets[i] != 0) {
+            used = i + 1;
+        }
+    }
+
+    json_writer_begin_object(w, key);
+    json_writer_add_uint(w, "count", h->count);
+    if (h->count > 0) {
+        json_writer_add_int(w, "max_us", h->max_us);
+        json_writer_add_int(w, "p50_us", percentile_us(h, 500));
+        json_writer_add_int(w, "p90_us", percentile_us(h, 900));
+        json_writer_add_int(w, "p99_us", percentile_us(h, 990));
+        json_writer_begin_array(w, "buckets");
+        for (size_t i = 0; i < used; i++) {
+            json_writer_add_uint(w, NULL, h->buckets[i]);
+        }
+        json_writer_end_array(w);
+    }
+    json_writer_end_object(w);
+}
+
+void metrics_write_json(json_writer_t *w, const char *key, bool reset)
+{
+    histogram_t snapshot[METRICS_HISTOGRAM_COUNT];
+    uint32_t dropped;
+
+    portENTER_CRITICAL(&metrics_lock);
+    memcpy(snapshot, histograms, sizeof(snapshot));
+    dropped = pending_dropped;
+    if (reset) {
+        memset(histograms, 0, sizeof(histograms));
+        pending_dropped = 0;
+    }
+    portEXIT_CRITICAL(&metrics_lock);
+
+    json_writer_begin_object(w, key);
+    for (size_t i = 0; i < METRICS_HISTOGRAM_COUNT; i++) {
+        write_histogram(w, histogram_names[i], &snapshot[i]);
+    }
+    json_writer_add_uint(w, "untracked_publishes", dropped);
+    json_writer_end_object(w);
+
+    if (dropped > 0) {
+        ESP_LOGW(TAG, "%u publishes not tracked, pending table full", (unsigned)dropped);
+    }
+}
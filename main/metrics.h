@@ -0,0 +1,92 @@
+/**
+ * @file metrics.h
+ * @brief Hot-path latency histograms
+ *
+ * Latencies are recorded into fixed log2 buckets (bucket i counts samples
+ * below 2^i microseconds), so recording is a handful of instructions under a
+ * spinlock and never allocates. QoS 1 publishes are matched to their PUBACK
+ * by msg_id in a small open-addressed table to measure publish round trips.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "json_writer.h"
+
+/**
+ * @brief Number of histogram buckets; the last one is open-ended (>= 2^22 us)
+ */
+#define METRICS_HISTOGRAM_BUCKETS 24
+
+/**
+ * @brief Recorded latencies
+ */
+typedef enum {
+    METRICS_PUBLISH_RTT,        ///< QoS 1 publish to PUBACK
+    METRICS_DISPATCH_LATENCY,   ///< First inbound fragment to handler return
+    METRICS_COMMAND_QUEUE,      ///< Command received to worker start
+    METRICS_SHADOW_ROUND_TRIP,  ///< Shadow request's last send to its accepted/rejected response
+    METRICS_CONNECT_TIME,       ///< Connect start to CONNACK (DNS, TCP, TLS handshake, MQTT CONNECT); successful connects only
+    METRICS_WIFI_RECONNECT,     ///< WiFi link lost (or station start) to IP address
+    METRICS_COMPRESS_TIME,      ///< CPU time of one payload_compress() call
+    METRICS_HISTOGRAM_COUNT,
+} metrics_histogram_t;
+
+/**
+ * @brief Record a latency sample
+ * @param histogram Target histogram
+ * @param latency_us Latency in microseconds
+ */
+void metrics_record(metrics_histogram_t histogram, int64_t latency_us);
+
+/**
+ * @brief Start timing a request/response span
+ *
+ * Only one span per histogram is tracked; a new start while one is pending
+ * restarts it.
+ *
+ * @param histogram Histogram the span is recorded into
+ */
+void metrics_span_begin(metrics_histogram_t histogram);
+
+/**
+ * @brief Finish the pending span, if any, and record its duration
+ * @param histogram Histogram passed to metrics_span_begin()
+ */
+void metrics_span_end(metrics_histogram_t histogram);
+
+/**
+ * @brief Note a QoS 1 publish
+ *
+ * The PUBACK may be processed before the publishing task gets here; both
+ * orders are matched.
+ *
+ * @param msg_id Message id returned by the MQTT client (ignored if <= 0)
+ * @param start_us esp_timer time taken just before the publish call
+ */
+void metrics_publish_sent(int msg_id, int64_t start_us);
+
+/**
+ * @brief Note a PUBACK (MQTT_EVENT_PUBLISHED)
+ * @param msg_id Acknowledged message id
+ */
+void metrics_publish_acked(int msg_id);
+
+/**
+ * @brief Write all histograms as a JSON object member
+ *
+ * Each histogram is written as
+ * {"count":n,"max_us":..,"p50_us":..,"p90_us":..,"p99_us":..,"buckets":[...]},
+ * percentiles being bucket upper bounds and buckets trimmed after the last
+ * non-empty one.
+ *
+ * @param w Writer positioned inside an object
+ * @param key Member name
+ * @param reset Clear the histograms after taking the snapshot
+ */
+void metrics_write_json(json_writer_t *w, const char *key, bool reset);
+
+#endif // METRICS_H
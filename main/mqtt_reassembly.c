@@ -0,0 +1,134 @@
+/**
+ * @file mqtt_reassembly.c
+ * @brief Reassembly of fragmented MQTT_EVENT_DATA payloads
+ */
+
+#include <string.h>
+#include "esp_timer.h"
+#include "mem_budget.h"
+#include "mqtt_reassembly.h"
+
+#include "aws_iot_config.h"
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_REASSEMBLY
+#include "app_log.h"
+
+static const char *TAG = "MQTT_REASSEMBLY";
+
+#define REASSEMBLY_MAX_TOPIC_LEN 256
+
+static char *arena = NULL;
+static size_t arena_size = 0;
+
+// In-progress message
+static char topic_buf[REASSEMBLY_MAX_TOPIC_LEN];
+static size_t topic_len = 0;
+static size_t expected_len = 0;
+static size_t received_len = 0;
+static int64_t first_fragment_us = 0;
+static bool in_progress = false;
+static bool discarding = false;
+
+esp_err_t mqtt_reassembly_init(size_t max_message_size)
+{
+    if (arena != NULL) {
+        return ESP_OK;
+    }
+
+    arena = mem_budget_alloc(MEM_TAG_REASSEMBLY, max_message_size, MEM_PLACE_SPIRAM);
+    if (arena == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate %u byte reassembly arena", (unsigned)max_message_size);
+        return ESP_ERR_NO_MEM;
+    }
+
+    arena_size = max_message_size;
+    ESP_LOGI(TAG, "Reassembly arena: %u bytes", (unsigned)arena_size);
+    return ESP_OK;
+}
+
+void mqtt_reassembly_reset(void)
+{
+    in_progress = false;
+    discarding = false;
+    topic_len = 0;
+    expected_len = 0;
+    received_len = 0;
+}
+
+bool mqtt_reassembly_feed(const esp_mqtt_event_t *event, mqtt_message_t *msg)
+{
+    size_t offset = event->current_data_offset;
+    size_t chunk_len = event->data_len;
+    size_t total_len = event->total_data_len;
+    int64_t now_us = esp_timer_get_time();
+
+    // Unfragmented message: hand out the MQTT buffer directly
+    if (offset == 0 && chunk_len == total_len) {
+        if (in_progress) {
+            ESP_LOGW(TAG, "Abandoning incomplete message on %.*s", (int)topic_len, topic_buf);
+            mqtt_reassembly_reset();
+        }
+        msg->topic = event->topic;
+        msg->topic_len = event->topic_len;
+        msg->data = event->data;
+        msg->data_len = chunk_len;
+        msg->rx_us = now_us;
+        return true;
+    }
+
+    if (offset == 0) {
+        // First fragment carries the topic
+        if (in_progress) {
+            ESP_LOGW(TAG, "Abandoning incomplete message on %.*s", (int)topic_len, topic_buf);
+        }
+        mqtt_reassembly_reset();
+        in_progress = true;
+        expected_len = total_len;
+        first_fragment_us = now_us;
+
+        if (event->topic_len <= 0 || (size_t)event->topic_len > sizeof(topic_buf)) {
+            ESP_LOGE(TAG, "Fragmented message topic too long, discarding");
+            discarding = true;
+        } else if (arena == NULL || total_len > arena_size) {
+            ESP_LOGE(TAG, "Message of %u bytes exceeds %u byte arena, discarding",
+                     (unsigned)total_len, (unsigned)arena_size);
+            discarding = true;
+        } else {
+            memcpy(topic_buf, event->topic, event->topic_len);
+            topic_len = event->topic_len;
+        }
+    } else if (!in_progress || offset != received_len || total_len != expected_len) {
+        ESP_LOGW(TAG, "Out-of-sequence fragment at offset %u, discarding", (unsigned)offset);
+        mqtt_reassembly_reset();
+        return false;
+    }
+
+    if (offset + chunk_len > expected_len) {
+        ESP_LOGW(TAG, "Fragment overruns declared length, discarding");
+        mqtt_reassembly_reset();
+        return false;
+    }
+
+    if (!discarding) {
+        memcpy(arena + offset, event->data, chunk_len);
+    }
+    received_len = offset + chunk_len;
+
+    if (received_len < expected_len) {
+        return false;
+    }
+
+    bool complete = !discarding;
+    in_progress = false;
+    discarding = false;
+    if (!complete) {
+        return false;
+    }
+
+    ESP_LOGD(TAG, "Reassembled %u byte message on %.*s", (unsigned)received_len, (int)topic_len, topic_buf);
+    msg->topic = topic_buf;
+    msg->topic_len = topic_len;
+    msg->data = arena;
+    msg->data_len = received_len;
+    msg->rx_us = first_fragment_us;
+    return true;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file mqtt_reassembly.h
+ * @brief Reassembly of fragmented MQTT_EVENT_DATA payloads
+ *
+ * esp-mqtt delivers messages larger than its RX buffer as a sequence of
+ * MQTT_EVENT_DATA events (current_data_offset / total_data_len). Fragments
+ * are collected into a single arena allocated once at init (preferring
+ * PSRAM), bounded by a configurable maximum message size. Messages that
+ * arrive in one piece are passed through without copying.
+ */
+
+#ifndef MQTT_REASSEMBLY_H
+#define MQTT_REASSEMBLY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/**
+ * @brief Complete inbound MQTT message
+ *
+ * Topic and data are not NUL-terminated and are only valid until the next
+ * call to mqtt_reassembly_feed().
+ */
+typedef struct {
+    const char *topic;
+    size_t topic_len;
+    const char *data;
+    size_t data_len;
+    int64_t rx_us;          ///< esp_timer time the first fragment arrived
+} mqtt_message_t;
+
+/**
+ * @brief Allocate the reassembly arena
+ * @param max_message_size Largest message that can be reassembled
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the arena can't be allocated
+ */
+esp_err_t mqtt_reassembly_init(size_t max_message_size);
+
+/**
+ * @brief Feed an MQTT_EVENT_DATA event
+ * @param event Event from the MQTT event handler
+ * @param msg Filled in when a complete message is available
+ * @return true if msg holds a complete message
+ */
+bool mqtt_reassembly_feed(const esp_mqtt_event_t *event, mqtt_message_t *msg);
+
+/**
+ * @brief Discard any partially received message (e.g. on disconnect)
+ */
+void mqtt_reassembly_reset(void);
+
+#endif // MQTT_REASSEMBLY_H
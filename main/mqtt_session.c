@@ -0,0 +1,300 @@
+/**
+ * @file mqtt_session.c
+ * @brief MQTT subscription set and persistent session bookkeeping
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "aws_iot_config.h"
+#include "mqtt_session.h"
+
+static const char *TAG = "MQTT_SESSION";
+
+#define PERSISTENT_SESSION CONFIG_AWS_IOT_MQTT_PERSISTENT_SESSION
+
+// Granted set: one [qos][filter]\0 record per filter
+#define SESSION_NVS_NAMESPACE "mqtt_session"
+#define SESSION_NVS_KEY "granted"
+
+// SUBACK codes from 0x80 up are refusals in both MQTT 3.1.1 and 5
+#define SUBACK_FAILURE 0x80
+
+typedef struct {
+    const char *filter;
+    uint8_t qos;
+    bool held;      ///< Granted in the broker's session
+    int msg_id;     ///< Pending SUBSCRIBE, -1 if none
+} subscription_t;
+
+typedef struct {
+    uint32_t connects;
+    uint32_t resumed;
+    uint32_t subscribed;
+    uint32_t skipped;
+    uint32_t unsubscribed;
+    uint32_t refused;
+} session_stats_t;
+
+static subscription_t subscriptions[MQTT_SESSION_MAX_SUBSCRIPTIONS];
+static size_t subscription_count;
+
+static session_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if PERSISTENT_SESSION
+// Set once the stored set has been checked against a resumed session
+static bool reconciled;
+static uint32_t persisted_hash;
+
+static uint32_t fnv1a(const uint8_t *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+#endif
+
+static subscription_t *find(const char *filter)
+{
+    for (size_t i = 0; i < subscription_count; i++) {
+        if (strcmp(subscriptions[i].filter, filter) == 0) {
+            return &subscriptions[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t mqtt_session_add(const char *filter, int qos)
+{
+    if (filter == NULL || qos < 0 || qos > 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (find(filter) != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (subscription_count >= MQTT_SESSION_MAX_SUBSCRIPTIONS) {
+        return ESP_ERR_NO_MEM;
+    }
+    subscriptions[subscription_count++] = (subscription_t){
+        .filter = filter,
+        .qos = (uint8_t)qos,
+        .msg_id = -1,
+    };
+    return ESP_OK;
+}
+
+#if PERSISTENT_SESSION
+/**
+ * Write the granted set, unless it is what NVS already holds. Only runs
+ * when a SUBACK or a firmware update changed the set.
+ */
+static void persist_granted(void)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < subscription_count; i++) {
+        if (subscriptions[i].held) {
+            len += 1 + strlen(subscriptions[i].filter) + 1;
+        }
+    }
+
+    uint8_t *blob = malloc(len > 0 ? len : 1);
+    if (blob == NULL) {
+        return;
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < subscription_count; i++) {
+        if (subscriptions[i].held) {
+            size_t filter_len = strlen(subscriptions[i].filter) + 1;
+            blob[pos++] = subscriptions[i].qos;
+            memcpy(blob + pos, subscriptions[i].filter, filter_len);
+            pos += filter_len;
+        }
+    }
+
+    uint32_t hash = fnv1a(blob, len);
+    nvs_handle_t h;
+    if (hash != persisted_hash &&
+        nvs_open(SESSION_NVS_NAMESPACE, NVS_READWRITE, &h) == ESP_OK) {
+        if (nvs_set_blob(h, SESSION_NVS_KEY, blob, len) == ESP_OK &&
+            nvs_commit(h) == ESP_OK) {
+            persisted_hash = hash;
+        }
+        nvs_close(h);
+    }
+    free(blob);
+}
+
+/**
+ * Match the set granted before this boot against the current one: filters
+ * still wanted at the same QoS are held, filters no longer wanted are
+ * unsubscribed.
+ */
+static void reconcile_stored(esp_mqtt_client_handle_t client)
+{
+    nvs_handle_t h;
+    size_t len = 0;
+    uint8_t *blob = NULL;
+    size_t stale = 0;
+
+    if (nvs_open(SESSION_NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(h, SESSION_NVS_KEY, NULL, &len) == ESP_OK && len > 0) {
+        blob = malloc(len);
+        if (blob != NULL && nvs_get_blob(h, SESSION_NVS_KEY, blob, &len) != ESP_OK) {
+            free(blob);
+            blob = NULL;
+        }
+    }
+    nvs_close(h);
+    if (blob == NULL) {
+        return;
+    }
+    persisted_hash = fnv1a(blob, len);
+
+    size_t pos = 0;
+    while (pos + 1 < len) {
+        uint8_t qos = blob[pos++];
+        const char *filter = (const char *)blob + pos;
+        size_t filter_len = strnlen(filter, len - pos);
+        if (filter_len == len - pos) {
+            break;  // Truncated record
+        }
+        pos += filter_len + 1;
+
+        subscription_t *sub = find(filter);
+        if (sub != NULL) {
+            // A different QoS is granted again by the resubscribe
+            sub->held = sub->qos == qos;
+        } else if (esp_mqtt_client_unsubscribe(client, filter) >= 0) {
+            ESP_LOGI(TAG, "Unsubscribed from %s", filter);
+            stale++;
+        }
+    }
+    free(blob);
+
+    if (stale > 0) {
+        portENTER_CRITICAL(&stats_lock);
+        stats.unsubscribed += stale;
+        portEXIT_CRITICAL(&stats_lock);
+        persist_granted();
+    }
+}
+#endif
+
+esp_err_t mqtt_session_connected(esp_mqtt_client_handle_t client, bool session_present)
+{
+    esp_mqtt_topic_t topics[MQTT_SESSION_MAX_SUBSCRIPTIONS];
+    size_t count = 0;
+
+#if PERSISTENT_SESSION
+    if (session_present && !reconciled) {
+        reconcile_stored(client);
+    }
+    reconciled = true;
+#endif
+
+    for (size_t i = 0; i < subscription_count; i++) {
+        subscription_t *sub = &subscriptions[i];
+        // A SUBSCRIBE still pending from the last connection is sent again
+        sub->msg_id = -1;
+        if (!PERSISTENT_SESSION || !session_present) {
+            sub->held = false;
+        }
+        if (!sub->held) {
+            topics[count++] = (esp_mqtt_topic_t){.filter = sub->filter, .qos = sub->qos};
+        }
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.connects++;
+    if (session_present) {
+        stats.resumed++;
+    }
+    stats.skipped += subscription_count - count;
+    portEXIT_CRITICAL(&stats_lock);
+
+    if (count == 0) {
+        ESP_LOGI(TAG, "Session resumed, all %u subscriptions held",
+                 (unsigned)subscription_count);
+        return ESP_OK;
+    }
+
+    int msg_id = esp_mqtt_client_subscribe_multiple(client, topics, (int)count);
+    if (msg_id < 0) {
+        ESP_LOGW(TAG, "Failed to queue SUBSCRIBE for %u filters", (unsigned)count);
+        return ESP_FAIL;
+    }
+    for (size_t i = 0; i < subscription_count; i++) {
+        if (!subscriptions[i].held) {
+            subscriptions[i].msg_id = msg_id;
+        }
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    stats.subscribed += count;
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI(TAG, "Subscribing to %u of %u filters (session %s), msg_id=%d",
+             (unsigned)count, (unsigned)subscription_count,
+             session_present ? "resumed" : "new", msg_id);
+    return ESP_OK;
+}
+
+void mqtt_session_subscribed(int msg_id, const uint8_t *codes, size_t len)
+{
+    size_t n = 0;
+    bool changed = false;
+
+    for (size_t i = 0; i < subscription_count; i++) {
+        subscription_t *sub = &subscriptions[i];
+        if (sub->msg_id != msg_id) {
+            continue;
+        }
+        sub->msg_id = -1;
+
+        uint8_t code = len == 0 ? sub->qos : n < len ? codes[n] : SUBACK_FAILURE;
+        n++;
+        if (code < SUBACK_FAILURE) {
+            sub->held = true;
+            changed = true;
+        } else {
+            ESP_LOGW(TAG, "Subscription to %s refused (0x%02x)", sub->filter, code);
+            portENTER_CRITICAL(&stats_lock);
+            stats.refused++;
+            portEXIT_CRITICAL(&stats_lock);
+        }
+    }
+
+#if PERSISTENT_SESSION
+    if (changed) {
+        persist_granted();
+    }
+#else
+    (void)changed;
+#endif
+}
+
+void mqtt_session_write_json(json_writer_t *w, const char *key)
+{
+    session_stats_t snapshot;
+
+    portENTER_CRITICAL(&stats_lock);
+    snapshot = stats;
+    portEXIT_CRITICAL(&stats_lock);
+
+    json_writer_begin_object(w, key);
+    json_writer_add_bool(w, "persistent", PERSISTENT_SESSION);
+    json_writer_add_uint(w, "connects", snapshot.connects);
+    json_writer_add_uint(w, "resumed", snapshot.resumed);
+    json_writer_add_uint(w, "subscribed", snapshot.subscribed);
+    json_writer_add_uint(w, "skipped", snapshot.skipped);
+    json_writer_add_uint(w, "unsubscribed", snapshot.unsubscribed);
+    json_writer_add_uint(w, "refused", snapshot.refused);
+    json_writer_end_object(w);
+}
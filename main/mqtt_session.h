@@ -0,0 +1,90 @@
+/**
+ * @file mqtt_session.h
+ * @brief MQTT subscription set and persistent session bookkeeping
+ *
+ * Every inbound topic filter is registered here once at startup. On each
+ * connect, the filters the broker's session does not already hold go out in
+ * a single multi-topic SUBSCRIBE instead of one round trip per filter.
+ *
+ * With CONFIG_AWS_IOT_MQTT_PERSISTENT_SESSION the client connects with clean
+ * session off and a stable client ID, so the broker keeps the subscriptions
+ * and queues QoS 1 messages (commands, shadow deltas) while the device is
+ * offline. If the CONNACK reports a session present, only filters that
+ * changed since the set was last granted are sent. The granted set is kept
+ * in NVS so this also holds across reboots: after a firmware update, filters
+ * that were dropped are unsubscribed and new ones subscribed. On a clean
+ * session every filter is subscribed on every connect.
+ *
+ * All functions except mqtt_session_add() and mqtt_session_write_json() run
+ * in the MQTT event handler.
+ */
+
+#ifndef MQTT_SESSION_H
+#define MQTT_SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "json_writer.h"
+#include "mqtt_client.h"
+
+/**
+ * @brief Most filters in the set (AWS IoT accepts 8 per SUBSCRIBE)
+ */
+#define MQTT_SESSION_MAX_SUBSCRIPTIONS 8
+
+/**
+ * @brief Add a topic filter to the subscription set
+ *
+ * Call before the client is started. The filter is referenced, not copied.
+ *
+ * @param filter MQTT topic filter, must stay valid
+ * @param qos Requested QoS, 0 or 1
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for a bad QoS,
+ *         ESP_ERR_NO_MEM if the set is full, ESP_ERR_INVALID_STATE if the
+ *         filter is already in the set
+ */
+esp_err_t mqtt_session_add(const char *filter, int qos);
+
+/**
+ * @brief Bring the broker's session up to date (MQTT_EVENT_CONNECTED)
+ *
+ * Sends one SUBSCRIBE with every filter the session does not hold. The
+ * first time a session is resumed after boot, filters granted by a previous
+ * firmware and no longer in the set are unsubscribed.
+ *
+ * @param client MQTT client handle
+ * @param session_present CONNACK session-present flag
+ * @return ESP_OK if nothing was needed or the SUBSCRIBE was queued,
+ *         ESP_FAIL if the client rejected it (retried on the next connect)
+ */
+esp_err_t mqtt_session_connected(esp_mqtt_client_handle_t client, bool session_present);
+
+/**
+ * @brief Note a SUBACK (MQTT_EVENT_SUBSCRIBED)
+ *
+ * Filters granted by the SUBACK count as held by the session; refused ones
+ * are retried on the next connect. Changes to the granted set are written
+ * to NVS in persistent mode.
+ *
+ * @param msg_id SUBSCRIBE message id
+ * @param codes SUBACK return (reason) codes, one per filter in request order
+ * @param len Number of codes; 0 treats every filter as granted
+ */
+void mqtt_session_subscribed(int msg_id, const uint8_t *codes, size_t len);
+
+/**
+ * @brief Write session counters as a JSON object member
+ *
+ * Format: {"persistent":b,"connects":n,"resumed":n,"subscribed":n,
+ * "skipped":n,"unsubscribed":n,"refused":n}. Counts are kept since boot;
+ * resumed counts connects with a session present, subscribed and skipped
+ * count filters sent and filters the session already held.
+ *
+ * @param w Writer positioned inside an object
+ * @param key Member name
+ */
+void mqtt_session_write_json(json_writer_t *w, const char *key);
+
+#endif // MQTT_SESSION_H
@@ -0,0 +1,239 @@
+/**
+ * @file network_link.c
+ * @brief Uplink selection between WiFi and the cellular fallback
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/task.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "aws_iot_config.h"
+#include "app_log.h"
+#include "cellular_link.h"
+#include "network_link.h"
+#include "task_config.h"
+#include "wifi_manager.h"
+
+static const char *TAG = "NETWORK_LINK";
+
+#define LINK_FAILOVER_MS CONFIG_AWS_IOT_LINK_FAILOVER_MS
+#define LINK_FAILBACK_MS CONFIG_AWS_IOT_LINK_FAILBACK_MS
+#define CELLULAR_REDIAL_MS CONFIG_AWS_IOT_CELLULAR_REDIAL_MS
+// Link events wake the supervisor at once; the poll only drives the
+// failover and failback timers
+#define LINK_POLL_INTERVAL_MS 1000
+
+#define LINK_UP_BIT BIT0
+
+static const network_link_ops_t links[NETWORK_LINK_COUNT] = {
+    [NETWORK_LINK_NONE] = {
+        .name = "none",
+    },
+    [NETWORK_LINK_WIFI] = {
+        .name = "wifi",
+        .init = wifi_manager_init,
+        .start = wifi_manager_start,
+        .stop = wifi_manager_stop,
+        .is_up = wifi_manager_is_connected,
+        .get_netif = wifi_manager_get_netif,
+    },
+#if CONFIG_AWS_IOT_CELLULAR_ENABLE
+    [NETWORK_LINK_CELLULAR] = {
+        .name = "cellular",
+        .init = cellular_link_init,
+        .start = cellular_link_start,
+        .stop = cellular_link_stop,
+        .is_up = cellular_link_is_up,
+        .get_netif = cellular_link_get_netif,
+        .metered = true,
+    },
+#else
+    [NETWORK_LINK_CELLULAR] = {
+        .name = "cellular",
+    },
+#endif
+};
+
+static EventGroupHandle_t link_event_group;
+static TaskHandle_t supervisor_task = NULL;
+static volatile network_link_type_t active_link = NETWORK_LINK_NONE;
+static network_link_change_cb_t change_cb = NULL;
+static void *change_cb_arg = NULL;
+static bool available[NETWORK_LINK_COUNT];
+
+static bool link_up(network_link_type_t link)
+{
+    return available[link] && links[link].is_up();
+}
+
+static void set_active(network_link_type_t link)
+{
+    if (link == active_link) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Active link: %s -> %s", links[active_link].name, links[link].name);
+    app_log_event(APP_LOG_EVT_LINK_CHANGED, link);
+    if (link != NETWORK_LINK_NONE) {
+        // Pin the route; esp_netif would otherwise follow interface priority
+        esp_netif_set_default_netif(links[link].get_netif());
+        xEventGroupSetBits(link_event_group, LINK_UP_BIT);
+    } else {
+        xEventGroupClearBits(link_event_group, LINK_UP_BIT);
+    }
+    active_link = link;
+
+    if (change_cb != NULL) {
+        change_cb(link, change_cb_arg);
+    }
+}
+
+/**
+ * WiFi is preferred whenever it is up, except that coming back from
+ * cellular it has to stay up for LINK_FAILBACK_MS first, so a flapping AP
+ * doesn't bounce the MQTT session between links.
+ */
+static void link_supervisor_task(void *pvParameters)
+{
+    int64_t wifi_changed_ms = esp_timer_get_time() / 1000;
+    bool wifi_was_up = false;
+    bool cellular_dialed = false;
+    int64_t cellular_dialed_ms = 0;
+
+    while (1) {
+        int64_t now_ms = esp_timer_get_time() / 1000;
+        bool wifi_up = link_up(NETWORK_LINK_WIFI);
+        if (wifi_up != wifi_was_up) {
+            wifi_changed_ms = now_ms;
+            wifi_was_up = wifi_up;
+        }
+        int64_t wifi_state_ms = now_ms - wifi_changed_ms;
+        bool cellular_up = link_up(NETWORK_LINK_CELLULAR);
+
+        network_link_type_t next;
+        if (wifi_up && (active_link != NETWORK_LINK_CELLULAR || !cellular_up ||
+                        wifi_state_ms >= LINK_FAILBACK_MS)) {
+            next = NETWORK_LINK_WIFI;
+        } else if (cellular_up) {
+            next = NETWORK_LINK_CELLULAR;
+        } else {
+            next = NETWORK_LINK_NONE;
+        }
+        set_active(next);
+
+        if (available[NETWORK_LINK_CELLULAR]) {
+            if (next == NETWORK_LINK_WIFI && cellular_dialed) {
+                ESP_LOGI(TAG, "Hanging up cellular");
+                links[NETWORK_LINK_CELLULAR].stop();
+                cellular_dialed = false;
+            } else if (!wifi_up && wifi_state_ms >= LINK_FAILOVER_MS) {
+                // Dial, and redial if PPP dropped or never came up
+                if (cellular_dialed && !cellular_up && now_ms - cellular_dialed_ms >= CELLULAR_REDIAL_MS) {
+                    links[NETWORK_LINK_CELLULAR].stop();
+                    cellular_dialed = false;
+                }
+                if (!cellular_dialed) {
+                    ESP_LOGW(TAG, "WiFi down for %lld ms, dialing cellular", (long long)wifi_state_ms);
+                    cellular_dialed = links[NETWORK_LINK_CELLULAR].start() == ESP_OK;
+                    cellular_dialed_ms = esp_timer_get_time() / 1000;
+                }
+            }
+        }
+
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LINK_POLL_INTERVAL_MS));
+    }
+}
+
+/**
+ * Registered after the links' own handlers, so by the time the supervisor
+ * runs their is_up() already reflects the event.
+ */
+static void link_event_handler(void *arg, esp_event_base_t event_base,
+                               int32_t event_id, void *event_data)
+{
+    if (supervisor_task != NULL) {
+        xTaskNotifyGive(supervisor_task);
+    }
+}
+
+esp_err_t network_link_init(network_link_change_cb_t on_change, void *arg)
+{
+    link_event_group = xEventGroupCreate();
+    if (link_event_group == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    change_cb = on_change;
+    change_cb_arg = arg;
+
+    for (int i = NETWORK_LINK_WIFI; i < NETWORK_LINK_COUNT; i++) {
+        if (links[i].init == NULL) {
+            continue;
+        }
+        esp_err_t err = links[i].init();
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to initialize %s link: %s", links[i].name, esp_err_to_name(err));
+            continue;
+        }
+        available[i] = true;
+    }
+    if (!available[NETWORK_LINK_WIFI]) {
+        return ESP_FAIL;
+    }
+
+    // WiFi reconnects on its own from here on (see wifi_manager.c)
+    ESP_ERROR_CHECK(links[NETWORK_LINK_WIFI].start());
+
+    if (xTaskCreatePinnedToCore(link_supervisor_task, "link_supervisor", LINK_SUPERVISOR_STACK_SIZE,
+                                NULL, LINK_SUPERVISOR_PRIORITY, &supervisor_task,
+                                LINK_SUPERVISOR_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create link supervisor task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    // React to an address within the event, not at the next poll
+    static const int32_t ip_events[] = {
+        IP_EVENT_STA_GOT_IP, IP_EVENT_STA_LOST_IP, IP_EVENT_PPP_GOT_IP, IP_EVENT_PPP_LOST_IP,
+    };
+    for (size_t i = 0; i < sizeof(ip_events) / sizeof(ip_events[0]); i++) {
+        ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, ip_events[i], link_event_handler, NULL));
+    }
+    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED,
+                                               link_event_handler, NULL));
+
+    ESP_LOGI(TAG, "Network links started, cellular fallback %s",
+             available[NETWORK_LINK_CELLULAR] ? "enabled" : "disabled");
+    return ESP_OK;
+}
+
+void network_link_shutdown(void)
+{
+    for (int i = NETWORK_LINK_WIFI; i < NETWORK_LINK_COUNT; i++) {
+        if (available[i] && links[i].stop != NULL) {
+            links[i].stop();
+        }
+    }
+}
+
+bool network_link_wait_for_connection(TickType_t timeout)
+{
+    EventBits_t bits = xEventGroupWaitBits(link_event_group, LINK_UP_BIT, pdFALSE, pdTRUE, timeout);
+    return (bits & LINK_UP_BIT) != 0;
+}
+
+network_link_type_t network_link_active(void)
+{
+    return active_link;
+}
+
+bool network_link_is_metered(void)
+{
+    return links[active_link].metered;
+}
+
+const char *network_link_name(network_link_type_t link)
+{
+    return link < NETWORK_LINK_COUNT ? links[link].name : "unknown";
+}
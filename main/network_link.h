@@ -0,0 +1,94 @@
+/**
+ * @file network_link.h
+ * @brief Uplink selection between WiFi and the cellular fallback
+ *
+ * Each uplink is described by a network_link_ops_t. A supervisor task keeps
+ * WiFi as the preferred link, brings the cellular modem up after WiFi has
+ * been down for CONFIG_AWS_IOT_LINK_FAILOVER_MS and returns to WiFi once it
+ * has stayed up for CONFIG_AWS_IOT_LINK_FAILBACK_MS, hanging the modem up
+ * again. The active link is made the lwIP default route, so sockets opened
+ * afterwards (including the MQTT client's) use it.
+ */
+
+#ifndef NETWORK_LINK_H
+#define NETWORK_LINK_H
+
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "esp_netif.h"
+
+/**
+ * @brief Uplinks, in order of preference
+ */
+typedef enum {
+    NETWORK_LINK_NONE,
+    NETWORK_LINK_WIFI,
+    NETWORK_LINK_CELLULAR,
+    NETWORK_LINK_COUNT,
+} network_link_type_t;
+
+/**
+ * @brief Operations of one uplink
+ */
+typedef struct {
+    const char *name;
+    esp_err_t (*init)(void);
+    esp_err_t (*start)(void);       ///< Begin connecting; may block for setup
+    esp_err_t (*stop)(void);
+    bool (*is_up)(void);            ///< Link has an IP address
+    esp_netif_t *(*get_netif)(void);
+    bool metered;                   ///< Traffic is billed; callers should batch harder
+} network_link_ops_t;
+
+/**
+ * @brief Called from the supervisor task when the active link changes
+ *
+ * IP events wake the supervisor, so this runs right after the address is
+ * assigned or lost rather than at the next poll.
+ *
+ * @param link New active link, NETWORK_LINK_NONE if every link is down
+ * @param arg User argument passed to network_link_init()
+ */
+typedef void (*network_link_change_cb_t)(network_link_type_t link, void *arg);
+
+/**
+ * @brief Initialize the uplinks, start WiFi and the supervisor task
+ * @param on_change Optional link change callback
+ * @param arg User argument for the callback
+ * @return ESP_OK on success
+ */
+esp_err_t network_link_init(network_link_change_cb_t on_change, void *arg);
+
+/**
+ * @brief Stop every link, e.g. before deep sleep
+ */
+void network_link_shutdown(void);
+
+/**
+ * @brief Block until some link is up
+ * @param timeout Maximum time to wait
+ * @return true if a link is up
+ */
+bool network_link_wait_for_connection(TickType_t timeout);
+
+/**
+ * @brief Get the link currently carrying traffic
+ * @return Active link, NETWORK_LINK_NONE if none is up
+ */
+network_link_type_t network_link_active(void);
+
+/**
+ * @brief Check whether the active link is metered
+ * @return true while traffic goes over cellular
+ */
+bool network_link_is_metered(void);
+
+/**
+ * @brief Get the name of a link, for logs
+ * @param link Link type
+ * @return Static name string
+ */
+const char *network_link_name(network_link_type_t link);
+
+#endif // NETWORK_LINK_H
@@ -0,0 +1,189 @@
+/**
+ * @file payload_compress.c
+ * @brief LZSS compression of outgoing payloads in the heatshrink format
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "aws_iot_config.h"
+#include "metrics.h"
+#include "payload_compress.h"
+
+#define WINDOW_SIZE (1 << PAYLOAD_COMPRESS_WINDOW_BITS)
+#define MAX_MATCH (1 << PAYLOAD_COMPRESS_LOOKAHEAD_BITS)
+// A back-reference costs 15 bits; three literals cost 27
+#define MIN_MATCH 3
+#define HASH_BITS 10
+#define HASH_SIZE (1 << HASH_BITS)
+// Candidates examined per position; bounds the worst case on long runs
+#define MAX_CHAIN 32
+#define COMPRESS_BUFFER_SIZE CONFIG_AWS_IOT_COMPRESS_BUFFER_SIZE
+
+// Positions of the latest occurrence of each 3-byte hash, and of the
+// previous occurrence of the same hash for each window slot; -1 when empty.
+// Payloads are limited to INT16_MAX bytes so positions fit in 16 bits
+static int16_t hash_head[HASH_SIZE];
+static int16_t hash_prev[WINDOW_SIZE];
+static uint8_t out_buffer[COMPRESS_BUFFER_SIZE];
+
+static uint32_t stat_payloads;
+static uint32_t stat_skipped;
+static uint64_t stat_bytes_in;
+static uint64_t stat_bytes_out;
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    uint8_t bits;       // Bits used in buf[len]
+    bool overflow;
+} bit_writer_t;
+
+static void put_bits(bit_writer_t *bw, uint32_t value, uint8_t count)
+{
+    // MSB first, as heatshrink reads them
+    while (count > 0 && !bw->overflow) {
+        if (bw->bits == 0) {
+            if (bw->len >= bw->size) {
+                bw->overflow = true;
+                return;
+            }
+            bw->buf[bw->len] = 0;
+        }
+        count--;
+        if (value & (1u << count)) {
+            bw->buf[bw->len] |= 0x80 >> bw->bits;
+        }
+        if (++bw->bits == 8) {
+            bw->bits = 0;
+            bw->len++;
+        }
+    }
+}
+
+static inline uint32_t hash3(const uint8_t *p)
+{
+    return ((p[0] << 6) ^ (p[1] << 3) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+static void insert(const uint8_t *data, size_t len, size_t pos)
+{
+    if (pos + MIN_MATCH > len) {
+        return;
+    }
+    uint32_t h = hash3(data + pos);
+    hash_prev[pos & (WINDOW_SIZE - 1)] = hash_head[h];
+    hash_head[h] = (int16_t)pos;
+}
+
+static size_t find_match(const uint8_t *data, size_t len, size_t pos, size_t *offset)
+{
+    size_t best = 0;
+    size_t limit = len - pos < MAX_MATCH ? len - pos : MAX_MATCH;
+
+    if (limit < MIN_MATCH) {
+        return 0;
+    }
+
+    int32_t candidate = hash_head[hash3(data + pos)];
+    for (int chain = 0; chain < MAX_CHAIN && candidate >= 0; chain++) {
+        size_t distance = pos - (size_t)candidate;
+        if (distance == 0 || distance > WINDOW_SIZE) {
+            break;
+        }
+
+        size_t n = 0;
+        while (n < limit && data[candidate + n] == data[pos + n]) {
+            n++;
+        }
+        if (n > best) {
+            best = n;
+            *offset = distance;
+            if (best == limit) {
+                break;
+            }
+        }
+
+        int32_t next = hash_prev[candidate & (WINDOW_SIZE - 1)];
+        if (next >= candidate) {
+            break;
+        }
+        candidate = next;
+    }
+    return best >= MIN_MATCH ? best : 0;
+}
+
+esp_err_t payload_compress(const void *in, size_t in_len, const uint8_t **out, size_t *out_len)
+{
+    if (in == NULL || out == NULL || out_len == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (in_len == 0 || in_len > INT16_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    const uint8_t *data = in;
+    int64_t start_us = esp_timer_get_time();
+    // Stop as soon as the output is no smaller than the input
+    bit_writer_t bw = {
+        .buf = out_buffer,
+        .size = in_len - 1 < sizeof(out_buffer) ? in_len - 1 : sizeof(out_buffer),
+    };
+
+    memset(hash_head, 0xff, sizeof(hash_head));
+
+    size_t pos = 0;
+    while (pos < in_len && !bw.overflow) {
+        size_t offset = 0;
+        size_t match = find_match(data, in_len, pos, &offset);
+
+        if (match > 0) {
+            put_bits(&bw, 0, 1);
+            put_bits(&bw, offset - 1, PAYLOAD_COMPRESS_WINDOW_BITS);
+            put_bits(&bw, match - 1, PAYLOAD_COMPRESS_LOOKAHEAD_BITS);
+            for (size_t i = 0; i < match; i++) {
+                insert(data, in_len, pos + i);
+            }
+            pos += match;
+        } else {
+            put_bits(&bw, 1, 1);
+            put_bits(&bw, data[pos], 8);
+            insert(data, in_len, pos);
+            pos++;
+        }
+    }
+    if (bw.bits > 0 && !bw.overflow) {
+        // Zero padding reads as the start of a back-reference that never
+        // completes, which heatshrink decoders ignore
+        bw.len++;
+    }
+    metrics_record(METRICS_COMPRESS_TIME, esp_timer_get_time() - start_us);
+
+    stat_payloads++;
+    stat_bytes_in += in_len;
+    if (bw.overflow) {
+        stat_skipped++;
+        stat_bytes_out += in_len;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    stat_bytes_out += bw.len;
+    *out = out_buffer;
+    *out_len = bw.len;
+    return ESP_OK;
+}
+
+void payload_compress_write_json(json_writer_t *w, const char *key)
+{
+    json_writer_begin_object(w, key);
+    json_writer_add_uint(w, "payloads", stat_payloads);
+    json_writer_add_uint(w, "skipped", stat_skipped);
+    json_writer_add_uint(w, "bytes_in", stat_bytes_in);
+    json_writer_add_uint(w, "bytes_out", stat_bytes_out);
+    json_writer_end_object(w);
+
+    stat_payloads = 0;
+    stat_skipped = 0;
+    stat_bytes_in = 0;
+    stat_bytes_out = 0;
+}
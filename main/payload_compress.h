@@ -0,0 +1,61 @@
+/**
+ * @file payload_compress.h
+ * @brief LZSS compression of outgoing payloads in the heatshrink format
+ *
+ * Batches are repetitive (same keys, slowly changing values), so a small
+ * LZSS window already removes most of their size. The output is a plain
+ * heatshrink bitstream (window 2^PAYLOAD_COMPRESS_WINDOW_BITS, lookahead
+ * 2^PAYLOAD_COMPRESS_LOOKAHEAD_BITS, no header), decodable with any
+ * heatshrink implementation configured with the same parameters, e.g.
+ * Python's heatshrink2: decompress(data, window_sz2=10, lookahead_sz2=4).
+ *
+ * Match-finder tables and the output buffer are static; the module is not
+ * reentrant and is owned by the telemetry task.
+ */
+
+#ifndef PAYLOAD_COMPRESS_H
+#define PAYLOAD_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "json_writer.h"
+
+/**
+ * @brief log2 of the back-reference window
+ */
+#define PAYLOAD_COMPRESS_WINDOW_BITS 10
+
+/**
+ * @brief log2 of the longest back-reference
+ */
+#define PAYLOAD_COMPRESS_LOOKAHEAD_BITS 4
+
+/**
+ * @brief Compress a payload into the static output buffer
+ *
+ * Fails rather than returning output that is not smaller than the input,
+ * so the caller can send the original instead.
+ *
+ * @param in Payload
+ * @param in_len Payload length
+ * @param out Set to the compressed data, valid until the next call
+ * @param out_len Compressed length
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the payload is too
+ *         large for the buffer or does not shrink
+ */
+esp_err_t payload_compress(const void *in, size_t in_len, const uint8_t **out, size_t *out_len);
+
+/**
+ * @brief Write compression statistics as a JSON object member and reset them
+ *
+ * Format: {"payloads":n,"skipped":n,"bytes_in":n,"bytes_out":n}; skipped
+ * counts payloads sent uncompressed because they did not shrink. CPU time
+ * per call is in the "compress" latency histogram.
+ *
+ * @param w Writer positioned inside an object
+ * @param key Member name
+ */
+void payload_compress_write_json(json_writer_t *w, const char *key);
+
+#endif // PAYLOAD_COMPRESS_H
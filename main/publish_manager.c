@@ -0,0 +1,478 @@
+/**
+ * @file publish_manager.c
+ * @brief Flow control and the single publisher for outgoing messages
+ */
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "mem_budget.h"
+#include "metrics.h"
+#include "publish_manager.h"
+#include "task_config.h"
+
+#include "aws_iot_config.h"
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_PUBLISH
+#include "app_log.h"
+
+static const char *TAG = "PUBLISH_MANAGER";
+
+#define PUBLISH_MAX_INFLIGHT CONFIG_AWS_IOT_PUBLISH_MAX_INFLIGHT
+#define PUBLISH_MAX_PAYLOAD CONFIG_AWS_IOT_PUBLISH_MAX_PAYLOAD
+#define PUBLISH_OUTBOX_HIGH_WATER CONFIG_AWS_IOT_PUBLISH_OUTBOX_HIGH_WATER
+#define PUBLISH_OUTBOX_LOW_WATER CONFIG_AWS_IOT_PUBLISH_OUTBOX_LOW_WATER
+#define PUBLISH_SLOT_COUNT (PUBLISH_MAX_INFLIGHT + PUBLISH_CONTROL_SLOTS)
+// PUBACKs for ids not (yet) in the window: either they overtook the
+// publisher task or belong to another publisher. Only the newest are kept
+#define EARLY_ACK_SLOTS 4
+// The outbox is polled this often while no message is queued
+#define OUTBOX_POLL_MS 1000
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_QUEUED,        ///< Payload copied, waiting for the publisher task
+    SLOT_INFLIGHT,      ///< In the client's outbox, waiting for PUBACK
+} slot_state_t;
+
+typedef struct {
+    slot_state_t state;
+    bool control;
+    uint8_t qos;
+    uint16_t msg_id;
+    uint32_t len;
+    publish_done_cb_t callback;
+    void *arg;
+    const char *content_type;
+    const publish_user_property_t *user_properties;
+    uint8_t user_property_count;
+    uint8_t correlation_len;
+    uint8_t correlation[PUBLISH_MAX_CORRELATION_LEN];
+    char topic[PUBLISH_MAX_TOPIC_LEN];
+    uint8_t *payload;   ///< PUBLISH_MAX_PAYLOAD bytes in the pool
+} publish_slot_t;
+
+static esp_mqtt_client_handle_t client = NULL;
+static publish_slot_t slots[PUBLISH_SLOT_COUNT];
+static uint8_t *payload_pool = NULL;
+static QueueHandle_t publish_queue = NULL;
+static StaticQueue_t publish_queue_struct;
+static uint8_t publish_queue_storage[PUBLISH_SLOT_COUNT];
+static uint16_t early_acks[EARLY_ACK_SLOTS];
+static size_t early_ack_next = 0;
+static size_t outbox_cached = 0;
+static bool above_high_water = false;
+static portMUX_TYPE publish_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t stat_inflight_peak;
+static uint32_t stat_outbox_peak;
+static uint32_t stat_window_full;
+static uint32_t stat_high_water;
+static uint32_t stat_expired;
+static uint32_t stat_failed;
+
+// Caller holds publish_lock; bulk_only leaves out control messages
+static size_t slots_used_locked(bool bulk_only, size_t *bytes)
+{
+    size_t count = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < PUBLISH_SLOT_COUNT; i++) {
+        if (slots[i].state != SLOT_FREE && !(bulk_only && slots[i].control)) {
+            count++;
+            total += slots[i].len;
+        }
+    }
+    if (bytes != NULL) {
+        *bytes = total;
+    }
+    return count;
+}
+
+// Caller holds publish_lock
+static publish_slot_t *slot_find_locked(uint16_t msg_id)
+{
+    for (size_t i = 0; i < PUBLISH_SLOT_COUNT; i++) {
+        if (slots[i].state == SLOT_INFLIGHT && slots[i].msg_id == msg_id) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Caller holds publish_lock
+static bool early_ack_take_locked(uint16_t msg_id)
+{
+    for (size_t i = 0; i < EARLY_ACK_SLOTS; i++) {
+        if (early_acks[i] == msg_id) {
+            early_acks[i] = 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes the client lock; not for use by producers
+static void outbox_update(void)
+{
+    int size = esp_mqtt_client_get_outbox_size(client);
+    size_t bytes = size > 0 ? (size_t)size : 0;
+
+    portENTER_CRITICAL(&publish_lock);
+    outbox_cached = bytes;
+    if (bytes > stat_outbox_peak) {
+        stat_outbox_peak = bytes;
+    }
+    portEXIT_CRITICAL(&publish_lock);
+}
+
+// Caller holds publish_lock; the callback is run once the lock is dropped
+static publish_done_cb_t slot_release_locked(publish_slot_t *slot, void **arg)
+{
+    publish_done_cb_t callback = slot->callback;
+    *arg = slot->arg;
+    slot->state = SLOT_FREE;
+    slot->len = 0;
+    return callback;
+}
+
+#if CONFIG_AWS_IOT_MQTT_PROTOCOL_5
+// Only ever called from the publisher task, right before its publish
+static void set_properties(const publish_slot_t *slot)
+{
+    esp_mqtt5_publish_property_config_t property = {
+        .content_type = slot->content_type,
+        .correlation_data = slot->correlation_len > 0 ? (const char *)slot->correlation : NULL,
+        .correlation_data_len = slot->correlation_len,
+    };
+    esp_mqtt5_user_property_item_t items[PUBLISH_MAX_USER_PROPERTIES];
+
+    if (slot->content_type == NULL && slot->correlation_len == 0 && slot->user_property_count == 0) {
+        return;
+    }
+    for (size_t i = 0; i < slot->user_property_count; i++) {
+        items[i].key = slot->user_properties[i].key;
+        items[i].value = slot->user_properties[i].value;
+    }
+    if (slot->user_property_count > 0 &&
+        esp_mqtt5_client_set_user_property(&property.user_property, items,
+                                           slot->user_property_count) != ESP_OK) {
+        ESP_LOGW(TAG, "Dropping user properties for %s", slot->topic);
+        property.user_property = NULL;
+    }
+    esp_mqtt5_client_set_publish_property(client, &property);
+    // The client keeps its own copy of the list
+    esp_mqtt5_client_delete_user_property(property.user_property);
+}
+#endif
+
+static void publish_slot(publish_slot_t *slot)
+{
+#if CONFIG_AWS_IOT_MQTT_PROTOCOL_5
+    set_properties(slot);
+#endif
+    int64_t start_us = esp_timer_get_time();
+    int msg_id = esp_mqtt_client_publish(client, slot->topic, (const char *)slot->payload,
+                                         slot->len, slot->qos, 0);
+    if (slot->qos > 0) {
+        metrics_publish_sent(msg_id, start_us);
+    }
+    outbox_update();
+
+    publish_done_cb_t callback = NULL;
+    void *arg = NULL;
+    esp_err_t result = ESP_OK;
+
+    portENTER_CRITICAL(&publish_lock);
+    if (msg_id < 0 || (msg_id == 0 && slot->qos > 0)) {
+        // -1 failed, -2 outbox full
+        stat_failed++;
+        result = ESP_FAIL;
+        callback = slot_release_locked(slot, &arg);
+    } else if (slot->qos == 0) {
+        // Written (or dropped while disconnected); nothing to wait for
+        callback = slot_release_locked(slot, &arg);
+    } else if (early_ack_take_locked(msg_id)) {
+        callback = slot_release_locked(slot, &arg);
+    } else {
+        slot->msg_id = msg_id;
+        slot->state = SLOT_INFLIGHT;
+    }
+    portEXIT_CRITICAL(&publish_lock);
+
+    if (callback != NULL) {
+        callback(result, msg_id, arg);
+    }
+}
+
+// An empty outbox holds nothing unacknowledged, so slots still in flight
+// after two polls lost their PUBACK or DELETED event (e.g. a clean-session
+// reconnect). The second poll gives a PUBACK being dispatched time to land
+static void reclaim_lost(void)
+{
+    static bool empty_last_poll = false;
+    bool empty = outbox_cached == 0;
+
+    if (empty && empty_last_poll) {
+        for (size_t i = 0; i < PUBLISH_SLOT_COUNT; i++) {
+            publish_done_cb_t callback = NULL;
+            void *arg = NULL;
+            int msg_id = slots[i].msg_id;
+
+            portENTER_CRITICAL(&publish_lock);
+            if (slots[i].state == SLOT_INFLIGHT) {
+                stat_expired++;
+                callback = slot_release_locked(&slots[i], &arg);
+            }
+            portEXIT_CRITICAL(&publish_lock);
+            if (callback != NULL) {
+                callback(ESP_ERR_TIMEOUT, msg_id, arg);
+            }
+        }
+    }
+    empty_last_poll = empty;
+}
+
+static void publish_task(void *pvParameters)
+{
+    uint8_t index;
+
+    while (1) {
+        if (xQueueReceive(publish_queue, &index, pdMS_TO_TICKS(OUTBOX_POLL_MS)) == pdTRUE) {
+            publish_slot(&slots[index]);
+        } else {
+            outbox_update();
+            reclaim_lost();
+        }
+    }
+}
+
+esp_err_t publish_manager_init(esp_mqtt_client_handle_t mqtt_client)
+{
+    if (mqtt_client == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (publish_queue != NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t pool_size = PUBLISH_SLOT_COUNT * PUBLISH_MAX_PAYLOAD;
+    payload_pool = mem_budget_alloc(MEM_TAG_PUBLISH, pool_size, MEM_PLACE_SPIRAM);
+    if (payload_pool == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes of publish slots", (unsigned)pool_size);
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < PUBLISH_SLOT_COUNT; i++) {
+        slots[i] = (publish_slot_t) {
+            .state = SLOT_FREE,
+            .payload = payload_pool + i * PUBLISH_MAX_PAYLOAD,
+        };
+    }
+    client = mqtt_client;
+
+    publish_queue = xQueueCreateStatic(PUBLISH_SLOT_COUNT, sizeof(uint8_t),
+                                       publish_queue_storage, &publish_queue_struct);
+    if (publish_queue == NULL) {
+        ESP_LOGE(TAG, "Failed to create publish queue");
+        return ESP_FAIL;
+    }
+    if (xTaskCreatePinnedToCore(publish_task, "publisher", PUBLISH_TASK_STACK_SIZE, NULL,
+                                PUBLISH_TASK_PRIORITY, NULL, PUBLISH_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create publisher task");
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Publish manager initialized: window=%d+%d, outbox high/low water=%d/%d bytes, MQTT %s",
+             PUBLISH_MAX_INFLIGHT, PUBLISH_CONTROL_SLOTS, PUBLISH_OUTBOX_HIGH_WATER,
+             PUBLISH_OUTBOX_LOW_WATER, CONFIG_AWS_IOT_MQTT_PROTOCOL_5 ? "5" : "3.1.1");
+    return ESP_OK;
+}
+
+bool publish_manager_window_open(void)
+{
+    portENTER_CRITICAL(&publish_lock);
+    bool open = publish_queue != NULL && slots_used_locked(true, NULL) < PUBLISH_MAX_INFLIGHT;
+    portEXIT_CRITICAL(&publish_lock);
+    return open;
+}
+
+size_t publish_manager_pending(void)
+{
+    portENTER_CRITICAL(&publish_lock);
+    size_t count = slots_used_locked(false, NULL);
+    portEXIT_CRITICAL(&publish_lock);
+    return count;
+}
+
+esp_err_t publish_manager_publish(const publish_message_t *msg)
+{
+    if (msg == NULL || msg->topic == NULL || (msg->data == NULL && msg->len > 0) ||
+        msg->qos < 0 || msg->qos > 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (publish_queue == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (msg->len > PUBLISH_MAX_PAYLOAD || strlen(msg->topic) >= PUBLISH_MAX_TOPIC_LEN ||
+        msg->correlation_len > PUBLISH_MAX_CORRELATION_LEN ||
+        msg->user_property_count > PUBLISH_MAX_USER_PROPERTIES) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Bulk messages are held to the window; control messages may also use
+    // the slots reserved for them
+    publish_slot_t *slot = NULL;
+    portENTER_CRITICAL(&publish_lock);
+    if (msg->control || slots_used_locked(true, NULL) < PUBLISH_MAX_INFLIGHT) {
+        for (size_t i = 0; i < PUBLISH_SLOT_COUNT; i++) {
+            if (slots[i].state == SLOT_FREE) {
+                slot = &slots[i];
+                // Claimed, but not queued until the message is in place
+                slot->state = SLOT_QUEUED;
+                slot->control = msg->control;
+                slot->msg_id = 0;
+                slot->len = msg->len;
+                break;
+            }
+        }
+    }
+    if (slot == NULL) {
+        stat_window_full++;
+    } else {
+        size_t count = slots_used_locked(false, NULL);
+        if (count > stat_inflight_peak) {
+            stat_inflight_peak = count;
+        }
+    }
+    portEXIT_CRITICAL(&publish_lock);
+    if (slot == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    slot->qos = msg->qos;
+    slot->callback = msg->callback;
+    slot->arg = msg->arg;
+    slot->content_type = msg->content_type;
+    slot->user_properties = msg->user_properties;
+    slot->user_property_count = msg->user_property_count;
+    slot->correlation_len = msg->correlation_len;
+    if (msg->correlation_len > 0) {
+        memcpy(slot->correlation, msg->correlation_data, msg->correlation_len);
+    }
+    strcpy(slot->topic, msg->topic);
+    if (msg->len > 0) {
+        memcpy(slot->payload, msg->data, msg->len);
+    }
+
+    // The queue has one place per slot, so this never waits
+    uint8_t index = slot - slots;
+    xQueueSend(publish_queue, &index, 0);
+    return ESP_OK;
+}
+
+bool publish_manager_high_water(void)
+{
+    bool crossed = false;
+
+    portENTER_CRITICAL(&publish_lock);
+    size_t bytes = outbox_cached;
+    if (!above_high_water && bytes >= PUBLISH_OUTBOX_HIGH_WATER) {
+        above_high_water = true;
+        crossed = true;
+        stat_high_water++;
+    } else if (above_high_water && bytes < PUBLISH_OUTBOX_LOW_WATER) {
+        above_high_water = false;
+    }
+    bool high = above_high_water;
+    portEXIT_CRITICAL(&publish_lock);
+
+    if (crossed) {
+        ESP_LOGW(TAG, "Outbox at %u bytes, above high water", (unsigned)bytes);
+    }
+    return high;
+}
+
+publish_policy_t publish_manager_policy(void)
+{
+    return (publish_policy_t)CONFIG_AWS_IOT_PUBLISH_HIGH_WATER_POLICY;
+}
+
+void publish_manager_acked(int msg_id)
+{
+    if (msg_id <= 0 || publish_queue == NULL) {
+        return;
+    }
+    outbox_update();
+
+    publish_done_cb_t callback = NULL;
+    void *arg = NULL;
+
+    portENTER_CRITICAL(&publish_lock);
+    publish_slot_t *slot = slot_find_locked(msg_id);
+    if (slot != NULL) {
+        callback = slot_release_locked(slot, &arg);
+    } else {
+        early_acks[early_ack_next] = msg_id;
+        early_ack_next = (early_ack_next + 1) % EARLY_ACK_SLOTS;
+    }
+    portEXIT_CRITICAL(&publish_lock);
+    if (callback != NULL) {
+        callback(ESP_OK, msg_id, arg);
+    }
+}
+
+void publish_manager_deleted(int msg_id)
+{
+    if (msg_id <= 0 || publish_queue == NULL) {
+        return;
+    }
+    outbox_update();
+
+    publish_done_cb_t callback = NULL;
+    void *arg = NULL;
+
+    portENTER_CRITICAL(&publish_lock);
+    publish_slot_t *slot = slot_find_locked(msg_id);
+    if (slot != NULL) {
+        stat_expired++;
+        callback = slot_release_locked(slot, &arg);
+    }
+    portEXIT_CRITICAL(&publish_lock);
+    if (callback != NULL) {
+        callback(ESP_ERR_TIMEOUT, msg_id, arg);
+    }
+}
+
+void publish_manager_write_json(json_writer_t *w, const char *key)
+{
+    size_t inflight_bytes;
+
+    portENTER_CRITICAL(&publish_lock);
+    size_t count = slots_used_locked(false, &inflight_bytes);
+    size_t bytes = outbox_cached;
+    uint32_t inflight_peak = stat_inflight_peak;
+    uint32_t outbox_peak = stat_outbox_peak;
+    uint32_t window_full = stat_window_full;
+    uint32_t high_water = stat_high_water;
+    uint32_t expired = stat_expired;
+    uint32_t failed = stat_failed;
+    stat_inflight_peak = count;
+    stat_outbox_peak = bytes;
+    stat_window_full = 0;
+    stat_high_water = 0;
+    stat_expired = 0;
+    stat_failed = 0;
+    portEXIT_CRITICAL(&publish_lock);
+
+    json_writer_begin_object(w, key);
+    json_writer_add_uint(w, "inflight", count);
+    json_writer_add_uint(w, "inflight_bytes", inflight_bytes);
+    json_writer_add_uint(w, "inflight_peak", inflight_peak);
+    json_writer_add_uint(w, "outbox_bytes", bytes);
+    json_writer_add_uint(w, "outbox_peak", outbox_peak);
+    json_writer_add_uint(w, "window_full", window_full);
+    json_writer_add_uint(w, "high_water", high_water);
+    json_writer_add_uint(w, "expired", expired);
+    json_writer_add_uint(w, "failed", failed);
+    json_writer_end_object(w);
+}
@@ -0,0 +1,195 @@
+/**
+ * @file publish_manager.h
+ * @brief Flow control and the single publisher for outgoing messages
+ *
+ * esp-mqtt keeps every QoS 1 message in its heap-allocated outbox until the
+ * PUBACK arrives, so publishing faster than the uplink drains grows it
+ * without bound. Bulk publishers (telemetry) go through this module, which
+ * admits at most CONFIG_AWS_IOT_PUBLISH_MAX_INFLIGHT unacknowledged messages
+ * and tracks the outbox against a high/low-water pair. What to do while the
+ * outbox is above the high-water mark is up to the caller, according to
+ * publish_manager_policy().
+ *
+ * Publishing never blocks the producer: esp_mqtt_client_publish() takes the
+ * client lock and may wait on a socket write for up to the network timeout,
+ * so the payload is copied into one of the window's slots and published by
+ * a dedicated publisher task. The producer hears back through an optional
+ * completion callback. Messages are matched to their PUBACK or outbox
+ * expiry by msg_id; like metrics_publish_sent(), both orders of publish and
+ * PUBACK are handled.
+ *
+ * Every publish in the firmware goes through here. With MQTT 5
+ * (CONFIG_AWS_IOT_MQTT_PROTOCOL_5) esp-mqtt keeps publish properties as
+ * per-client state consumed by the next publish from any task, so the
+ * publisher task must be the only one publishing for properties to land on
+ * the right message. Control traffic (shadow, command responses, metrics)
+ * has PUBLISH_CONTROL_SLOTS slots of its own, so a full telemetry window
+ * never holds it up.
+ */
+
+#ifndef PUBLISH_MANAGER_H
+#define PUBLISH_MANAGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "json_writer.h"
+#include "mqtt_client.h"
+
+/**
+ * @brief Slots reserved for control messages, on top of the bulk window
+ */
+#define PUBLISH_CONTROL_SLOTS 4
+
+/**
+ * @brief Longest accepted topic, including the terminator
+ */
+#define PUBLISH_MAX_TOPIC_LEN 128
+
+/**
+ * @brief Longest MQTT 5 correlation data
+ */
+#define PUBLISH_MAX_CORRELATION_LEN 32
+
+/**
+ * @brief Most MQTT 5 user properties on one message
+ */
+#define PUBLISH_MAX_USER_PROPERTIES 4
+
+/**
+ * @brief What bulk publishers do while the outbox is above the high-water mark
+ */
+typedef enum {
+    PUBLISH_POLICY_DROP_OLDEST, ///< Stop publishing; the ring buffer overwrites its oldest samples
+    PUBLISH_POLICY_DOWNSAMPLE,  ///< Keep publishing, but store only every Nth sample
+    PUBLISH_POLICY_SPILL,       ///< Stop publishing and move full batches to the flash spool
+} publish_policy_t;
+
+/**
+ * @brief Called once a message has been acknowledged or given up on
+ *
+ * Runs in the MQTT task (PUBACK, expiry) or the publisher task (rejected by
+ * the client); must not block.
+ *
+ * @param result ESP_OK on PUBACK, ESP_ERR_TIMEOUT if the message left the
+ *               outbox unacknowledged, ESP_FAIL if the client rejected it
+ *               (e.g. the outbox limit was reached)
+ * @param msg_id Message id, negative if the client rejected it
+ * @param arg User argument
+ */
+typedef void (*publish_done_cb_t)(esp_err_t result, int msg_id, void *arg);
+
+/**
+ * @brief MQTT 5 user property
+ */
+typedef struct {
+    const char *key;
+    const char *value;
+} publish_user_property_t;
+
+/**
+ * @brief Message to publish
+ *
+ * Topic, payload and correlation data are copied. The content type and user
+ * properties are referenced until the message completes and are normally
+ * string literals. MQTT 5 properties are ignored on MQTT 3.1.1 connections.
+ */
+typedef struct {
+    const char *topic;
+    const void *data;
+    size_t len;
+    int qos;                        ///< 0 or 1
+    bool control;                   ///< Use the control slots instead of the bulk window
+    const char *content_type;       ///< MQTT 5 content type, may be NULL
+    const publish_user_property_t *user_properties;
+    size_t user_property_count;
+    const void *correlation_data;   ///< MQTT 5 correlation data, may be NULL
+    size_t correlation_len;
+    publish_done_cb_t callback;     ///< Optional completion callback
+    void *arg;                      ///< User argument for the callback
+} publish_message_t;
+
+/**
+ * @brief Allocate the window's slots and start the publisher task
+ * @param client MQTT client handle
+ * @return ESP_OK on success, ESP_ERR_INVALID_STATE if already initialized,
+ *         ESP_ERR_NO_MEM if the slots or task could not be allocated
+ */
+esp_err_t publish_manager_init(esp_mqtt_client_handle_t client);
+
+/**
+ * @brief Queue a message if its window has room
+ *
+ * Returns immediately whatever the network state: the message is copied and
+ * published by the publisher task. Safe to call from any task, including
+ * the MQTT event handler, but not from an ISR. QoS 0 messages complete as
+ * soon as they are written.
+ *
+ * @param msg Message
+ * @return ESP_OK if queued (the callback will run exactly once),
+ *         ESP_ERR_NO_MEM if the window is full (nothing was queued),
+ *         ESP_ERR_INVALID_SIZE if the topic, payload, correlation data or
+ *         user properties are too long, ESP_ERR_INVALID_STATE before init
+ */
+esp_err_t publish_manager_publish(const publish_message_t *msg);
+
+/**
+ * @brief Check whether a bulk message would be admitted
+ * @return true if fewer than CONFIG_AWS_IOT_PUBLISH_MAX_INFLIGHT bulk
+ *         messages are queued or unacknowledged
+ */
+bool publish_manager_window_open(void);
+
+/**
+ * @brief Get the number of messages queued or awaiting PUBACK
+ * @return Bulk and control messages in flight
+ */
+size_t publish_manager_pending(void);
+
+/**
+ * @brief Check the outbox against the high-water mark
+ *
+ * Becomes true once the outbox holds CONFIG_AWS_IOT_PUBLISH_OUTBOX_HIGH_WATER
+ * bytes and false again once it is back below
+ * CONFIG_AWS_IOT_PUBLISH_OUTBOX_LOW_WATER. Uses the outbox size last seen
+ * by the publisher and MQTT tasks, so it never takes the client lock.
+ *
+ * @return true while above the high-water mark
+ */
+bool publish_manager_high_water(void);
+
+/**
+ * @brief Get the configured high-water policy
+ * @return CONFIG_AWS_IOT_PUBLISH_HIGH_WATER_POLICY
+ */
+publish_policy_t publish_manager_policy(void);
+
+/**
+ * @brief Note a PUBACK (MQTT_EVENT_PUBLISHED), from the MQTT event handler
+ * @param msg_id Acknowledged message id
+ */
+void publish_manager_acked(int msg_id);
+
+/**
+ * @brief Note a message dropped from the outbox unacknowledged
+ *        (MQTT_EVENT_DELETED), from the MQTT event handler
+ * @param msg_id Expired message id
+ */
+void publish_manager_deleted(int msg_id);
+
+/**
+ * @brief Write flow-control counters as a JSON object member and reset them
+ *
+ * Format: {"inflight":n,"inflight_bytes":n,"inflight_peak":n,
+ * "outbox_bytes":n,"outbox_peak":n,"window_full":n,"high_water":n,
+ * "expired":n,"failed":n}. The inflight counts cover bulk and control
+ * messages. Peaks cover the interval since the last report, window_full
+ * counts deferred publishes and high_water counts crossings of the
+ * high-water mark.
+ *
+ * @param w Writer positioned inside an object
+ * @param key Member name
+ */
+void publish_manager_write_json(json_writer_t *w, const char *key);
+
+#endif // PUBLISH_MANAGER_H
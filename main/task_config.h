@@ -0,0 +1,67 @@
+/**
+ * @file task_config.h
+ * @brief Core affinity, priority and stack layout for every firmware task
+ *
+ * Network-facing work (WiFi, LwIP, event loop, MQTT, publisher) runs on
+ * PRO_CPU (core 0) and application work (telemetry, commands, monitoring)
+ * runs on APP_CPU (core 1), so sampling and command handlers never compete
+ * with the radio and TCP/IP stack for CPU time.
+ *
+ * Tasks owned by ESP-IDF are placed through sdkconfig:
+ *   WiFi   CONFIG_ESP_WIFI_TASK_PINNED_TO_CORE_0   core 0, priority 23
+ *   LwIP   CONFIG_LWIP_TCPIP_TASK_AFFINITY_CPU0    core 0, priority 18
+ *   MQTT   CONFIG_MQTT_USE_CORE_0                  core 0, priority below
+ */
+
+#ifndef TASK_CONFIG_H
+#define TASK_CONFIG_H
+
+#define TASK_CORE_NETWORK 0
+#define TASK_CORE_APP 1
+
+// esp-mqtt client task (core selected via CONFIG_MQTT_USE_CORE_0)
+#define MQTT_TASK_PRIORITY 6
+#define MQTT_TASK_STACK_SIZE 6144
+
+// Publisher for queued QoS 1 messages (the socket write happens here)
+#define PUBLISH_TASK_PRIORITY 5
+#define PUBLISH_TASK_STACK_SIZE 4096
+#define PUBLISH_TASK_CORE TASK_CORE_NETWORK
+
+// Telemetry sampling and publishing
+#define TELEMETRY_TASK_PRIORITY 5
+#define TELEMETRY_TASK_STACK_SIZE 4096
+#define TELEMETRY_TASK_CORE TASK_CORE_APP
+
+// Command worker pool
+#define COMMAND_WORKER_PRIORITY 4
+#define COMMAND_WORKER_STACK_SIZE 4096
+#define COMMAND_WORKER_CORE TASK_CORE_APP
+
+// One-shot MQTT client restart after a credential change
+#define MQTT_RESTART_TASK_PRIORITY 3
+#define MQTT_RESTART_TASK_STACK_SIZE 4096
+#define MQTT_RESTART_TASK_CORE TASK_CORE_APP
+
+// WiFi/cellular failover supervisor (blocks on modem AT commands)
+#define LINK_SUPERVISOR_PRIORITY 3
+#define LINK_SUPERVISOR_STACK_SIZE 4096
+#define LINK_SUPERVISOR_CORE TASK_CORE_APP
+
+// Per-task CPU usage reporting
+#define TASK_MONITOR_PRIORITY 1
+#define TASK_MONITOR_STACK_SIZE 3072
+#define TASK_MONITOR_CORE TASK_CORE_APP
+
+// Benchmark cases (bench.h), one short-lived task each so the stack
+// high-water mark is the case's own
+#define BENCH_TASK_PRIORITY 4
+#define BENCH_TASK_STACK_SIZE 4096
+#define BENCH_TASK_CORE TASK_CORE_APP
+
+// Soak-test publisher (bench.h)
+#define SOAK_TASK_PRIORITY 4
+#define SOAK_TASK_STACK_SIZE 4096
+#define SOAK_TASK_CORE TASK_CORE_APP
+
+#endif // TASK_CONFIG_H
@@ -0,0 +1,108 @@
+/**
+ * @file task_monitor.c
+ * @brief Periodic per-task CPU usage report
+ */
+
+#include <string.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "task_config.h"
+#include "task_monitor.h"
+
+static const char *TAG = "TASK_MONITOR";
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+
+#define TASK_MONITOR_MAX_TASKS 40
+
+typedef struct {
+    TaskHandle_t handle;
+    uint32_t run_time;
+} task_sample_t;
+
+static TaskStatus_t task_status[TASK_MONITOR_MAX_TASKS];
+static task_sample_t previous[TASK_MONITOR_MAX_TASKS];
+static size_t previous_count = 0;
+static uint32_t previous_total = 0;
+
+static uint32_t previous_run_time(TaskHandle_t handle)
+{
+    for (size_t i = 0; i < previous_count; i++) {
+        if (previous[i].handle == handle) {
+            return previous[i].run_time;
+        }
+    }
+    return 0;
+}
+
+static void report_cpu_usage(void)
+{
+    uint32_t total = 0;
+    UBaseType_t count = uxTaskGetSystemState(task_status, TASK_MONITOR_MAX_TASKS, &total);
+    if (count == 0) {
+        ESP_LOGW(TAG, "More than %d tasks, skipping report", TASK_MONITOR_MAX_TASKS);
+        return;
+    }
+
+    // Percentages are of one core; a dual-core system sums to 200%
+    uint32_t elapsed = total - previous_total;
+    if (previous_total != 0 && elapsed > 0) {
+        ESP_LOGI(TAG, "%-16s %4s %4s %7s %6s", "task", "core", "prio", "cpu%", "stack");
+        for (UBaseType_t i = 0; i < count; i++) {
+            const TaskStatus_t *t = &task_status[i];
+            uint32_t delta = t->ulRunTimeCounter - previous_run_time(t->xHandle);
+            uint32_t permille = (uint32_t)((uint64_t)delta * 1000 / elapsed);
+#if CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+            int core = t->xCoreID == tskNO_AFFINITY ? -1 : (int)t->xCoreID;
+#else
+            int core = -1;
+#endif
+            ESP_LOGI(TAG, "%-16s %4d %4u %3lu.%lu%% %6lu", t->pcTaskName, core,
+                     (unsigned)t->uxCurrentPriority, (unsigned long)(permille / 10),
+                     (unsigned long)(permille % 10), (unsigned long)t->usStackHighWaterMark);
+        }
+    }
+
+    for (UBaseType_t i = 0; i < count; i++) {
+        previous[i].handle = task_status[i].xHandle;
+        previous[i].run_time = task_status[i].ulRunTimeCounter;
+    }
+    previous_count = count;
+    previous_total = total;
+}
+
+static void task_monitor_task(void *pvParameters)
+{
+    uint32_t interval_ms = (uint32_t)(uintptr_t)pvParameters;
+
+    while (1) {
+        report_cpu_usage();
+        vTaskDelay(pdMS_TO_TICKS(interval_ms));
+    }
+}
+
+esp_err_t task_monitor_start(uint32_t interval_ms)
+{
+    if (interval_ms == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (xTaskCreatePinnedToCore(task_monitor_task, "task_monitor", TASK_MONITOR_STACK_SIZE,
+                                (void *)(uintptr_t)interval_ms, TASK_MONITOR_PRIORITY,
+                                NULL, TASK_MONITOR_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create task monitor");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+#else
+
+esp_err_t task_monitor_start(uint32_t interval_ms)
+{
+    ESP_LOGW(TAG, "Run-time stats disabled, enable CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
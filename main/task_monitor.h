@@ -0,0 +1,23 @@
+/**
+ * @file task_monitor.h
+ * @brief Periodic per-task CPU usage report
+ *
+ * Requires CONFIG_FREERTOS_USE_TRACE_FACILITY and
+ * CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS; core IDs are included when
+ * CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID is set.
+ */
+
+#ifndef TASK_MONITOR_H
+#define TASK_MONITOR_H
+
+#include <stdint.h>
+#include "esp_err.h"
+
+/**
+ * @brief Start logging per-task CPU usage every interval
+ * @param interval_ms Report interval
+ * @return ESP_OK on success, ESP_ERR_NOT_SUPPORTED if run-time stats are disabled
+ */
+esp_err_t task_monitor_start(uint32_t interval_ms);
+
+#endif // TASK_MONITOR_H
@@ -0,0 +1,442 @@
+/**
+ * @file telemetry.c
+ * @brief Batched telemetry pipeline for ESP32-S3
+ */
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "boot_timing.h"
+#include "cbor_writer.h"
+#include "duty_cycle.h"
+#include "json_writer.h"
+#include "mem_budget.h"
+#include "mqtt_session.h"
+#include "metrics.h"
+#include "payload_compress.h"
+#include "publish_manager.h"
+#include "telemetry.h"
+#include "tls_transport.h"
+
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+#include "esp_rtc_time.h"
+#endif
+
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_TELEMETRY
+#include "app_log.h"
+
+static const char *TAG = "TELEMETRY";
+
+#define TELEMETRY_RING_CAPACITY CONFIG_AWS_IOT_TELEMETRY_RING_CAPACITY
+#define TELEMETRY_BATCH_MAX_AGE_MS CONFIG_AWS_IOT_TELEMETRY_BATCH_MAX_AGE_MS
+#define TELEMETRY_HEARTBEAT_MS CONFIG_AWS_IOT_TELEMETRY_HEARTBEAT_MS
+
+// Duty-cycled builds keep the ring in RTC memory so samples survive deep sleep
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+#define TELEMETRY_RETAINED RTC_DATA_ATTR
+#else
+#define TELEMETRY_RETAINED
+#endif
+
+// Ring buffer storage - owned by the telemetry task, not thread-safe
+static TELEMETRY_RETAINED telemetry_sample_t ring[TELEMETRY_RING_CAPACITY];
+static TELEMETRY_RETAINED size_t ring_head;     // Index of the oldest sample
+static TELEMETRY_RETAINED size_t ring_count;
+static RTC_DATA_ATTR uint32_t sample_sequence;  // Zeroed on power-on only
+// Last stored sample, the reference for deadband checks
+static TELEMETRY_RETAINED telemetry_value_t last_values[TELEMETRY_MAX_FIELDS];
+static TELEMETRY_RETAINED int64_t last_stored_ms;
+static TELEMETRY_RETAINED bool last_valid;
+static uint32_t dropped_samples = 0;
+static uint32_t suppressed_samples = 0;
+static char device_id[64] = {0};
+static size_t flush_threshold = TELEMETRY_BATCH_SIZE;
+static int64_t batch_max_age_ms = TELEMETRY_BATCH_MAX_AGE_MS;
+static uint32_t decimation = 1;
+static uint32_t decimation_phase = 0;
+static telemetry_encoding_t encoding = CONFIG_AWS_IOT_TELEMETRY_ENCODING_CBOR ? TELEMETRY_ENCODING_CBOR
+                                                                               : TELEMETRY_ENCODING_JSON;
+
+static telemetry_value_t sample_free_heap(void)
+{
+    return (telemetry_value_t) {.u = esp_get_free_heap_size()};
+}
+
+static telemetry_value_t sample_min_free_heap(void)
+{
+    return (telemetry_value_t) {.u = esp_get_minimum_free_heap_size()};
+}
+
+static telemetry_value_t sample_largest_free_block(void)
+{
+    return (telemetry_value_t) {.u = mem_budget_largest_free_internal()};
+}
+
+static telemetry_value_t sample_heap_fragmentation(void)
+{
+    return (telemetry_value_t) {.u = mem_budget_fragmentation_internal()};
+}
+
+// Sampled fields; bump TELEMETRY_SCHEMA_VERSION when changing this table
+static const telemetry_field_t fields[] = {
+    {"free_heap", TELEMETRY_FIELD_UINT, sample_free_heap, 1024},
+    {"min_free_heap", TELEMETRY_FIELD_UINT, sample_min_free_heap, 0},
+    {"largest_free_block", TELEMETRY_FIELD_UINT, sample_largest_free_block, 1024},
+    {"heap_fragmentation", TELEMETRY_FIELD_UINT, sample_heap_fragmentation, 5},
+};
+
+#define FIELD_COUNT (sizeof(fields) / sizeof(fields[0]))
+_Static_assert(FIELD_COUNT <= TELEMETRY_MAX_FIELDS, "Raise TELEMETRY_MAX_FIELDS");
+
+typedef size_t (*batch_encoder_t)(const telemetry_sample_t *samples, size_t count,
+                                  char *buf, size_t buf_len, size_t *out_len);
+
+esp_err_t telemetry_init(const char *id)
+{
+    if (id == NULL) {
+        ESP_LOGE(TAG, "Device ID cannot be NULL");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    strncpy(device_id, id, sizeof(device_id) - 1);
+    device_id[sizeof(device_id) - 1] = '\0';
+
+    if (esp_reset_reason() != ESP_RST_DEEPSLEEP) {
+        ring_head = 0;
+        ring_count = 0;
+        last_valid = false;
+    }
+
+    ESP_LOGI(TAG, "Telemetry initialized: ring=%d, batch=%d, max_age=%dms, schema %d, %s",
+             TELEMETRY_RING_CAPACITY, TELEMETRY_BATCH_SIZE, TELEMETRY_BATCH_MAX_AGE_MS,
+             TELEMETRY_SCHEMA_VERSION, encoding == TELEMETRY_ENCODING_CBOR ? "cbor" : "json");
+    return ESP_OK;
+}
+
+int64_t telemetry_now_ms(void)
+{
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+    // esp_timer restarts at every wake; the RTC timer runs through deep sleep
+    return esp_rtc_get_time_us() / 1000;
+#else
+    return esp_timer_get_time() / 1000;
+#endif
+}
+
+void telemetry_set_batch_policy(size_t threshold, int64_t max_age_ms)
+{
+    flush_threshold = threshold < TELEMETRY_RING_CAPACITY ? threshold : TELEMETRY_RING_CAPACITY;
+    batch_max_age_ms = max_age_ms;
+    ESP_LOGI(TAG, "Batch policy: flush at %u samples or %lld ms",
+             (unsigned)flush_threshold, (long long)batch_max_age_ms);
+}
+
+void telemetry_set_decimation(uint32_t factor)
+{
+    factor = factor > 1 ? factor : 1;
+    if (factor != decimation) {
+        decimation = factor;
+        decimation_phase = 0;
+        ESP_LOGI(TAG, "Keeping 1 in %u samples", (unsigned)decimation);
+    }
+}
+
+void telemetry_set_encoding(telemetry_encoding_t new_encoding)
+{
+    encoding = new_encoding;
+}
+
+telemetry_encoding_t telemetry_get_encoding(void)
+{
+    return encoding;
+}
+
+static double field_as_double(const telemetry_field_t *field, telemetry_value_t value)
+{
+    switch (field->type) {
+    case TELEMETRY_FIELD_UINT:
+        return value.u;
+    case TELEMETRY_FIELD_INT:
+        return value.i;
+    case TELEMETRY_FIELD_FLOAT:
+        return value.f;
+    case TELEMETRY_FIELD_BOOL:
+        return value.b;
+    }
+    return 0;
+}
+
+static bool outside_deadband(const telemetry_value_t *values)
+{
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        double delta = field_as_double(&fields[i], values[i]) - field_as_double(&fields[i], last_values[i]);
+        if (fabs(delta) > fields[i].deadband) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool telemetry_sample(void)
+{
+    telemetry_value_t values[TELEMETRY_MAX_FIELDS];
+    int64_t now_ms = telemetry_now_ms();
+    size_t slot;
+
+    if (decimation > 1 && decimation_phase++ % decimation != 0) {
+        suppressed_samples++;
+        return false;
+    }
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        values[i] = fields[i].sample();
+    }
+    if (last_valid && now_ms - last_stored_ms < TELEMETRY_HEARTBEAT_MS && !outside_deadband(values)) {
+        suppressed_samples++;
+        return false;
+    }
+    memcpy(last_values, values, sizeof(last_values));
+    last_stored_ms = now_ms;
+    last_valid = true;
+
+    if (ring_count == TELEMETRY_RING_CAPACITY) {
+        // Overwrite the oldest sample
+        slot = ring_head;
+        ring_head = (ring_head + 1) % TELEMETRY_RING_CAPACITY;
+        dropped_samples++;
+    } else {
+        slot = (ring_head + ring_count) % TELEMETRY_RING_CAPACITY;
+        ring_count++;
+    }
+
+    ring[slot].timestamp_ms = now_ms;
+    ring[slot].sequence = ++sample_sequence;
+    memcpy(ring[slot].values, values, sizeof(ring[slot].values));
+    return true;
+}
+
+size_t telemetry_pending_count(void)
+{
+    return ring_count;
+}
+
+bool telemetry_flush_due(int64_t now_ms)
+{
+    if (ring_count == 0) {
+        return false;
+    }
+    if (ring_count >= flush_threshold) {
+        return true;
+    }
+    return (now_ms - ring[ring_head].timestamp_ms) >= batch_max_age_ms;
+}
+
+static void json_add_field(json_writer_t *w, const telemetry_field_t *field, telemetry_value_t value)
+{
+    switch (field->type) {
+    case TELEMETRY_FIELD_UINT:
+        json_writer_add_uint(w, field->name, value.u);
+        break;
+    case TELEMETRY_FIELD_INT:
+        json_writer_add_int(w, field->name, value.i);
+        break;
+    case TELEMETRY_FIELD_FLOAT:
+        json_writer_add_double(w, field->name, value.f);
+        break;
+    case TELEMETRY_FIELD_BOOL:
+        json_writer_add_bool(w, field->name, value.b);
+        break;
+    }
+}
+
+/**
+ * Integers are written as the change from the previous sample, if any;
+ * slowly moving values then take one or two bytes
+ */
+static void cbor_add_field(cbor_writer_t *w, const telemetry_field_t *field, telemetry_value_t value,
+                           const telemetry_value_t *previous)
+{
+    switch (field->type) {
+    case TELEMETRY_FIELD_UINT:
+        if (previous != NULL) {
+            cbor_writer_add_int(w, (int64_t)value.u - (int64_t)previous->u);
+        } else {
+            cbor_writer_add_uint(w, value.u);
+        }
+        break;
+    case TELEMETRY_FIELD_INT:
+        cbor_writer_add_int(w, previous != NULL ? (int64_t)value.i - previous->i : value.i);
+        break;
+    case TELEMETRY_FIELD_FLOAT:
+        cbor_writer_add_float(w, value.f);
+        break;
+    case TELEMETRY_FIELD_BOOL:
+        cbor_writer_add_bool(w, value.b);
+        break;
+    }
+}
+
+static size_t encode_json(const telemetry_sample_t *samples, size_t count,
+                          char *buf, size_t buf_len, size_t *out_len)
+{
+    json_writer_t w;
+    json_writer_init(&w, buf, buf_len);
+    json_writer_begin_object(&w, NULL);
+    json_writer_add_uint(&w, "schema", TELEMETRY_SCHEMA_VERSION);
+    json_writer_add_string(&w, "device_id", device_id);
+    json_writer_begin_array(&w, "samples");
+
+    size_t encoded = 0;
+    while (encoded < count) {
+        const telemetry_sample_t *s = &samples[encoded];
+        json_writer_t before = w;
+
+        json_writer_begin_object(&w, NULL);
+        json_writer_add_int(&w, "timestamp", s->timestamp_ms);
+        json_writer_add_uint(&w, "message_count", s->sequence);
+        for (size_t i = 0; i < FIELD_COUNT; i++) {
+            json_add_field(&w, &fields[i], s->values[i]);
+        }
+        json_writer_end_object(&w);
+
+        // Keep room for the closing "]}"
+        if (w.overflow || w.size - w.len <= 2) {
+            w = before;
+            break;
+        }
+        encoded++;
+    }
+
+    json_writer_end_array(&w);
+    json_writer_end_object(&w);
+    if (encoded == 0 || json_writer_finish(&w, out_len) != ESP_OK) {
+        return 0;
+    }
+    return encoded;
+}
+
+static size_t encode_cbor(const telemetry_sample_t *samples, size_t count,
+                          char *buf, size_t buf_len, size_t *out_len)
+{
+    const telemetry_sample_t *first = &samples[0];
+    cbor_writer_t w;
+
+    cbor_writer_init(&w, buf, buf_len);
+    cbor_writer_add_tag(&w, CBOR_TAG_SELF_DESCRIBE);
+    cbor_writer_begin_array(&w, 5);
+    cbor_writer_add_uint(&w, TELEMETRY_SCHEMA_VERSION);
+    cbor_writer_add_text(&w, device_id);
+    cbor_writer_add_int(&w, first->timestamp_ms);
+    cbor_writer_add_uint(&w, first->sequence);
+    cbor_writer_begin_indefinite_array(&w);
+
+    size_t encoded = 0;
+    while (encoded < count) {
+        const telemetry_sample_t *s = &samples[encoded];
+        cbor_writer_t before = w;
+
+        // Deltas from the first sample: a second apart and consecutive
+        // sequence numbers encode in three and one bytes
+        cbor_writer_begin_array(&w, 2 + FIELD_COUNT);
+        cbor_writer_add_int(&w, s->timestamp_ms - first->timestamp_ms);
+        cbor_writer_add_uint(&w, s->sequence - first->sequence);
+        for (size_t i = 0; i < FIELD_COUNT; i++) {
+            cbor_add_field(&w, &fields[i], s->values[i], encoded > 0 ? &samples[encoded - 1].values[i] : NULL);
+        }
+
+        // Keep room for the closing break
+        if (w.overflow || w.size - w.len < 1) {
+            w = before;
+            break;
+        }
+        encoded++;
+    }
+
+    cbor_writer_end_indefinite(&w);
+    if (encoded == 0 || cbor_writer_finish(&w, out_len) != ESP_OK) {
+        return 0;
+    }
+    return encoded;
+}
+
+static const batch_encoder_t encoders[] = {
+    [TELEMETRY_ENCODING_JSON] = encode_json,
+    [TELEMETRY_ENCODING_CBOR] = encode_cbor,
+};
+
+size_t telemetry_encode_samples(const telemetry_sample_t *samples, size_t count,
+                                char *buf, size_t buf_len, size_t *out_len)
+{
+    if (samples == NULL || buf == NULL || out_len == NULL || count == 0) {
+        return 0;
+    }
+
+    size_t encoded = encoders[encoding](samples, count, buf, buf_len, out_len);
+    if (encoded == 0) {
+        ESP_LOGE(TAG, "Batch buffer too small for a single sample");
+    }
+    return encoded;
+}
+
+size_t telemetry_encode_batch(char *buf, size_t buf_len, size_t *out_len)
+{
+    telemetry_sample_t batch[TELEMETRY_BATCH_SIZE];
+    size_t count = telemetry_peek(batch, TELEMETRY_BATCH_SIZE);
+
+    if (dropped_samples > 0) {
+        ESP_LOGW(TAG, "%" PRIu32 " samples overwritten before publish", dropped_samples);
+        dropped_samples = 0;
+    }
+    return telemetry_encode_samples(batch, count, buf, buf_len, out_len);
+}
+
+esp_err_t telemetry_encode_metrics(char *buf, size_t buf_len, size_t *out_len)
+{
+    if (buf == NULL || out_len == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    json_writer_t w;
+    json_writer_init(&w, buf, buf_len);
+    json_writer_begin_object(&w, NULL);
+    json_writer_add_string(&w, "device_id", device_id);
+    json_writer_add_int(&w, "uptime_ms", esp_timer_get_time() / 1000);
+    json_writer_add_uint(&w, "suppressed_samples", suppressed_samples);
+    suppressed_samples = 0;
+    metrics_write_json(&w, "latency", true);
+#if CONFIG_AWS_IOT_DUTY_CYCLE_ENABLE
+    // Timings of the previous cycle; this one is still in progress
+    duty_cycle_write_json(&w, "duty_cycle");
+#else
+    boot_timing_write_json(&w, "boot");
+#endif
+#if CONFIG_AWS_IOT_TELEMETRY_COMPRESS
+    payload_compress_write_json(&w, "compression");
+#endif
+    publish_manager_write_json(&w, "publish");
+    mem_budget_write_json(&w, "memory");
+    mqtt_session_write_json(&w, "session");
+    tls_transport_write_json(&w, "tls");
+    json_writer_end_object(&w);
+    return json_writer_finish(&w, out_len);
+}
+
+size_t telemetry_peek(telemetry_sample_t *out, size_t max)
+{
+    size_t count = ring_count < max ? ring_count : max;
+    for (size_t i = 0; i < count; i++) {
+        out[i] = ring[(ring_head + i) % TELEMETRY_RING_CAPACITY];
+    }
+    return count;
+}
+
+void telemetry_consume(size_t count)
+{
+    if (count > ring_count) {
+        count = ring_count;
+    }
+    ring_head = (ring_head + count) % TELEMETRY_RING_CAPACITY;
+    ring_count -= count;
+}
@@ -0,0 +1,225 @@
+/**
+ * @file telemetry.h
+ * @brief Batched telemetry pipeline header
+ *
+ * Samples are captured into a fixed-size ring buffer by the sampling stage
+ * and flushed as a single batch message by the publish stage once the batch
+ * is full or the oldest sample exceeds the maximum batch age.
+ *
+ * What a sample holds is declared by the field table in telemetry.c (name,
+ * type, sampler, deadband); TELEMETRY_SCHEMA_VERSION must be bumped whenever
+ * it changes. A sample is only stored when some field moved by more than its
+ * deadband since the last stored sample, or when
+ * CONFIG_AWS_IOT_TELEMETRY_HEARTBEAT_MS has passed without one.
+ *
+ * Batches are encoded as JSON, for debugging, or CBOR:
+ *
+ *   55799([schema, device_id, t0_ms, seq0, [_ [dt_ms, dseq, field...], ...]])
+ *
+ * where each sample's time and sequence are deltas from t0_ms and seq0 and
+ * fields follow the table order. Integer fields of every sample but the
+ * first are deltas from the previous sample in the batch. The self-describe
+ * tag makes CBOR batches start with d9 d9 f7, JSON batches start with '{'.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "aws_iot_config.h"
+
+/**
+ * @brief Maximum number of samples in one published batch
+ */
+#define TELEMETRY_BATCH_SIZE CONFIG_AWS_IOT_TELEMETRY_BATCH_SIZE
+
+/**
+ * @brief Version of the batch layout and field table, sent in every batch
+ */
+#define TELEMETRY_SCHEMA_VERSION 4
+
+/**
+ * @brief Maximum number of fields in the field table
+ */
+#define TELEMETRY_MAX_FIELDS 4
+
+/**
+ * @brief Type of a telemetry field
+ */
+typedef enum {
+    TELEMETRY_FIELD_UINT,
+    TELEMETRY_FIELD_INT,
+    TELEMETRY_FIELD_FLOAT,
+    TELEMETRY_FIELD_BOOL,
+} telemetry_field_type_t;
+
+/**
+ * @brief Value of one field; the member used follows the field type
+ */
+typedef union {
+    uint32_t u;
+    int32_t i;
+    float f;
+    bool b;
+} telemetry_value_t;
+
+/**
+ * @brief Field table entry
+ */
+typedef struct {
+    const char *name;                   ///< JSON member name
+    telemetry_field_type_t type;
+    telemetry_value_t (*sample)(void);  ///< Called on the telemetry task at capture time
+    float deadband;                     ///< Change that makes a sample worth storing; 0 for any change
+} telemetry_field_t;
+
+/**
+ * @brief Batch encodings
+ */
+typedef enum {
+    TELEMETRY_ENCODING_JSON,
+    TELEMETRY_ENCODING_CBOR,
+} telemetry_encoding_t;
+
+/**
+ * @brief Compact telemetry sample as stored in the ring buffer
+ */
+typedef struct {
+    int64_t timestamp_ms;   ///< Capture time, see telemetry_now_ms()
+    uint32_t sequence;      ///< Monotonic sample sequence number
+    telemetry_value_t values[TELEMETRY_MAX_FIELDS];  ///< In field table order
+} telemetry_sample_t;
+
+/**
+ * @brief Initialize the telemetry ring buffer
+ * @param device_id Device identifier included in every batch
+ * @return ESP_OK on success
+ */
+esp_err_t telemetry_init(const char *device_id);
+
+/**
+ * @brief Get the telemetry clock
+ *
+ * Milliseconds since boot, or since power-on across deep sleeps in
+ * duty-cycled builds.
+ *
+ * @return Current time in ms
+ */
+int64_t telemetry_now_ms(void);
+
+/**
+ * @brief Change when telemetry_flush_due() reports a batch as due
+ *
+ * Used to batch harder on metered links. Messages still carry at most
+ * TELEMETRY_BATCH_SIZE samples; a higher threshold flushes several batches
+ * back to back.
+ *
+ * @param flush_threshold Buffered samples that make a flush due (clamped to
+ *                        the ring capacity)
+ * @param max_age_ms Age of the oldest sample that makes a flush due
+ */
+void telemetry_set_batch_policy(size_t flush_threshold, int64_t max_age_ms);
+
+/**
+ * @brief Keep only every Nth call to telemetry_sample()
+ *
+ * Used to shed load while the MQTT outbox is congested. Skipped calls do
+ * not sample at all and are counted as suppressed.
+ *
+ * @param factor Keep one call in factor; 0 and 1 keep every call
+ */
+void telemetry_set_decimation(uint32_t factor);
+
+/**
+ * @brief Select the encoding of batch messages
+ * @param encoding New encoding
+ */
+void telemetry_set_encoding(telemetry_encoding_t encoding);
+
+/**
+ * @brief Get the encoding of batch messages
+ * @return Current encoding, CONFIG_AWS_IOT_TELEMETRY_ENCODING_CBOR at boot
+ */
+telemetry_encoding_t telemetry_get_encoding(void);
+
+/**
+ * @brief Capture a sample of the current device state into the ring buffer
+ *
+ * The sample is discarded if no field moved past its deadband and the
+ * heartbeat has not expired, or skipped by telemetry_set_decimation(). When
+ * the ring buffer is full the oldest sample is overwritten.
+ *
+ * @return true if the sample was stored
+ */
+bool telemetry_sample(void);
+
+/**
+ * @brief Get the number of buffered samples
+ * @return Samples waiting to be published
+ */
+size_t telemetry_pending_count(void);
+
+/**
+ * @brief Check whether a batch should be flushed
+ * @param now_ms Current time, from telemetry_now_ms()
+ * @return true if the batch is full or the oldest sample is too old
+ */
+bool telemetry_flush_due(int64_t now_ms);
+
+/**
+ * @brief Encode samples as one batch message in the current encoding
+ * @param samples Samples to encode, oldest first
+ * @param count Number of samples
+ * @param buf Output buffer
+ * @param buf_len Output buffer size
+ * @param out_len Length of the encoded message (excluding the NUL of JSON)
+ * @return Number of samples encoded, 0 if nothing fits
+ */
+size_t telemetry_encode_samples(const telemetry_sample_t *samples, size_t count,
+                                char *buf, size_t buf_len, size_t *out_len);
+
+/**
+ * @brief Encode buffered samples as one batch message in the current encoding
+ *
+ * Samples are not removed from the ring buffer; call telemetry_consume()
+ * once the batch has been handed to the MQTT client.
+ *
+ * @param buf Output buffer
+ * @param buf_len Output buffer size
+ * @param out_len Length of the encoded message (excluding NUL)
+ * @return Number of samples encoded, 0 if nothing fits
+ */
+size_t telemetry_encode_batch(char *buf, size_t buf_len, size_t *out_len);
+
+/**
+ * @brief Encode the latency histograms as one JSON metrics message
+ *
+ * Format: {"device_id": "...", "uptime_ms": 123, "latency": {...}}; see
+ * metrics_write_json(). The histograms are reset, so each message covers the
+ * interval since the previous one.
+ *
+ * @param buf Output buffer
+ * @param buf_len Output buffer size
+ * @param out_len Length of the encoded message (excluding NUL)
+ * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if the buffer is too small
+ */
+esp_err_t telemetry_encode_metrics(char *buf, size_t buf_len, size_t *out_len);
+
+/**
+ * @brief Copy the oldest buffered samples without removing them
+ * @param out Output array
+ * @param max Capacity of the output array
+ * @return Number of samples copied
+ */
+size_t telemetry_peek(telemetry_sample_t *out, size_t max);
+
+/**
+ * @brief Drop the oldest samples from the ring buffer
+ * @param count Number of samples to drop
+ */
+void telemetry_consume(size_t count);
+
+#endif // TELEMETRY_H
@@ -0,0 +1,445 @@
+/**
+ * @file tls_transport.c
+ * @brief esp-mqtt transport over esp-tls with TLS session resumption
+ */
+
+// The session start time tells a resumed handshake from a full one
+#define MBEDTLS_ALLOW_PRIVATE_ACCESS
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_tls.h"
+#include "lwip/sockets.h"
+#include "mbedtls/ssl.h"
+#include "aws_iot_config.h"
+#include "sdkconfig.h"
+#include "tls_transport.h"
+
+static const char *TAG = "TLS_TRANSPORT";
+
+#define TLS_SESSION_RESUMPTION CONFIG_AWS_IOT_TLS_SESSION_RESUMPTION
+#define TLS_SESSION_RTC_SIZE CONFIG_AWS_IOT_TLS_SESSION_RTC_SIZE
+
+#if TLS_SESSION_RESUMPTION && !defined(CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS)
+#error "CONFIG_AWS_IOT_TLS_SESSION_RESUMPTION needs CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS=y in sdkconfig"
+#endif
+
+#define TLS_DEFAULT_PORT 8883
+
+typedef struct {
+    uint32_t full;
+    uint32_t resumed;
+    uint32_t failed;
+    uint64_t full_us;
+    uint64_t resumed_us;
+} tls_stats_t;
+
+static esp_transport_handle_t transport;
+static tls_transport_credentials_t credentials;
+static esp_tls_t *tls;
+
+static tls_stats_t stats;
+static tls_transport_error_t last_error;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if TLS_SESSION_RESUMPTION
+/**
+ * esp-tls hands out a client session as a bare mbedtls_ssl_session
+ * (struct esp_tls_client_session in esp_tls_mbedtls.c) and releases it
+ * with mbedtls_ssl_session_free() and free(). A session loaded back from
+ * RTC memory is built in that same shape so it can be offered through
+ * esp_tls_cfg_t.client_session.
+ */
+typedef struct {
+    mbedtls_ssl_session saved_session;
+} tls_client_session_t;
+
+/**
+ * Serialized session. Kept in RTC slow memory so a wake from deep sleep
+ * can resume; zeroed on power-on.
+ */
+typedef struct {
+    uint32_t identity;      ///< session_identity() it was made with
+    mbedtls_time_t start;   ///< Start of the session's full handshake
+    uint32_t len;           ///< Bytes in data, 0 if empty
+    uint8_t data[TLS_SESSION_RTC_SIZE];
+} retained_session_t;
+
+static RTC_DATA_ATTR retained_session_t retained;
+
+// Session offered on the next connect, NULL if there is none
+static esp_tls_client_session_t *session;
+static uint32_t session_id_hash;
+static mbedtls_time_t session_start;
+
+static uint32_t fnv1a(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * A session is only offered to the endpoint it was made with, and only
+ * with the certificate it authenticated, so rotation starts afresh.
+ */
+static uint32_t session_identity(const char *host, int port)
+{
+    uint32_t hash = fnv1a(2166136261u, host, strlen(host));
+    hash = fnv1a(hash, &port, sizeof(port));
+    if (credentials.client_cert != NULL) {
+        hash = fnv1a(hash, credentials.client_cert, strlen(credentials.client_cert));
+    }
+    return hash;
+}
+
+static void session_drop(void)
+{
+    if (session != NULL) {
+        esp_tls_free_client_session(session);
+        session = NULL;
+    }
+    retained.len = 0;
+}
+
+/**
+ * Make sure the session to offer belongs to identity, falling back to the
+ * copy in RTC memory after deep sleep.
+ */
+static void session_prepare(uint32_t identity)
+{
+    if (session != NULL && session_id_hash != identity) {
+        ESP_LOGI(TAG, "Endpoint or certificate changed, dropping TLS session");
+        session_drop();
+    }
+    if (session != NULL || retained.len == 0) {
+        return;
+    }
+    if (retained.identity != identity || retained.len > sizeof(retained.data)) {
+        retained.len = 0;
+        return;
+    }
+
+    tls_client_session_t *restored = calloc(1, sizeof(*restored));
+    if (restored == NULL) {
+        return;
+    }
+    mbedtls_ssl_session_init(&restored->saved_session);
+    if (mbedtls_ssl_session_load(&restored->saved_session, retained.data,
+                                 retained.len) != 0) {
+        ESP_LOGW(TAG, "Retained TLS session unusable, discarded");
+        mbedtls_ssl_session_free(&restored->saved_session);
+        free(restored);
+        retained.len = 0;
+        return;
+    }
+    session = (esp_tls_client_session_t *)restored;
+    session_id_hash = identity;
+    session_start = retained.start;
+    ESP_LOGI(TAG, "TLS session restored from RTC memory");
+}
+
+/**
+ * Keep the session of the handshake that just completed for the next one.
+ * Returns whether the handshake resumed the session that was offered.
+ */
+static bool session_update(uint32_t identity, bool offered)
+{
+    mbedtls_ssl_session current;
+    bool resumed = false;
+
+    mbedtls_ssl_session_init(&current);
+    mbedtls_ssl_context *ssl = esp_tls_get_ssl_context(tls);
+    if (ssl == NULL || mbedtls_ssl_get_session(ssl, &current) != 0) {
+        mbedtls_ssl_session_free(&current);
+        return false;
+    }
+
+    // mbedtls only resets the start time on a full handshake. The session
+    // ID can't be compared: with a ticket the client sends a fresh random
+    // one, which the server echoes back when it accepts the ticket.
+    resumed = offered && current.MBEDTLS_PRIVATE(start) == session_start;
+
+    esp_tls_client_session_t *fresh = esp_tls_get_client_session(tls);
+    if (fresh != NULL) {
+        if (session != NULL) {
+            esp_tls_free_client_session(session);
+        }
+        session = fresh;
+        session_id_hash = identity;
+        session_start = current.MBEDTLS_PRIVATE(start);
+
+        size_t len = 0;
+        if (mbedtls_ssl_session_save(&current, retained.data, sizeof(retained.data),
+                                     &len) == 0) {
+            retained.identity = identity;
+            retained.start = session_start;
+            retained.len = len;
+        } else {
+            // Survives reconnects, just not deep sleep
+            ESP_LOGW(TAG, "TLS session too large for RTC memory (%u bytes)",
+                     (unsigned)sizeof(retained.data));
+            retained.len = 0;
+        }
+    }
+
+    mbedtls_ssl_session_free(&current);
+    return resumed;
+}
+#endif
+
+/**
+ * Keep the connection's esp-tls error for tls_transport_get_last_error().
+ * stack_err is the mbedtls code the failing call returned, used when
+ * esp-tls recorded none.
+ */
+static void record_error(int stack_err, int sock_errno)
+{
+    esp_tls_error_handle_t error_handle;
+    tls_transport_error_t error = {
+        .sock_errno = sock_errno,
+    };
+
+    if (tls != NULL && esp_tls_get_error_handle(tls, &error_handle) == ESP_OK) {
+        error.esp_tls_err = esp_tls_get_and_clear_last_error(error_handle, &error.tls_stack_err,
+                                                             &error.tls_verify_flags);
+    }
+    if (error.tls_stack_err == 0) {
+        error.tls_stack_err = stack_err;
+    }
+
+    portENTER_CRITICAL(&stats_lock);
+    last_error = error;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+static int tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms)
+{
+    esp_tls_cfg_t cfg = {
+        .cacert_buf = (const unsigned char *)credentials.root_ca,
+        .cacert_bytes = credentials.root_ca != NULL ? strlen(credentials.root_ca) + 1 : 0,
+        .use_global_ca_store = credentials.use_global_ca_store,
+        .clientcert_buf = (const unsigned char *)credentials.client_cert,
+        .clientcert_bytes = credentials.client_cert != NULL ? strlen(credentials.client_cert) + 1 : 0,
+        .clientkey_buf = (const unsigned char *)credentials.client_key,
+        .clientkey_bytes = credentials.client_key != NULL ? strlen(credentials.client_key) + 1 : 0,
+#ifdef CONFIG_ESP_TLS_USE_DS_PERIPHERAL
+        .ds_data = credentials.ds_data,
+#endif
+        .timeout_ms = timeout_ms,
+    };
+    if (credentials.use_global_ca_store) {
+        cfg.cacert_buf = NULL;
+        cfg.cacert_bytes = 0;
+    }
+
+#if TLS_SESSION_RESUMPTION
+    uint32_t identity = session_identity(host, port);
+    session_prepare(identity);
+    bool offered = session != NULL;
+    cfg.client_session = session;
+#endif
+
+    tls = esp_tls_init();
+    if (tls == NULL) {
+        portENTER_CRITICAL(&stats_lock);
+        stats.failed++;
+        portEXIT_CRITICAL(&stats_lock);
+        return -1;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    if (esp_tls_conn_new_sync(host, (int)strlen(host), port, &cfg, tls) != 1) {
+        tls_transport_error_t error;
+        record_error(0, errno);
+        tls_transport_get_last_error(&error);
+        ESP_LOGW(TAG, "TLS connect failed: %s (tls 0x%x, verify flags 0x%x)",
+                 esp_err_to_name(error.esp_tls_err), error.tls_stack_err, error.tls_verify_flags);
+        esp_tls_conn_destroy(tls);
+        tls = NULL;
+        portENTER_CRITICAL(&stats_lock);
+        stats.failed++;
+        portEXIT_CRITICAL(&stats_lock);
+        return -1;
+    }
+    uint64_t elapsed_us = (uint64_t)(esp_timer_get_time() - start_us);
+
+    bool resumed = false;
+#if TLS_SESSION_RESUMPTION
+    resumed = session_update(identity, offered);
+#endif
+
+    portENTER_CRITICAL(&stats_lock);
+    last_error = (tls_transport_error_t){0};
+    if (resumed) {
+        stats.resumed++;
+        stats.resumed_us += elapsed_us;
+    } else {
+        stats.full++;
+        stats.full_us += elapsed_us;
+    }
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI(TAG, "%s TLS handshake in %u ms", resumed ? "Resumed" : "Full",
+             (unsigned)(elapsed_us / 1000));
+    return 0;
+}
+
+/**
+ * select() on the connection's socket; -1 on a socket error
+ */
+static int socket_poll(int timeout_ms, bool write)
+{
+    int fd;
+    fd_set ready;
+    fd_set errors;
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+
+    if (tls == NULL || esp_tls_get_conn_sockfd(tls, &fd) != ESP_OK || fd < 0) {
+        return -1;
+    }
+    FD_ZERO(&ready);
+    FD_SET(fd, &ready);
+    FD_ZERO(&errors);
+    FD_SET(fd, &errors);
+
+    int ret = select(fd + 1, write ? NULL : &ready, write ? &ready : NULL, &errors,
+                     timeout_ms < 0 ? NULL : &tv);
+    if (ret < 0) {
+        record_error(0, errno);
+    } else if (ret > 0 && FD_ISSET(fd, &errors)) {
+        int sock_errno = 0;
+        socklen_t optlen = sizeof(sock_errno);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &sock_errno, &optlen);
+        record_error(0, sock_errno);
+        return -1;
+    }
+    return ret;
+}
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms)
+{
+    // Records already decrypted by mbedtls are not visible to select()
+    if (tls != NULL && esp_tls_get_bytes_avail(tls) > 0) {
+        return 1;
+    }
+    return socket_poll(timeout_ms, false);
+}
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms)
+{
+    return socket_poll(timeout_ms, true);
+}
+
+static int tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms)
+{
+    int poll = tls_poll_read(t, timeout_ms);
+    if (poll <= 0) {
+        return poll == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : poll;
+    }
+
+    ssize_t ret = esp_tls_conn_read(tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret == 0) {
+        // Readable but nothing to read: the broker closed the connection
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    if (ret < 0) {
+        record_error((int)-ret, errno);
+    }
+    return (int)ret;
+}
+
+static int tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms)
+{
+    int poll = tls_poll_write(t, timeout_ms);
+    if (poll <= 0) {
+        return poll == 0 ? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT : poll;
+    }
+
+    ssize_t ret = esp_tls_conn_write(tls, buffer, len);
+    if (ret < 0) {
+        ESP_LOGD(TAG, "esp_tls_conn_write error: -0x%x", (unsigned)-ret);
+        if (ret != ESP_TLS_ERR_SSL_WANT_WRITE) {
+            record_error((int)-ret, errno);
+        }
+    }
+    return (int)ret;
+}
+
+static int tls_close(esp_transport_handle_t t)
+{
+    if (tls != NULL) {
+        esp_tls_conn_destroy(tls);
+        tls = NULL;
+    }
+    return 0;
+}
+
+static int tls_destroy(esp_transport_handle_t t)
+{
+    tls_close(t);
+    transport = NULL;
+    return 0;
+}
+
+esp_transport_handle_t tls_transport_get(void)
+{
+    if (transport != NULL) {
+        return transport;
+    }
+
+    esp_transport_handle_t t = esp_transport_init();
+    if (t == NULL) {
+        return NULL;
+    }
+    esp_transport_set_default_port(t, TLS_DEFAULT_PORT);
+    esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close,
+                           tls_poll_read, tls_poll_write, tls_destroy);
+    transport = t;
+    return transport;
+}
+
+void tls_transport_set_credentials(const tls_transport_credentials_t *new_credentials)
+{
+    credentials = *new_credentials;
+}
+
+void tls_transport_get_last_error(tls_transport_error_t *error)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *error = last_error;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+void tls_transport_write_json(json_writer_t *w, const char *key)
+{
+    tls_stats_t snapshot;
+
+    portENTER_CRITICAL(&stats_lock);
+    snapshot = stats;
+    portEXIT_CRITICAL(&stats_lock);
+
+    json_writer_begin_object(w, key);
+    json_writer_add_bool(w, "resumption", TLS_SESSION_RESUMPTION);
+    json_writer_add_uint(w, "full", snapshot.full);
+    json_writer_add_uint(w, "resumed", snapshot.resumed);
+    json_writer_add_uint(w, "failed", snapshot.failed);
+    json_writer_add_uint(w, "full_ms",
+                         snapshot.full > 0 ? snapshot.full_us / snapshot.full / 1000 : 0);
+    json_writer_add_uint(w, "resumed_ms",
+                         snapshot.resumed > 0 ? snapshot.resumed_us / snapshot.resumed / 1000 : 0);
+    json_writer_end_object(w);
+}
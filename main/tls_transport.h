@@ -0,0 +1,97 @@
+/**
+ * @file tls_transport.h
+ * @brief esp-mqtt transport over esp-tls with TLS session resumption
+ *
+ * esp-mqtt's own SSL transport neither accepts a saved TLS session nor
+ * exposes its esp-tls handle, so every connect paid a full mutual-TLS
+ * handshake. This transport is handed to esp-mqtt through
+ * network.transport and does the handshake itself: with
+ * CONFIG_AWS_IOT_TLS_SESSION_RESUMPTION the session of the last handshake
+ * (session ID and ticket) is offered on the next connect, so a reconnect
+ * skips the certificate exchange and signature.
+ *
+ * The session is kept in RAM between reconnects and, serialized, in RTC
+ * memory so it survives deep sleep. It is bound to the broker host, port
+ * and client certificate and dropped when any of them changes. It is never
+ * written to flash, since it holds the session's master secret.
+ *
+ * Every handshake is counted, including failed ones, so full/resumed/failed
+ * add up to the number of TLS connect attempts.
+ */
+
+#ifndef TLS_TRANSPORT_H
+#define TLS_TRANSPORT_H
+
+#include <stdbool.h>
+#include "esp_transport.h"
+#include "json_writer.h"
+
+/**
+ * @brief Credentials for the next handshake
+ *
+ * Strings are referenced, not copied, and must stay valid until replaced.
+ */
+typedef struct {
+    const char *root_ca;        ///< PEM root CA, unused with the global CA store
+    bool use_global_ca_store;   ///< Verify against the esp-tls global CA store
+    const char *client_cert;    ///< PEM client certificate
+    const char *client_key;     ///< PEM client key, NULL with ds_data
+    void *ds_data;              ///< esp_ds_data_ctx_t for the DS peripheral, or NULL
+} tls_transport_credentials_t;
+
+/**
+ * @brief Error of the last failed connect, read or write
+ */
+typedef struct {
+    esp_err_t esp_tls_err;  ///< esp-tls error, ESP_OK if none was set
+    int tls_stack_err;      ///< mbedtls error code, positive, 0 if none
+    int tls_verify_flags;   ///< Certificate verification flags
+    int sock_errno;         ///< Socket errno, 0 if none
+} tls_transport_error_t;
+
+/**
+ * @brief Get the transport, creating it on first use
+ *
+ * The handle is owned by the esp-mqtt client it is configured on and lives
+ * as long as that client.
+ *
+ * @return Transport handle, or NULL if out of memory
+ */
+esp_transport_handle_t tls_transport_get(void);
+
+/**
+ * @brief Set the credentials used from the next connect on
+ *
+ * Call only while the MQTT client is stopped or not yet started. A client
+ * certificate other than the one the cached session was made with drops
+ * the session.
+ *
+ * @param credentials Credentials, copied by value
+ */
+void tls_transport_set_credentials(const tls_transport_credentials_t *credentials);
+
+/**
+ * @brief Get the error of the last failed transport call
+ *
+ * esp-mqtt fills the transport fields of its error event only for its own
+ * transports, so with this one esp_tls_last_esp_err, esp_tls_stack_err and
+ * esp_transport_sock_errno are always 0. Read this instead. A successful
+ * connect clears it.
+ *
+ * @param[out] error Last error, all zero if none since the last connect
+ */
+void tls_transport_get_last_error(tls_transport_error_t *error);
+
+/**
+ * @brief Write handshake counters as a JSON object member
+ *
+ * Format: {"resumption":b,"full":n,"resumed":n,"failed":n,"full_ms":n,
+ * "resumed_ms":n}. Counts are kept since boot; full_ms and resumed_ms are
+ * the average TCP connect plus handshake time of each kind.
+ *
+ * @param w Writer positioned inside an object
+ * @param key Member name
+ */
+void tls_transport_write_json(json_writer_t *w, const char *key);
+
+#endif // TLS_TRANSPORT_H
@@ -0,0 +1,209 @@
+/**
+ * @file topic_router.c
+ * @brief Inbound MQTT topic router
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "topic_router.h"
+
+#include "aws_iot_config.h"
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_ROUTER
+#include "app_log.h"
+
+static const char *TAG = "TOPIC_ROUTER";
+
+#define NODE_NONE -1
+
+typedef struct {
+    const char *level;          // Points into filter_storage
+    uint16_t level_len;
+    int16_t first_child;
+    int16_t next_sibling;
+    topic_router_handler_t handler;
+    void *arg;
+} router_node_t;
+
+// Node 0 is the root and has no level of its own
+static router_node_t nodes[TOPIC_ROUTER_MAX_NODES] = {
+    [0] = {.first_child = NODE_NONE, .next_sibling = NODE_NONE},
+};
+static size_t node_count = 1;
+static char filter_storage[TOPIC_ROUTER_STORAGE_SIZE];
+static size_t storage_used = 0;
+
+static bool level_is(const router_node_t *node, const char *level, size_t len)
+{
+    return node->level_len == len && memcmp(node->level, level, len) == 0;
+}
+
+static int16_t find_child(int16_t parent, const char *level, size_t len)
+{
+    for (int16_t c = nodes[parent].first_child; c != NODE_NONE; c = nodes[c].next_sibling) {
+        if (level_is(&nodes[c], level, len)) {
+            return c;
+        }
+    }
+    return NODE_NONE;
+}
+
+static int16_t add_child(int16_t parent, const char *level, size_t len)
+{
+    if (node_count >= TOPIC_ROUTER_MAX_NODES) {
+        return NODE_NONE;
+    }
+    int16_t idx = (int16_t)node_count++;
+    nodes[idx] = (router_node_t) {
+        .level = level,
+        .level_len = (uint16_t)len,
+        .first_child = NODE_NONE,
+        .next_sibling = nodes[parent].first_child,
+    };
+    nodes[parent].first_child = idx;
+    return idx;
+}
+
+static bool filter_is_valid(const char *filter, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        char c = filter[i];
+        bool level_start = i == 0 || filter[i - 1] == '/';
+        bool level_end = i + 1 == len || filter[i + 1] == '/';
+        if ((c == '+' || c == '#') && !(level_start && level_end)) {
+            return false;
+        }
+        // '#' must be the last level
+        if (c == '#' && i + 1 != len) {
+            return false;
+        }
+    }
+    return len > 0;
+}
+
+esp_err_t topic_router_register(const char *filter, topic_router_handler_t handler, void *arg)
+{
+    if (filter == NULL || handler == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t len = strlen(filter);
+    if (!filter_is_valid(filter, len)) {
+        ESP_LOGE(TAG, "Invalid topic filter: %s", filter);
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (storage_used + len > sizeof(filter_storage)) {
+        ESP_LOGE(TAG, "Filter storage exhausted registering %s", filter);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Levels reference the stored copy, so copy first
+    char *stored = &filter_storage[storage_used];
+    memcpy(stored, filter, len);
+
+    size_t used_nodes = node_count;
+    int16_t node = 0;
+    size_t pos = 0;
+    for (;;) {
+        size_t end = pos;
+        while (end < len && stored[end] != '/') {
+            end++;
+        }
+
+        int16_t child = find_child(node, stored + pos, end - pos);
+        if (child == NODE_NONE) {
+            child = add_child(node, stored + pos, end - pos);
+            if (child == NODE_NONE) {
+                // Roll back nodes added for this filter
+                node_count = used_nodes;
+                for (size_t i = 0; i < node_count; i++) {
+                    while (nodes[i].first_child >= (int16_t)used_nodes) {
+                        nodes[i].first_child = nodes[nodes[i].first_child].next_sibling;
+                    }
+                }
+                ESP_LOGE(TAG, "Node pool exhausted registering %s", filter);
+                return ESP_ERR_NO_MEM;
+            }
+        }
+        node = child;
+
+        if (end >= len) {
+            break;
+        }
+        pos = end + 1;
+    }
+
+    if (nodes[node].handler != NULL) {
+        ESP_LOGE(TAG, "Filter already registered: %s", filter);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    nodes[node].handler = handler;
+    nodes[node].arg = arg;
+    storage_used += len;
+    ESP_LOGI(TAG, "Registered handler for %s", filter);
+    return ESP_OK;
+}
+
+static const router_node_t *match(int16_t idx, const char *topic, size_t len, size_t pos, bool done)
+{
+    const router_node_t *node = &nodes[idx];
+
+    if (done) {
+        if (node->handler != NULL) {
+            return node;
+        }
+        // "a/#" also matches "a"
+        int16_t hash = find_child(idx, "#", 1);
+        return (hash != NODE_NONE && nodes[hash].handler != NULL) ? &nodes[hash] : NULL;
+    }
+
+    size_t end = pos;
+    while (end < len && topic[end] != '/') {
+        end++;
+    }
+    bool last = end >= len;
+    size_t next = end + 1;
+
+    int16_t child = find_child(idx, topic + pos, end - pos);
+    if (child != NODE_NONE) {
+        const router_node_t *found = match(child, topic, len, next, last);
+        if (found != NULL) {
+            return found;
+        }
+    }
+
+    // Wildcards never match a leading '$' level
+    if (pos == 0 && len > 0 && topic[0] == '$') {
+        return NULL;
+    }
+
+    child = find_child(idx, "+", 1);
+    if (child != NODE_NONE) {
+        const router_node_t *found = match(child, topic, len, next, last);
+        if (found != NULL) {
+            return found;
+        }
+    }
+
+    child = find_child(idx, "#", 1);
+    if (child != NODE_NONE && nodes[child].handler != NULL) {
+        return &nodes[child];
+    }
+    return NULL;
+}
+
+bool topic_router_dispatch(const char *topic, size_t topic_len, const char *data, size_t data_len)
+{
+    if (topic == NULL || topic_len == 0) {
+        return false;
+    }
+
+    const router_node_t *node = match(0, topic, topic_len, 0, false);
+    if (node == NULL) {
+        ESP_LOGW(TAG, "No handler for topic %.*s", (int)topic_len, topic);
+        return false;
+    }
+
+    node->handler(topic, topic_len, data, data_len, node->arg);
+    return true;
+}
@@ -0,0 +1,66 @@
+/**
+ * @file topic_router.h
+ * @brief Inbound MQTT topic router
+ *
+ * Handlers register MQTT topic filters (including '+' and '#' wildcards) once
+ * at startup. Filters are compiled into a level trie held in a static node
+ * pool, so dispatching an inbound message is a single length-bounded walk
+ * over the topic with no formatting, copying or NUL-terminator requirement.
+ */
+
+#ifndef TOPIC_ROUTER_H
+#define TOPIC_ROUTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+/**
+ * @brief Maximum number of trie nodes (one per distinct filter level)
+ */
+#define TOPIC_ROUTER_MAX_NODES 48
+
+/**
+ * @brief Total bytes available for storing registered filter strings
+ */
+#define TOPIC_ROUTER_STORAGE_SIZE 1024
+
+/**
+ * @brief Message handler
+ * @param topic Topic (not NUL-terminated)
+ * @param topic_len Topic length
+ * @param data Payload (not NUL-terminated)
+ * @param data_len Payload length
+ * @param arg User argument passed at registration
+ */
+typedef void (*topic_router_handler_t)(const char *topic, size_t topic_len,
+                                       const char *data, size_t data_len, void *arg);
+
+/**
+ * @brief Register a handler for a topic filter
+ *
+ * The filter is copied into router storage. When several filters match a
+ * topic, the most specific one wins: an exact level beats '+', which beats
+ * '#'. As required by MQTT, wildcards at the first level never match topics
+ * starting with '$'.
+ *
+ * @param filter MQTT topic filter
+ * @param handler Message handler
+ * @param arg User argument passed to handler
+ * @return ESP_OK on success, ESP_ERR_INVALID_ARG for malformed filters,
+ *         ESP_ERR_NO_MEM if the node pool or storage is exhausted,
+ *         ESP_ERR_INVALID_STATE if the filter is already registered
+ */
+esp_err_t topic_router_register(const char *filter, topic_router_handler_t handler, void *arg);
+
+/**
+ * @brief Dispatch a message to the best matching handler
+ * @param topic Topic (not NUL-terminated)
+ * @param topic_len Topic length
+ * @param data Payload
+ * @param data_len Payload length
+ * @return true if a handler was found
+ */
+bool topic_router_dispatch(const char *topic, size_t topic_len, const char *data, size_t data_len);
+
+#endif // TOPIC_ROUTER_H
@@ -3,6 +3,7 @@
  * @brief WiFi connection management for ESP32-S3
  */
 
+#include <stdio.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -10,46 +11,215 @@
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
-#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "nvs.h"
 #include "nvs_flash.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
 
+#include "aws_iot_config.h"
+
+#define APP_LOG_LEVEL CONFIG_AWS_IOT_LOG_LEVEL_WIFI
+#include "app_log.h"
+#include "metrics.h"
 #include "wifi_manager.h"
 
 static const char *TAG = "WIFI_MANAGER";
 
+#define WIFI_BACKOFF_MIN_MS CONFIG_AWS_IOT_WIFI_BACKOFF_MIN_MS
+#define WIFI_BACKOFF_MAX_MS CONFIG_AWS_IOT_WIFI_BACKOFF_MAX_MS
+#define WIFI_FAST_CONNECT_ATTEMPTS CONFIG_AWS_IOT_WIFI_FAST_CONNECT_ATTEMPTS
+
+// Last AP we got an address from, for single-channel reconnects
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_AP_KEY "ap"
+
 /* FreeRTOS event group to signal when we are connected*/
 static EventGroupHandle_t s_wifi_event_group;
 
-/* The event group allows multiple bits for each event, but we only care about two events:
- * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
 #define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
 
-static int s_retry_num = 0;
+typedef struct {
+    char ssid[33];      ///< Cache is ignored if the SSID changed
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_ap_cache_t;
+
+static wifi_config_t s_wifi_config;
+static wifi_ap_cache_t s_ap_cache;
+static bool s_ap_cache_valid = false;
+
+// Only touched from the default event loop task
+static uint32_t s_attempt = 0;          // Connect attempts since the link was lost
+static int64_t s_disconnected_us = 0;   // When the link was lost, 0 while connected
+static esp_timer_handle_t s_retry_timer;
+static esp_netif_t *s_sta_netif;
+
+// Set by wifi_manager_stop(): the disconnect that esp_wifi_stop() raises
+// must not schedule another attempt
+static volatile bool s_stopping = false;
+
+static void load_ap_cache(void)
+{
+    nvs_handle_t h;
+    size_t len = sizeof(s_ap_cache);
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &h) != ESP_OK) {
+        return;
+    }
+    s_ap_cache_valid = nvs_get_blob(h, WIFI_NVS_AP_KEY, &s_ap_cache, &len) == ESP_OK &&
+                       len == sizeof(s_ap_cache) &&
+                       strcmp(s_ap_cache.ssid, CONFIG_EXAMPLE_WIFI_SSID) == 0;
+    nvs_close(h);
+
+    if (s_ap_cache_valid) {
+        ESP_LOGI(TAG, "Cached AP " MACSTR " on channel %u",
+                 MAC2STR(s_ap_cache.bssid), s_ap_cache.channel);
+    }
+}
+
+static void store_ap_cache(void)
+{
+    wifi_ap_record_t ap;
+    nvs_handle_t h;
+
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+    // Only write flash when the AP actually moved
+    if (s_ap_cache_valid && s_ap_cache.channel == ap.primary &&
+        memcmp(s_ap_cache.bssid, ap.bssid, sizeof(ap.bssid)) == 0) {
+        return;
+    }
+
+    memset(&s_ap_cache, 0, sizeof(s_ap_cache));
+    snprintf(s_ap_cache.ssid, sizeof(s_ap_cache.ssid), "%s", CONFIG_EXAMPLE_WIFI_SSID);
+    memcpy(s_ap_cache.bssid, ap.bssid, sizeof(ap.bssid));
+    s_ap_cache.channel = ap.primary;
+    s_ap_cache_valid = true;
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &h) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(h, WIFI_NVS_AP_KEY, &s_ap_cache, sizeof(s_ap_cache)) == ESP_OK) {
+        nvs_commit(h);
+    }
+    nvs_close(h);
+    ESP_LOGI(TAG, "Cached AP " MACSTR " on channel %u", MAC2STR(ap.bssid), ap.primary);
+}
+
+/**
+ * Target the cached AP directly (no scan) for the first attempts, then fall
+ * back to a full scan picking the strongest AP with our SSID.
+ */
+static void apply_scan_config(bool fast)
+{
+    if (fast) {
+        s_wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+        s_wifi_config.sta.bssid_set = true;
+        memcpy(s_wifi_config.sta.bssid, s_ap_cache.bssid, sizeof(s_ap_cache.bssid));
+        s_wifi_config.sta.channel = s_ap_cache.channel;
+    } else {
+        s_wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+        s_wifi_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+        s_wifi_config.sta.bssid_set = false;
+        s_wifi_config.sta.channel = 0;
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config);
+}
+
+/**
+ * Jittered exponential backoff: the nth retry waits a random time in
+ * [d/2, d] with d = min(MIN * 2^(n-1), MAX), so devices that lost the same AP
+ * do not come back in lockstep. The first attempt after a drop is immediate.
+ */
+static uint32_t backoff_ms(uint32_t attempt)
+{
+    if (attempt == 0) {
+        return 0;
+    }
+    uint32_t shift = attempt - 1 < 16 ? attempt - 1 : 16;
+    uint64_t delay = (uint64_t)WIFI_BACKOFF_MIN_MS << shift;
+    if (delay > WIFI_BACKOFF_MAX_MS) {
+        delay = WIFI_BACKOFF_MAX_MS;
+    }
+    uint32_t half = (uint32_t)delay / 2;
+    return half + esp_random() % (half + 1);
+}
+
+static void retry_timer_cb(void *arg)
+{
+    if (s_stopping) {
+        return;
+    }
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "esp_wifi_connect failed: %s", esp_err_to_name(err));
+    }
+}
+
+static void schedule_connect(void)
+{
+    if (s_stopping) {
+        return;
+    }
+    bool fast = s_ap_cache_valid && s_attempt < WIFI_FAST_CONNECT_ATTEMPTS;
+    uint32_t delay_ms = backoff_ms(s_attempt);
+
+    apply_scan_config(fast);
+    s_attempt++;
+
+    if (delay_ms == 0) {
+        retry_timer_cb(NULL);
+        return;
+    }
+    APP_LOGI_LIMITED(TAG, "Reconnect attempt %u in %u ms (%s)", (unsigned)s_attempt,
+                     (unsigned)delay_ms, fast ? "cached AP" : "full scan");
+    esp_timer_stop(s_retry_timer);
+    esp_timer_start_once(s_retry_timer, (uint64_t)delay_ms * 1000);
+}
 
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
+        s_attempt = 0;
+        s_disconnected_us = esp_timer_get_time();
+        schedule_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_STOP) {
+        esp_timer_stop(s_retry_timer);
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < 5) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+        wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+        if (s_disconnected_us == 0) {
+            s_disconnected_us = esp_timer_get_time();
+            s_attempt = 0;
+            app_log_event(APP_LOG_EVT_WIFI_DISCONNECTED, event->reason);
+            ESP_LOGW(TAG, "Disconnected from AP, reason %u", event->reason);
+        }
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+
+        // The cached AP is gone or moved channel; stop targeting it
+        if (event->reason == WIFI_REASON_NO_AP_FOUND && s_attempt < WIFI_FAST_CONNECT_ATTEMPTS) {
+            s_attempt = WIFI_FAST_CONNECT_ATTEMPTS;
         }
-        ESP_LOGI(TAG,"connect to the AP fail");
+        schedule_connect();
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
+        ESP_LOGI(TAG, "got ip:" IPSTR " after %u attempts", IP2STR(&event->ip_info.ip),
+                 (unsigned)s_attempt);
+        if (s_disconnected_us != 0) {
+            metrics_record(METRICS_WIFI_RECONNECT, esp_timer_get_time() - s_disconnected_us);
+            s_disconnected_us = 0;
+        }
+        app_log_event(APP_LOG_EVT_WIFI_CONNECTED, s_attempt);
+        s_attempt = 0;
+        store_ap_cache();
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_LOST_IP) {
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
 
@@ -58,13 +228,22 @@ esp_err_t wifi_manager_init(void)
     s_wifi_event_group = xEventGroupCreate();
 
     ESP_ERROR_CHECK(esp_netif_init());
-    esp_netif_create_default_wifi_sta();
+    s_sta_netif = esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    // The config changes on every reconnect attempt; keep it out of flash
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = retry_timer_cb,
+        .name = "wifi_retry",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_retry_timer));
 
     esp_event_handler_instance_t instance_any_id;
     esp_event_handler_instance_t instance_got_ip;
+    esp_event_handler_instance_t instance_lost_ip;
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                         ESP_EVENT_ANY_ID,
                                                         &event_handler,
@@ -75,11 +254,16 @@ esp_err_t wifi_manager_init(void)
                                                         &event_handler,
                                                         NULL,
                                                         &instance_got_ip));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                        IP_EVENT_STA_LOST_IP,
+                                                        &event_handler,
+                                                        NULL,
+                                                        &instance_lost_ip));
 
-    wifi_config_t wifi_config = {
+    s_wifi_config = (wifi_config_t) {
         .sta = {
-            .ssid = "Noovoleum_Office",
-            .password = "greenenergychampion",
+            .ssid = CONFIG_EXAMPLE_WIFI_SSID,
+            .password = CONFIG_EXAMPLE_WIFI_PASSWORD,
             .threshold.authmode = WIFI_AUTH_WPA2_PSK,
             .pmf_cfg = {
                 .capable = true,
@@ -87,47 +271,33 @@ esp_err_t wifi_manager_init(void)
             },
         },
     };
+    load_ap_cache();
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA) );
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config) );
 
     return ESP_OK;
 }
 
-esp_err_t wifi_manager_connect(void)
+esp_err_t wifi_manager_start(void)
 {
-    ESP_ERROR_CHECK(esp_wifi_start());
-    
-    ESP_LOGI(TAG, "wifi_init_sta finished.");
-
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-
-    /* xEventGroupWaitBits() returns the bits before the call returned, hence we can test which event actually
-     * happened. */
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "connected to ap SSID:%s", "Noovoleum_Office");
-        return ESP_OK;
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGI(TAG, "Failed to connect to SSID:%s", "Noovoleum_Office");
-        return ESP_FAIL;
-    } else {
-        ESP_LOGE(TAG, "UNEXPECTED EVENT");
-        return ESP_ERR_INVALID_STATE;
-    }
+    s_stopping = false;
+    return esp_wifi_start();
 }
 
-void wifi_manager_wait_for_connection(void)
+esp_err_t wifi_manager_stop(void)
 {
-    xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    s_stopping = true;
+    esp_timer_stop(s_retry_timer);
+    return esp_wifi_stop();
 }
 
 bool wifi_manager_is_connected(void)
 {
     EventBits_t bits = xEventGroupGetBits(s_wifi_event_group);
     return (bits & WIFI_CONNECTED_BIT) != 0;
-}
\ No newline at end of file
+}
+
+esp_netif_t *wifi_manager_get_netif(void)
+{
+    return s_sta_netif;
+}
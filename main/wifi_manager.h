@@ -6,7 +6,9 @@
 #ifndef WIFI_MANAGER_H
 #define WIFI_MANAGER_H
 
+#include <stdbool.h>
 #include "esp_err.h"
+#include "esp_netif.h"
 
 /**
  * @brief Initialize WiFi manager
@@ -15,15 +17,30 @@
 esp_err_t wifi_manager_init(void);
 
 /**
- * @brief Connect to WiFi network
+ * @brief Start WiFi without waiting for a connection
+ *
+ * Connecting and reconnecting then happen in the background. The station
+ * reconnects on its own after any disconnect, first to the AP cached in NVS
+ * on its last channel, then with full scans, backing off exponentially with
+ * jitter up to CONFIG_AWS_IOT_WIFI_BACKOFF_MAX_MS. It never gives up.
+ *
+ * After a deep-sleep wake the cached AP is paired with the TLS session that
+ * tls_transport keeps in RTC memory, so an upload wake pays neither a scan
+ * nor a full handshake.
+ *
  * @return ESP_OK on success
  */
-esp_err_t wifi_manager_connect(void);
+esp_err_t wifi_manager_start(void);
 
 /**
- * @brief Wait for WiFi connection to be established
+ * @brief Stop WiFi and its reconnect timer
+ *
+ * No reconnect is attempted afterwards, including for the disconnect event
+ * that esp_wifi_stop() itself raises, until wifi_manager_start().
+ *
+ * @return ESP_OK on success
  */
-void wifi_manager_wait_for_connection(void);
+esp_err_t wifi_manager_stop(void);
 
 /**
  * @brief Check if WiFi is connected
@@ -31,4 +48,10 @@ void wifi_manager_wait_for_connection(void);
  */
 bool wifi_manager_is_connected(void);
 
+/**
+ * @brief Get the station network interface
+ * @return Interface handle, NULL before wifi_manager_init()
+ */
+esp_netif_t *wifi_manager_get_netif(void);
+
 #endif // WIFI_MANAGER_H
\ No newline at end of file
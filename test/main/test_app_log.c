@@ -0,0 +1,32 @@
+/**
+ * @file test_app_log.c
+ * @brief Unity cases for the log rate limiter
+ */
+
+#include <stdint.h>
+#include "unity.h"
+#include "esp_timer.h"
+#include "app_log.h"
+
+#define TEST_REFILL_US 1500000
+
+TEST_CASE("limiter refills while called faster than one token per call", "[app_log]")
+{
+    app_log_limiter_t limiter = {0};
+    uint32_t suppressed = 0;
+    uint32_t allowed = 0;
+
+    int64_t start = esp_timer_get_time();
+    while (esp_timer_get_time() - start < TEST_REFILL_US) {
+        if (app_log_limiter_allow(&limiter, &suppressed)) {
+            allowed++;
+        }
+    }
+
+    // The burst, then one token per 1/rate s; a partial token is never lost
+    // to a call that comes too soon to add a whole milli-token
+    uint32_t refilled = (uint32_t)((int64_t)TEST_REFILL_US * CONFIG_AWS_IOT_LOG_RATE_PER_SEC / 1000000);
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(CONFIG_AWS_IOT_LOG_RATE_BURST + refilled, allowed);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(CONFIG_AWS_IOT_LOG_RATE_BURST + refilled + 1, allowed);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, suppressed);
+}
@@ -0,0 +1,225 @@
+/**
+ * @file test_device_shadow.c
+ * @brief Unity cases for shadow document building and response handling
+ *
+ * The desired-key table cannot be emptied, so the keys are registered once
+ * per boot and every case starts by applying a full document with known
+ * values.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "device_shadow.h"
+#include "json_reader.h"
+
+#define SHADOW_TOPIC(suffix) "$aws/things/unit-test/shadow/" suffix
+#define GET_ACCEPTED_TOPIC SHADOW_TOPIC("get/accepted")
+#define DELTA_TOPIC SHADOW_TOPIC("update/delta")
+#define UPDATE_REJECTED_TOPIC SHADOW_TOPIC("update/rejected")
+
+static int callback_count;
+static char last_key[DEVICE_SHADOW_MAX_KEY_LEN];
+
+static void desired_cb(const char *key, const device_shadow_value_t *value, void *arg)
+{
+    callback_count++;
+    snprintf(last_key, sizeof(last_key), "%s", key);
+}
+
+static esp_err_t feed(const char *topic, const char *document)
+{
+    return device_shadow_handle_response(topic, strlen(topic), document, strlen(document));
+}
+
+// Tokenizes the whole buffer; true if it is one well-formed JSON value
+static bool json_valid(const char *data, size_t len)
+{
+    json_reader_t r;
+    json_token_t tok;
+    esp_err_t err;
+
+    json_reader_init(&r, data, len);
+    while ((err = json_reader_next(&r, &tok)) == ESP_OK) {
+    }
+    return err == ESP_ERR_NOT_FOUND && json_reader_depth(&r) == 0 && r.pos > 0;
+}
+
+/**
+ * Register the test keys on first use and apply a full document holding
+ * interval_ms 1000, led false and mode "base" at the given version
+ */
+static void load_base(int64_t version)
+{
+    static bool registered;
+    char document[256];
+
+    if (!registered) {
+        TEST_ESP_OK(device_shadow_register_desired("interval_ms", DEVICE_SHADOW_VALUE_NUMBER,
+                                                   desired_cb, NULL));
+        TEST_ESP_OK(device_shadow_register_desired("led", DEVICE_SHADOW_VALUE_BOOL,
+                                                   desired_cb, NULL));
+        TEST_ESP_OK(device_shadow_register_desired("mode", DEVICE_SHADOW_VALUE_STRING,
+                                                   desired_cb, NULL));
+        registered = true;
+    }
+    snprintf(document, sizeof(document),
+             "{\"state\":{\"desired\":{\"interval_ms\":1000,\"led\":false,\"mode\":\"base\"},"
+             "\"reported\":{\"connected\":true}},\"metadata\":{},\"version\":%lld,"
+             "\"timestamp\":1760000000}", (long long)version);
+    TEST_ESP_OK(feed(GET_ACCEPTED_TOPIC, document));
+    TEST_ASSERT_EQUAL_INT64(version, device_shadow_get_version());
+    callback_count = 0;
+    last_key[0] = '\0';
+}
+
+static double desired_number(const char *key)
+{
+    device_shadow_value_t value;
+    TEST_ESP_OK(device_shadow_get_desired(key, &value, NULL, 0));
+    TEST_ASSERT_EQUAL(DEVICE_SHADOW_VALUE_NUMBER, value.type);
+    return value.number;
+}
+
+static bool desired_bool(const char *key)
+{
+    device_shadow_value_t value;
+    TEST_ESP_OK(device_shadow_get_desired(key, &value, NULL, 0));
+    TEST_ASSERT_EQUAL(DEVICE_SHADOW_VALUE_BOOL, value.type);
+    return value.boolean;
+}
+
+static void assert_desired_string(const char *key, const char *expected)
+{
+    device_shadow_value_t value;
+    char buf[DEVICE_SHADOW_MAX_STRING_LEN];
+    TEST_ESP_OK(device_shadow_get_desired(key, &value, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL(DEVICE_SHADOW_VALUE_STRING, value.type);
+    TEST_ASSERT_EQUAL_STRING(expected, value.string);
+}
+
+TEST_CASE("state document is compact JSON holding the reported state", "[device_shadow]")
+{
+    static const char prefix[] = "{\"state\":{\"reported\":{\"connected\":true,";
+    char buf[256];
+    size_t len = 0;
+
+    TEST_ESP_OK(device_shadow_create_state_document(buf, sizeof(buf), &len));
+    TEST_ASSERT_EQUAL(strlen(buf), len);
+    TEST_ASSERT_EQUAL_STRING_LEN(prefix, buf, sizeof(prefix) - 1);
+    TEST_ASSERT_NOT_NULL(strstr(buf, "\"free_heap\":"));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "\"uptime_ms\":"));
+    TEST_ASSERT_TRUE(json_valid(buf, len));
+}
+
+TEST_CASE("state document fails cleanly when the buffer is too small", "[device_shadow]")
+{
+    char buf[32];
+    size_t len = 0;
+
+    TEST_ASSERT_NOT_EQUAL(ESP_OK, device_shadow_create_state_document(buf, sizeof(buf), &len));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, device_shadow_create_state_document(NULL, 0, &len));
+}
+
+TEST_CASE("full document applies every registered desired key", "[device_shadow]")
+{
+    load_base(10);
+    TEST_ESP_OK(feed(GET_ACCEPTED_TOPIC,
+                     "{\"state\":{\"desired\":{\"interval_ms\":5000,\"led\":true,\"mode\":\"eco\","
+                     "\"unregistered\":{\"nested\":[1,2,3]}},"
+                     "\"reported\":{\"interval_ms\":1000,\"led\":false},"
+                     "\"delta\":{\"interval_ms\":5000,\"led\":true}},"
+                     "\"metadata\":{\"desired\":{\"led\":{\"timestamp\":1760000000}}},"
+                     "\"version\":11,\"timestamp\":1760000000}"));
+
+    TEST_ASSERT_EQUAL(3, callback_count);
+    TEST_ASSERT_EQUAL_INT64(11, device_shadow_get_version());
+    TEST_ASSERT_EQUAL_DOUBLE(5000, desired_number("interval_ms"));
+    TEST_ASSERT_TRUE(desired_bool("led"));
+    assert_desired_string("mode", "eco");
+}
+
+TEST_CASE("delta calls back only for keys whose value changed", "[device_shadow]")
+{
+    load_base(20);
+    TEST_ESP_OK(feed(DELTA_TOPIC,
+                     "{\"version\":21,\"timestamp\":1760000000,"
+                     "\"state\":{\"interval_ms\":2000,\"led\":false},"
+                     "\"metadata\":{\"interval_ms\":{\"timestamp\":1760000000}}}"));
+
+    TEST_ASSERT_EQUAL(1, callback_count);
+    TEST_ASSERT_EQUAL_STRING("interval_ms", last_key);
+    TEST_ASSERT_EQUAL_INT64(21, device_shadow_get_version());
+    TEST_ASSERT_EQUAL_DOUBLE(2000, desired_number("interval_ms"));
+    TEST_ASSERT_FALSE(desired_bool("led"));
+}
+
+TEST_CASE("delta older than the cached version is ignored", "[device_shadow]")
+{
+    load_base(30);
+    TEST_ESP_OK(feed(DELTA_TOPIC, "{\"version\":29,\"state\":{\"led\":true}}"));
+
+    TEST_ASSERT_EQUAL(0, callback_count);
+    TEST_ASSERT_EQUAL_INT64(30, device_shadow_get_version());
+    TEST_ASSERT_FALSE(desired_bool("led"));
+}
+
+TEST_CASE("desired value of the wrong type is ignored", "[device_shadow]")
+{
+    load_base(40);
+    TEST_ESP_OK(feed(DELTA_TOPIC, "{\"version\":41,\"state\":{\"led\":\"on\",\"mode\":\"eco\"}}"));
+
+    TEST_ASSERT_EQUAL(1, callback_count);
+    TEST_ASSERT_FALSE(desired_bool("led"));
+    assert_desired_string("mode", "eco");
+}
+
+TEST_CASE("rejection of another client's request is ignored", "[device_shadow]")
+{
+    load_base(50);
+    TEST_ESP_OK(feed(UPDATE_REJECTED_TOPIC,
+                     "{\"code\":409,\"message\":\"Version conflict\",\"timestamp\":1760000000,"
+                     "\"clientToken\":\"other-client\"}"));
+
+    TEST_ASSERT_EQUAL(0, callback_count);
+    TEST_ASSERT_EQUAL_INT64(50, device_shadow_get_version());
+}
+
+TEST_CASE("malformed document leaves the cache untouched", "[device_shadow]")
+{
+    load_base(60);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE,
+                      feed(GET_ACCEPTED_TOPIC, "{\"state\":{\"desired\":{\"led\":tru"));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE, feed(DELTA_TOPIC, "[\"state\"]"));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, device_shadow_handle_response(NULL, 0, "{}", 2));
+
+    TEST_ASSERT_EQUAL(0, callback_count);
+    TEST_ASSERT_EQUAL_INT64(60, device_shadow_get_version());
+    TEST_ASSERT_FALSE(desired_bool("led"));
+}
+
+TEST_CASE("document with balanced brackets but bad contents is not applied", "[device_shadow]")
+{
+    // Each has a changed desired value before the error
+    static const char *const documents[] = {
+        "{\"state\":{\"desired\":{\"interval_ms\":9000,\"led\":true \"mode\":\"x\"}},\"version\":71}",
+        "{\"state\":{\"desired\":{\"interval_ms\":9000,,\"led\":true}},\"version\":71}",
+        "{\"state\":{\"desired\":{\"interval_ms\":9000,\"led\":true,}},\"version\":71}",
+        "{\"state\":{\"desired\":{\"interval_ms\":9000,\"led\":tru}},\"version\":71}",
+        "{\"state\":{\"desired\":{\"interval_ms\":9000,\"mode\":12.}},\"version\":71}",
+        "{\"state\":{\"desired\":{\"interval_ms\":9000}},\"version\":71}{}",
+    };
+
+    load_base(70);
+    for (size_t i = 0; i < sizeof(documents) / sizeof(documents[0]); i++) {
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE, feed(GET_ACCEPTED_TOPIC, documents[i]));
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE,
+                      feed(DELTA_TOPIC, "{\"version\":71,\"state\":{\"interval_ms\":9000 \"led\":true}}"));
+
+    TEST_ASSERT_EQUAL(0, callback_count);
+    TEST_ASSERT_EQUAL_INT64(70, device_shadow_get_version());
+    TEST_ASSERT_EQUAL_DOUBLE(1000, desired_number("interval_ms"));
+    TEST_ASSERT_FALSE(desired_bool("led"));
+}
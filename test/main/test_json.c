@@ -0,0 +1,122 @@
+/**
+ * @file test_json.c
+ * @brief Unity cases for the JSON reader and writer
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unity.h"
+#include "json_reader.h"
+#include "json_writer.h"
+
+// Reads the whole document; ESP_ERR_NOT_FOUND if it is valid
+static esp_err_t read_all(const char *data)
+{
+    json_reader_t r;
+    json_token_t tok;
+    esp_err_t err;
+
+    json_reader_init(&r, data, strlen(data));
+    while ((err = json_reader_next(&r, &tok)) == ESP_OK) {
+    }
+    return err;
+}
+
+// Skips the top-level value in one call, then expects the end
+static esp_err_t skip_all(const char *data)
+{
+    json_reader_t r;
+    json_token_t tok;
+
+    json_reader_init(&r, data, strlen(data));
+    esp_err_t err = json_reader_next(&r, &tok);
+    if (err == ESP_OK) {
+        err = json_reader_skip(&r, &tok);
+    }
+    if (err == ESP_OK) {
+        err = json_reader_next(&r, &tok);
+    }
+    return err;
+}
+
+TEST_CASE("reader accepts well-formed documents", "[json]")
+{
+    static const char *const valid[] = {
+        "{}",
+        "[]",
+        " { \"a\" : [ 1 , -2.5e+3 , 0 , 0.25 , 1E2 ] , \"b\" : { } , \"c\" : null } ",
+        "{\"s\":\"esc \\\" \\\\ \\/ \\b \\f \\n \\r \\t \\u00e9\",\"t\":true,\"f\":false}",
+        "[[[]],{\"x\":[{}]}]",
+        "42",
+    };
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+        TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, read_all(valid[i]));
+        TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, skip_all(valid[i]));
+    }
+}
+
+TEST_CASE("reader rejects malformed documents, also when skipping them", "[json]")
+{
+    static const char *const invalid[] = {
+        "",
+        "{\"a\":1 \"b\":2}",        // Missing comma
+        "{\"a\":1,,\"b\":2}",       // Extra comma
+        "{\"a\":1,}",               // Trailing comma
+        "[1,2,]",
+        "[,1]",
+        "{\"a\"}",                  // Key without value
+        "{\"a\":}",
+        "{1:2}",                    // Key not a string
+        "{\"a\":[1 2]}",
+        "{\"a\":tru}",
+        "{\"a\":truex}",
+        "{\"a\":01}",
+        "{\"a\":1.}",
+        "{\"a\":-}",
+        "{\"a\":1e}",
+        "{\"a\":+1}",
+        "{\"a\":\"bad \\x escape\"}",
+        "{\"a\":\"bad \\u12g4\"}",
+        "{\"a\":\"raw\ttab\"}",
+        "{\"a\":[1}",               // Mismatched brackets
+        "{\"a\":1}}",
+        "{\"a\":1}{}",              // Data after the document
+        "{\"a\":1",                 // Truncated
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE, read_all(invalid[i]));
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_RESPONSE, skip_all(invalid[i]));
+    }
+}
+
+// Writes value as the only array element and returns the text between the brackets
+static const char *write_double(double value, char *buf, size_t size)
+{
+    json_writer_t w;
+    size_t len;
+
+    json_writer_init(&w, buf, size);
+    json_writer_begin_array(&w, NULL);
+    json_writer_add_double(&w, NULL, value);
+    json_writer_end_array(&w);
+    TEST_ESP_OK(json_writer_finish(&w, &len));
+    buf[len - 1] = '\0';
+    return buf + 1;
+}
+
+TEST_CASE("writer doubles read back exactly", "[json]")
+{
+    static const double values[] = {
+        1700000000123.0, 4294967296.5, 9007199254740993.0, 0.1, 1.0 / 3.0, -2.5e-300, 123456789.123,
+    };
+    char buf[48];
+
+    TEST_ASSERT_EQUAL_STRING("1700000000123", write_double(1700000000123.0, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_STRING("0.1", write_double(0.1, buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_STRING("null", write_double(NAN, buf, sizeof(buf)));
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        TEST_ASSERT_TRUE(strtod(write_double(values[i], buf, sizeof(buf)), NULL) == values[i]);
+    }
+}
@@ -0,0 +1,17 @@
+/**
+ * @file test_main.c
+ * @brief Unity test runner for the firmware modules
+ */
+
+#include "esp_err.h"
+#include "nvs_flash.h"
+#include "unity.h"
+
+void app_main(void)
+{
+    // Every boot starts from an empty shadow cache
+    ESP_ERROR_CHECK(nvs_flash_erase());
+    ESP_ERROR_CHECK(nvs_flash_init());
+
+    unity_run_menu();
+}
@@ -0,0 +1,116 @@
+/**
+ * @file test_telemetry.c
+ * @brief Unity cases for telemetry batch encoding
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "unity.h"
+#include "json_reader.h"
+#include "telemetry.h"
+
+#define TEST_DEVICE_ID "unit-test"
+
+static telemetry_sample_t samples[TELEMETRY_BATCH_SIZE];
+static char buf[CONFIG_AWS_IOT_TELEMETRY_BATCH_BUFFER_SIZE];
+
+// Samples a second apart with heap readings drifting by a few hundred bytes
+static void setup_samples(telemetry_encoding_t encoding)
+{
+    TEST_ESP_OK(telemetry_init(TEST_DEVICE_ID));
+    telemetry_set_encoding(encoding);
+    for (size_t i = 0; i < TELEMETRY_BATCH_SIZE; i++) {
+        samples[i].timestamp_ms = 1760000000000LL + (int64_t)i * 1000;
+        samples[i].sequence = 100 + (uint32_t)i;
+        for (size_t f = 0; f < TELEMETRY_MAX_FIELDS; f++) {
+            samples[i].values[f].u = 180000 - (uint32_t)(f * 20000) + (uint32_t)((i * 37 + f * 11) % 512);
+        }
+    }
+}
+
+// Number of objects in the "samples" array, or -1 if the batch is not valid JSON
+static int json_sample_count(const char *data, size_t len)
+{
+    json_reader_t r;
+    json_token_t tok;
+    esp_err_t err;
+    int count = 0;
+
+    json_reader_init(&r, data, len);
+    while ((err = json_reader_next(&r, &tok)) == ESP_OK) {
+        // Sample objects are the only ones inside the "samples" array
+        if (tok.type == JSON_TOKEN_OBJECT_BEGIN && json_reader_depth(&r) == 3) {
+            count++;
+        }
+    }
+    return err == ESP_ERR_NOT_FOUND ? count : -1;
+}
+
+static void restore_encoding(void)
+{
+    telemetry_set_encoding(CONFIG_AWS_IOT_TELEMETRY_ENCODING_CBOR ? TELEMETRY_ENCODING_CBOR
+                                                                   : TELEMETRY_ENCODING_JSON);
+}
+
+TEST_CASE("JSON batch holds every sample", "[telemetry]")
+{
+    char prefix[64];
+    size_t len = 0;
+
+    setup_samples(TELEMETRY_ENCODING_JSON);
+    TEST_ASSERT_EQUAL(3, telemetry_encode_samples(samples, 3, buf, sizeof(buf), &len));
+    restore_encoding();
+
+    snprintf(prefix, sizeof(prefix), "{\"schema\":%d,\"device_id\":\"" TEST_DEVICE_ID "\",",
+             TELEMETRY_SCHEMA_VERSION);
+    TEST_ASSERT_EQUAL(strlen(buf), len);
+    TEST_ASSERT_EQUAL_STRING_LEN(prefix, buf, strlen(prefix));
+    TEST_ASSERT_NOT_NULL(strstr(buf, "{\"timestamp\":1760000000000,\"message_count\":100,"));
+    TEST_ASSERT_EQUAL(3, json_sample_count(buf, len));
+}
+
+TEST_CASE("JSON batch stops at the last sample that fits", "[telemetry]")
+{
+    size_t len = 0;
+    size_t small = 400;
+
+    setup_samples(TELEMETRY_ENCODING_JSON);
+    size_t encoded = telemetry_encode_samples(samples, TELEMETRY_BATCH_SIZE, buf, small, &len);
+    size_t none = telemetry_encode_samples(samples, TELEMETRY_BATCH_SIZE, buf, 48, &len);
+    restore_encoding();
+
+    TEST_ASSERT_EQUAL(0, none);
+    TEST_ASSERT_GREATER_THAN(0, encoded);
+    TEST_ASSERT_LESS_THAN(TELEMETRY_BATCH_SIZE, encoded);
+    TEST_ASSERT_LESS_THAN(small, len);
+}
+
+TEST_CASE("CBOR batch is self-described and smaller than JSON", "[telemetry]")
+{
+    // A full batch does not fit the buffer as JSON
+    const size_t count = 8;
+    size_t json_len = 0;
+    size_t cbor_len = 0;
+
+    setup_samples(TELEMETRY_ENCODING_JSON);
+    TEST_ASSERT_EQUAL(count, telemetry_encode_samples(samples, count, buf, sizeof(buf), &json_len));
+    telemetry_set_encoding(TELEMETRY_ENCODING_CBOR);
+    TEST_ASSERT_EQUAL(count, telemetry_encode_samples(samples, count, buf, sizeof(buf), &cbor_len));
+    restore_encoding();
+
+    // 55799([schema, device_id, t0_ms, seq0, [_ ...]])
+    static const uint8_t header[] = {0xd9, 0xd9, 0xf7, 0x85, TELEMETRY_SCHEMA_VERSION};
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(header, buf, sizeof(header));
+    TEST_ASSERT_EQUAL_HEX8(0xff, (uint8_t)buf[cbor_len - 1]);
+    TEST_ASSERT_LESS_THAN(json_len, cbor_len);
+}
+
+TEST_CASE("nothing is encoded from an empty batch", "[telemetry]")
+{
+    size_t len = 0;
+
+    TEST_ASSERT_EQUAL(0, telemetry_encode_samples(samples, 0, buf, sizeof(buf), &len));
+    TEST_ASSERT_EQUAL(0, telemetry_encode_samples(NULL, 1, buf, sizeof(buf), &len));
+    TEST_ASSERT_EQUAL(0, telemetry_encode_samples(samples, 1, NULL, sizeof(buf), &len));
+}
@@ -0,0 +1,10 @@
+# Runs the Unity cases of the test app on a connected ESP32-S3:
+#   idf.py -C test build
+#   pytest test --target esp32s3
+import pytest
+from pytest_embedded_idf.dut import IdfDut
+
+
+@pytest.mark.esp32s3
+def test_unit(dut: IdfDut) -> None:
+    dut.run_all_single_board_cases(timeout=60)